@@ -40,6 +40,11 @@ struct cli_context{
   char *outv_current;
   char *outv_limit;
 #endif
+  /* If set, output is passed to these functions instead of being written to standard output, eg,
+     when the server runs a command for a client of its command socket.  cli_flush() calls write()
+     with a NULL buffer and zero length.  */
+  int (*write)(struct cli_context *context, const char *buf, size_t len);
+  int (*delim)(struct cli_context *context, const char *opt);
   void *context;
 };
 
@@ -48,6 +53,7 @@ struct cli_schema {
   const char *words[COMMAND_LINE_MAX_LABELS];
   uint64_t flags;
 #define CLIFLAG_PERMISSIVE_CONFIG   (1<<0) /* Accept defective configuration file */
+#define CLIFLAG_RUN_IN_SERVER       (1<<1) /* Can be run inside the server process by "servald exec" */
   const char *description; // describe this invocation
 };
 
@@ -90,6 +96,7 @@ int cli_interval_ms(const char *arg);
 int cli_uint(const char *arg);
 int cli_optional_did(const char *text);
 
+int cli_write(struct cli_context *context, const unsigned char *buf, size_t len);
 int cli_putchar(struct cli_context *context, char c);
 int cli_puts(struct cli_context *context, const char *str);
 int cli_printf(struct cli_context *context, const char *fmt, ...)
@@ -0,0 +1,420 @@
+/*
+Copyright (C) 2013 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  Running commands inside the server process.
+
+  "servald exec <command>..." connects to the running server's command.socket and asks it to run
+  the command, so the client does not pay for loading the configuration, opening the keyring and
+  opening the rhizome database every time.  Only commands flagged with CLIFLAG_RUN_IN_SERVER may
+  be run this way; they use the server's keyring, so PINs cannot be supplied.
+
+  The client sends its working directory and each argument as nul terminated strings, then shuts
+  down its side of the socket.  The server runs the command, resolving relative file paths against
+  the client's working directory, and queues its reply as a sequence of frames, each a type byte
+  and a four byte big-endian payload length;
+
+  'o' output bytes
+  'd' a field delimiter, the payload is the delimiter string
+  'D' a field delimiter with no delimiter string
+  'x' the command has finished, the payload is its four byte big-endian exit status
+
+  The reply is sent as the client reads it, without blocking the server.  A client that stops
+  sending or reading for COMMAND_IDLE_TIMEOUT_MS is disconnected.  The command itself runs to
+  completion in the server's main loop, like the rhizome requests served by the HTTP server, which
+  is why only quick local commands are flagged to run this way.
+
+  Messages logged while the command runs go to the server's log, not to the client.  JNI callers
+  can use the same path by passing "exec" and the command to rawCommand().
+ */
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "serval.h"
+#include "conf.h"
+#include "cli.h"
+#include "net.h"
+#include "str.h"
+#include "strbuf.h"
+#include "strbuf_helpers.h"
+
+#define COMMAND_REQUEST_MAX 16384
+#define COMMAND_OUTPUT_BUFFER 4096
+#define COMMAND_IDLE_TIMEOUT_MS 5000
+#define COMMAND_FRAME_HEADER 5
+
+struct command_client{
+  struct sched_ent alarm;
+  size_t request_length;
+  char request[COMMAND_REQUEST_MAX];
+  int failed;
+  size_t output_length;
+  unsigned char output[COMMAND_OUTPUT_BUFFER];
+  // framed reply, queued until the client reads it
+  unsigned char *reply;
+  size_t reply_size;
+  size_t reply_length;
+  size_t reply_sent;
+};
+
+static void command_poll(struct sched_ent *alarm);
+static void command_client_poll(struct sched_ent *alarm);
+
+static struct sched_ent named_socket;
+static struct profile_total named_stats={
+  .name="command_poll",
+};
+static struct profile_total client_stats={
+  .name="command_client_poll",
+};
+
+int command_setup_socket()
+{
+  int sock = -1;
+  if ((sock = esocket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+    goto error;
+  struct sockaddr_un addr;
+  socklen_t addrlen;
+  if (make_local_sockaddr(&addr, &addrlen, "command.socket") == -1)
+    goto error;
+  if (socket_bind(sock, (struct sockaddr*)&addr, addrlen) == -1)
+    goto error;
+  if (socket_listen(sock, 8) == -1)
+    goto error;
+  if (set_nonblock(sock) == -1)
+    goto error;
+  named_socket.function=command_poll;
+  named_socket.stats=&named_stats;
+  named_socket.poll.fd=sock;
+  named_socket.poll.events=POLLIN;
+  watch(&named_socket);
+  INFOF("Command socket: fd=%d %s", sock, alloca_sockaddr(&addr, addrlen));
+  return 0;
+
+error:
+  if (sock != -1)
+    close(sock);
+  return -1;
+}
+
+static void command_new_client(int s)
+{
+  uid_t otheruid;
+  if (set_nonblock(s) == -1 || socket_peer_uid(s, &otheruid) == -1){
+    close(s);
+    return;
+  }
+  if (otheruid != getuid()){
+    WHYF("command.socket client has wrong uid (%d versus %d)", otheruid, getuid());
+    close(s);
+    return;
+  }
+  struct command_client *c = emalloc_zero(sizeof(struct command_client));
+  if (!c){
+    close(s);
+    return;
+  }
+  c->alarm.function = command_client_poll;
+  c->alarm.stats = &client_stats;
+  c->alarm.poll.fd = s;
+  c->alarm.poll.events = POLLIN;
+  watch(&c->alarm);
+  c->alarm.alarm = gettime_ms() + COMMAND_IDLE_TIMEOUT_MS;
+  c->alarm.deadline = c->alarm.alarm;
+  schedule(&c->alarm);
+}
+
+static void command_poll(struct sched_ent *alarm)
+{
+  int s;
+  while ((s = accept(alarm->poll.fd, NULL, NULL)) != -1)
+    command_new_client(s);
+  if (errno != EAGAIN && errno != EWOULDBLOCK)
+    WHY_perror("accept");
+}
+
+static void command_close(struct command_client *c)
+{
+  unwatch(&c->alarm);
+  if (is_scheduled(&c->alarm))
+    unschedule(&c->alarm);
+  close(c->alarm.poll.fd);
+  if (c->reply)
+    free(c->reply);
+  free(c);
+}
+
+static void command_idle_timeout(struct command_client *c)
+{
+  unschedule(&c->alarm);
+  c->alarm.alarm = gettime_ms() + COMMAND_IDLE_TIMEOUT_MS;
+  c->alarm.deadline = c->alarm.alarm;
+  schedule(&c->alarm);
+}
+
+static int command_send_frame(struct command_client *c, char type, const unsigned char *payload, size_t len)
+{
+  if (c->failed)
+    return -1;
+  size_t needed = c->reply_length + COMMAND_FRAME_HEADER + len;
+  if (needed > c->reply_size){
+    size_t size = c->reply_size ? c->reply_size : COMMAND_OUTPUT_BUFFER;
+    while (size < needed)
+      size *= 2;
+    unsigned char *reply = erealloc(c->reply, size);
+    if (!reply){
+      c->failed = 1;
+      return -1;
+    }
+    c->reply = reply;
+    c->reply_size = size;
+  }
+  unsigned char *header = &c->reply[c->reply_length];
+  header[0] = type;
+  write_uint32(&header[1], len);
+  if (len)
+    bcopy(payload, &header[COMMAND_FRAME_HEADER], len);
+  c->reply_length = needed;
+  return 0;
+}
+
+static int command_flush(struct command_client *c)
+{
+  if (c->output_length == 0)
+    return 0;
+  int ret = command_send_frame(c, 'o', c->output, c->output_length);
+  c->output_length = 0;
+  return ret;
+}
+
+static int command_write(struct cli_context *context, const char *buf, size_t len)
+{
+  struct command_client *c = context->context;
+  if (buf == NULL)
+    return command_flush(c);
+  if (c->output_length + len > sizeof c->output && command_flush(c) == -1)
+    return EOF;
+  if (len > sizeof c->output)
+    return command_send_frame(c, 'o', (const unsigned char *)buf, len) == -1 ? EOF : 0;
+  bcopy(buf, &c->output[c->output_length], len);
+  c->output_length += len;
+  return 0;
+}
+
+static int command_delim(struct cli_context *context, const char *opt)
+{
+  struct command_client *c = context->context;
+  if (command_flush(c) == -1)
+    return -1;
+  if (opt)
+    return command_send_frame(c, 'd', (const unsigned char *)opt, strlen(opt));
+  return command_send_frame(c, 'D', NULL, 0);
+}
+
+static void command_run(struct command_client *c)
+{
+  // the request is cwd\0arg\0arg\0...
+  if (c->request_length == 0 || c->request[c->request_length - 1] != '\0'){
+    WHY("command.socket request is malformed");
+    return;
+  }
+  const char *cwd = c->request;
+  const char *argv[COMMAND_REQUEST_MAX / 2];
+  int argc = 0;
+  const char *p = cwd + strlen(cwd) + 1;
+  const char *end = &c->request[c->request_length];
+  while (p < end){
+    if (argc >= NELS(argv) - 1){
+      WHY("command.socket request has too many arguments");
+      return;
+    }
+    argv[argc++] = p;
+    p += strlen(p) + 1;
+  }
+  argv[argc] = NULL;
+
+  if (config.debug.verbose){
+    strbuf b = strbuf_alloca(160);
+    strbuf_append_argv(b, argc, argv);
+    DEBUGF("command.socket running: %s", strbuf_str(b));
+  }
+
+  struct cli_context context;
+  bzero(&context, sizeof context);
+  context.context = c;
+  context.write = command_write;
+  context.delim = command_delim;
+  int32_t status = server_run_command(&context, cwd, argc, argv);
+
+  unsigned char result[4];
+  write_uint32(result, (uint32_t)status);
+  if (command_flush(c) == -1 || command_send_frame(c, 'x', result, sizeof result) == -1)
+    WHY("command.socket reply could not be queued");
+}
+
+// send as much of the reply as the client will take without blocking
+static void command_send_reply(struct command_client *c)
+{
+  while (c->reply_sent < c->reply_length){
+    ssize_t written = write(c->alarm.poll.fd, &c->reply[c->reply_sent], c->reply_length - c->reply_sent);
+    if (written == -1){
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+	return;
+      WHY_perror("write");
+      break;
+    }
+    c->reply_sent += written;
+    command_idle_timeout(c);
+  }
+  command_close(c);
+}
+
+static void command_client_poll(struct sched_ent *alarm)
+{
+  struct command_client *c = (struct command_client *)alarm;
+  if (alarm->poll.revents == 0){
+    WHY("command.socket client timed out");
+    command_close(c);
+    return;
+  }
+  if (alarm->poll.revents & POLLOUT){
+    command_send_reply(c);
+    return;
+  }
+  if (alarm->poll.revents & POLLIN){
+    if (c->request_length >= sizeof c->request){
+      WHY("command.socket request is too long");
+      command_close(c);
+      return;
+    }
+    ssize_t bytes = read(alarm->poll.fd, &c->request[c->request_length], sizeof c->request - c->request_length);
+    if (bytes == -1){
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+	return;
+      WHY_perror("read");
+      command_close(c);
+      return;
+    }
+    if (bytes > 0){
+      c->request_length += bytes;
+      command_idle_timeout(c);
+      return;
+    }
+    // the client has sent the whole request
+    command_run(c);
+    if (c->reply_length == 0){
+      command_close(c);
+      return;
+    }
+    c->alarm.poll.events = POLLOUT;
+    watch(&c->alarm);
+    command_send_reply(c);
+    return;
+  }
+  if (alarm->poll.revents & (POLLHUP | POLLERR))
+    command_close(c);
+}
+
+int app_exec(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  if (config.debug.verbose)
+    DEBUG_cli_parsed(parsed);
+  const char *command;
+  if (cli_arg(parsed, "command", &command, NULL, NULL) == -1)
+    return -1;
+  char cwd[1024];
+  if (getcwd(cwd, sizeof cwd) == NULL)
+    return WHY_perror("getcwd");
+
+  int sock = -1;
+  int ret = -1;
+  if ((sock = esocket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+    goto end;
+  struct sockaddr_un addr;
+  socklen_t addrlen;
+  if (make_local_sockaddr(&addr, &addrlen, "command.socket") == -1)
+    goto end;
+  if (socket_connect(sock, (struct sockaddr*)&addr, addrlen) == -1){
+    WHY("Is the server running?");
+    goto end;
+  }
+
+  if (write_all(sock, cwd, strlen(cwd) + 1) == -1
+    || write_all(sock, command, strlen(command) + 1) == -1)
+    goto end;
+  unsigned i;
+  for (i = parsed->varargi; i < parsed->argc; ++i)
+    if (write_all(sock, parsed->args[i], strlen(parsed->args[i]) + 1) == -1)
+      goto end;
+  if (shutdown(sock, SHUT_WR) == -1){
+    WHY_perror("shutdown");
+    goto end;
+  }
+
+  FILE *in = fdopen(sock, "r");
+  if (!in){
+    WHY_perror("fdopen");
+    goto end;
+  }
+  sock = -1;
+  unsigned char header[COMMAND_FRAME_HEADER];
+  unsigned char buffer[COMMAND_OUTPUT_BUFFER];
+  int finished = 0;
+  while (fread(header, sizeof header, 1, in) == 1){
+    uint32_t len = read_uint32(&header[1]);
+    char *payload = (char *)buffer;
+    if (len >= sizeof buffer && (payload = emalloc(len + 1)) == NULL)
+      break;
+    if (len && fread(payload, len, 1, in) != 1){
+      WHY("Command output is truncated");
+      if (payload != (char *)buffer)
+	free(payload);
+      break;
+    }
+    payload[len] = '\0';
+    switch (header[0]){
+    case 'o':
+      cli_write(context, (unsigned char *)payload, len);
+      break;
+    case 'd':
+      cli_delim(context, payload);
+      break;
+    case 'D':
+      cli_delim(context, NULL);
+      break;
+    case 'x':
+      if (len == 4){
+	ret = (int32_t)read_uint32((unsigned char *)payload);
+	finished = 1;
+      }
+      break;
+    }
+    if (payload != (char *)buffer)
+      free(payload);
+    if (finished)
+      break;
+  }
+  if (!finished)
+    WHY("Server did not finish the command");
+  fclose(in);
+
+end:
+  if (sock != -1)
+    close(sock);
+  return ret;
+}
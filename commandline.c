@@ -259,6 +259,48 @@ int parseCommandLine(struct cli_context *context, const char *argv0, int argc, c
   return result;
 }
 
+/* Run a command on behalf of a command socket client, inside the server process.  Unlike
+   parseCommandLine(), this must leave the server's configuration, rhizome database and subscriber
+   table alone, so only commands flagged with CLIFLAG_RUN_IN_SERVER are permitted, and they use the
+   server's own keyring.  The server's working directory is shared by everything it does, so
+   relative file and manifest paths are resolved against the client's working directory instead of
+   changing to it.
+ */
+int server_run_command(struct cli_context *context, const char *cwd, int argc, const char *const *args)
+{
+  IN();
+  struct cli_parsed parsed;
+  int result = cli_parse(argc, args, command_line_options, &parsed);
+  if (result != 0)
+    RETURN(result);
+  if (!(parsed.commands[parsed.cmdi].flags & CLIFLAG_RUN_IN_SERVER)) {
+    strbuf b = strbuf_alloca(160);
+    strbuf_append_argv(b, argc, args);
+    RETURN(WHYF("command cannot be run by the server: %s", strbuf_str(b)));
+  }
+  unsigned i;
+  for (i = 0; i < parsed.labelc; ++i) {
+    struct labelv *label = &parsed.labelv[i];
+    if (!(   (label->len == 8 && strncmp(label->label, "filepath", 8) == 0)
+	  || (label->len == 12 && strncmp(label->label, "manifestpath", 12) == 0)))
+      continue;
+    // an empty path means none was given, and "-" means standard output
+    if (label->text[0] == '\0' || strcmp(label->text, "-") == 0)
+      continue;
+    strbuf b = strbuf_alloca(strlen(cwd) + strlen(label->text) + 2);
+    label->text = strbuf_str(strbuf_path_join(b, cwd, label->text, NULL));
+  }
+  if (!keyring)
+    RETURN(WHY("server has no keyring"));
+  keyring_file *server_keyring = keyring;
+  keyring_shared = keyring;
+  result = cli_invoke(&parsed, context);
+  keyring_shared = NULL;
+  keyring = server_keyring;
+  RETURN(result);
+  OUT();
+}
+
 /* Write a buffer of data to output.  If in a JNI call, then this appends the data to the
    current output field, including any embedded nul characters.  Returns a non-negative integer on
    success, EOF on error.
@@ -281,6 +323,8 @@ int cli_write(struct cli_context *context, const unsigned char *buf, size_t len)
     return 0;
   }
 #endif
+  if (context && context->write)
+    return context->write(context, (const char *) buf, len);
   return fwrite(buf, len, 1, stdout);
 }
 
@@ -295,7 +339,9 @@ int cli_puts(struct cli_context *context, const char *str)
     return cli_write(context, (const unsigned char *) str, strlen(str));
   else
 #endif
-    return fputs(str, stdout);
+  if (context && context->write)
+    return context->write(context, str, strlen(str));
+  return fputs(str, stdout);
 }
 
 /* Write a formatted string to output.  If in a JNI call, then this appends the string to the
@@ -323,7 +369,16 @@ int cli_printf(struct cli_context *context, const char *fmt, ...)
     ret = count;
   } else
 #endif
-  {
+  if (context && context->write) {
+    va_start(ap, fmt);
+    int count = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    char buf[count + 1];
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof buf, fmt, ap);
+    va_end(ap);
+    ret = context->write(context, buf, count) == EOF ? -1 : count;
+  } else {
     va_start(ap, fmt);
     ret = vfprintf(stdout, fmt, ap);
     va_end(ap);
@@ -455,6 +510,8 @@ int cli_delim(struct cli_context *context, const char *opt)
   if (context && context->jni_env)
     return outv_end_field(context);
 #endif
+  if (context && context->delim)
+    return context->delim(context, opt);
   const char *delim = getenv("SERVALD_OUTPUT_DELIMITER");
   if (delim == NULL)
     delim = opt ? opt : "\n";
@@ -462,7 +519,8 @@ int cli_delim(struct cli_context *context, const char *opt)
   return 0;
 }
 
-/* Flush the output fields if they are being written to standard output.
+/* Flush the output fields if they are being written to standard output, or sent to a client of the
+   server's command socket.
  */
 void cli_flush(struct cli_context *context)
 {
@@ -470,7 +528,10 @@ void cli_flush(struct cli_context *context)
   if (context && context->jni_env)
     return;
 #endif
-  fflush(stdout);
+  if (context && context->write)
+    context->write(context, NULL, 0);
+  else
+    fflush(stdout);
 }
 
 int app_echo(const struct cli_parsed *parsed, struct cli_context *context)
@@ -508,6 +569,77 @@ int app_log(const struct cli_parsed *parsed, struct cli_context *context)
   return 0;
 }
 
+/* Print the records of a binary log file (log.file.binary) in the same form as a text log.
+ */
+int app_log_decode(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  if (config.debug.verbose)
+    DEBUG_cli_parsed(parsed);
+  const char *path;
+  if (cli_arg(parsed, "filepath", &path, NULL, "") == -1)
+    return -1;
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return WHYF_perror("fopen(%s, \"r\")", alloca_str_toprint(path));
+  int ret = 0;
+  char *text = NULL;
+  size_t text_size = 0;
+  struct log_record record;
+  while (fread(&record, sizeof record, 1, f) == 1) {
+    if (record.magic != LOG_RECORD_MAGIC) {
+      ret = WHY("Not a binary log file, or it was written on a different architecture");
+      break;
+    }
+    if (record.length >= text_size) {
+      char *p = erealloc(text, record.length + 1);
+      if (!p) {
+	ret = -1;
+	break;
+      }
+      text = p;
+      text_size = record.length + 1;
+    }
+    if (fread(text, record.length, 1, f) != 1) {
+      ret = WHY("Binary log file is truncated");
+      break;
+    }
+    text[record.length] = '\0';
+    const char *file = text;
+    const char *function = file + strnlen(file, record.length) + 1;
+    const char *end = text + record.length;
+    const char *message = function < end ? function + strnlen(function, end - function) + 1 : end;
+    if (function > end)
+      function = end;
+    if (message > end)
+      message = end;
+    if (record.level == LOG_LEVEL_SILENT) {
+      cli_printf(context, "%s\n", message);
+      continue;
+    }
+    time_t sec = record.time_us / 1000000;
+    struct tm tm;
+    char buf[50];
+    localtime_r(&sec, &tm);
+    strftime(buf, sizeof buf, "%T", &tm);
+    cli_printf(context, "%-6.6s[%5u] %s.%03u ", log_level_prefix(record.level),
+	       record.pid, buf, (unsigned)(record.time_us % 1000000) / 1000);
+    if (file[0]) {
+      cli_printf(context, "%s", file);
+      if (record.line)
+	cli_printf(context, ":%u", record.line);
+      if (function[0])
+	cli_printf(context, ":%s()", function);
+      cli_puts(context, "  ");
+    } else if (function[0])
+      cli_printf(context, "%s()  ", function);
+    cli_printf(context, "%s\n", message);
+  }
+  if (text)
+    free(text);
+  fclose(f);
+  return ret;
+}
+
 void lookup_send_request(int mdp_sockfd, const sid_t *srcsid, int srcport, const sid_t *dstsid, const char *did)
 {
   overlay_mdp_frame mdp;
@@ -1068,6 +1200,98 @@ int app_mdp_ping(const struct cli_parsed *parsed, struct cli_context *context)
   return ret;
 }
 
+// ask for a port binding, failing if another client already holds it
+static int mdp_bind_unforced(int mdp_sockfd, const sid_t *localaddr, mdp_port_t port)
+{
+  overlay_mdp_frame mdp;
+  bzero(&mdp, sizeof mdp);
+  mdp.packetTypeAndFlags=MDP_BIND;
+  mdp.bind.sid = *localaddr;
+  mdp.bind.port=port;
+  return overlay_mdp_send(mdp_sockfd, &mdp, MDP_AWAITREPLY, 5000);
+}
+
+/* Bind many ports from one client, deliver a frame to the first of them, then check that the
+   client's goodbye releases every one of them to another client.
+ */
+int app_mdp_bind_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  if (config.debug.verbose)
+    DEBUG_cli_parsed(parsed);
+  const char *count_arg;
+  if (cli_arg(parsed, "--count", &count_arg, cli_uint, "200") == -1)
+    return -1;
+  unsigned count = atoi(count_arg);
+  if (count < 2 || count > 16384)
+    return WHYF("Cannot bind %u ports", count);
+
+  int mdp_sockfd, other_sockfd;
+  if ((mdp_sockfd = overlay_mdp_client_socket()) < 0)
+    return WHY("Cannot create MDP socket");
+  if ((other_sockfd = overlay_mdp_client_socket()) < 0){
+    overlay_mdp_client_close(mdp_sockfd);
+    return WHY("Cannot create MDP socket");
+  }
+  int ret=-1;
+  unsigned bound=0, delivered=0, released=0;
+  mdp_port_t base=32768+(random()&16383);
+  sid_t srcsid;
+  if (overlay_mdp_getmyaddr(mdp_sockfd, 0, &srcsid)){
+    WHY("Could not get local address");
+    goto end;
+  }
+  for (bound=0; bound<count; bound++)
+    if (overlay_mdp_bind(mdp_sockfd, &srcsid, base+bound))
+      goto end;
+  if (mdp_bind_unforced(other_sockfd, &srcsid, base) == 0){
+    WHYF("Port %"PRImdp_port_t" was bound by two clients", base);
+    goto end;
+  }
+
+  // from the last binding to the first
+  overlay_mdp_frame mdp;
+  bzero(&mdp, sizeof mdp);
+  mdp.packetTypeAndFlags=MDP_TX|MDP_NOCRYPT|MDP_NOSIGN;
+  mdp.out.src.sid=srcsid;
+  mdp.out.src.port=base+count-1;
+  mdp.out.dst.sid=srcsid;
+  mdp.out.dst.port=base;
+  mdp.out.payload_length=5;
+  bcopy("hello", mdp.out.payload, 5);
+  if (overlay_mdp_send(mdp_sockfd, &mdp, 0, 0))
+    goto end;
+  time_ms_t timeout = gettime_ms() + 1000;
+  while (!delivered && overlay_mdp_client_poll(mdp_sockfd, timeout - gettime_ms()) > 0){
+    overlay_mdp_frame rx;
+    int ttl;
+    if (overlay_mdp_recv(mdp_sockfd, &rx, base, &ttl) == 0
+      && (rx.packetTypeAndFlags & MDP_TYPE_MASK) == MDP_TX
+      && rx.in.src.port == base+count-1
+      && rx.in.payload_length == 5 && memcmp(rx.in.payload, "hello", 5) == 0)
+      delivered=1;
+  }
+
+  // saying goodbye must release every binding, or the other client cannot take them over
+  overlay_mdp_client_close(mdp_sockfd);
+  mdp_sockfd=-1;
+  for (released=0; released<count; released++)
+    if (mdp_bind_unforced(other_sockfd, &srcsid, base+released))
+      break;
+  ret = delivered && released==count ? 0 : 1;
+
+end:
+  cli_field_name(context, "bound", ":");
+  cli_put_long(context, bound, "\n");
+  cli_field_name(context, "delivered", ":");
+  cli_put_long(context, delivered, "\n");
+  cli_field_name(context, "released", ":");
+  cli_put_long(context, released, "\n");
+  if (mdp_sockfd!=-1)
+    overlay_mdp_client_close(mdp_sockfd);
+  overlay_mdp_client_close(other_sockfd);
+  return ret;
+}
+
 int app_trace(const struct cli_parsed *parsed, struct cli_context *context)
 {
   int mdp_sockfd;
@@ -1471,6 +1695,62 @@ int app_rhizome_add_file(const struct cli_parsed *parsed, struct cli_context *co
   return ret;
 }
 
+static int slip_format_arg(const char *arg)
+{
+  if (strcasecmp(arg, "slip")==0)
+    return SLIP_FORMAT_SLIP;
+  if (strcasecmp(arg, "upper7")==0)
+    return SLIP_FORMAT_UPPER7;
+  return -1;
+}
+
+/* Feed an encoded stream through slip_decode() in blocks of at most chunk bytes,
+   as if it were read from a serial port. Calls fn for each decoded packet.
+ */
+static int slip_test_decode_stream(struct slip_decode_state *state, unsigned char *stream, int len, int chunk,
+				   int (*fn)(struct slip_decode_state *state, void *context), void *context)
+{
+  int ofs=0, packets=0;
+  while (ofs<len){
+    int n = len - ofs;
+    if (chunk>0 && n>chunk)
+      n=chunk;
+    state->src=&stream[ofs];
+    state->src_size=n;
+    state->src_offset=0;
+    while(state->src_offset<state->src_size){
+      int r=slip_decode(state);
+      if (r<0)
+	return -1;
+      if (r==0)
+	break;
+      packets++;
+      if (fn && fn(state, context))
+	return -1;
+      state->dst_offset=0;
+    }
+    ofs+=n;
+  }
+  return packets;
+}
+
+struct slip_test_packet{
+  unsigned char *data;
+  int len;
+};
+
+static int slip_test_compare(struct slip_decode_state *state, void *context)
+{
+  struct slip_test_packet *packet = context;
+  if (state->packet_length!=packet->len || memcmp(state->dst, packet->data, packet->len)!=0){
+    WHYF("Decoded packet does not match (%d vs %d bytes)", state->packet_length, packet->len);
+    dump("input",packet->data,packet->len);
+    dump("decoded",state->dst,state->packet_length);
+    return -1;
+  }
+  return 0;
+}
+
 int app_slip_test(const struct cli_parsed *parsed, struct cli_context *context)
 {
   const char *seed = NULL;
@@ -1494,16 +1774,19 @@ int app_slip_test(const struct cli_parsed *parsed, struct cli_context *context)
     int len=1+random()%1500;
     int i;
     for(i=0;i<len;i++) bufin[i]=random()&0xff;
+    // alternate between formats, and split the encoded stream at random points
     struct slip_decode_state state;
     bzero(&state,sizeof state);
-    int outlen=slip_encode(SLIP_FORMAT_UPPER7,bufin,len,bufout,8192);
-    for(i=0;i<outlen;i++) upper7_decode(&state,bufout[i]);
-    uint32_t crc=Crc32_ComputeBuf( 0, state.dst, state.packet_length);
-    if (crc!=state.crc) {
-      WHYF("CRC error (%08x vs %08x)",crc,state.crc);
-      dump("input",bufin,len);
+    state.encapsulator = (count&1) ? SLIP_FORMAT_SLIP : SLIP_FORMAT_UPPER7;
+    int outlen=slip_encode(state.encapsulator,bufin,len,bufout,8192);
+    if (outlen<0)
+      return -1;
+    struct slip_test_packet packet={.data=bufin, .len=len};
+    int packets=slip_test_decode_stream(&state, bufout, outlen, 1+random()%outlen, slip_test_compare, &packet);
+    if (packets!=1) {
+      if (packets==0)
+	WHYF("Failed to decode %d byte packet", len);
       dump("encoded",bufout,outlen);
-      dump("decoded",state.dst,state.packet_length);
       return 1;
     } else { 
       if (!(count%1000))
@@ -1514,6 +1797,113 @@ int app_slip_test(const struct cli_parsed *parsed, struct cli_context *context)
   return 0;
 }
 
+int app_slip_encode(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *format_arg, *path, *seed = NULL, *count_arg = NULL;
+  if (   cli_arg(parsed, "format", &format_arg, NULL, "") == -1
+      || cli_arg(parsed, "filepath", &path, NULL, "") == -1
+      || cli_arg(parsed, "--seed", &seed, cli_uint, NULL) == -1
+      || cli_arg(parsed, "--count", &count_arg, cli_uint, "1000") == -1)
+    return -1;
+  int format = slip_format_arg(format_arg);
+  if (format<0)
+    return WHYF("Unsupported format %s", alloca_str_toprint(format_arg));
+  if (seed)
+    srandom(atoi(seed));
+  FILE *fp = fopen(path, "w");
+  if (!fp)
+    return WHYF_perror("fopen(%s, \"w\")", alloca_str_toprint(path));
+  int i, count = atoi(count_arg);
+  int64_t total=0;
+  for (i=0;i<count;i++){
+    unsigned char bufin[8192];
+    unsigned char bufout[8192];
+    int len=1+random()%1200, j;
+    for(j=0;j<len;j++) bufin[j]=random()&0xff;
+    int outlen=slip_encode(format,bufin,len,bufout,8192);
+    if (outlen<0 || fwrite(bufout, outlen, 1, fp)!=1){
+      fclose(fp);
+      return WHY("Failed to write trace");
+    }
+    total+=outlen;
+  }
+  fclose(fp);
+  cli_field_name(context, "packets", ":");
+  cli_put_long(context, count, "\n");
+  cli_field_name(context, "bytes", ":");
+  cli_put_long(context, total, "\n");
+  return 0;
+}
+
+/* Measure decoder throughput over a captured (or generated) serial byte stream.
+   Decoding is repeated until at least the requested duration has passed.
+ */
+int app_slip_decode(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *format_arg, *path, *duration_arg = NULL, *chunk_arg = NULL;
+  if (   cli_arg(parsed, "format", &format_arg, NULL, "") == -1
+      || cli_arg(parsed, "filepath", &path, NULL, "") == -1
+      || cli_arg(parsed, "--duration", &duration_arg, cli_uint, "1") == -1
+      || cli_arg(parsed, "--chunk", &chunk_arg, cli_uint, "256") == -1)
+    return -1;
+  int format = slip_format_arg(format_arg);
+  if (format<0)
+    return WHYF("Unsupported format %s", alloca_str_toprint(format_arg));
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return WHYF_perror("fopen(%s, \"r\")", alloca_str_toprint(path));
+  size_t size=0, alloced=0;
+  unsigned char *stream=NULL;
+  while(1){
+    if (size==alloced){
+      alloced = alloced ? alloced*2 : 65536;
+      unsigned char *p = erealloc(stream, alloced);
+      if (!p){
+	free(stream);
+	fclose(fp);
+	return -1;
+      }
+      stream = p;
+    }
+    size_t n = fread(stream + size, 1, alloced - size, fp);
+    if (n==0)
+      break;
+    size+=n;
+  }
+  fclose(fp);
+  
+  int chunk = atoi(chunk_arg);
+  time_ms_t start = gettime_ms();
+  time_ms_t end = start + atoi(duration_arg) * (time_ms_t) 1000;
+  int64_t passes=0, packets=0;
+  do {
+    struct slip_decode_state state;
+    bzero(&state,sizeof state);
+    state.encapsulator = format;
+    int r = slip_test_decode_stream(&state, stream, size, chunk, NULL, NULL);
+    if (r<0){
+      free(stream);
+      return -1;
+    }
+    packets+=r;
+    passes++;
+  } while (gettime_ms() < end);
+  time_ms_t elapsed = gettime_ms() - start;
+  free(stream);
+  
+  cli_field_name(context, "packets", ":");
+  cli_put_long(context, packets / passes, "\n");
+  cli_field_name(context, "bytes", ":");
+  cli_put_long(context, size, "\n");
+  cli_field_name(context, "passes", ":");
+  cli_put_long(context, passes, "\n");
+  cli_field_name(context, "elapsed_ms", ":");
+  cli_put_long(context, elapsed, "\n");
+  cli_field_name(context, "bytes_per_second", ":");
+  cli_put_long(context, elapsed ? (int64_t)size * passes * 1000 / elapsed : 0, "\n");
+  return 0;
+}
+
 int app_rhizome_import_bundle(const struct cli_parsed *parsed, struct cli_context *context)
 {
   if (config.debug.verbose)
@@ -2667,6 +3057,53 @@ int app_route_print(const struct cli_parsed *parsed, struct cli_context *context
   return 0;
 }
 
+int app_stats_print(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  int mdp_sockfd;
+  if (config.debug.verbose)
+    DEBUG_cli_parsed(parsed);
+
+  if ((mdp_sockfd = overlay_mdp_client_socket()) < 0)
+    return WHY("Cannot create MDP socket");
+
+  // the daemon sends the JSON document a page of frames at a time, then an MDP_ERROR frame to say
+  // it has finished
+  int ret=-1, finished=0;
+  unsigned offset=0, frames=MDP_STATS_PAGE_FRAMES;
+  while(!finished){
+    if (frames == MDP_STATS_PAGE_FRAMES){
+      overlay_mdp_frame mdp;
+      bzero(&mdp,sizeof(mdp));
+      mdp.packetTypeAndFlags=MDP_STATS;
+      mdp.stats.offset=offset;
+      overlay_mdp_send(mdp_sockfd, &mdp,0,0);
+      frames=0;
+    }
+    if (!overlay_mdp_client_poll(mdp_sockfd, 1000))
+      break;
+    overlay_mdp_frame rx;
+    int ttl;
+    if (overlay_mdp_recv(mdp_sockfd, &rx, 0, &ttl))
+      continue;
+    switch (rx.packetTypeAndFlags & MDP_TYPE_MASK){
+      case MDP_TX:
+	cli_write(context, rx.out.payload, rx.out.payload_length);
+	offset+=rx.out.payload_length;
+	frames++;
+	break;
+      case MDP_ERROR:
+	// overlay_mdp_recv() has already logged any error message
+	ret = rx.error.error ? -1 : 0;
+	finished = 1;
+	break;
+    }
+  }
+  if (!finished)
+    WHY("Timed out waiting for stats from the server");
+  overlay_mdp_client_close(mdp_sockfd);
+  return ret;
+}
+
 int app_reverse_lookup(const struct cli_parsed *parsed, struct cli_context *context)
 {
   int mdp_sockfd;
@@ -2864,29 +3301,35 @@ int app_network_scan(const struct cli_parsed *parsed, struct cli_context *contex
 struct cli_schema command_line_options[]={
   {commandline_usage,{"help|-h|--help","...",NULL},CLIFLAG_PERMISSIVE_CONFIG,
    "Display command usage."},
-  {app_echo,{"echo","[-e]","[--]","...",NULL},CLIFLAG_PERMISSIVE_CONFIG,
+  {app_echo,{"echo","[-e]","[--]","...",NULL},CLIFLAG_PERMISSIVE_CONFIG | CLIFLAG_RUN_IN_SERVER,
    "Output the supplied string."},
-  {app_log,{"log","error|warn|hint|info|debug","<message>",NULL},CLIFLAG_PERMISSIVE_CONFIG,
+  {app_log,{"log","error|warn|hint|info|debug","<message>",NULL},CLIFLAG_PERMISSIVE_CONFIG | CLIFLAG_RUN_IN_SERVER,
    "Log the supplied message at given level."},
+  {app_log_decode,{"log","decode","<filepath>",NULL},CLIFLAG_PERMISSIVE_CONFIG | CLIFLAG_RUN_IN_SERVER,
+   "Print the contents of a binary log file as text."},
   {app_server_start,{"start" KEYRING_PIN_OPTIONS, "[foreground|exec <path>]",NULL}, 0,
    "Start daemon with instance path from SERVALINSTANCE_PATH environment variable."},
   {app_server_stop,{"stop",NULL},CLIFLAG_PERMISSIVE_CONFIG,
    "Stop a running daemon with instance path from SERVALINSTANCE_PATH environment variable."},
   {app_server_status,{"status",NULL},CLIFLAG_PERMISSIVE_CONFIG,
    "Display information about running daemon."},
+  {app_exec,{"exec","<command>","...",NULL}, 0,
+   "Run a command inside the running daemon, with the daemon's keyring and Rhizome store."},
   {app_mdp_ping,{"mdp","ping","[--interval=<ms>]","[--timeout=<seconds>]","<SID>|broadcast","[<count>]",NULL}, 0,
    "Attempts to ping specified node via Mesh Datagram Protocol (MDP)."},
   {app_trace,{"mdp","trace","<SID>",NULL}, 0,
    "Trace through the network to the specified node via MDP."},
-  {app_config_schema,{"config","schema",NULL},CLIFLAG_PERMISSIVE_CONFIG,
+  {app_mdp_bind_test,{"test","mdp","bind","[--count=<N>]",NULL}, 0,
+   "Bind many MDP ports from one client, and check that they are all delivered to and released"},
+  {app_config_schema,{"config","schema",NULL},CLIFLAG_PERMISSIVE_CONFIG | CLIFLAG_RUN_IN_SERVER,
    "Display configuration schema."},
-  {app_config_dump,{"config","dump","[--full]",NULL},CLIFLAG_PERMISSIVE_CONFIG,
+  {app_config_dump,{"config","dump","[--full]",NULL},CLIFLAG_PERMISSIVE_CONFIG | CLIFLAG_RUN_IN_SERVER,
    "Dump configuration settings."},
   {app_config_set,{"config","set","<variable>","<value>","...",NULL},CLIFLAG_PERMISSIVE_CONFIG,
    "Set and del specified configuration variables."},
   {app_config_set,{"config","del","<variable>","...",NULL},CLIFLAG_PERMISSIVE_CONFIG,
    "Del and set specified configuration variables."},
-  {app_config_get,{"config","get","[<variable>]",NULL},CLIFLAG_PERMISSIVE_CONFIG,
+  {app_config_get,{"config","get","[<variable>]",NULL},CLIFLAG_PERMISSIVE_CONFIG | CLIFLAG_RUN_IN_SERVER,
    "Get specified configuration variable."},
   {app_vomp_console,{"console",NULL}, 0,
     "Test phone call life-cycle from the console"},
@@ -2898,36 +3341,36 @@ struct cli_schema command_line_options[]={
    "Send a MeshMS message from <sender_sid> to <recipient_sid>"},
   {app_meshms_mark_read,{"meshms","read","messages" KEYRING_PIN_OPTIONS, "<sender_sid>", "[<recipient_sid>]", "[<offset>]",NULL},0,
    "Mark incoming messages from this recipient as read."},
-  {app_rhizome_append_manifest, {"rhizome", "append", "manifest", "<filepath>", "<manifestpath>", NULL}, 0,
+  {app_rhizome_append_manifest, {"rhizome", "append", "manifest", "<filepath>", "<manifestpath>", NULL}, CLIFLAG_RUN_IN_SERVER,
     "Append a manifest to the end of the file it belongs to."},
-  {app_rhizome_hash_file,{"rhizome","hash","file","<filepath>",NULL}, 0,
+  {app_rhizome_hash_file,{"rhizome","hash","file","<filepath>",NULL}, CLIFLAG_RUN_IN_SERVER,
    "Compute the Rhizome hash of a file"},
-  {app_rhizome_add_file,{"rhizome","add","file" KEYRING_PIN_OPTIONS,"[--force-new]","<author_sid>","<filepath>","[<manifestpath>]","[<bsk>]",NULL}, 0,
+  {app_rhizome_add_file,{"rhizome","add","file" KEYRING_PIN_OPTIONS,"[--force-new]","<author_sid>","<filepath>","[<manifestpath>]","[<bsk>]",NULL}, CLIFLAG_RUN_IN_SERVER,
 	"Add a file to Rhizome and optionally write its manifest to the given path"},
-  {app_rhizome_add_file, {"rhizome", "journal", "append" KEYRING_PIN_OPTIONS, "<author_sid>", "<manifestid>", "<filepath>", "[<bsk>]", NULL}, 0,
+  {app_rhizome_add_file, {"rhizome", "journal", "append" KEYRING_PIN_OPTIONS, "<author_sid>", "<manifestid>", "<filepath>", "[<bsk>]", NULL}, CLIFLAG_RUN_IN_SERVER,
 	"Append content to a journal bundle"},
-  {app_rhizome_import_bundle,{"rhizome","import","bundle","<filepath>","<manifestpath>",NULL}, 0,
+  {app_rhizome_import_bundle,{"rhizome","import","bundle","<filepath>","<manifestpath>",NULL}, CLIFLAG_RUN_IN_SERVER,
 	"Import a payload/manifest pair into Rhizome"},
   {app_rhizome_list,{"rhizome","list" KEYRING_PIN_OPTIONS,
-	"[<service>]","[<name>]","[<sender_sid>]","[<recipient_sid>]","[<offset>]","[<limit>]",NULL}, 0,
+	"[<service>]","[<name>]","[<sender_sid>]","[<recipient_sid>]","[<offset>]","[<limit>]",NULL}, CLIFLAG_RUN_IN_SERVER,
 	"List all manifests and files in Rhizome"},
   {app_rhizome_extract,{"rhizome","export","bundle" KEYRING_PIN_OPTIONS,
-	"<manifestid>","[<manifestpath>]","[<filepath>]",NULL}, 0,
+	"<manifestid>","[<manifestpath>]","[<filepath>]",NULL}, CLIFLAG_RUN_IN_SERVER,
 	"Export a manifest and payload file to the given paths, without decrypting."},
   {app_rhizome_extract,{"rhizome","export","manifest" KEYRING_PIN_OPTIONS,
-	"<manifestid>","[<manifestpath>]",NULL}, 0,
+	"<manifestid>","[<manifestpath>]",NULL}, CLIFLAG_RUN_IN_SERVER,
 	"Export a manifest from Rhizome and write it to the given path"},
-  {app_rhizome_export_file,{"rhizome","export","file","<fileid>","[<filepath>]",NULL}, 0,
+  {app_rhizome_export_file,{"rhizome","export","file","<fileid>","[<filepath>]",NULL}, CLIFLAG_RUN_IN_SERVER,
 	"Export a file from Rhizome and write it to the given path without attempting decryption"},
   {app_rhizome_extract,{"rhizome","extract","bundle" KEYRING_PIN_OPTIONS,
-	"<manifestid>","[<manifestpath>]","[<filepath>]","[<bsk>]",NULL}, 0,
+	"<manifestid>","[<manifestpath>]","[<filepath>]","[<bsk>]",NULL}, CLIFLAG_RUN_IN_SERVER,
 	"Extract and decrypt a manifest and file to the given paths."},
   {app_rhizome_extract,{"rhizome","extract","file" KEYRING_PIN_OPTIONS,
-	"<manifestid>","[<filepath>]","[<bsk>]",NULL}, 0,
+	"<manifestid>","[<filepath>]","[<bsk>]",NULL}, CLIFLAG_RUN_IN_SERVER,
         "Extract and decrypt a file from Rhizome and write it to the given path"},
-  {app_rhizome_delete,{"rhizome","delete","manifest|payload|bundle","<manifestid>",NULL}, 0,
+  {app_rhizome_delete,{"rhizome","delete","manifest|payload|bundle","<manifestid>",NULL}, CLIFLAG_RUN_IN_SERVER,
 	"Remove the manifest, or payload, or both for the given Bundle ID from the Rhizome store"},
-  {app_rhizome_delete,{"rhizome","delete","|file","<fileid>",NULL}, 0,
+  {app_rhizome_delete,{"rhizome","delete","|file","<fileid>",NULL}, CLIFLAG_RUN_IN_SERVER,
 	"Remove the file with the given hash from the Rhizome store"},
   {app_rhizome_direct_sync,{"rhizome","direct","sync","[<url>]",NULL}, 0,
 	"Synchronise with the specified Rhizome Direct server. Return when done."},
@@ -2943,7 +3386,7 @@ struct cli_schema command_line_options[]={
    "Dump all keyring identities that can be accessed using the specified PINs"},
   {app_keyring_load,{"keyring","load" KEYRING_PIN_OPTIONS,"<file>","[<keyring-pin>]","[<entry-pin>]...",NULL}, 0,
    "Load identities from the given dump text and insert them into the keyring using the specified entry PINs"},
-  {app_keyring_list,{"keyring","list" KEYRING_PIN_OPTIONS,NULL}, 0,
+  {app_keyring_list,{"keyring","list" KEYRING_PIN_OPTIONS,NULL}, CLIFLAG_RUN_IN_SERVER,
    "List identities that can be accessed using the supplied PINs"},
   {app_keyring_add,{"keyring","add" KEYRING_PIN_OPTIONS,"[<pin>]",NULL}, 0,
    "Create a new identity in the keyring protected by the supplied PIN (empty PIN if not given)"},
@@ -2963,6 +3406,8 @@ struct cli_schema command_line_options[]={
    "Unload a specific identity and drop all routes to it"},
   {app_route_print, {"route","print",NULL}, 0,
   "Print the routing table"},
+  {app_stats_print, {"stats","print",NULL}, 0,
+  "Print the scheduler, queue and profiling statistics of the running daemon as JSON"},
   {app_network_scan, {"scan","[<address>]",NULL}, 0,
     "Scan the network for serval peers. If no argument is supplied, all local addresses will be scanned."},
   {app_count_peers,{"peer","count",NULL}, 0,
@@ -2981,8 +3426,14 @@ struct cli_schema command_line_options[]={
    "Run memory speed test"},
   {app_byteorder_test,{"test","byteorder",NULL}, 0,
    "Run byte order handling test"},
+  {app_trace_replay,{"trace","replay" KEYRING_PIN_OPTIONS, "<filepath>","[--speed=<factor>]",NULL}, 0,
+   "Feed packets captured with server.capture_file back through the overlay, and report how long it took. A speed of 0 replays as fast as possible"},
   {app_slip_test,{"test","slip","[--seed=<N>]","[--duration=<seconds>|--iterations=<N>]",NULL}, 0,
    "Run serial encapsulation test"},
+  {app_slip_encode,{"test","slip","encode","<format>","<filepath>","[--seed=<N>]","[--count=<N>]",NULL}, 0,
+   "Write a stream of random packets in the given serial encapsulation format (slip or upper7)"},
+  {app_slip_decode,{"test","slip","decode","<format>","<filepath>","[--duration=<seconds>]","[--chunk=<bytes>]",NULL}, 0,
+   "Measure the decoding throughput of a captured serial stream"},
 #ifdef HAVE_VOIPTEST
   {app_pa_phone,{"phone",NULL}, 0,
    "Run phone test application"},
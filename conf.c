@@ -24,6 +24,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "log.h"
 #include "str.h"
 #include "mem.h"
+#include "strbuf.h"
 
 #define CONFFILE_NAME		  "serval.conf"
 
@@ -41,6 +42,10 @@ int cf_limbo = 1;
 struct config_main config;
 static struct file_meta config_meta = FILE_META_UNKNOWN;
 
+// The COM that the current config was parsed from, and the one before it, as "key=text" lines.
+static char *config_om_text = NULL;
+static char *prior_om_text = NULL;
+
 static const char *conffile_path()
 {
   static char path[1024] = "";
@@ -169,10 +174,67 @@ int cf_om_save()
   return 0;
 }
 
+/* Return the COM as "fullkey=text" lines in a malloc()ed string, in the same order that
+ * cf_om_save() writes them, so that two COMs with the same settings give equal strings regardless
+ * of comments, blank lines or the order of lines in the file.
+ */
+static char *om_text(const struct cf_om_node *root)
+{
+  size_t len = 1;
+  struct cf_om_iterator it;
+  if (root)
+    for (cf_om_iter_start(&it, root); it.node; cf_om_iter_next(&it))
+      if (it.node->text)
+	len += strlen(it.node->fullkey) + strlen(it.node->text) + 2;
+  char *text = emalloc(len);
+  if (text == NULL)
+    return NULL;
+  strbuf b = strbuf_local(text, len);
+  if (root)
+    for (cf_om_iter_start(&it, root); it.node; cf_om_iter_next(&it))
+      if (it.node->text)
+	strbuf_sprintf(b, "%s=%s\n", it.node->fullkey, it.node->text);
+  return text;
+}
+
+/* Copy the lines of a COM text that belong to the given top-level section into a strbuf.
+ */
+static void om_text_section(strbuf b, const char *text, const char *section)
+{
+  size_t len = strlen(section);
+  while (text && *text) {
+    const char *next = strchr(text, '\n');
+    next = next ? next + 1 : text + strlen(text);
+    if (strncmp(text, section, len) == 0 && (text[len] == '=' || text[len] == '.'))
+      strbuf_ncat(b, text, next - text);
+    text = next;
+  }
+}
+
+/* Return true if the last reload that changed the config changed any setting in the given
+ * top-level section, eg, "interfaces" or "rhizome".  Lets the server apply just the sections that
+ * changed, instead of restarting everything.
+ */
+int cf_changed(const char *section)
+{
+  if (config_om_text == NULL)
+    return 1;
+  strbuf old = strbuf_alloca(CONFIG_FILE_MAX_SIZE);
+  strbuf new = strbuf_alloca(CONFIG_FILE_MAX_SIZE);
+  om_text_section(old, prior_om_text, section);
+  om_text_section(new, config_om_text, section);
+  return strbuf_overrun(old) || strbuf_overrun(new) || strcmp(strbuf_str(old), strbuf_str(new)) != 0;
+}
+
 int cf_init()
 {
   cf_limbo = 1;
   conffile_meta = config_meta = FILE_META_UNKNOWN;
+  if (config_om_text)
+    free(config_om_text);
+  if (prior_om_text)
+    free(prior_om_text);
+  config_om_text = prior_om_text = NULL;
   memset(&config, 0, sizeof config);
   if (cf_dfl_config_main(&config) == CFERROR)
     return -1;
@@ -191,6 +253,16 @@ static int reload_and_parse(int permissive, int strict)
       return 0;
     else {
       config_meta = conffile_meta;
+      char *new_om_text = NULL;
+      if (result == CFOK || result == CFEMPTY) {
+	// A new file with the same settings, eg, only comments changed, leaves the config as it is.
+	if ((new_om_text = om_text(cf_om_root)) == NULL)
+	  result = CFERROR;
+	else if (!cf_limbo && config_om_text && strcmp(new_om_text, config_om_text) == 0) {
+	  free(new_om_text);
+	  return 0;
+	}
+      }
       if (result == CFOK || result == CFEMPTY) {
 	struct config_main new_config;
 	memset(&new_config, 0, sizeof new_config);
@@ -203,9 +275,18 @@ static int reload_and_parse(int permissive, int strict)
 	  } else if (result != CFERROR && !strict) {
 	    result &= ~CFEMPTY; // don't log "empty" as a problem
 	    config = new_config;
+	  } else {
+	    free(new_om_text);
+	    new_om_text = NULL;
 	  }
 	}
       }
+      if (new_om_text) {
+	if (prior_om_text)
+	  free(prior_om_text);
+	prior_om_text = config_om_text;
+	config_om_text = new_om_text;
+      }
     }
   }
   int ret = 1;
@@ -700,5 +700,6 @@ int cf_load_permissive();
 int cf_reload();
 int cf_reload_strict();
 int cf_reload_permissive();
+int cf_changed(const char *section);
 
 #endif //__SERVALDNA_CONFIG_H
@@ -819,6 +819,37 @@ int cf_cmp_pattern_list(const struct pattern_list *a, const struct pattern_list
   return (a->patc < b->patc) ? -1 : (a->patc > b->patc) ? 1 : 0;
 }
 
+int vld_vomp_jitter(const struct cf_om_node *parent, struct config_vomp_jitter *jitter, int result)
+{
+  if (jitter->percentile > 100) {
+    int nodei = cf_om_get_child(parent, "percentile", NULL);
+    assert(nodei != -1);
+    cf_warn_node_value(parent->nodv[nodei], CFINVALID);
+    return result | CFSUB(CFINVALID);
+  }
+  if (jitter->max_delay_ms < jitter->min_delay_ms) {
+    int nodei_min = cf_om_get_child(parent, "min_delay_ms", NULL);
+    int nodei_max = cf_om_get_child(parent, "max_delay_ms", NULL);
+    if (nodei_min != -1 && nodei_max != -1)
+      cf_warn_incompatible(parent->nodv[nodei_min], parent->nodv[nodei_max]);
+    else
+      cf_warn_node(parent, NULL, "max_delay_ms must not be less than min_delay_ms");
+    return result | CFSUB(CFINCOMPATIBLE);
+  }
+  return result;
+}
+
+int vld_vomp_fec(const struct cf_om_node *parent, struct config_vomp_fec *fec, int result)
+{
+  if (fec->group_size > VOMP_FEC_MAX_GROUP) {
+    int nodei = cf_om_get_child(parent, "group_size", NULL);
+    assert(nodei != -1);
+    cf_warn_node_value(parent->nodv[nodei], CFINVALID);
+    return result | CFSUB(CFINVALID);
+  }
+  return result;
+}
+
 /* Config parse function.  Implements the original form of the 'interfaces' config option.  Parses a
  * single text string of the form:
  *
@@ -279,6 +279,8 @@ ATOM(bool_t, trace,                     0, boolean,, "")
 ATOM(bool_t, profiling,                 0, boolean,, "")
 ATOM(bool_t, externalblobs,             0, boolean,, "")
 ATOM(bool_t, linkstate,                 0, boolean,, "")
+ATOM(uint16_t, vomp_fec_drop_frame,     0, uint16,, "Position in each parity group of an audio frame not to send, to test recovery from parity, 0 to send all")
+ATOM(uint16_t, rhizome_mdp_tamper,      0, uint16,, "Corrupt every Nth block sent with a Merkle proof, to test that receivers refuse it, 0 to send all intact")
 END_STRUCT
 
 #define LOG_FORMAT_OPTIONS \
@@ -296,6 +298,8 @@ STRING(256,                 directory_path, "log", str_nonempty,, "Path of direc
 STRING(256,                 path,           "", str_nonempty,, "Path of single log file, either absolute or relative to directory_path")
 ATOM(unsigned short,        rotate,         12, ushort,, "Number of log files to rotate, zero means no deletion")
 ATOM(uint32_t,              duration,       3600, uint32_time_interval,, "Time duration of each log file, zero means one file per invocation")
+ATOM(uint64_t,              buffer_size,    0, uint64_scaled,, "Bytes of log output the server may hold in memory between writes, zero means write every line as it is logged")
+ATOM(bool_t,                binary,         0, boolean,, "If true, write compact binary records instead of text lines, which can be read with the log decode command")
 LOG_FORMAT_OPTIONS
 END_STRUCT
 
@@ -324,6 +328,7 @@ STRUCT(server)
 STRING(256,                 chdir,      "/", absolute_path,, "Absolute path of chdir(2) for server process")
 STRING(256,                 interface_path, "", str_nonempty,, "Path of directory containing interface files, either absolute or relative to instance directory")
 ATOM(bool_t,                respawn_on_crash, 0, boolean,, "If true, server will exec(2) itself on fatal signals, eg SEGV")
+STRING(256,                 capture_file, "", str_nonempty,, "If set, record every received packet to this file, either absolute or relative to instance directory")
 END_STRUCT
 
 STRUCT(monitor)
@@ -356,13 +361,17 @@ KEY_ATOM(unsigned short, ushort_nonzero)
 VALUE_STRING(128, str)
 END_ARRAY(16)
 
-STRUCT(executable)
+STRUCT(dna_helper)
 STRING(256,                 executable, "", absolute_path, MANDATORY, "Absolute path of dna helper executable")
 SUB_STRUCT(argv,            argv,)
+ATOM(uint32_t,              processes,  1, uint32_nonzero,, "Most dna helper processes to run at once, started as lookups need them")
+ATOM(uint32_t,              pipeline,   4, uint32_nonzero,, "Most lookups written to one dna helper process before it replies")
+ATOM(uint32_t,              cache_ttl_ms, 10000, uint32_nonzero,, "Time to answer repeated lookups of a DID from the results of the last one")
+ATOM(uint16_t,              cache_entries, 256, uint16,, "Most DIDs whose lookup results are cached, 0 to disable the cache")
 END_STRUCT
 
 STRUCT(dna)
-SUB_STRUCT(executable,      helper,)
+SUB_STRUCT(dna_helper,      helper,)
 END_STRUCT
 
 STRUCT(rhizome_peer)
@@ -378,6 +387,7 @@ END_ARRAY(10)
 
 STRUCT(rhizome_direct)
 SUB_STRUCT(peerlist,        peer,)
+ATOM(bool_t,                range_digests, 1, boolean,, "If true, compare digests of BID ranges before sending BARs")
 END_STRUCT
 
 STRUCT(user)
@@ -414,21 +424,48 @@ END_STRUCT
 
 STRUCT(rhizome_mdp)
 ATOM(bool_t,                enable,     1, boolean,, "If true, Rhizome MDP server is started")
+ATOM(uint64_t,              overheard_bytes, 65536, uint64_scaled,, "Most bytes of overheard blocks kept for queued bundles until their fetch begins, 0 to keep none")
+ATOM(uint32_t,              window_initial, 4, uint32_nonzero,, "Number of blocks asked for in the first request of a Rhizome MDP transfer")
+ATOM(uint32_t,              window_max, 128, uint32_nonzero,, "Most blocks asked for in one request of a Rhizome MDP transfer, or sent in reply to one")
+ATOM(uint64_t,              cache_size, 1024*1024, uint64_scaled,, "Most bytes of payload pages cached in memory for serving Rhizome MDP requests, 0 to disable")
+ATOM(uint16_t,              read_ahead, 4, uint16,, "Number of extra payload pages read into the cache when a payload is being read in order")
 END_STRUCT
 
 STRUCT(rhizome_advertise)
 ATOM(bool_t,                enable,     1, boolean,, "If true, Rhizome advertisements are sent")
 ATOM(uint32_t,              interval,   500, uint32_nonzero,, "Interval between Rhizome advertisements")
+ATOM(uint32_t,              max_interval, 5000, uint32_nonzero,, "Longest interval between Rhizome advertisements, reached while there are no new bundles and no neighbour is still syncing")
 END_STRUCT
 
+STRUCT(rhizome_tier)
+STRING(256,                 path,               "", str_nonempty, MANDATORY, "Path of directory for payload files in this tier, absolute or relative to instance directory")
+ATOM(uint64_t,              size,               0, uint64_scaled,, "Most payload bytes this tier may hold, zero means no limit")
+ATOM(uint64_t,              min_payload_size,   0, uint64_scaled,, "Smallest payload to place in this tier")
+ATOM(uint64_t,              max_payload_size,   0, uint64_scaled,, "Largest payload to place in this tier, zero means no limit")
+ATOM(int32_t,               min_priority,       0, int32_nonneg,, "Lowest priority of payload to place in this tier")
+STRING(40,                  service,            "", str,, "If set, only payloads of bundles of this service are placed in this tier")
+ATOM(bool_t,                hot,                0, boolean,, "If true, payloads that are read often are moved into this tier")
+END_STRUCT
+
+ARRAY(rhizome_tierlist, NO_DUPLICATES)
+KEY_ATOM(unsigned, uint)
+VALUE_SUB_STRUCT(rhizome_tier)
+END_ARRAY(8)
+
 STRUCT(rhizome)
 ATOM(bool_t,                enable,         1, boolean,, "If true, server opens Rhizome database when starting")
 ATOM(bool_t,                fetch,          1, boolean,, "If false, no new bundles will be fetched from peers")
 ATOM(bool_t,                clean_on_open,  0, boolean,, "If true, Rhizome database is cleaned at start of every command")
 ATOM(bool_t,                clean_on_start, 1, boolean,, "If true, Rhizome database is cleaned at start of daemon")
 STRING(256,                 datastore_path, "", absolute_path,, "Path of rhizome storage directory, absolute or relative to instance directory")
-ATOM(uint64_t,              database_size,  1000000, uint64_scaled,, "Size of database in bytes")
+ATOM(uint64_t,              database_size,  0, uint64_scaled,, "Most bytes of database used by payloads stored inside it before the least recently read are evicted, 0 for no limit")
 ATOM(bool_t,                external_blobs, 0, boolean,, "Store rhizome bundles as separate files.")
+ATOM(uint64_t,              max_blob_size,  128*1024, uint64_scaled,, "Largest payload stored inside the database, larger ones are stored as separate files")
+ATOM(bool_t,                merkle_tree,    0, boolean,, "If true, added payloads get a Merkle tree root in their manifest, so that receivers can check each block sent over MDP")
+SUB_STRUCT(rhizome_tierlist, tier,)
+ATOM(uint32_t,              tier_interval_ms,   10000, uint32_nonzero,, "Interval between moving payloads between storage tiers")
+ATOM(uint64_t,              tier_migrate_bytes, 1024*1024, uint64_scaled,, "Most payload bytes moved between storage tiers at each interval")
+ATOM(uint32_t,              tier_promote_reads, 3, uint32_nonzero,, "Reads of a payload before it is moved into a hot tier")
 
 ATOM(uint64_t,              rhizome_mdp_block_size, 512, uint64_scaled,, "Rhizome MDP block size.")
 ATOM(uint64_t,              idle_timeout,           RHIZOME_IDLE_TIMEOUT, uint64_scaled,, "Rhizome transfer timeout if no data received.")
@@ -440,6 +477,23 @@ SUB_STRUCT(rhizome_mdp,     mdp,)
 SUB_STRUCT(rhizome_advertise, advertise,)
 END_STRUCT
 
+STRUCT(vomp_jitter, vld_vomp_jitter)
+ATOM(bool_t,                playout,        0, boolean,, "If true, buffer received audio and release it to monitor clients in sequence at its playout time")
+ATOM(uint16_t,              percentile,     97, uint16_nonzero,, "Percentage of received audio frames that should arrive before their playout time")
+ATOM(int32_t,               min_delay_ms,   60, int32_nonneg,, "Minimum playout delay in milliseconds")
+ATOM(int32_t,               max_delay_ms,   1000, int32_nonneg,, "Maximum playout delay in milliseconds")
+END_STRUCT
+
+STRUCT(vomp_fec, vld_vomp_fec)
+ATOM(bool_t,                enable,         0, boolean,, "If true, offer to send and receive XOR parity frames with call audio")
+ATOM(uint16_t,              group_size,     4, uint16_nonzero,, "Number of consecutive audio frames protected by each parity frame (at most 8)")
+END_STRUCT
+
+STRUCT(vomp)
+SUB_STRUCT(vomp_jitter,     jitter,)
+SUB_STRUCT(vomp_fec,        fec,)
+END_STRUCT
+
 STRUCT(directory)
 ATOM(sid_t,                 service,     SID_ANY, sid,, "Subscriber ID of Serval Directory Service")
 END_STRUCT
@@ -496,6 +550,7 @@ SUB_STRUCT(mdp,             mdp,)
 SUB_STRUCT(dna,             dna,)
 SUB_STRUCT(debug,           debug,)
 SUB_STRUCT(rhizome,         rhizome,)
+SUB_STRUCT(vomp,            vomp,)
 SUB_STRUCT(directory,       directory,)
 SUB_STRUCT(olsr,            olsr,)
 SUB_STRUCT(host_list,       hosts,)
@@ -163,6 +163,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define MDP_ROUTING_TABLE 7
 #define MDP_GOODBYE 9
 #define MDP_SCAN 10
+#define MDP_STATS 11
+// Most MDP_TX frames sent in reply to one MDP_STATS request, fewer than Linux queues by default
+#define MDP_STATS_PAGE_FRAMES 8
 
 // These are back-compatible with the old values of 'mode' when it was 'selfP'
 #define MDP_ADDRLIST_MODE_ROUTABLE_PEERS 0
@@ -194,6 +197,10 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 // other out of band signals, probably shouldn't be codecs
 #define VOMP_CODEC_DTMF 0x20
 #define VOMP_CODEC_TEXT 0x21
+// XOR parity over a group of preceding audio frames, offered in the codec list when enabled
+#define VOMP_CODEC_FEC_XOR 0x30
+// most audio frames that one parity frame can cover
+#define VOMP_FEC_MAX_GROUP 8
 
 // Note, Don't add codec's we aren't using yet
 
@@ -0,0 +1,449 @@
+/*
+Copyright (C) 2013 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  Faster SHA-512 and xsalsa20, chosen at run time.
+
+  The portable implementations in sha2.c and nacl/ process one word or one block at a time.  Here,
+  xsalsa20 generates 4 keystream blocks at once in 128 bit vectors (SSE2 on x86-64, NEON on ARM),
+  or 8 at once in 256 bit vectors when the CPU has AVX2.  SHA-512 can't be split across blocks, so
+  its message schedule is computed two words at a time in vectors, and its rounds are fully
+  unrolled; on x86-64 with BMI2 and AVX2 the compiler can use rorx and three operand instructions.
+
+  The kernels are written with GCC vector extensions, so the same source compiles for each
+  instruction set.  Without them, only the portable implementations are used.
+ */
+
+#include <string.h>
+#include "serval.h"
+#include "conf.h"
+#include "crypto_accel.h"
+#include "sha2.h"
+#include "crypto_core_hsalsa20.h"
+#include "crypto_stream_xsalsa20.h"
+
+void (*SHA512_Transform_accel)(uint64_t state[8], const unsigned char *data, size_t blocks) = NULL;
+
+typedef void (*salsa20_blocks_fn)(const uint32_t input[16], uint64_t counter,
+				  unsigned char *out, const unsigned char *in, size_t blocks);
+
+struct xsalsa20_impl{
+  const char *name;
+  unsigned lanes;
+  salsa20_blocks_fn blocks;
+};
+
+struct sha512_impl{
+  const char *name;
+  void (*transform)(uint64_t state[8], const unsigned char *data, size_t blocks);
+};
+
+static int initialised = 0;
+static int enabled = 1;
+static struct xsalsa20_impl xsalsa20_best = {"portable", 0, NULL};
+static struct sha512_impl sha512_best = {"portable", NULL};
+static const struct xsalsa20_impl *xsalsa20_current = NULL;
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__aarch64__) || defined(__ARM_NEON))
+#define HAVE_VECTOR_KERNELS 1
+#if defined(__x86_64__)
+#define VECTOR_ISA "sse2"
+#else
+#define VECTOR_ISA "neon"
+#endif
+#endif
+
+static inline uint32_t load_le32(const unsigned char *p)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  uint32_t v;
+  memcpy(&v, p, sizeof v);
+  return v;
+#else
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+#endif
+}
+
+static inline void store_le32(unsigned char *p, uint32_t v)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  memcpy(p, &v, sizeof v);
+#else
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+#endif
+}
+
+static inline uint64_t load_be64(const unsigned char *p)
+{
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  uint64_t v;
+  memcpy(&v, p, sizeof v);
+  return __builtin_bswap64(v);
+#else
+  return ((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) | ((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32)
+    | ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) | ((uint64_t)p[6] << 8) | p[7];
+#endif
+}
+
+#ifdef HAVE_VECTOR_KERNELS
+
+typedef uint32_t v4u32 __attribute__((vector_size(16)));
+typedef uint32_t v8u32 __attribute__((vector_size(32)));
+typedef uint64_t v2u64 __attribute__((vector_size(16)));
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define SALSA20_QUARTERROUND(a, b, c, d) { \
+    b ^= ROTL32(a + d, 7); \
+    c ^= ROTL32(b + a, 9); \
+    d ^= ROTL32(c + b, 13); \
+    a ^= ROTL32(d + c, 18); \
+  }
+
+#define SALSA20_DOUBLEROUND(x) { \
+    SALSA20_QUARTERROUND(x[0], x[4], x[8], x[12]); \
+    SALSA20_QUARTERROUND(x[5], x[9], x[13], x[1]); \
+    SALSA20_QUARTERROUND(x[10], x[14], x[2], x[6]); \
+    SALSA20_QUARTERROUND(x[15], x[3], x[7], x[11]); \
+    SALSA20_QUARTERROUND(x[0], x[1], x[2], x[3]); \
+    SALSA20_QUARTERROUND(x[5], x[6], x[7], x[4]); \
+    SALSA20_QUARTERROUND(x[10], x[11], x[8], x[9]); \
+    SALSA20_QUARTERROUND(x[15], x[12], x[13], x[14]); \
+  }
+
+/* Each vector lane computes a different block of the keystream, so word i of every block is held in
+   vector x[i].  Only the block counter (words 8 and 9) differs between lanes.  blocks must be a
+   multiple of the number of lanes.
+ */
+#define DEFINE_SALSA20_BLOCKS(NAME, VTYPE, LANES, ATTR) \
+ATTR static void NAME(const uint32_t input[16], uint64_t counter, \
+		      unsigned char *out, const unsigned char *in, size_t blocks) \
+{ \
+  const VTYPE zero = {0}; \
+  size_t b; \
+  for (b = 0; b + LANES <= blocks; b += LANES) { \
+    VTYPE j[16], x[16]; \
+    unsigned i, l; \
+    for (i = 0; i < 16; ++i) \
+      j[i] = zero + input[i]; \
+    for (l = 0; l < LANES; ++l) { \
+      uint64_t c = counter + b + l; \
+      j[8][l] = (uint32_t)c; \
+      j[9][l] = (uint32_t)(c >> 32); \
+    } \
+    for (i = 0; i < 16; ++i) \
+      x[i] = j[i]; \
+    for (i = 0; i < 10; ++i) \
+      SALSA20_DOUBLEROUND(x); \
+    for (i = 0; i < 16; ++i) \
+      x[i] += j[i]; \
+    for (l = 0; l < LANES; ++l) { \
+      size_t ofs = (b + l) * 64; \
+      for (i = 0; i < 16; ++i, ofs += 4) \
+	store_le32(&out[ofs], load_le32(&in[ofs]) ^ x[i][l]); \
+    } \
+  } \
+}
+
+DEFINE_SALSA20_BLOCKS(salsa20_blocks_4, v4u32, 4, )
+#ifdef __x86_64__
+DEFINE_SALSA20_BLOCKS(salsa20_blocks_avx2, v8u32, 8, __attribute__((target("avx2"))))
+#endif
+
+static const uint64_t K512[80] = {
+	0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL,
+	0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+	0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL,
+	0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+	0xd807aa98a3030242ULL, 0x12835b0145706fbeULL,
+	0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+	0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL,
+	0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+	0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL,
+	0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+	0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL,
+	0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+	0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL,
+	0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+	0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL,
+	0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+	0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL,
+	0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+	0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL,
+	0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+	0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL,
+	0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+	0xd192e819d6ef5218ULL, 0xd69906245565a910ULL,
+	0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+	0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL,
+	0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+	0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL,
+	0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+	0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL,
+	0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+	0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL,
+	0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+	0xca273eceea26619cULL, 0xd186b8c721c0c207ULL,
+	0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+	0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL,
+	0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+	0x28db77f523047d84ULL, 0x32caab7b40c72493ULL,
+	0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+	0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL,
+	0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL
+};
+
+#define ROTR64(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+#define SHA512_S0(x) (ROTR64(x, 28) ^ ROTR64(x, 34) ^ ROTR64(x, 39))
+#define SHA512_S1(x) (ROTR64(x, 14) ^ ROTR64(x, 18) ^ ROTR64(x, 41))
+#define SHA512_s0(x) (ROTR64(x, 1) ^ ROTR64(x, 8) ^ ((x) >> 7))
+#define SHA512_s1(x) (ROTR64(x, 19) ^ ROTR64(x, 61) ^ ((x) >> 6))
+#define SHA512_CH(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define SHA512_MAJ(x, y, z) (((x) & (y)) | ((z) & ((x) | (y))))
+
+// the caller rotates the names of the working variables, instead of moving their values
+#define SHA512_ROUND(a, b, c, d, e, f, g, h, i) { \
+    uint64_t T1 = h + SHA512_S1(e) + SHA512_CH(e, f, g) + W[i]; \
+    d += T1; \
+    h = T1 + SHA512_S0(a) + SHA512_MAJ(a, b, c); \
+  }
+
+static inline __attribute__((always_inline))
+void sha512_transform_body(uint64_t state[8], const unsigned char *data, size_t blocks)
+{
+  while (blocks--) {
+    uint64_t W[80];
+    unsigned t;
+    for (t = 0; t < 16; ++t)
+      W[t] = load_be64(&data[t * 8]);
+    // W[t] depends on W[t-2], so two words can be computed at once
+    for (t = 16; t < 80; t += 2) {
+      v2u64 w2, w7, w15, w16;
+      memcpy(&w2, &W[t - 2], sizeof w2);
+      memcpy(&w7, &W[t - 7], sizeof w7);
+      memcpy(&w15, &W[t - 15], sizeof w15);
+      memcpy(&w16, &W[t - 16], sizeof w16);
+      v2u64 w = SHA512_s1(w2) + w7 + SHA512_s0(w15) + w16;
+      memcpy(&W[t], &w, sizeof w);
+    }
+    for (t = 0; t < 80; t += 2) {
+      v2u64 w, k;
+      memcpy(&w, &W[t], sizeof w);
+      memcpy(&k, &K512[t], sizeof k);
+      w += k;
+      memcpy(&W[t], &w, sizeof w);
+    }
+
+    uint64_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint64_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (t = 0; t < 80; t += 8) {
+      SHA512_ROUND(a, b, c, d, e, f, g, h, t);
+      SHA512_ROUND(h, a, b, c, d, e, f, g, t + 1);
+      SHA512_ROUND(g, h, a, b, c, d, e, f, t + 2);
+      SHA512_ROUND(f, g, h, a, b, c, d, e, t + 3);
+      SHA512_ROUND(e, f, g, h, a, b, c, d, t + 4);
+      SHA512_ROUND(d, e, f, g, h, a, b, c, t + 5);
+      SHA512_ROUND(c, d, e, f, g, h, a, b, t + 6);
+      SHA512_ROUND(b, c, d, e, f, g, h, a, t + 7);
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+    data += SHA512_BLOCK_LENGTH;
+  }
+}
+
+static void sha512_transform_vector(uint64_t state[8], const unsigned char *data, size_t blocks)
+{
+  sha512_transform_body(state, data, blocks);
+}
+
+#ifdef __x86_64__
+__attribute__((target("avx2,bmi2")))
+static void sha512_transform_avx2(uint64_t state[8], const unsigned char *data, size_t blocks)
+{
+  sha512_transform_body(state, data, blocks);
+}
+#endif
+
+#endif // HAVE_VECTOR_KERNELS
+
+static const unsigned char sigma[16] = "expand 32-byte k";
+
+static int xsalsa20_xor_blocks(const struct xsalsa20_impl *impl, unsigned char *c, const unsigned char *m,
+			       unsigned long long mlen, const unsigned char *n, const unsigned char *k)
+{
+  unsigned char subkey[32];
+  crypto_core_hsalsa20(subkey, n, k, sigma);
+  uint32_t input[16];
+  unsigned i;
+  for (i = 0; i < 4; ++i) {
+    input[i * 5] = load_le32(&sigma[i * 4]);
+    input[1 + i] = load_le32(&subkey[i * 4]);
+    input[11 + i] = load_le32(&subkey[16 + i * 4]);
+  }
+  input[6] = load_le32(&n[16]);
+  input[7] = load_le32(&n[20]);
+  input[8] = input[9] = 0;
+
+  size_t blocks = mlen / (64 * impl->lanes) * impl->lanes;
+  impl->blocks(input, 0, c, m, blocks);
+  size_t done = blocks * 64;
+  if (done < mlen) {
+    // the last few blocks are done in a temporary buffer, as a whole group of lanes
+    unsigned char tail[64 * 8];
+    size_t rest = mlen - done;
+    bzero(tail, 64 * impl->lanes);
+    bcopy(m + done, tail, rest);
+    impl->blocks(input, blocks, tail, tail, impl->lanes);
+    bcopy(tail, c + done, rest);
+    bzero(tail, sizeof tail);
+  }
+  bzero(subkey, sizeof subkey);
+  bzero(input, sizeof input);
+  return 0;
+}
+
+int crypto_xsalsa20_xor(unsigned char *c, const unsigned char *m, unsigned long long mlen,
+			const unsigned char *n, const unsigned char *k)
+{
+  if (!initialised)
+    crypto_accel_init();
+  if (!xsalsa20_current)
+    return crypto_stream_xsalsa20_xor(c, m, mlen, n, k);
+  return xsalsa20_xor_blocks(xsalsa20_current, c, m, mlen, n, k);
+}
+
+static void test_pattern(unsigned char *buf, size_t len, unsigned seed)
+{
+  size_t i;
+  for (i = 0; i < len; ++i)
+    buf[i] = (i * 131 + seed * 17 + (i >> 8)) & 0xFF;
+}
+
+// check an accelerated implementation against the portable one, including a partial last group
+static int xsalsa20_check(const struct xsalsa20_impl *impl)
+{
+  unsigned char key[crypto_stream_xsalsa20_KEYBYTES];
+  unsigned char nonce[crypto_stream_xsalsa20_NONCEBYTES];
+  unsigned char expect[64 * 8 * 2 + 37];
+  unsigned char actual[sizeof expect];
+  test_pattern(key, sizeof key, 1);
+  test_pattern(nonce, sizeof nonce, 2);
+  test_pattern(expect, sizeof expect, 3);
+  bcopy(expect, actual, sizeof actual);
+  crypto_stream_xsalsa20_xor(expect, expect, sizeof expect, nonce, key);
+  xsalsa20_xor_blocks(impl, actual, actual, sizeof actual, nonce, key);
+  return memcmp(expect, actual, sizeof expect) == 0;
+}
+
+static int sha512_check(const struct sha512_impl *impl)
+{
+  unsigned char data[SHA512_BLOCK_LENGTH * 3 + 17];
+  unsigned char expect[SHA512_DIGEST_LENGTH];
+  unsigned char actual[SHA512_DIGEST_LENGTH];
+  test_pattern(data, sizeof data, 4);
+  SHA512_CTX context;
+  SHA512_Transform_accel = NULL;
+  SHA512_Init(&context);
+  SHA512_Update(&context, data, sizeof data);
+  SHA512_Final(expect, &context);
+  SHA512_Transform_accel = impl->transform;
+  SHA512_Init(&context);
+  SHA512_Update(&context, data, 5);
+  SHA512_Update(&context, data + 5, sizeof data - 5);
+  SHA512_Final(actual, &context);
+  SHA512_Transform_accel = NULL;
+  return memcmp(expect, actual, sizeof expect) == 0;
+}
+
+static void choose_xsalsa20(const struct xsalsa20_impl *impl)
+{
+  if (xsalsa20_check(impl))
+    xsalsa20_best = *impl;
+  else
+    WHYF("%s xsalsa20 does not match the portable implementation, not using it", impl->name);
+}
+
+static void choose_sha512(const struct sha512_impl *impl)
+{
+  if (sha512_check(impl))
+    sha512_best = *impl;
+  else
+    WHYF("%s SHA-512 does not match the portable implementation, not using it", impl->name);
+}
+
+void crypto_accel_init()
+{
+  if (initialised)
+    return;
+  initialised = 1;
+#ifdef HAVE_VECTOR_KERNELS
+  {
+    struct xsalsa20_impl impl = {VECTOR_ISA, 4, salsa20_blocks_4};
+    choose_xsalsa20(&impl);
+  }
+  {
+    struct sha512_impl impl = {VECTOR_ISA, sha512_transform_vector};
+    choose_sha512(&impl);
+  }
+#ifdef __x86_64__
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    struct xsalsa20_impl impl = {"avx2", 8, salsa20_blocks_avx2};
+    choose_xsalsa20(&impl);
+  }
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2")) {
+    struct sha512_impl impl = {"avx2", sha512_transform_avx2};
+    choose_sha512(&impl);
+  }
+#endif
+#endif
+  crypto_accel_enable(enabled);
+  if (config.debug.verbose)
+    DEBUGF("Using %s SHA-512 and %s xsalsa20", sha512_best.name, xsalsa20_best.name);
+}
+
+void crypto_accel_enable(int enable)
+{
+  enabled = enable;
+  if (!initialised)
+    return;
+  SHA512_Transform_accel = enable ? sha512_best.transform : NULL;
+  xsalsa20_current = enable && xsalsa20_best.blocks ? &xsalsa20_best : NULL;
+}
+
+const char *crypto_accel_sha512_name()
+{
+  crypto_accel_init();
+  return SHA512_Transform_accel ? sha512_best.name : "portable";
+}
+
+const char *crypto_accel_xsalsa20_name()
+{
+  crypto_accel_init();
+  return xsalsa20_current ? xsalsa20_current->name : "portable";
+}
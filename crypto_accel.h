@@ -0,0 +1,50 @@
+/*
+Copyright (C) 2013 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef __SERVALD_CRYPTO_ACCEL_H
+#define __SERVALD_CRYPTO_ACCEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Choose the fastest SHA-512 and xsalsa20 implementations that this CPU supports.  Called
+ * automatically the first time either is used.  Each accelerated implementation is checked against
+ * the portable one before it is chosen.
+ */
+void crypto_accel_init();
+
+/* Turn the accelerated implementations off or back on, eg, to compare them with the portable ones.
+ */
+void crypto_accel_enable(int enable);
+
+/* The names of the implementations in use, eg, "avx2" or "portable".
+ */
+const char *crypto_accel_sha512_name();
+const char *crypto_accel_xsalsa20_name();
+
+/* A drop-in replacement for crypto_stream_xsalsa20_xor().
+ */
+int crypto_xsalsa20_xor(unsigned char *c, const unsigned char *m, unsigned long long mlen,
+			const unsigned char *n, const unsigned char *k);
+
+/* Set by crypto_accel_init() if there is a faster SHA-512 compression function than the one in
+ * sha2.c.  Processes whole 128 byte blocks.
+ */
+extern void (*SHA512_Transform_accel)(uint64_t state[8], const unsigned char *data, size_t blocks);
+
+#endif
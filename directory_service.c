@@ -3,115 +3,247 @@
 #include <poll.h>
 #endif
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
+#include <inttypes.h>
 #include "constants.h"
 #include "mdp_client.h"
 #include "str.h"
 
+/*
+  Records are kept in a hash table keyed on DID, which doubles in size as records are added.  A DID
+  may have several records, one for each SID that registered it.  Every record is also on a timer
+  wheel, in the slot for the tick in which it expires, so that expired records can be dropped a slot
+  at a time without looking at the rest.
+
+  A registration packet may carry several records for its sender, one "did|name" per line.
+
+  "directory_service --load <records> [<lookups> [<did length>]]" fills the store with generated
+  records and times registration, lookup and expiry, without needing a server.
+ */
+
+// expire after 20 minutes
+#define EXPIRY_MS 1200000
+#define WHEEL_TICK_MS 10000
+// must cover EXPIRY_MS, so that a record never waits for a second turn of the wheel
+#define WHEEL_SLOTS 128
+#define MIN_BUCKETS 1024
+// registration packets to handle before going back to look for lookups
+#define MAX_PACKETS_PER_POLL 64
+
 struct item{
-  // simple tree structure
-  struct item *_left;
-  struct item *_right;
+  struct item *_hash_next;
+  struct item *_wheel_prev;
+  struct item *_wheel_next;
   char key[32];
   char value[128];
   time_ms_t expires;
 };
 
-struct item *root=NULL;
+static struct item **buckets=NULL;
+static unsigned bucket_count=0;
+static unsigned item_count=0;
+
+static struct item *wheel[WHEEL_SLOTS];
+// the end of the oldest tick whose slot has not been emptied yet
+static time_ms_t wheel_time=0;
+
+// set when generating load, to keep the output to the results
+static int quiet=0;
+
+// only the part of a DID that fits in item->key is stored and compared, so only that part is hashed
+#define KEY_LENGTH (sizeof(((struct item *)0)->key) - 1)
+
+static unsigned hash_key(const char *key){
+  // FNV-1a
+  unsigned h = 2166136261u;
+  const char *end = key + KEY_LENGTH;
+  while (key < end && *key)
+    h = (h ^ (unsigned char)*key++) * 16777619u;
+  return h;
+}
+
+static struct item **key_bucket(const char *key){
+  return &buckets[hash_key(key) % bucket_count];
+}
+
+static int grow_buckets(){
+  unsigned count = bucket_count ? bucket_count * 2 : MIN_BUCKETS;
+  struct item **new_buckets = calloc(count, sizeof *new_buckets);
+  if (!new_buckets)
+    return -1;
+  unsigned i;
+  for (i=0;i<bucket_count;i++){
+    struct item *item;
+    while((item = buckets[i])){
+      buckets[i] = item->_hash_next;
+      struct item **bucket = &new_buckets[hash_key(item->key) % count];
+      item->_hash_next = *bucket;
+      *bucket = item;
+    }
+  }
+  free(buckets);
+  buckets = new_buckets;
+  bucket_count = count;
+  return 0;
+}
+
+static struct item **wheel_slot(time_ms_t expires){
+  return &wheel[(expires / WHEEL_TICK_MS) % WHEEL_SLOTS];
+}
+
+static void wheel_link(struct item *item){
+  struct item **slot = wheel_slot(item->expires);
+  item->_wheel_prev = NULL;
+  item->_wheel_next = *slot;
+  if (*slot)
+    (*slot)->_wheel_prev = item;
+  *slot = item;
+}
+
+static void wheel_unlink(struct item *item){
+  if (item->_wheel_prev)
+    item->_wheel_prev->_wheel_next = item->_wheel_next;
+  else
+    *wheel_slot(item->expires) = item->_wheel_next;
+  if (item->_wheel_next)
+    item->_wheel_next->_wheel_prev = item->_wheel_prev;
+}
+
+static void remove_item(struct item *item){
+  struct item **ptr = key_bucket(item->key);
+  while(*ptr != item)
+    ptr = &(*ptr)->_hash_next;
+  *ptr = item->_hash_next;
+  wheel_unlink(item);
+  item_count--;
+  free(item);
+}
+
+/* Drop the records in every slot whose tick has passed.  Returns the number dropped.
+ */
+static unsigned expire_items(time_ms_t now){
+  unsigned expired=0;
+  if (!wheel_time)
+    wheel_time = (now / WHEEL_TICK_MS + 1) * WHEEL_TICK_MS;
+  // after a long sleep, one turn of the wheel visits every slot
+  if (now - wheel_time > WHEEL_SLOTS * WHEEL_TICK_MS)
+    wheel_time = now - WHEEL_SLOTS * WHEEL_TICK_MS;
+  while(wheel_time <= now){
+    struct item *item = *wheel_slot(wheel_time - WHEEL_TICK_MS);
+    while(item){
+      struct item *next = item->_wheel_next;
+      if (item->expires <= now){
+	remove_item(item);
+	expired++;
+      }
+      item = next;
+    }
+    wheel_time += WHEEL_TICK_MS;
+  }
+  return expired;
+}
 
 static struct item *create_item(const char *key){
   struct item *ret=calloc(1,sizeof(struct item));
+  if (!ret)
+    return NULL;
   strncpy(ret->key,key,sizeof(ret->key));
   ret->key[sizeof(ret->key) -1]=0;
   return ret;
 }
 
-static struct item *find_item(const char *key){
-  struct item *item = root;
-  
-  while(item){
-    int c=strcmp(item->key, key);
-    if (c==0)
-      return item;
-    if (c<0){
-      item = item->_left;
-    }else{
-      item = item->_right;
-    }
-  }
-  return NULL;
-}
-
-static void add_item(char *key, char *value){
-  struct item *item = root, **last_ptr=&root;
-  while(item){
-    int c=strcmp(item->key, key);
-    if (c==0){
-      c=strcmp(item->value, value);
-      if (c==0){
-	item->expires = gettime_ms()+1200000;
-	return;
-      }
-    }
-    if (c<0){
-      last_ptr = &item->_left;
-    }else{
-      last_ptr = &item->_right;
+static void add_item(const char *key, const char *value, time_ms_t now){
+  if (item_count >= bucket_count && grow_buckets() && !bucket_count)
+    return;
+  struct item **bucket = key_bucket(key);
+  struct item *item;
+  for (item = *bucket; item; item = item->_hash_next){
+    if (strncmp(item->key, key, KEY_LENGTH)==0 && strncmp(item->value, value, sizeof(item->value) -1)==0){
+      wheel_unlink(item);
+      item->expires = now+EXPIRY_MS;
+      wheel_link(item);
+      return;
     }
-    item = *last_ptr;
   }
-  
-  *last_ptr = item = create_item(key);
-  
+
+  if (!(item = create_item(key)))
+    return;
   strncpy(item->value,value,sizeof(item->value));
   item->value[sizeof(item->value) -1]=0;
-  // expire after 20 minutes
-  item->expires = gettime_ms()+1200000;
+  item->expires = now+EXPIRY_MS;
+  item->_hash_next = *bucket;
+  *bucket = item;
+  wheel_link(item);
+  item_count++;
   // used by tests
-  fprintf(stderr, "PUBLISHED \"%s\" = \"%s\"\n", key, value);
+  if (!quiet)
+    fprintf(stderr, "PUBLISHED \"%s\" = \"%s\"\n", key, value);
+}
+
+/* Add each "did|name" line of a registration payload for the given SID.  Returns the number of
+   records added or refreshed.
+ */
+static unsigned add_records(const sid_t *sidp, char *payload, size_t len, time_ms_t now){
+  char *sid = alloca_tohex_sid_t(*sidp);
+  char *end = payload + len;
+  unsigned count=0;
+  while(payload < end){
+    char *did = payload;
+    while(payload < end && *payload && *payload!='\n')
+      payload++;
+    *payload++=0;
+    char *name = did;
+    while(*name && *name!='|')
+      name++;
+    if (*name)
+      *name++=0;
+
+    // TODO check that did is a valid phone number
+    if (!*did)
+      continue;
+
+    char url[256];
+    snprintf(url, sizeof(url), "sid://%s/local/%s|%s|%s", sid, did, did, name);
+    add_item(did, url, now);
+    count++;
+  }
+  return count;
 }
 
 static void add_record(int mdp_sockfd){
   int ttl;
   overlay_mdp_frame mdp;
-  
+
   if (overlay_mdp_recv(mdp_sockfd, &mdp, MDP_PORT_DIRECTORY, &ttl))
     return;
-  
+
   if (mdp.packetTypeAndFlags&MDP_NOCRYPT){
     fprintf(stderr, "Only encrypted packets will be considered for publishing\n");
     return;
   }
-  
+
   // make sure the payload is a NULL terminated string
   mdp.in.payload[mdp.in.payload_length]=0;
-  
-  char *did=(char *)mdp.in.payload;
-  int i=0;
-  while(i<mdp.in.payload_length && mdp.in.payload[i] && mdp.in.payload[i]!='|')
-    i++;
-  mdp.in.payload[i]=0;
-  char *name = (char *)mdp.in.payload+i+1;
-  char *sid = alloca_tohex_sid_t(mdp.in.src.sid);
-  
-  // TODO check that did is a valid phone number
-  
-  char url[256];
-  snprintf(url, sizeof(url), "sid://%s/local/%s|%s|%s", sid, did, did, name);
-  add_item(did, url);
-}
-
-static void respond(char *token, struct item *item, char *key){
-  if (!item)
-    return;
-  
-  int c = strcmp(item->key, key);
-  if (c<=0)
-    respond(token, item->_left, key);
-  if (c==0 && item->expires > gettime_ms())
-    printf("%s|%s|\n",token,item->value);
-  if (c>=0)
-    respond(token, item->_right, key);
+
+  add_records(&mdp.in.src.sid, (char *)mdp.in.payload, mdp.in.payload_length, gettime_ms());
+}
+
+/* Write each live record of the given DID to out, if given.  Returns the number of records found.
+ */
+static unsigned respond(FILE *out, const char *token, const char *key, time_ms_t now){
+  unsigned found=0;
+  if (!bucket_count)
+    return 0;
+  struct item *item;
+  for (item = *key_bucket(key); item; item = item->_hash_next){
+    if (item->expires > now && strncmp(item->key, key, KEY_LENGTH)==0){
+      if (out)
+	fprintf(out, "%s|%s|\n",token,item->value);
+      found++;
+    }
+  }
+  return found;
 }
 
 static void process_line(char *line){
@@ -122,8 +254,8 @@ static void process_line(char *line){
   char *did = p;
   while(*p && *p!='|') p++;
   *p++=0;
-  
-  respond(token, find_item(did), did);
+
+  respond(stdout, token, did, gettime_ms());
   printf("DONE\n");
   fflush(stdout);
 }
@@ -131,18 +263,18 @@ static void process_line(char *line){
 static void resolve_request(){
   static char line_buff[1024];
   static int line_pos=0;
-  
+
   set_nonblock(STDIN_FILENO);
-  
+
   int bytes = read(STDIN_FILENO, line_buff + line_pos, sizeof(line_buff) - line_pos);
-  
+
   set_block(STDIN_FILENO);
-  
+
   int i = line_pos;
   int processed=0;
   line_pos+=bytes;
   char *line_start=line_buff;
-  
+
   for (;i<line_pos;i++){
     if (line_buff[i]=='\n'){
       line_buff[i]=0;
@@ -152,7 +284,7 @@ static void resolve_request(){
       line_start = line_buff + processed;
     }
   }
-  
+
   if (processed){
     // squash unprocessed data back to the start of the buffer
     line_pos -= processed;
@@ -160,16 +292,81 @@ static void resolve_request(){
   }
 }
 
+/* Format a generated DID of at least the given length.  Long DIDs are padded after the number, so
+   that the part kept in item->key still differs between records.
+ */
+static void load_did(char *did, size_t size, uint64_t number, unsigned length){
+  size_t len = snprintf(did, size, "%010"PRIu64, number);
+  while (len < length && len + 1 < size)
+    did[len++]='0';
+  did[len]=0;
+}
+
+static double per_second(unsigned count, time_ns_t elapsed){
+  return elapsed > 0 ? count * 1e9 / elapsed : 0;
+}
+
+/* Generate load on the store: register the given number of records from made up SIDs, in packets
+   of a few records each, then look up as many DIDs, half of them registered, then expire them all.
+ */
+static int generate_load(unsigned records, unsigned lookups, unsigned did_length){
+  const unsigned per_packet = 8;
+  quiet=1;
+  time_ms_t now = gettime_ms();
+  sid_t sid;
+  memset(&sid, 0, sizeof sid);
+  char payload[MDP_MTU];
+  char did[64];
+  unsigned added=0;
+
+  time_ns_t start = gettime_ns();
+  unsigned i;
+  for (i=0;i<records;){
+    // each SID registers a few DIDs in one packet
+    write_uint32(sid.binary, i);
+    size_t len=0;
+    unsigned j;
+    for (j=0;j<per_packet && i<records;j++,i++){
+      load_did(did, sizeof did, UINT64_C(5550000000) + i, did_length);
+      len += snprintf(payload + len, sizeof payload - len, "%s%s|Load %u", j?"\n":"", did, i);
+    }
+    added += add_records(&sid, payload, len, now);
+  }
+  time_ns_t elapsed = gettime_ns() - start;
+  printf("registrations: %u in %.1f ms, %.0f/sec, %u buckets\n", added, elapsed / 1e6, per_second(added, elapsed), bucket_count);
+
+  unsigned found=0;
+  srandom(1);
+  start = gettime_ns();
+  for (i=0;i<lookups;i++){
+    load_did(did, sizeof did, UINT64_C(5550000000) + random() % (records ? records * 2 : 1), did_length);
+    found += respond(NULL, "", did, now);
+  }
+  elapsed = gettime_ns() - start;
+  printf("lookups: %u in %.1f ms, %.0f/sec, %u found\n", lookups, elapsed / 1e6, per_second(lookups, elapsed), found);
+
+  start = gettime_ns();
+  unsigned expired = expire_items(now);
+  expired += expire_items(now + EXPIRY_MS + WHEEL_TICK_MS);
+  elapsed = gettime_ns() - start;
+  printf("expired: %u in %.1f ms, %u left\n", expired, elapsed / 1e6, item_count);
+  fflush(stdout);
+  return 0;
+}
+
 int main(int argc, char **argv){
   struct pollfd fds[2];
   int mdp_sockfd;
 
+  if (argc >= 3 && strcmp(argv[1], "--load")==0)
+    return generate_load(atoi(argv[2]), argc >= 4 ? atoi(argv[3]) : atoi(argv[2]), argc >= 5 ? atoi(argv[4]) : 0);
+
   if ((mdp_sockfd = overlay_mdp_client_socket()) < 0)
     return WHY("Cannot create MDP socket");
 
   // bind for incoming directory updates
   sid_t srcsid;
-    
+
   if (overlay_mdp_getmyaddr(mdp_sockfd, 0, &srcsid)) {
     overlay_mdp_client_close(mdp_sockfd);
     return WHY("Could not get local address");
@@ -178,28 +375,34 @@ int main(int argc, char **argv){
     overlay_mdp_client_close(mdp_sockfd);
     return WHY("Could not bind to MDP socket");
   }
-  
+
   fds[0].fd = STDIN_FILENO;
   fds[0].events = POLLIN;
   fds[1].fd = mdp_sockfd;
   fds[1].events = POLLIN;
-  
+
   printf("STARTED\n");
   fflush(stdout);
-  
+
   while(1){
     int r = poll(fds, 2, 100);
     if (r>0){
       if (fds[0].revents & POLLIN)
         resolve_request();
-      if (fds[1].revents & POLLIN)
-	add_record(mdp_sockfd);
-      
+      if (fds[1].revents & POLLIN){
+	// take all the registrations that have queued up, within reason
+	int n=0;
+	do
+	  add_record(mdp_sockfd);
+	while(++n < MAX_PACKETS_PER_POLL && overlay_mdp_client_poll(mdp_sockfd, 0) > 0);
+      }
+
       if (fds[0].revents & (POLLHUP | POLLERR))
 	break;
     }
+    expire_items(gettime_ms());
   }
-  
+
   overlay_mdp_client_close(mdp_sockfd);
   return 0;
 }
@@ -39,12 +39,18 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
   a request over a lossy network.
 
   The second part of the solution is to create an asynchronous queue for requests,
-  by passing them via file descriptor to a single persistent instance of the DNA
-  helper application, and polling the output of that application for results, and
+  by passing them via file descriptor to persistent instances of the DNA helper
+  application, and polling the output of those applications for results, and
   then passing them out to their destinations.  This ensures that the process is
   asynchronous and non-blocking, regardless of how much time the helper application
-  requires.  Then the helper will just be another file descriptor to poll in the
+  requires.  Then each helper will just be another file descriptor to poll in the
   main loop.
+
+  Several requests may be written to a helper before it has answered the first,
+  and it answers them in order, ending each with "DONE".  When all running helpers
+  have as many requests as they may take, another is started, up to the configured
+  number.  Lookups of a DID that is already being looked up wait for the same
+  replies, and the replies are kept for a while to answer repeated lookups.
  */
 
 int
@@ -79,89 +85,316 @@ parseDnaReply(const char *buf, size_t len, char *token, char *did, char *name, c
   return 1;
 }
 
-static pid_t dna_helper_pid = -1;
-static int dna_helper_stdin = -1;
-static int dna_helper_stdout = -1;
-static int dna_helper_stderr = -1;
-static int dna_helper_started = 0;
+#define DNA_HELPER_MAX_PROCESSES 16
+#define DNA_HELPER_MAX_PIPELINE 16
+#define DNA_HELPER_MAX_WAITERS 8
+#define DNA_HELPER_MAX_RESULTS 8
+#define DNA_HELPER_QUEUE_LENGTH 64
+#define DNA_HELPER_QUEUE_TIMEOUT_MS 5000
+#define DNA_HELPER_REPLY_TIMEOUT_MS 1500
+#define DNA_HELPER_CACHE_BUCKETS 64
+// Each request line is "SID|DID|\n"
+#define DNA_HELPER_REQUEST_LEN (SID_STRLEN + DID_MAXSIZE + 3)
+
+struct dna_result {
+  char uri[512];
+  char name[64];
+};
+
+/* A lookup of one DID, on behalf of all the requestors who asked for it while it was pending.  The
+   first requestor's SID is sent as the token, which the helper copies into each of its replies.
+ */
+struct dna_request {
+  struct dna_request *_next;
+  char did[DID_MAXSIZE + 1];
+  char token[SID_STRLEN + 1];
+  time_ms_t queued_time;
+  unsigned nwaiters;
+  sockaddr_mdp waiters[DNA_HELPER_MAX_WAITERS];
+  unsigned nresults;
+  struct dna_result results[DNA_HELPER_MAX_RESULTS];
+};
+
+struct dna_cache_entry {
+  struct dna_cache_entry *_hash_next;
+  struct dna_cache_entry *_fifo_next;
+  char did[DID_MAXSIZE + 1];
+  time_ms_t expires;
+  unsigned nresults;
+  struct dna_result *results;
+};
 
-#define DECLARE_SCHED_ENT(FUNCTION, VARIABLE) \
+struct dna_helper {
+  unsigned index;
+  // -1 when stopped, 0 while pausing before a restart
+  pid_t pid;
+  int stdin_fd;
+  int stdout_fd;
+  int stderr_fd;
+  int started;
+  int dying;
+  struct sched_ent sched_requests;
+  struct sched_ent sched_replies;
+  struct sched_ent sched_errors;
+  struct sched_ent sched_harvester;
+  struct sched_ent sched_restart;
+  struct sched_ent sched_timeout;
+  // requests written, or being written, to the helper, oldest first; each ends with "DONE"
+  struct dna_request *inflight;
+  unsigned ninflight;
+  char request_buffer[DNA_HELPER_MAX_PIPELINE * DNA_HELPER_REQUEST_LEN];
+  size_t request_len;
+  int discarding_until_nl;
+  char reply_buffer[2048];
+  char *reply_bufend;
+  // statistics
+  unsigned requests;
+  unsigned completed;
+  unsigned timeouts;
+  unsigned restarts;
+  time_ms_t latency_last;
+  time_ms_t latency_max;
+  time_ms_t latency_total;
+};
+
+#define DECLARE_SCHED_FUNC(FUNCTION) \
 static void FUNCTION(struct sched_ent *alarm); \
-static struct profile_total VARIABLE##_timing={.name="" #FUNCTION "",}; \
-static struct sched_ent VARIABLE = {.function = FUNCTION, .stats = & VARIABLE##_timing, .poll.fd = -1, };
-
-DECLARE_SCHED_ENT(monitor_requests, sched_requests);
-DECLARE_SCHED_ENT(monitor_replies,  sched_replies);
-DECLARE_SCHED_ENT(monitor_errors,   sched_errors);
-DECLARE_SCHED_ENT(harvester,        sched_harvester);
-DECLARE_SCHED_ENT(restart_delayer,  sched_restart);
-DECLARE_SCHED_ENT(reply_timeout,    sched_timeout);
-
-// This buffer must hold "SID|DID|\n\0"
-static char request_buffer[SID_STRLEN + DID_MAXSIZE + 4];
-static char *request_bufptr = NULL;
-static char *request_bufend = NULL;
-static overlay_mdp_data_frame request_mdp_data;
-static char request_did[DID_MAXSIZE + 1];
-
-static int awaiting_reply = 0;
-static int discarding_until_nl = 0;
-static char reply_buffer[2048];
-static char *reply_bufend = NULL;
-
-static void
-dna_helper_close_pipes()
-{
-  if (dna_helper_stdin != -1) {
+static struct profile_total FUNCTION##_timing={.name="" #FUNCTION "",};
+
+DECLARE_SCHED_FUNC(monitor_requests);
+DECLARE_SCHED_FUNC(monitor_replies);
+DECLARE_SCHED_FUNC(monitor_errors);
+DECLARE_SCHED_FUNC(harvester);
+DECLARE_SCHED_FUNC(restart_delayer);
+DECLARE_SCHED_FUNC(reply_timeout);
+
+static struct dna_helper dna_helpers[DNA_HELPER_MAX_PROCESSES];
+static unsigned dna_helpers_used = 0;
+
+// requests not yet given to a helper, oldest first
+static struct dna_request *pending_head = NULL;
+static struct dna_request *pending_tail = NULL;
+static unsigned pending_count = 0;
+
+static struct dna_cache_entry *cache_hash[DNA_HELPER_CACHE_BUCKETS];
+static struct dna_cache_entry *cache_oldest = NULL;
+static struct dna_cache_entry *cache_newest = NULL;
+static unsigned cache_count = 0;
+
+static uint64_t stat_cache_hits = 0;
+static uint64_t stat_cache_misses = 0;
+static uint64_t stat_coalesced = 0;
+static uint64_t stat_dropped = 0;
+
+static void dna_helper_dispatch();
+
+static unsigned pool_size()
+{
+  return config.dna.helper.processes < DNA_HELPER_MAX_PROCESSES ? config.dna.helper.processes : DNA_HELPER_MAX_PROCESSES;
+}
+
+static unsigned pipeline_depth()
+{
+  return config.dna.helper.pipeline < DNA_HELPER_MAX_PIPELINE ? config.dna.helper.pipeline : DNA_HELPER_MAX_PIPELINE;
+}
+
+static struct dna_helper *helper_init(unsigned index)
+{
+  struct dna_helper *h = &dna_helpers[index];
+  if (index >= dna_helpers_used) {
+    bzero(h, sizeof *h);
+    h->index = index;
+    h->pid = -1;
+    h->stdin_fd = h->stdout_fd = h->stderr_fd = -1;
+#define INIT_SCHED(MEMBER, FUNCTION) \
+    h->MEMBER.function = FUNCTION; \
+    h->MEMBER.stats = &FUNCTION##_timing; \
+    h->MEMBER.context = h; \
+    h->MEMBER.poll.fd = -1;
+    INIT_SCHED(sched_requests, monitor_requests);
+    INIT_SCHED(sched_replies, monitor_replies);
+    INIT_SCHED(sched_errors, monitor_errors);
+    INIT_SCHED(sched_harvester, harvester);
+    INIT_SCHED(sched_restart, restart_delayer);
+    INIT_SCHED(sched_timeout, reply_timeout);
+#undef INIT_SCHED
+    dna_helpers_used = index + 1;
+  }
+  return h;
+}
+
+static unsigned did_hash(const char *did)
+{
+  unsigned h = 0;
+  while (*did)
+    h = h * 31 + (unsigned char)*did++;
+  return h % DNA_HELPER_CACHE_BUCKETS;
+}
+
+static void cache_evict_oldest()
+{
+  struct dna_cache_entry *e = cache_oldest;
+  struct dna_cache_entry **ptr = &cache_hash[did_hash(e->did)];
+  while (*ptr != e)
+    ptr = &(*ptr)->_hash_next;
+  *ptr = e->_hash_next;
+  cache_oldest = e->_fifo_next;
+  if (!cache_oldest)
+    cache_newest = NULL;
+  cache_count--;
+  if (e->results)
+    free(e->results);
+  free(e);
+}
+
+/* Entries all live for the same time, so the oldest always expires first.
+ */
+static void cache_expire(time_ms_t now)
+{
+  while (cache_oldest && (cache_oldest->expires <= now || cache_count > config.dna.helper.cache_entries))
+    cache_evict_oldest();
+}
+
+static struct dna_cache_entry *cache_find(const char *did)
+{
+  struct dna_cache_entry *e;
+  for (e = cache_hash[did_hash(did)]; e; e = e->_hash_next)
+    if (strcmp(e->did, did) == 0)
+      return e;
+  return NULL;
+}
+
+static void cache_store(struct dna_request *r, time_ms_t now)
+{
+  if (!config.dna.helper.cache_entries)
+    return;
+  cache_expire(now);
+  struct dna_cache_entry *e = cache_find(r->did);
+  if (!e) {
+    if (cache_count >= config.dna.helper.cache_entries)
+      cache_evict_oldest();
+    if (!(e = emalloc_zero(sizeof *e)))
+      return;
+    strcpy(e->did, r->did);
+    struct dna_cache_entry **bucket = &cache_hash[did_hash(e->did)];
+    e->_hash_next = *bucket;
+    *bucket = e;
+    if (cache_newest)
+      cache_newest->_fifo_next = e;
+    else
+      cache_oldest = e;
+    cache_newest = e;
+    cache_count++;
+  }
+  if (e->results) {
+    free(e->results);
+    e->results = NULL;
+  }
+  e->nresults = 0;
+  if (r->nresults && !(e->results = emalloc(r->nresults * sizeof *e->results)))
+    return;
+  bcopy(r->results, e->results, r->nresults * sizeof *e->results);
+  e->nresults = r->nresults;
+  e->expires = now + config.dna.helper.cache_ttl_ms;
+}
+
+static void request_reply(const sockaddr_mdp *waiter, const char *did, const struct dna_result *result)
+{
+  overlay_mdp_dnalookup_reply(waiter, &my_subscriber->sid, result->uri, did, result->name);
+}
+
+static void helper_close_pipes(struct dna_helper *h)
+{
+  if (h->stdin_fd != -1) {
     if (config.debug.dnahelper)
-      DEBUGF("DNAHELPER closing stdin pipe fd=%d", dna_helper_stdin);
-    close(dna_helper_stdin);
-    dna_helper_stdin = -1;
+      DEBUGF("DNAHELPER closing stdin pipe fd=%d", h->stdin_fd);
+    close(h->stdin_fd);
+    h->stdin_fd = -1;
   }
-  if (sched_requests.poll.fd != -1) {
-    unwatch(&sched_requests);
-    sched_requests.poll.fd = -1;
+  if (h->sched_requests.poll.fd != -1) {
+    unwatch(&h->sched_requests);
+    h->sched_requests.poll.fd = -1;
   }
-  if (dna_helper_stdout != -1) {
+  if (h->stdout_fd != -1) {
     if (config.debug.dnahelper)
-      DEBUGF("DNAHELPER closing stdout pipe fd=%d", dna_helper_stdout);
-    close(dna_helper_stdout);
-    dna_helper_stdout = -1;
+      DEBUGF("DNAHELPER closing stdout pipe fd=%d", h->stdout_fd);
+    close(h->stdout_fd);
+    h->stdout_fd = -1;
   }
-  if (sched_replies.poll.fd != -1) {
-    unwatch(&sched_replies);
-    sched_replies.poll.fd = -1;
+  if (h->sched_replies.poll.fd != -1) {
+    unwatch(&h->sched_replies);
+    h->sched_replies.poll.fd = -1;
   }
-  if (dna_helper_stderr != -1) {
+  if (h->stderr_fd != -1) {
     if (config.debug.dnahelper)
-      DEBUGF("DNAHELPER closing stderr pipe fd=%d", dna_helper_stderr);
-    close(dna_helper_stderr);
-    dna_helper_stderr = -1;
+      DEBUGF("DNAHELPER closing stderr pipe fd=%d", h->stderr_fd);
+    close(h->stderr_fd);
+    h->stderr_fd = -1;
   }
-  if (sched_errors.poll.fd != -1) {
-    unwatch(&sched_errors);
-    sched_errors.poll.fd = -1;
+  if (h->sched_errors.poll.fd != -1) {
+    unwatch(&h->sched_errors);
+    h->sched_errors.poll.fd = -1;
   }
 }
 
-int
-dna_helper_start()
+/* Start watching the helper's stdin if it has said it is ready and there is a request to write.
+ */
+static void helper_want_write(struct dna_helper *h)
 {
-  if (!config.dna.helper.executable[0]) {
-    /* Check if we have a helper configured. If not, then set
-     dna_helper_pid to magic value of 0 so that we don't waste time
-     in future looking up the dna helper configuration value. */
-    INFO("DNAHELPER none configured");
-    dna_helper_pid = 0;
-    return 0;
+  if (h->started && h->request_len && h->stdin_fd != -1 && h->sched_requests.poll.fd == -1) {
+    h->sched_requests.poll.fd = h->stdin_fd;
+    h->sched_requests.poll.events = POLLOUT;
+    watch(&h->sched_requests);
   }
-  
+}
+
+/* Time the oldest request in flight from when the helper could start on it.
+ */
+static void helper_start_timeout(struct dna_helper *h, time_ms_t now)
+{
+  unschedule(&h->sched_timeout);
+  if (h->inflight) {
+    h->sched_timeout.alarm = now + DNA_HELPER_REPLY_TIMEOUT_MS;
+    h->sched_timeout.deadline = h->sched_timeout.alarm + 3000;
+    schedule(&h->sched_timeout);
+  }
+}
+
+/* Give up on the helper's requests: the oldest is the one it failed on, so drop that, but put the
+   rest back at the front of the queue for another helper to answer.
+ */
+static void helper_abandon(struct dna_helper *h)
+{
+  unschedule(&h->sched_timeout);
+  h->request_len = 0;
+  struct dna_request *r = h->inflight;
+  if (!r)
+    return;
+  h->inflight = r->_next;
+  free(r);
+  stat_dropped++;
+  if (h->inflight) {
+    struct dna_request *last = h->inflight;
+    while (last->_next)
+      last = last->_next;
+    last->_next = pending_head;
+    if (!pending_head)
+      pending_tail = last;
+    pending_head = h->inflight;
+    pending_count += h->ninflight - 1;
+  }
+  h->inflight = NULL;
+  h->ninflight = 0;
+}
+
+static int helper_start(struct dna_helper *h)
+{
   if (!my_subscriber)
     return WHY("Unable to lookup my SID");
   
   const char *mysid = alloca_tohex_sid_t(my_subscriber->sid);
   
-  dna_helper_close_pipes();
+  helper_close_pipes(h);
   int stdin_fds[2], stdout_fds[2], stderr_fds[2];
   if (pipe(stdin_fds) == -1)
     return WHY_perror("pipe");
@@ -187,7 +420,7 @@ dna_helper_start()
     argv[i + 1] = config.dna.helper.argv.av[i].value;
   argv[i + 1] = NULL;
   strbuf argv_sb = strbuf_append_argv(strbuf_alloca(1024), config.dna.helper.argv.ac + 1, argv);
-  switch (dna_helper_pid = fork()) {
+  switch (h->pid = fork()) {
   case 0:
     /* Child, should exec() to become helper after installing file descriptors. */
     close_log_file();
@@ -212,6 +445,7 @@ dna_helper_start()
   case -1:
     /* fork failed */
     WHY_perror("fork");
+    h->pid = -1;
     close(stdin_fds[0]);
     close(stdin_fds[1]);
     close(stdout_fds[0]);
@@ -224,78 +458,93 @@ dna_helper_start()
     close(stdin_fds[0]);
     close(stdout_fds[1]);
     close(stderr_fds[1]);
-    dna_helper_started = 0;
-    dna_helper_stdin = stdin_fds[1];
-    dna_helper_stdout = stdout_fds[0];
-    dna_helper_stderr = stderr_fds[0];
-    INFOF("STARTED DNA HELPER pid=%u stdin=%d stdout=%d stderr=%d executable=%s argv=[%s]",
-	dna_helper_pid,
-	dna_helper_stdin,
-	dna_helper_stdout,
-	dna_helper_stderr,
+    h->started = 0;
+    h->dying = 0;
+    h->stdin_fd = stdin_fds[1];
+    h->stdout_fd = stdout_fds[0];
+    h->stderr_fd = stderr_fds[0];
+    INFOF("STARTED DNA HELPER %u pid=%u stdin=%d stdout=%d stderr=%d executable=%s argv=[%s]",
+	h->index,
+	h->pid,
+	h->stdin_fd,
+	h->stdout_fd,
+	h->stderr_fd,
 	alloca_str_toprint(config.dna.helper.executable),
 	strbuf_str(argv_sb)
       );
 
-    sched_replies.poll.fd = dna_helper_stdout;
-    sched_replies.poll.events = POLLIN;
-    sched_errors.poll.fd = dna_helper_stderr;
-    sched_errors.poll.events = POLLIN;
-    sched_requests.poll.fd = -1;
-    sched_requests.poll.events = POLLOUT;
-    sched_harvester.alarm = gettime_ms() + 1000;
-    sched_harvester.deadline = sched_harvester.alarm + 1000;
-    reply_bufend = reply_buffer;
-    discarding_until_nl = 0;
-    awaiting_reply = 0;
-    watch(&sched_replies);
-    watch(&sched_errors);
-    schedule(&sched_harvester);
+    h->sched_replies.poll.fd = h->stdout_fd;
+    h->sched_replies.poll.events = POLLIN;
+    h->sched_errors.poll.fd = h->stderr_fd;
+    h->sched_errors.poll.events = POLLIN;
+    h->sched_requests.poll.fd = -1;
+    h->sched_requests.poll.events = POLLOUT;
+    h->sched_harvester.alarm = gettime_ms() + 1000;
+    h->sched_harvester.deadline = h->sched_harvester.alarm + 1000;
+    h->reply_bufend = h->reply_buffer;
+    h->discarding_until_nl = 0;
+    h->request_len = 0;
+    h->inflight = NULL;
+    h->ninflight = 0;
+    h->restarts++;
+    watch(&h->sched_replies);
+    watch(&h->sched_errors);
+    schedule(&h->sched_harvester);
     return 0;
   }
   return -1;
 }
 
-static int
-dna_helper_kill()
+int
+dna_helper_start()
 {
-  if (awaiting_reply) {
-    unschedule(&sched_timeout);
-    awaiting_reply = 0;
+  if (!config.dna.helper.executable[0]) {
+    INFO("DNAHELPER none configured");
+    return 0;
   }
-  if (dna_helper_pid > 0) {
+  // start one helper now; more are started when lookups arrive faster than it can answer them
+  struct dna_helper *h = helper_init(0);
+  if (h->pid == -1 && h->stdin_fd == -1 && h->stdout_fd == -1 && h->stderr_fd == -1)
+    return helper_start(h);
+  return 0;
+}
+
+static int
+helper_kill(struct dna_helper *h)
+{
+  helper_abandon(h);
+  if (h->pid > 0) {
+    h->dying = 1;
     if (config.debug.dnahelper)
-      DEBUGF("DNAHELPER sending SIGTERM to pid=%d", dna_helper_pid);
-    if (kill(dna_helper_pid, SIGTERM) == -1)
-      WHYF_perror("kill(%d, SIGTERM)", dna_helper_pid);
-    // The process is wait()ed for in dna_helper_monitor() so that we do not block here.
+      DEBUGF("DNAHELPER sending SIGTERM to pid=%d", h->pid);
+    if (kill(h->pid, SIGTERM) == -1)
+      WHYF_perror("kill(%d, SIGTERM)", h->pid);
+    // The process is wait()ed for in harvester() so that we do not block here.
     return 1;
   }
   return 0;
 }
 
 static int
-dna_helper_harvest(int blocking)
+helper_harvest(struct dna_helper *h, int blocking)
 {
-  if (dna_helper_pid > 0) {
+  if (h->pid > 0) {
     if (blocking && (config.debug.dnahelper))
-      DEBUGF("DNAHELPER waiting for pid=%d to die", dna_helper_pid);
+      DEBUGF("DNAHELPER waiting for pid=%d to die", h->pid);
     int status;
-    pid_t pid = waitpid(dna_helper_pid, &status, blocking ? 0 : WNOHANG);
-    if (pid == dna_helper_pid) {
+    pid_t pid = waitpid(h->pid, &status, blocking ? 0 : WNOHANG);
+    if (pid == h->pid) {
       strbuf b = strbuf_alloca(80);
       INFOF("DNAHELPER process pid=%u %s", pid, strbuf_str(strbuf_append_exit_status(b, status)));
-      unschedule(&sched_harvester);
-      dna_helper_pid = -1;
-      if (awaiting_reply) {
-	unschedule(&sched_timeout);
-	awaiting_reply = 0;
-      }
+      unschedule(&h->sched_harvester);
+      h->pid = -1;
+      helper_abandon(h);
+      helper_close_pipes(h);
       return 1;
     } else if (pid == -1) {
-      return WHYF_perror("waitpid(%d, %s)", dna_helper_pid, blocking ? "0" : "WNOHANG");
+      return WHYF_perror("waitpid(%d, %s)", h->pid, blocking ? "0" : "WNOHANG");
     } else if (pid) {
-      return WHYF("waitpid(%d, %s) returned %d", dna_helper_pid, blocking ? "0" : "WNOHANG", pid);
+      return WHYF("waitpid(%d, %s) returned %d", h->pid, blocking ? "0" : "WNOHANG", pid);
     }
   }
   return 0;
@@ -305,70 +554,76 @@ int dna_helper_shutdown()
 {
   if (config.debug.dnahelper)
     DEBUG("DNAHELPER shutting down");
-  dna_helper_close_pipes();
-  switch (dna_helper_kill()) {
-  case -1:
-    return -1;
-  case 0:
-    return 0;
-  default:
-    return dna_helper_harvest(1);
+  int ret = 0;
+  unsigned i;
+  for (i = 0; i < dna_helpers_used; ++i) {
+    struct dna_helper *h = &dna_helpers[i];
+    helper_close_pipes(h);
+    switch (helper_kill(h)) {
+    case -1:
+      ret = -1;
+      break;
+    case 0:
+      break;
+    default:
+      if (helper_harvest(h, 1) == -1)
+	ret = -1;
+    }
   }
+  while (pending_head) {
+    struct dna_request *r = pending_head;
+    pending_head = r->_next;
+    free(r);
+  }
+  pending_tail = NULL;
+  pending_count = 0;
+  return ret;
 }
 
 static void monitor_requests(struct sched_ent *alarm)
 {
+  struct dna_helper *h = alarm->context;
   if (config.debug.dnahelper) {
     DEBUGF("sched_requests.poll.fd=%d .revents=%s",
-	sched_requests.poll.fd,
-	strbuf_str(strbuf_append_poll_events(strbuf_alloca(40), sched_requests.poll.revents))
+	h->sched_requests.poll.fd,
+	strbuf_str(strbuf_append_poll_events(strbuf_alloca(40), h->sched_requests.poll.revents))
       );
   }
   // On Linux, poll(2) returns ERR when the remote reader dies.  On Mac OS X, poll(2) returns NVAL,
   // which is documented to mean the file descriptor is not open, but testing revealed that in this
   // case it is still open.  See issue #5.
-  if (sched_requests.poll.revents & (POLLHUP | POLLERR | POLLNVAL)) {
+  if (h->sched_requests.poll.revents & (POLLHUP | POLLERR | POLLNVAL)) {
     if (config.debug.dnahelper)
-      DEBUGF("DNAHELPER closing stdin fd=%d", dna_helper_stdin);
-    close(dna_helper_stdin);
-    dna_helper_stdin = -1;
-    unwatch(&sched_requests);
-    sched_requests.poll.fd = -1;
-    dna_helper_kill();
-  }
-  else if (sched_requests.poll.revents & POLLOUT) {
-    if (request_bufptr) {
-      if (request_bufptr < request_bufend) {
-	size_t remaining = request_bufend - request_bufptr;
-	sigPipeFlag = 0;
-	ssize_t written = write_nonblock(dna_helper_stdin, request_bufptr, remaining);
-	if (sigPipeFlag) {
-	  /* Broken pipe is probably due to a dead helper, but make sure the helper is dead, just to be
-	    sure.  It will be harvested at the next harvester() timeout, and restarted on the first
-	    request that arrives after a suitable pause has elapsed.  Losing the current request is not
-	    a big problem, because DNA preemptively retries.
-	  */
-	  INFO("DNAHELPER got SIGPIPE on write -- stopping process");
-	  dna_helper_kill();
-	} else if (written > 0) {
-	  if (config.debug.dnahelper)
-	    DEBUGF("DNAHELPER wrote request %s", alloca_toprint(-1, request_bufptr, written));
-	  request_bufptr += written;
-	}
-      }
-      if (request_bufptr >= request_bufend) {
-	// Request sent successfully.  Start watching for reply.
-	request_bufptr = request_bufend = NULL;
-	awaiting_reply = 1;
-	sched_timeout.alarm = gettime_ms() + 1500;
-	sched_timeout.deadline = sched_timeout.alarm + 3000;
-	schedule(&sched_timeout);
+      DEBUGF("DNAHELPER closing stdin fd=%d", h->stdin_fd);
+    close(h->stdin_fd);
+    h->stdin_fd = -1;
+    unwatch(&h->sched_requests);
+    h->sched_requests.poll.fd = -1;
+    helper_kill(h);
+  }
+  else if (h->sched_requests.poll.revents & POLLOUT) {
+    if (h->request_len) {
+      sigPipeFlag = 0;
+      ssize_t written = write_nonblock(h->stdin_fd, h->request_buffer, h->request_len);
+      if (sigPipeFlag) {
+	/* Broken pipe is probably due to a dead helper, but make sure the helper is dead, just to be
+	  sure.  It will be harvested at the next harvester() timeout, and restarted when a request
+	  needs it after a suitable pause has elapsed.  Losing the current request is not a big
+	  problem, because DNA preemptively retries.
+	*/
+	INFO("DNAHELPER got SIGPIPE on write -- stopping process");
+	helper_kill(h);
+      } else if (written > 0) {
+	if (config.debug.dnahelper)
+	  DEBUGF("DNAHELPER wrote request %s", alloca_toprint(-1, h->request_buffer, written));
+	h->request_len -= written;
+	memmove(h->request_buffer, h->request_buffer + written, h->request_len);
       }
     }
     // If no request to send, stop monitoring the helper's stdin pipe.
-    if (!request_bufptr) {
-      unwatch(&sched_requests);
-      sched_requests.poll.fd = -1;
+    if (!h->request_len && h->sched_requests.poll.fd != -1) {
+      unwatch(&h->sched_requests);
+      h->sched_requests.poll.fd = -1;
     }
   }
 }
@@ -383,34 +638,55 @@ static char *srv_strnstr(char *haystack, size_t haystack_len, const char *needle
   return NULL;
 }
 
-void handle_reply_line(const char *bufp, size_t len)
+/* The helper answers its requests in the order they were written, so "DONE" ends the oldest one in
+   flight.
+ */
+static void helper_request_done(struct dna_helper *h)
+{
+  struct dna_request *r = h->inflight;
+  time_ms_t now = gettime_ms();
+  time_ms_t latency = now - r->queued_time;
+  h->completed++;
+  h->latency_last = latency;
+  h->latency_total += latency;
+  if (latency > h->latency_max)
+    h->latency_max = latency;
+  if (config.debug.dnahelper)
+    DEBUGF("DNAHELPER reply DONE for %s, %u results, %u waiting, after %"PRId64"ms",
+	   r->did, r->nresults, r->nwaiters, latency);
+  cache_store(r, now);
+  h->inflight = r->_next;
+  h->ninflight--;
+  free(r);
+  helper_start_timeout(h, now);
+  dna_helper_dispatch();
+}
+
+static void handle_reply_line(struct dna_helper *h, const char *bufp, size_t len)
 {
-  if (!dna_helper_started) {
+  if (!h->started) {
     if (len == 8 && strncmp(bufp, "STARTED\n", 8) == 0) {
       if (config.debug.dnahelper)
 	DEBUGF("DNAHELPER got STARTED ACK");
-      dna_helper_started = 1;
-      // Start sending request if there is one pending.
-      if (request_bufptr) {
-	sched_requests.poll.fd = dna_helper_stdin;
-	watch(&sched_requests);
-      }
+      h->started = 1;
+      // Start sending requests if there are any pending.
+      helper_want_write(h);
+      dna_helper_dispatch();
     } else {
       WHYF("DNAHELPER malformed start ACK %s", alloca_toprint(-1, bufp, len));
-      dna_helper_kill();
+      helper_kill(h);
     }
-  } else if (awaiting_reply) {
+  } else if (h->inflight) {
     if (len == 5 && strncmp(bufp, "DONE\n", 5) == 0) {
-      if (config.debug.dnahelper)
-	DEBUG("DNAHELPER reply DONE");
-      unschedule(&sched_timeout);
-      awaiting_reply = 0;
+      helper_request_done(h);
     } else {
       char sidhex[SID_STRLEN + 1];
       char did[DID_MAXSIZE + 1];
       char name[64];
       char uri[512];
       const char *replyend = NULL;
+      // match the reply to a request in flight by its token and DID
+      struct dna_request *r = NULL, *t = NULL;
       if (!parseDnaReply(bufp, len, sidhex, did, name, uri, &replyend))
 	WHYF("DNAHELPER reply %s invalid -- ignored", alloca_toprint(-1, bufp, len));
       else if (uri[0] == '\0')
@@ -421,20 +697,32 @@ void handle_reply_line(const char *bufp, size_t len)
 	WHYF("DNAHELPER reply %s contains empty token -- ignored", alloca_toprint(-1, bufp, len));
       else if (!str_is_subscriber_id(sidhex))
 	WHYF("DNAHELPER reply %s contains invalid token -- ignored", alloca_toprint(-1, bufp, len));
-      else if (strncmp(sidhex, request_buffer, SID_STRLEN) != 0)
-	WHYF("DNAHELPER reply %s contains mismatched token -- ignored", alloca_toprint(-1, bufp, len));
-      else if (did[0] == '\0')
-	WHYF("DNAHELPER reply %s contains empty DID -- ignored", alloca_toprint(-1, bufp, len));
-      else if (!str_is_did(did))
-	WHYF("DNAHELPER reply %s contains invalid DID -- ignored", alloca_toprint(-1, bufp, len));
-      else if (strcmp(did, request_did) != 0)
-	WHYF("DNAHELPER reply %s contains mismatched DID -- ignored", alloca_toprint(-1, bufp, len));
-      else if (*replyend != '\n')
-	WHYF("DNAHELPER reply %s contains spurious trailing chars -- ignored", alloca_toprint(-1, bufp, len));
       else {
-	if (config.debug.dnahelper)
-	  DEBUGF("DNAHELPER reply %s", alloca_toprint(-1, bufp, len));
-	overlay_mdp_dnalookup_reply(&request_mdp_data.src, &my_subscriber->sid, uri, did, name);
+	for (t = h->inflight; t; t = t->_next)
+	  if (strcasecmp(sidhex, t->token) == 0 && (!r || strcmp(did, t->did) == 0))
+	    r = t;
+	if (!r)
+	  WHYF("DNAHELPER reply %s contains mismatched token -- ignored", alloca_toprint(-1, bufp, len));
+	else if (did[0] == '\0')
+	  WHYF("DNAHELPER reply %s contains empty DID -- ignored", alloca_toprint(-1, bufp, len));
+	else if (!str_is_did(did))
+	  WHYF("DNAHELPER reply %s contains invalid DID -- ignored", alloca_toprint(-1, bufp, len));
+	else if (strcmp(did, r->did) != 0)
+	  WHYF("DNAHELPER reply %s contains mismatched DID -- ignored", alloca_toprint(-1, bufp, len));
+	else if (*replyend != '\n')
+	  WHYF("DNAHELPER reply %s contains spurious trailing chars -- ignored", alloca_toprint(-1, bufp, len));
+	else {
+	  if (config.debug.dnahelper)
+	    DEBUGF("DNAHELPER reply %s", alloca_toprint(-1, bufp, len));
+	  struct dna_result result;
+	  strcpy(result.uri, uri);
+	  strcpy(result.name, name);
+	  if (r->nresults < DNA_HELPER_MAX_RESULTS)
+	    r->results[r->nresults++] = result;
+	  unsigned i;
+	  for (i = 0; i < r->nwaiters; ++i)
+	    request_reply(&r->waiters[i], r->did, &result);
+	}
       }
     }
   } else {
@@ -444,172 +732,295 @@ void handle_reply_line(const char *bufp, size_t len)
 
 static void monitor_replies(struct sched_ent *alarm)
 {
+  struct dna_helper *h = alarm->context;
   if (config.debug.dnahelper) {
     DEBUGF("sched_replies.poll.fd=%d .revents=%s",
-	sched_replies.poll.fd,
-	strbuf_str(strbuf_append_poll_events(strbuf_alloca(40), sched_replies.poll.revents))
+	h->sched_replies.poll.fd,
+	strbuf_str(strbuf_append_poll_events(strbuf_alloca(40), h->sched_replies.poll.revents))
       );
   }
-  if (sched_replies.poll.revents & POLLIN) {
-    size_t remaining = reply_buffer + sizeof reply_buffer - reply_bufend;
-    ssize_t nread = read_nonblock(sched_replies.poll.fd, reply_bufend, remaining);
+  if (h->sched_replies.poll.revents & POLLIN) {
+    size_t remaining = h->reply_buffer + sizeof h->reply_buffer - h->reply_bufend;
+    ssize_t nread = read_nonblock(h->sched_replies.poll.fd, h->reply_bufend, remaining);
     if (nread > 0) {
-      char *bufp = reply_buffer;
-      char *readp = reply_bufend;
-      reply_bufend += nread;
+      char *bufp = h->reply_buffer;
+      char *readp = h->reply_bufend;
+      h->reply_bufend += nread;
       char *nl;
       while (nread > 0 && (nl = srv_strnstr(readp, nread, "\n"))) {
 	size_t len = nl - bufp + 1;
-	if (discarding_until_nl) {
+	if (h->discarding_until_nl) {
 	  if (config.debug.dnahelper)
 	    DEBUGF("Discarding %s", alloca_toprint(-1, bufp, len));
-	  discarding_until_nl = 0;
+	  h->discarding_until_nl = 0;
 	} else {
-	  handle_reply_line(bufp, len);
+	  handle_reply_line(h, bufp, len);
 	}
 	readp = bufp = nl + 1;
-	nread = reply_bufend - readp;
+	nread = h->reply_bufend - readp;
       }
-      if (bufp != reply_buffer) {
-	size_t len = reply_bufend - bufp;
-	memmove(reply_buffer, bufp, len);
-	reply_bufend = reply_buffer + len;
-      } else if (reply_bufend >= reply_buffer + sizeof reply_buffer) {
+      if (bufp != h->reply_buffer) {
+	size_t len = h->reply_bufend - bufp;
+	memmove(h->reply_buffer, bufp, len);
+	h->reply_bufend = h->reply_buffer + len;
+      } else if (h->reply_bufend >= h->reply_buffer + sizeof h->reply_buffer) {
 	WHY("DNAHELPER reply buffer overrun");
 	if (config.debug.dnahelper)
-	  DEBUGF("Discarding %s", alloca_toprint(-1, reply_buffer, sizeof reply_buffer));
-	reply_bufend = reply_buffer;
-	discarding_until_nl = 1;
+	  DEBUGF("Discarding %s", alloca_toprint(-1, h->reply_buffer, sizeof h->reply_buffer));
+	h->reply_bufend = h->reply_buffer;
+	h->discarding_until_nl = 1;
       }
     }
   }
-  if (sched_replies.poll.revents & (POLLHUP | POLLERR | POLLNVAL)) {
+  if (h->sched_replies.poll.revents & (POLLHUP | POLLERR | POLLNVAL)) {
     if (config.debug.dnahelper)
-      DEBUGF("DNAHELPER closing stdout fd=%d", dna_helper_stdout);
-    close(dna_helper_stdout);
-    dna_helper_stdout = -1;
-    unwatch(&sched_replies);
-    sched_replies.poll.fd = -1;
-    dna_helper_kill();
+      DEBUGF("DNAHELPER closing stdout fd=%d", h->stdout_fd);
+    close(h->stdout_fd);
+    h->stdout_fd = -1;
+    unwatch(&h->sched_replies);
+    h->sched_replies.poll.fd = -1;
+    helper_kill(h);
   }
 }
 
 static void monitor_errors(struct sched_ent *alarm)
 {
+  struct dna_helper *h = alarm->context;
   if (config.debug.dnahelper) {
     DEBUGF("sched_errors.poll.fd=%d .revents=%s",
-	sched_errors.poll.fd,
-	strbuf_str(strbuf_append_poll_events(strbuf_alloca(40), sched_errors.poll.revents))
+	h->sched_errors.poll.fd,
+	strbuf_str(strbuf_append_poll_events(strbuf_alloca(40), h->sched_errors.poll.revents))
       );
   }
-  if (sched_errors.poll.revents & POLLIN) {
+  if (h->sched_errors.poll.revents & POLLIN) {
     char buffer[1024];
-    ssize_t nread = read_nonblock(sched_errors.poll.fd, buffer, sizeof buffer);
+    ssize_t nread = read_nonblock(h->sched_errors.poll.fd, buffer, sizeof buffer);
     if (nread > 0)
       WHYF("DNAHELPER stderr %s", alloca_toprint(-1, buffer, nread));
   }
-  if (sched_errors.poll.revents & (POLLHUP | POLLERR | POLLNVAL)) {
+  if (h->sched_errors.poll.revents & (POLLHUP | POLLERR | POLLNVAL)) {
     if (config.debug.dnahelper)
-      DEBUGF("DNAHELPER closing stderr fd=%d", dna_helper_stderr);
-    close(dna_helper_stderr);
-    dna_helper_stderr = -1;
-    unwatch(&sched_errors);
-    sched_errors.poll.fd = -1;
+      DEBUGF("DNAHELPER closing stderr fd=%d", h->stderr_fd);
+    close(h->stderr_fd);
+    h->stderr_fd = -1;
+    unwatch(&h->sched_errors);
+    h->sched_errors.poll.fd = -1;
   }
 }
 
 static void harvester(struct sched_ent *alarm)
 {
+  struct dna_helper *h = alarm->context;
   // While the helper process appears to still be running, keep calling this function.
   // Otherwise, wait a while before re-starting the helper.
-  if (dna_helper_harvest(0) <= 0) {
-    sched_harvester.alarm = gettime_ms() + 1000;
-    sched_harvester.deadline = sched_harvester.alarm + 1000;
-    schedule(&sched_harvester);
+  if (helper_harvest(h, 0) <= 0) {
+    h->sched_harvester.alarm = gettime_ms() + 1000;
+    h->sched_harvester.deadline = h->sched_harvester.alarm + 1000;
+    schedule(&h->sched_harvester);
   } else {
     const int delay_ms = 500;
     if (config.debug.dnahelper)
       DEBUGF("DNAHELPER process died, pausing %d ms before restart", delay_ms);
-    dna_helper_pid = 0; // Will be set to -1 after delay
-    sched_restart.function = restart_delayer;
-    sched_restart.alarm = gettime_ms() + delay_ms;
-    sched_restart.deadline = sched_restart.alarm + 500;
-    schedule(&sched_restart);
+    h->pid = 0; // Will be set to -1 after delay
+    h->sched_restart.alarm = gettime_ms() + delay_ms;
+    h->sched_restart.deadline = h->sched_restart.alarm + 500;
+    schedule(&h->sched_restart);
+    dna_helper_dispatch();
   }
 }
 
 static void restart_delayer(struct sched_ent *alarm)
 {
-  if (dna_helper_pid == 0) {
+  struct dna_helper *h = alarm->context;
+  if (h->pid == 0) {
     if (config.debug.dnahelper)
       DEBUG("DNAHELPER re-enable restart");
-    dna_helper_pid = -1;
+    h->pid = -1;
+    dna_helper_dispatch();
   }
 }
 
 static void reply_timeout(struct sched_ent *alarm)
 {
-  if (awaiting_reply) {
+  struct dna_helper *h = alarm->context;
+  if (h->inflight) {
     WHY("DNAHELPER reply timeout");
-    dna_helper_kill();
+    h->timeouts++;
+    helper_kill(h);
+    // the requests behind the one that timed out may go to another helper
+    dna_helper_dispatch();
+  }
+}
+
+/* Choose the running helper with the fewest requests in flight.  Another helper is only started
+   once every running one has dna.helper.pipeline requests in flight.
+ */
+static struct dna_helper *choose_helper()
+{
+  struct dna_helper *best = NULL;
+  struct dna_helper *stopped = NULL;
+  unsigned depth = pipeline_depth();
+  unsigned i;
+  for (i = 0; i < pool_size(); ++i) {
+    struct dna_helper *h = helper_init(i);
+    if (h->pid > 0 && !h->dying && h->stdin_fd != -1) {
+      if (h->ninflight < depth && (!best || h->ninflight < best->ninflight))
+	best = h;
+    } else if (!stopped && h->pid == -1 && h->stdin_fd == -1 && h->stdout_fd == -1 && h->stderr_fd == -1)
+      stopped = h;
+  }
+  if (best)
+    return best;
+  // Only try to restart a DNA helper process if the previous one is well and truly gone.
+  if (stopped && helper_start(stopped) == 0)
+    return stopped;
+  return NULL;
+}
+
+/* Give queued requests to helpers, dropping any that have waited so long that their requestors will
+   have given up.
+ */
+static void dna_helper_dispatch()
+{
+  time_ms_t now = gettime_ms();
+  while (pending_head) {
+    struct dna_request *r = pending_head;
+    if (now - r->queued_time > DNA_HELPER_QUEUE_TIMEOUT_MS) {
+      WARNF("DNAHELPER request for %s waited %"PRId64"ms -- dropped", r->did, now - r->queued_time);
+    } else {
+      struct dna_helper *h = choose_helper();
+      if (!h)
+	return;
+      strbuf b = strbuf_local(h->request_buffer + h->request_len, sizeof h->request_buffer - h->request_len);
+      strbuf_sprintf(b, "%s|%s|\n", r->token, r->did);
+      if (strbuf_overrun(b)) {
+	WHYF("DNAHELPER request buffer overrun: %s -- request not sent", strbuf_str(b));
+      } else {
+	pending_head = r->_next;
+	if (!pending_head)
+	  pending_tail = NULL;
+	pending_count--;
+	h->request_len += strbuf_len(b);
+	r->_next = NULL;
+	struct dna_request **ptr = &h->inflight;
+	while (*ptr)
+	  ptr = &(*ptr)->_next;
+	*ptr = r;
+	if (h->ninflight++ == 0)
+	  helper_start_timeout(h, now);
+	h->requests++;
+	helper_want_write(h);
+	continue;
+      }
+    }
+    pending_head = r->_next;
+    if (!pending_head)
+      pending_tail = NULL;
+    pending_count--;
+    stat_dropped++;
+    free(r);
   }
 }
 
+static struct dna_request *find_request(struct dna_request *list, const char *did)
+{
+  for (; list; list = list->_next)
+    if (strcmp(list->did, did) == 0)
+      return list;
+  return NULL;
+}
+
+/* Add a requestor to a lookup that is already under way, and pass on any results it has had so far.
+ */
+static void request_join(struct dna_request *r, const overlay_mdp_frame *mdp)
+{
+  unsigned i;
+  for (i = 0; i < r->nwaiters; ++i)
+    if (memcmp(&r->waiters[i], &mdp->out.src, sizeof r->waiters[i]) == 0)
+      return;
+  if (r->nwaiters >= DNA_HELPER_MAX_WAITERS)
+    return;
+  r->waiters[r->nwaiters++] = mdp->out.src;
+  stat_coalesced++;
+  for (i = 0; i < r->nresults; ++i)
+    request_reply(&mdp->out.src, r->did, &r->results[i]);
+}
+
 int
 dna_helper_enqueue(overlay_mdp_frame *mdp, const char *did, const sid_t *requestorSidp)
 {
   if (config.debug.dnahelper)
     DEBUGF("DNAHELPER request did=%s sid=%s", did, alloca_tohex_sid_t(*requestorSidp));
-  if (dna_helper_pid == 0)
+  if (!config.dna.helper.executable[0])
     return 0;
-  // Only try to restart a DNA helper process if the previous one is well and truly gone.
-  if (dna_helper_pid == -1 && dna_helper_stdin == -1 && dna_helper_stdout == -1 && dna_helper_stderr == -1) {
-    if (dna_helper_start() == -1) {
-      /* Something broke, bail out */
-      return WHY("DNAHELPER start failed");
-    }
+  if (strlen(did) > DID_MAXSIZE)
+    return WHYF("DNAHELPER DID too long: %s -- request not sent", did);
+  time_ms_t now = gettime_ms();
+
+  // answer from the cache if the same DID was looked up recently
+  cache_expire(now);
+  struct dna_cache_entry *e = cache_find(did);
+  if (e) {
+    if (config.debug.dnahelper)
+      DEBUGF("DNAHELPER cached %u results for %s", e->nresults, did);
+    stat_cache_hits++;
+    unsigned i;
+    for (i = 0; i < e->nresults; ++i)
+      request_reply(&mdp->out.src, did, &e->results[i]);
+    return 1;
+  }
+  stat_cache_misses++;
+
+  // join a lookup of the same DID that is already under way
+  struct dna_request *r = find_request(pending_head, did);
+  unsigned i;
+  for (i = 0; !r && i < dna_helpers_used; ++i)
+    r = find_request(dna_helpers[i].inflight, did);
+  if (r) {
+    request_join(r, mdp);
+    return 1;
   }
-  /* Write request to dna helper.
+
+  /* Queue a request for a helper.
      Request takes form:  SID-of-Requestor|DID|\n
      By passing the requestor's SID to the helper, we don't need to maintain
      any state, as all we have to do is wait for responses from the helper,
      which will include the requestor's SID.
   */
-  if (dna_helper_stdin == -1)
-    return 0;
-  if (request_bufptr && request_bufptr != request_buffer) {
-    WARNF("DNAHELPER currently sending request %s -- dropping new request", request_buffer);
-    return 0;
-  }
-  if (awaiting_reply) {
-    WARN("DNAHELPER currently awaiting reply -- dropping new request");
+  if (pending_count >= DNA_HELPER_QUEUE_LENGTH) {
+    WARNF("DNAHELPER %u requests queued -- dropping new request", pending_count);
+    stat_dropped++;
     return 0;
   }
-  char buffer[sizeof request_buffer];
-  strbuf b = strbuf_local(request_bufptr == request_buffer ? buffer : request_buffer, sizeof buffer);
+  if (!(r = emalloc_zero(sizeof *r)))
+    return -1;
+  strcpy(r->did, did);
+  strbuf b = strbuf_local(r->token, sizeof r->token);
   strbuf_tohex(b, SID_STRLEN, requestorSidp->binary);
-  strbuf_putc(b, '|');
-  strbuf_puts(b, did);
-  strbuf_putc(b, '|');
-  strbuf_putc(b, '\n');
-  if (strbuf_overrun(b)) {
-    WHYF("DNAHELPER request buffer overrun: %s -- request not sent", strbuf_str(b));
-    request_bufptr = request_bufend = NULL;
-  } else {
-    if (strbuf_str(b) != request_buffer) {
-      if (strcmp(strbuf_str(b), request_buffer) != 0)
-	WARNF("DNAHELPER overwriting unsent request %s", request_buffer);
-      strcpy(request_buffer, strbuf_str(b));
-    }
-    request_bufptr = request_buffer;
-    request_bufend = request_buffer + strbuf_len(b);
-    request_mdp_data = mdp->out;
-    strncpy(request_did, did, sizeof request_did);
-    request_did[sizeof request_did - 1] = '\0';
-  }
-  if (dna_helper_started) {
-    sched_requests.poll.fd = dna_helper_stdin;
-    watch(&sched_requests);
-  }
+  r->queued_time = now;
+  r->waiters[r->nwaiters++] = mdp->out.src;
+  if (pending_tail)
+    pending_tail->_next = r;
+  else
+    pending_head = r;
+  pending_tail = r;
+  pending_count++;
+  dna_helper_dispatch();
   return 1;
 }
+
+void dna_helper_stats_json(strbuf b)
+{
+  strbuf_sprintf(b, "{\"cache_entries\":%u,\"cache_hits\":%"PRIu64",\"cache_misses\":%"PRIu64
+		 ",\"coalesced\":%"PRIu64",\"dropped\":%"PRIu64",\"queued\":%u,\"helpers\":[",
+		 cache_count, stat_cache_hits, stat_cache_misses, stat_coalesced, stat_dropped, pending_count);
+  unsigned i;
+  for (i = 0; i < dna_helpers_used; ++i) {
+    struct dna_helper *h = &dna_helpers[i];
+    strbuf_sprintf(b, "%s{\"pid\":%d,\"starts\":%u,\"requests\":%u,\"completed\":%u,\"timeouts\":%u,\"in_flight\":%u,"
+		   "\"latency_ms\":{\"last\":%"PRId64",\"mean\":%"PRId64",\"max\":%"PRId64"}}",
+		   i ? "," : "", h->pid, h->restarts, h->requests, h->completed, h->timeouts, h->ninflight,
+		   h->latency_last, h->completed ? h->latency_total / h->completed : 0, h->latency_max);
+  }
+  strbuf_puts(b, "]}");
+}
@@ -227,8 +227,10 @@ static void call_alarm(struct sched_ent *alarm, int revents)
   if (config.debug.io)
     DEBUGF("Calling alarm/callback %p %s", alarm, alloca_alarm_name(alarm));
 
-  if (call_stats.totals)
+  if (call_stats.totals){
+    call_stats.totals->alarm=1;
     fd_func_enter(__HERE__, &call_stats);
+  }
   
   alarm->poll.revents = revents;
   alarm->function(alarm);
@@ -26,19 +26,28 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "os.h"
 #include "log.h"
 
+/* Latency histogram buckets, bucket n counts calls that took between 2^n and
+ * 2^(n+1) nanoseconds, the last bucket also counts anything longer. */
+#define PROFILE_HISTOGRAM_BUCKETS 32
+
 struct profile_total {
   struct profile_total *_next;
   int _initialised;
   const char *name;
-  time_ms_t max_time;
-  time_ms_t total_time;
-  time_ms_t child_time;
+  time_ns_t max_time;
+  time_ns_t total_time;
+  time_ns_t child_time;
   int calls;
+  // set when these totals belong to a scheduled alarm, rather than an IN() / OUT() function
+  int alarm;
+  // cumulative since the process started, never cleared by fd_clearstats()
+  time_ns_t cumulative_time;
+  uint32_t histogram[PROFILE_HISTOGRAM_BUCKETS];
 };
 
 struct call_stats{
-  time_ms_t enter_time;
-  time_ms_t child_time;
+  time_ns_t enter_time;
+  time_ns_t child_time;
   struct profile_total *totals;
   struct call_stats *prev;
 };
@@ -76,6 +85,9 @@ int fd_poll();
 /* function timing routines */
 int fd_clearstats();
 int fd_showstats();
+struct strbuf;
+struct strbuf *strbuf_append_fd_stats_json(struct strbuf *sb);
+char *fd_stats_json(size_t *length);
 int fd_checkalarms();
 int fd_func_enter(struct __sourceloc, struct call_stats *this_call);
 int fd_func_exit(struct __sourceloc, struct call_stats *this_call);
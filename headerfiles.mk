@@ -18,6 +18,7 @@ HDRS=	fifo.h \
 	conf.h \
 	conf_schema.h \
 	crypto.h \
+	crypto_accel.h \
 	log.h \
 	net.h \
 	fdqueue.h \
@@ -30,6 +30,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "crypto.h"
 #include "overlay_packet.h"
 #include "keyring.h"
+#include "crypto_accel.h"
 
 static void keyring_free_keypair(keypair *kp);
 static void keyring_free_context(keyring_context *c);
@@ -194,10 +195,12 @@ static void add_subscriber(keyring_identity *id, unsigned keypair)
   }
 }
 
+keyring_file *keyring_shared = NULL;
+
 void keyring_free(keyring_file *k)
 {
   int i;
-  if (!k) return;
+  if (!k || k == keyring_shared) return;
 
   /* Close keyring file handle */
   if (k->file) fclose(k->file);
@@ -410,7 +413,7 @@ static int keyring_munge_block(
   /* Now en/de-crypt the remainder of the block.
      We do this in-place for convenience, so you should not pass in a mmap()'d
      lump. */
-  crypto_stream_xsalsa20_xor(&block[96],&block[96],len-96, hashNonce,hashKey);
+  crypto_xsalsa20_xor(&block[96],&block[96],len-96, hashNonce,hashKey);
   exit_code=0;
 
  kmb_safeexit:
@@ -1994,6 +1997,12 @@ keyring_file *keyring_open_instance()
 keyring_file *keyring_open_instance_cli(const struct cli_parsed *parsed)
 {
   IN();
+  if (keyring_shared) {
+    // entering PINs would unlock identities in the server for everyone, so the server refuses
+    if (cli_arg(parsed, "--keyring-pin", NULL, NULL, NULL) == 0 || cli_arg(parsed, "--entry-pin", NULL, NULL, NULL) == 0)
+      RETURN(WHYNULL("Keyring PINs cannot be given to a command run by the server"));
+    RETURN(keyring_shared);
+  }
   keyring_file *k = keyring_open_instance();
   if (k == NULL)
     RETURN(NULL);
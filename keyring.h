@@ -71,6 +71,10 @@ void keyring_release_identity(keyring_file *k, int cn, int id);
 
 /* handle to keyring file for use in running instance */
 extern keyring_file *keyring;
+/* Set while the server runs a command for a client of its command socket, so that the command uses
+ * the server's own keyring instead of opening another copy.
+ */
+extern keyring_file *keyring_shared;
 
 /* Public calls to keyring management */
 keyring_file *keyring_open(const char *path, int writeable);
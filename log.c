@@ -82,6 +82,8 @@ typedef struct _log_iterator {
   struct tm tm;
   XPRINTF xpf;
   time_t file_start_time;
+  /* Whether the current line is being formatted as a binary record.  */
+  bool_t binary;
 } _log_iterator;
 
 /* Static variables for sending log output to a file.
@@ -100,6 +102,31 @@ struct config_log_format config_file;
 time_t _log_file_start_time;
 static char _log_file_buf[8192];
 static struct strbuf _log_file_strbuf = STRUCT_STRBUF_EMPTY;
+static int _log_file_urgent = 0;
+static void _log_file_write(const char *buf, size_t len);
+
+/* Static variables for writing binary log records (log.file.binary).
+ *
+ * The message of the record being formatted is accumulated in _log_record_strbuf, while its level,
+ * time and source location are held in _log_record until the end of the line.
+ */
+static struct log_record _log_record;
+static struct __sourceloc _log_record_whence;
+static char _log_record_buf[8192];
+static struct strbuf _log_record_strbuf = STRUCT_STRBUF_EMPTY;
+
+/* Static variables for buffering log file output in the server (log.file.buffer_size).
+ *
+ * Completed lines or records are appended to _log_buffer instead of being written to the file, and
+ * the server's main loop writes them out periodically by calling logDrain().  If the buffer is
+ * full, the line is discarded and counted, so that logging never waits for the disk.  Errors are
+ * never buffered; they cause the buffer to be drained and are then written immediately.
+ */
+static char *_log_buffer = NULL;
+static size_t _log_buffer_size = 0;
+static size_t _log_buffer_len = 0;
+static unsigned _log_dropped = 0;
+static uint64_t _log_dropped_total = 0;
 
 #ifdef ANDROID
 /* Static variables for sending log output to the Android log.
@@ -134,6 +161,7 @@ static void _log_iterator_rewind(_log_iterator *it)
 {
   it->config = NULL;
   it->state = NULL;
+  it->binary = 0;
 }
 
 static void _log_iterator_advance_to_file(_log_iterator *it)
@@ -192,22 +220,42 @@ static int _log_enabled(_log_iterator *it)
   return 1;
 }
 
-static void _log_prefix_level(_log_iterator *it, int level)
+const char *log_level_prefix(int level)
 {
-  const char *levelstr = "UNKWN:";
   switch (level) {
-    case LOG_LEVEL_FATAL: levelstr = "FATAL:"; break;
-    case LOG_LEVEL_ERROR: levelstr = "ERROR:"; break;
-    case LOG_LEVEL_WARN:  levelstr = "WARN:"; break;
-    case LOG_LEVEL_HINT:  levelstr = "HINT:"; break;
-    case LOG_LEVEL_INFO:  levelstr = "INFO:"; break;
-    case LOG_LEVEL_DEBUG: levelstr = "DEBUG:"; break;
+    case LOG_LEVEL_FATAL: return "FATAL:";
+    case LOG_LEVEL_ERROR: return "ERROR:";
+    case LOG_LEVEL_WARN:  return "WARN:";
+    case LOG_LEVEL_HINT:  return "HINT:";
+    case LOG_LEVEL_INFO:  return "INFO:";
+    case LOG_LEVEL_DEBUG: return "DEBUG:";
   }
-  xprintf(it->xpf, "%-6.6s", levelstr);
+  return "UNKWN:";
+}
+
+static void _log_prefix_level(_log_iterator *it, int level)
+{
+  xprintf(it->xpf, "%-6.6s", log_level_prefix(level));
+}
+
+static int _log_binary()
+{
+  return !cf_limbo && config.log.file.binary;
 }
 
 static void _log_prefix(_log_iterator *it, int level)
 {
+  it->binary = 0;
+  if (it->config == &config_file && _log_binary()) {
+    it->binary = 1;
+    strbuf_init(&_log_record_strbuf, _log_record_buf, sizeof _log_record_buf);
+    it->xpf = XPRINTF_STRBUF(&_log_record_strbuf);
+    _log_record.level = level;
+    _log_record.pid = getpid();
+    _log_record.time_us = (int64_t)it->tv.tv_sec * 1000000 + it->tv.tv_usec;
+    _log_record_whence = __NOWHERE__;
+    return;
+  }
   if (it->config == &config_file) {
     if (strbuf_is_empty(&_log_file_strbuf))
       strbuf_init(&_log_file_strbuf, _log_file_buf, sizeof _log_file_buf);
@@ -259,6 +307,10 @@ static const char *_trimbuildpath(const char *path)
 
 static void _log_prefix_whence(_log_iterator *it, struct __sourceloc whence)
 {
+  if (it->binary) {
+    _log_record_whence = whence;
+    return;
+  }
   if (whence.file && whence.file[0]) {
     xprintf(it->xpf, "%s", _trimbuildpath(whence.file));
     if (whence.line)
@@ -271,8 +323,51 @@ static void _log_prefix_whence(_log_iterator *it, struct __sourceloc whence)
   }
 }
 
+/* Format a binary record into the given buffer, truncating the message if necessary.  Returns the
+ * number of bytes used.
+ */
+static size_t _log_record_format(char *buf, size_t size, const struct log_record *header,
+				 struct __sourceloc whence, const char *message, size_t message_len)
+{
+  struct log_record record = *header;
+  const char *file = whence.file && whence.file[0] ? _trimbuildpath(whence.file) : "";
+  const char *function = whence.function ? whence.function : "";
+  size_t file_len = strlen(file) + 1;
+  size_t function_len = strlen(function) + 1;
+  size_t ofs = sizeof record;
+  assert(size >= ofs + file_len + function_len);
+  if (message_len > size - ofs - file_len - function_len)
+    message_len = size - ofs - file_len - function_len;
+  record.magic = LOG_RECORD_MAGIC;
+  record.line = whence.line;
+  record.length = file_len + function_len + message_len;
+  memcpy(buf, &record, sizeof record);
+  memcpy(&buf[ofs], file, file_len);
+  ofs += file_len;
+  memcpy(&buf[ofs], function, function_len);
+  ofs += function_len;
+  memcpy(&buf[ofs], message, message_len);
+  return ofs + message_len;
+}
+
+static void _log_record_end()
+{
+  char buf[sizeof(struct log_record) + 1024 + sizeof _log_record_buf];
+  size_t len = _log_record_format(buf, sizeof buf, &_log_record, _log_record_whence,
+				  strbuf_str(&_log_record_strbuf), strbuf_len(&_log_record_strbuf));
+  _log_file_write(buf, len);
+}
+
 static void _log_end_line(_log_iterator *it, int level)
 {
+  if (it->config == &config_file) {
+    _log_file_urgent = level >= LOG_LEVEL_ERROR;
+    if (it->binary) {
+      if (_log_file && _log_file != NO_FILE)
+	_log_record_end();
+      it->binary = 0;
+    }
+  }
 #ifdef ANDROID
   if (it->config == &config.log.android) {
     int alevel = ANDROID_LOG_UNKNOWN;
@@ -573,8 +668,10 @@ static void _rotate_log_file(_log_iterator *it)
       _compute_file_start_time(it);
       if (it->file_start_time != _log_file_start_time) {
 	// Close the current log file, which will cause _open_log_file() to open the next one.
-	if (_log_file)
+	if (_log_file) {
+	  logDrain();
 	  fclose(_log_file);
+	}
 	_log_file = NULL;
 	_log_file_path = NULL;
       }
@@ -582,23 +679,118 @@ static void _rotate_log_file(_log_iterator *it)
   }
 }
 
+/* Returns true if the server has configured a log buffer, allocating it if necessary.
+ */
+static int _log_buffering()
+{
+  if (!serverMode || cf_limbo || !config.log.file.buffer_size || !_log_file || _log_file == NO_FILE)
+    return 0;
+  size_t size = config.log.file.buffer_size;
+  if (size != _log_buffer_size) {
+    logDrain();
+    // not emalloc(), which would log on failure
+    char *buffer = realloc(_log_buffer, size);
+    if (!buffer)
+      return 0;
+    if (!_log_buffer)
+      atexit(logDrain);
+    _log_buffer = buffer;
+    _log_buffer_size = size;
+  }
+  return 1;
+}
+
+static void _log_file_write(const char *buf, size_t len)
+{
+  if (_log_buffering()) {
+    if (!_log_file_urgent) {
+      if (_log_buffer_len + len > _log_buffer_size) {
+	++_log_dropped;
+	return;
+      }
+      memcpy(&_log_buffer[_log_buffer_len], buf, len);
+      _log_buffer_len += len;
+      return;
+    }
+    // preserve the order of messages, and get errors to disk in case we are about to crash
+    logDrain();
+  }
+  fwrite(buf, len, 1, _log_file);
+  fflush(_log_file);
+}
+
 static void _flush_log_file()
 {
   if (_log_file && _log_file != NO_FILE) {
-    fprintf(_log_file, "%s%s%s",
-	strbuf_len(&_log_file_strbuf) ? strbuf_str(&_log_file_strbuf) : "",
-	strbuf_len(&_log_file_strbuf) ? "\n" : "",
-	strbuf_overrun(&_log_file_strbuf) ? "LOG OVERRUN\n" : ""
-      );
+    if (strbuf_len(&_log_file_strbuf)) {
+      if (_log_binary()) {
+	// text logged before the configuration was loaded
+	struct log_record header;
+	memset(&header, 0, sizeof header);
+	header.pid = getpid();
+	char buf[sizeof header + 2 + sizeof _log_file_buf];
+	size_t len = _log_record_format(buf, sizeof buf, &header, __NOWHERE__,
+					strbuf_str(&_log_file_strbuf), strbuf_len(&_log_file_strbuf));
+	_log_file_write(buf, len);
+      } else {
+	strbuf_putc(&_log_file_strbuf, '\n');
+	_log_file_write(strbuf_str(&_log_file_strbuf), strbuf_len(&_log_file_strbuf));
+	if (strbuf_overrun(&_log_file_strbuf))
+	  _log_file_write("\nLOG OVERRUN\n", 13);
+      }
+    }
     strbuf_reset(&_log_file_strbuf);
   }
 }
 
+/* Write out everything held in the server's log buffer, followed by a count of the messages that
+ * had to be discarded because it was full.
+ */
+void logDrain()
+{
+  if (!_log_file || _log_file == NO_FILE)
+    return;
+  if (_log_buffer_len)
+    fwrite(_log_buffer, _log_buffer_len, 1, _log_file);
+  _log_buffer_len = 0;
+  if (_log_dropped) {
+    char message[80];
+    snprintf(message, sizeof message, "LOG BUFFER FULL, %u messages dropped", _log_dropped);
+    if (_log_binary()) {
+      struct log_record header;
+      memset(&header, 0, sizeof header);
+      struct timeval tv;
+      gettimeofday(&tv, NULL);
+      header.time_us = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+      header.pid = getpid();
+      header.level = LOG_LEVEL_WARN;
+      char buf[sizeof header + 2 + sizeof message];
+      size_t len = _log_record_format(buf, sizeof buf, &header, __NOWHERE__, message, strlen(message));
+      fwrite(buf, len, 1, _log_file);
+    } else
+      fprintf(_log_file, "%s\n", message);
+    _log_dropped_total += _log_dropped;
+    _log_dropped = 0;
+  }
+  fflush(_log_file);
+}
+
+void log_buffer_stats(size_t *buffered, uint64_t *dropped)
+{
+  *buffered = _log_buffer_len;
+  *dropped = _log_dropped_total + _log_dropped;
+}
+
+/* Close the log file so that it will be reopened when next needed.  This is only called in a forked
+ * child process, so anything still in the log buffer is discarded; the parent will write it.
+ */
 void close_log_file()
 {
   if (_log_file && _log_file != NO_FILE)
     fclose(_log_file);
   _log_file = NULL;
+  _log_buffer_len = 0;
+  _log_dropped = 0;
 }
 
 static void _open_log_stderr()
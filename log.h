@@ -24,6 +24,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <stdarg.h>
 #include <sys/types.h>
 #include <errno.h>
+#include <stdint.h>
 
 #define LOG_LEVEL_INVALID   (-1)
 #define LOG_LEVEL_SILENT    (0)
@@ -36,6 +37,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define LOG_LEVEL_NONE      (127)
 
 const char *log_level_as_string(int level);
+const char *log_level_prefix(int level);
 int string_to_log_level(const char *text);
 
 /*
@@ -104,10 +106,30 @@ void logMessage(int level, struct __sourceloc whence, const char *fmt, ...)
 __attribute__ (( format(printf,3,4) ));
 void vlogMessage(int level, struct __sourceloc whence, const char *fmt, va_list);
 void logConfigChanged();
+void logDrain();
+void log_buffer_stats(size_t *buffered, uint64_t *dropped);
 int logDump(int level, struct __sourceloc whence, char *name, const unsigned char *addr, size_t len);
 ssize_t get_self_executable_path(char *buf, size_t len);
 int log_backtrace(int level, struct __sourceloc whence);
 
+/* When log.file.binary is set, each message is appended to the log file as one of these headers,
+ * followed by the nul terminated source file name, the nul terminated function name, and the
+ * message text (not terminated), for a total of 'length' bytes.  Text that was logged before the
+ * configuration was loaded is written as a single record with level LOG_LEVEL_SILENT.  Records are
+ * in host byte order; "servald log decode" rejects a file from a different architecture by checking
+ * the magic number.
+ */
+#define LOG_RECORD_MAGIC 0x534c4f47 // "SLOG"
+
+struct log_record {
+  uint32_t magic;
+  uint32_t length;
+  int64_t time_us;
+  uint32_t pid;
+  uint32_t line;
+  int32_t level;
+};
+
 struct strbuf;
 
 #define __HERE__            ((struct __sourceloc){ .file = __FILE__, .line = __LINE__, .function = __FUNCTION__ })
@@ -325,18 +325,9 @@ static int decode_length(struct slip_decode_state *state, unsigned char *p)
   return 0;
 }
 
-int mavlink_decode(struct overlay_interface *interface, struct slip_decode_state *state, uint8_t c)
+static void mavlink_parse_buffer(struct overlay_interface *interface, struct slip_decode_state *state)
 {
-  if (state->mavlink_payload_start + state->mavlink_payload_offset >= sizeof(state->mavlink_payload)){
-    // drop one byte if we run out of space
-    if (config.debug.mavlink)
-      DEBUGF("Dropped %02x, buffer full", state->mavlink_payload[0]);
-    bcopy(state->mavlink_payload+1, state->mavlink_payload, sizeof(state->mavlink_payload) -1);
-    state->mavlink_payload_start--;
-  }
-  
-  unsigned char *p = &state->mavlink_payload[state->mavlink_payload_start];
-  p[state->mavlink_payload_offset++]=c;
+  unsigned char *p;
   
   while(1){
     // look for packet length headers
@@ -362,7 +353,7 @@ int mavlink_decode(struct overlay_interface *interface, struct slip_decode_state
     
     // wait for a whole packet
     if (!state->mavlink_payload_length || state->mavlink_payload_offset < state->mavlink_payload_length+8)
-      return 0;
+      return;
     
     if (parse_heartbeat(interface, p)){
       // cut the bytes of the heartbeat out of the buffer
@@ -405,3 +396,33 @@ int mavlink_decode(struct overlay_interface *interface, struct slip_decode_state
     state->mavlink_payload_length=0;
   };
 }
+
+/* Append as many received bytes as will fit to the payload buffer, then parse any complete frames.
+   Parsing after each block of bytes instead of each byte gives the same result, 
+   since a frame is only examined once all of its bytes have arrived.
+ */
+int mavlink_decode(struct overlay_interface *interface, struct slip_decode_state *state, const uint8_t *buffer, size_t len)
+{
+  while(len>0){
+    if (state->mavlink_payload_start + state->mavlink_payload_offset >= sizeof(state->mavlink_payload)){
+      // drop one byte if we run out of space
+      if (config.debug.mavlink)
+	DEBUGF("Dropped %02x, buffer full", state->mavlink_payload[0]);
+      bcopy(state->mavlink_payload+1, state->mavlink_payload, sizeof(state->mavlink_payload) -1);
+      if (state->mavlink_payload_start)
+	state->mavlink_payload_start--;
+      else
+	state->mavlink_payload_offset--;
+    }
+    
+    size_t space = sizeof(state->mavlink_payload) - (state->mavlink_payload_start + state->mavlink_payload_offset);
+    size_t count = len < space ? len : space;
+    bcopy(buffer, &state->mavlink_payload[state->mavlink_payload_start + state->mavlink_payload_offset], count);
+    state->mavlink_payload_offset+=count;
+    buffer+=count;
+    len-=count;
+    
+    mavlink_parse_buffer(interface, state);
+  }
+  return 0;
+}
@@ -330,6 +330,9 @@ ssize_t overlay_mdp_relevant_bytes(overlay_mdp_frame *mdp)
   size_t len;
   switch(mdp->packetTypeAndFlags&MDP_TYPE_MASK)
   {
+    case MDP_STATS:
+      len = (char *)(&mdp->stats + 1) - (char *)mdp;
+      break;
     case MDP_ROUTING_TABLE:
     case MDP_GOODBYE:
       /* no arguments for saying goodbye */
@@ -18,6 +18,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
 #include <string.h>
+#include <assert.h>
 #include "mem.h"
 
 void *_emalloc(struct __sourceloc __whence, size_t bytes)
@@ -63,6 +64,67 @@ char *_str_edup(struct __sourceloc __whence, const char *str)
   return _strn_edup(__whence, str, strlen(str));
 }
 
+struct mem_pool *mem_pools = NULL;
+
+void *_pool_alloc(struct __sourceloc __whence, struct mem_pool *pool)
+{
+  if (!pool->_registered){
+    assert(pool->size >= sizeof(void *));
+    pool->_registered = 1;
+    pool->_next = mem_pools;
+    mem_pools = pool;
+  }
+#ifndef MALLOC_PARANOIA
+  if (pool->_free_list){
+    void **block = pool->_free_list;
+    pool->_free_list = *block;
+    pool->free_count--;
+    pool->allocs++;
+    pool->reused++;
+    return block;
+  }
+#endif
+  void *new = _emalloc(__whence, pool->size);
+  if (new)
+    pool->allocs++;
+  return new;
+}
+
+void *_pool_alloc_zero(struct __sourceloc __whence, struct mem_pool *pool)
+{
+  void *new = _pool_alloc(__whence, pool);
+  if (new)
+    memset(new, 0, pool->size);
+  return new;
+}
+
+void pool_release(struct mem_pool *pool, void *block)
+{
+  if (!block)
+    return;
+  pool->releases++;
+#ifndef MALLOC_PARANOIA
+  if (pool->free_count < pool->max_free){
+    *(void **)block = pool->_free_list;
+    pool->_free_list = block;
+    pool->free_count++;
+    return;
+  }
+#endif
+  free(block);
+}
+
+// return every cached block to the heap
+void pool_trim(struct mem_pool *pool)
+{
+  while(pool->_free_list){
+    void **block = pool->_free_list;
+    pool->_free_list = *block;
+    free(block);
+  }
+  pool->free_count = 0;
+}
+
 #undef malloc
 #undef calloc
 #undef free
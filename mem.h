@@ -21,6 +21,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define __SERVALDNA__MEM_H
 
 #include <sys/types.h>
+#include <stdint.h>
 #include "log.h"
 
 // #define MALLOC_PARANOIA
@@ -63,6 +64,42 @@ void *_emalloc_zero(struct __sourceloc, size_t bytes);
 char *_str_edup(struct __sourceloc, const char *str);
 char *_strn_edup(struct __sourceloc, const char *str, size_t len);
 
+/* A free list of released blocks of the same size, so that small objects that
+ * are created and destroyed for every packet don't need to go through
+ * malloc(3) and free(3) each time.  At most max_free released blocks are kept
+ * for reuse, anything more is returned to the heap.
+ *
+ * Blocks are allocated from the heap one at a time, so any block of the right
+ * size may be released into a pool, and a pooled block may be passed to free(3).
+ * Pools are not thread safe.
+ */
+struct mem_pool {
+  const char *name;
+  size_t size;
+  unsigned max_free;
+  unsigned free_count;
+  void *_free_list;
+  struct mem_pool *_next;
+  int _registered;
+  // totals since the process started
+  uint64_t allocs;
+  uint64_t reused;
+  uint64_t releases;
+};
+
+#define MEM_POOL(NAME, SIZE, MAX_FREE) {.name = (NAME), .size = (SIZE), .max_free = (MAX_FREE)}
+
+// every pool that has been used, for reporting
+extern struct mem_pool *mem_pools;
+
+void *_pool_alloc(struct __sourceloc, struct mem_pool *pool);
+void *_pool_alloc_zero(struct __sourceloc, struct mem_pool *pool);
+void pool_release(struct mem_pool *pool, void *block);
+void pool_trim(struct mem_pool *pool);
+
+#define pool_alloc(pool)      _pool_alloc(__HERE__, (pool))
+#define pool_alloc_zero(pool) _pool_alloc_zero(__HERE__, (pool))
+
 #define emalloc(bytes)       _emalloc(__HERE__, (bytes))
 #define erealloc(ptr, bytes) _erealloc(__HERE__, (ptr), (bytes))
 #define emalloc_zero(bytes)  _emalloc_zero(__HERE__, (bytes))
@@ -33,16 +33,6 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "overlay_address.h"
 #include "monitor-client.h"
 
-#ifdef HAVE_UCRED_H
-#include <ucred.h>
-#endif
-
-#ifdef linux
-#if defined(LOCAL_PEERCRED) && !defined(SO_PEERCRED)
-#define SO_PEERCRED LOCAL_PEERCRED
-#endif
-#endif
-
 #define MONITOR_LINE_LENGTH 160
 #define MONITOR_DATA_SIZE MAX_AUDIO_BYTES
 struct monitor_context {
@@ -271,51 +261,14 @@ void monitor_client_poll(struct sched_ent *alarm)
 }
  
 static void monitor_new_client(int s) {
-#ifdef SO_PEERCRED
-  struct ucred			ucred;
-  socklen_t			len;
-  int				res;
-#elif defined(HAVE_GETPEEREID)
-  gid_t				othergid;
-#elif defined(HAVE_UCRED_H)
-  ucred_t			*ucred;
-#endif
   uid_t				otheruid;
   struct monitor_context	*c;
 
   if (set_nonblock(s) == -1)
     goto error;
 
-#ifdef SO_PEERCRED
-  /* Linux way */
-  len = sizeof(ucred);
-  res = getsockopt(s, SOL_SOCKET, SO_PEERCRED, &ucred, &len);
-  if (res) { 
-    WHY_perror("getsockopt(SO_PEERCRED)");
-    goto error;
-  }
-  if (len < sizeof(ucred)) {
-    WHYF("getsockopt(SO_PEERCRED) returned the wrong size (Got %d expected %d)", len, (int)sizeof(ucred));
+  if (socket_peer_uid(s, &otheruid) == -1)
     goto error;
-  }
-  otheruid = ucred.uid;
-#elif defined(HAVE_UCRED_H)
-  /* Solaris way */
-  if (getpeerucred(s, &ucred) != 0) {
-    WHY_perror("getpeerucred");
-    goto error;
-  }
-  otheruid = ucred_geteuid(ucred);
-  ucred_free(ucred);
-#elif defined(HAVE_GETPEEREID)
-  /* BSD way */
-  if (getpeereid(s, &otheruid, &othergid) != 0) {
-    WHY_perror("getpeereid");
-    goto error;
-  }
-#else
-#error No way to get socket peer credentials
-#endif
 
   if (otheruid != getuid()) {
     if (otheruid != config.monitor.uid){
@@ -59,6 +59,16 @@ typedef int64_t time_ms_t;
 time_ms_t gettime_ms();
 time_ms_t sleep_ms(time_ms_t milliseconds);
 
+/* Intervals that are too short to measure in milliseconds, such as the time
+ * spent in a single function, are measured in nanoseconds using a monotonic
+ * clock.  The values returned by gettime_ns() are only meaningful relative
+ * to each other, and bear no relation to wall clock time.
+ */
+typedef int64_t time_ns_t;
+#define PRItime_ns_t PRId64
+
+time_ns_t gettime_ns();
+
 #ifndef HAVE_BZERO
 __SERVALDNA_OS_INLINE void bzero(void *buf, size_t len) {
     memset(buf, 0, len);
@@ -117,12 +117,17 @@ schedule(&_sched_##X); }
   /* Periodically check for server shut down */
   SCHEDULE(server_shutdown_check, 0, 100);
   
-  /* Periodically reload configuration */
+  /* Reload configuration when it changes, and periodically in case a change is missed */
+  server_config_watch_setup();
   SCHEDULE(server_config_reload, SERVER_CONFIG_RELOAD_INTERVAL_MS, SERVER_CONFIG_RELOAD_INTERVAL_MS + 100);
   
-  /* Setup up MDP & monitor interface unix domain sockets */
+  /* Periodically write out buffered log messages, if the log is buffered */
+  server_log_drain_setup();
+  
+  /* Setup up MDP, monitor & command interface unix domain sockets */
   overlay_mdp_setup_sockets();
   monitor_setup_sockets();
+  command_setup_socket();
   
   olsr_init_socket();
 
@@ -149,6 +154,10 @@ schedule(&_sched_##X); }
   /* Periodically advertise bundles */
   SCHEDULE(overlay_rhizome_advertise, 1000, 10000);
   
+  /* Periodically move Rhizome payloads between storage tiers */
+  if (is_rhizome_enabled())
+    SCHEDULE(rhizome_tier_migrate, config.rhizome.tier_interval_ms, 1000);
+  
   /* Calculate (and possibly show) CPU usage stats periodically */
   SCHEDULE(fd_periodicstats, 3000, 500);
 
@@ -43,19 +43,39 @@ static struct broadcast bpilist[MAX_BPIS];
 #define OA_CODE_P2P_YOU 0xfd
 #define OA_CODE_P2P_ME 0xfc
 
-// each node has 16 slots based on the next 4 bits of a subscriber id
-// each slot either points to another tree node or a struct subscriber.
+/* Known subscribers are kept in a tree with 16 slots per node, based on the next 4 bits of a
+ * subscriber id.  Each slot is empty, or points to another tree node or to a subscriber.  A
+ * subscriber sits at the shallowest node where no other known sid shares its prefix, which gives
+ * its shortest unique abbreviation.
+ *
+ * The nodes are kept in one array and refer to each other by index, so each node is one 64 byte
+ * cache line.  Subscribers are allocated in blocks, and are never freed while the server is running,
+ * so a struct subscriber never moves.
+ */
+
+// a slot is 0 if empty, (index<<1)|1 for a tree node, or index<<1 for a subscriber
+typedef uint32_t tree_slot;
+#define SLOT_IS_NODE(s) ((s)&1)
+#define SLOT_INDEX(s) ((s)>>1)
+#define NODE_SLOT(i) (((tree_slot)(i)<<1)|1)
+#define SUBSCRIBER_SLOT(i) ((tree_slot)(i)<<1)
+
 struct tree_node{
-  // bit flags for the type of object each element points to
-  uint16_t is_tree;
-  
-  union{
-    struct tree_node *tree_nodes[16];
-    struct subscriber *subscribers[16];
-  };
+  tree_slot slots[16];
 };
 
-static struct tree_node root;
+#define TREE_NODE_ALIGN 64
+#define SUBSCRIBER_BLOCK 256
+
+// nodes[0] is the root, once the first subscriber has been added
+static struct tree_node *nodes=NULL;
+static unsigned node_count=0;
+static unsigned node_alloc=0;
+
+// subscriber index 0 is never used, so that an empty slot is 0
+static struct subscriber **subscriber_blocks=NULL;
+static unsigned subscriber_block_count=0;
+static unsigned subscriber_count=1;
 
 struct subscriber *my_subscriber=NULL;
 
@@ -67,6 +87,48 @@ static unsigned char get_nibble(const unsigned char *sidp, int pos)
   return byte&0xF;
 }
 
+static inline struct subscriber *subscriber_at(unsigned index)
+{
+  return &subscriber_blocks[index / SUBSCRIBER_BLOCK][index % SUBSCRIBER_BLOCK];
+}
+
+// returns the index of a new empty node, which may move all the others, or -1 on failure
+static int new_node()
+{
+  if (node_count == node_alloc){
+    unsigned alloc = node_alloc ? node_alloc * 2 : 64;
+    void *p = NULL;
+    if (posix_memalign(&p, TREE_NODE_ALIGN, alloc * sizeof(struct tree_node))){
+      WHY("Could not allocate subscriber tree nodes");
+      return -1;
+    }
+    if (nodes){
+      bcopy(nodes, p, node_count * sizeof(struct tree_node));
+      free(nodes);
+    }
+    nodes = p;
+    node_alloc = alloc;
+  }
+  bzero(&nodes[node_count], sizeof(struct tree_node));
+  return node_count++;
+}
+
+// returns the index of a new zero filled subscriber, or 0 on failure
+static unsigned new_subscriber()
+{
+  unsigned block = subscriber_count / SUBSCRIBER_BLOCK;
+  if (block == subscriber_block_count){
+    struct subscriber **blocks = erealloc(subscriber_blocks, (block + 1) * sizeof(struct subscriber *));
+    if (!blocks)
+      return 0;
+    subscriber_blocks = blocks;
+    if ((subscriber_blocks[block] = emalloc_zero(SUBSCRIBER_BLOCK * sizeof(struct subscriber))) == NULL)
+      return 0;
+    subscriber_block_count++;
+  }
+  return subscriber_count++;
+}
+
 static void free_subscriber(struct subscriber *subscriber)
 {
   if (subscriber->link_state || subscriber->destination)
@@ -75,24 +137,10 @@ static void free_subscriber(struct subscriber *subscriber)
     FATAL("Can't free a subscriber that is being used by rhizome");
   if (subscriber->identity)
     FATAL("Can't free a subscriber that is unlocked in the keyring");
-  free(subscriber);
 }
 
-static void free_children(struct tree_node *parent)
-{
-  int i;
-  for (i=0;i<16;i++){
-    if (parent->is_tree & (1<<i)){
-      free_children(parent->tree_nodes[i]);
-      free(parent->tree_nodes[i]);
-      parent->tree_nodes[i]=NULL;
-    }else if(parent->subscribers[i]){
-      free_subscriber(parent->subscribers[i]);
-      parent->subscribers[i]=NULL;
-    }
-  }
-  parent->is_tree=0;
-}
+// set by commands that build routing state without a daemon, which is never torn down
+int subscribers_in_use=0;
 
 void free_subscribers()
 {
@@ -100,28 +148,45 @@ void free_subscribers()
   // who knows where subscriber ptr's may have leaked to.
   if (serverMode)
     FATAL("Freeing subscribers from a running daemon is not supported");
-  free_children(&root);
+  if (subscribers_in_use)
+    return;
+  unsigned i;
+  for (i = 1; i < subscriber_count; i++)
+    free_subscriber(subscriber_at(i));
+  for (i = 0; i < subscriber_block_count; i++)
+    free(subscriber_blocks[i]);
+  free(subscriber_blocks);
+  subscriber_blocks = NULL;
+  subscriber_block_count = 0;
+  subscriber_count = 1;
+  free(nodes);
+  nodes = NULL;
+  node_count = node_alloc = 0;
 }
 
 // find a subscriber struct from a whole or abbreviated subscriber id
 struct subscriber *_find_subscriber(struct __sourceloc __whence, const unsigned char *sidp, int len, int create)
 {
-  IN();
   if (config.debug.subscriber)
     DEBUGF("find_subscriber(sid=%s, create=%d)", alloca_tohex(sidp, len), create);
-  struct tree_node *ptr = &root;
-  int pos=0;
   if (len!=SID_SIZE)
     create =0;
   struct subscriber *ret = NULL;
+  if (node_count == 0 && (!create || new_node() == -1))
+    goto done;
+  unsigned node = 0;
+  int pos=0;
   do {
     unsigned char nibble = get_nibble(sidp, pos++);
-    if (ptr->is_tree & (1<<nibble)){
-      ptr = ptr->tree_nodes[nibble];
-    }else if(!ptr->subscribers[nibble]){
+    tree_slot slot = nodes[node].slots[nibble];
+    if (SLOT_IS_NODE(slot)){
+      node = SLOT_INDEX(slot);
+    }else if(!slot){
       // subscriber is not yet known
-      if (create && (ret = (struct subscriber *) emalloc_zero(sizeof(struct subscriber)))) {
-	ptr->subscribers[nibble] = ret;
+      unsigned index;
+      if (create && (index = new_subscriber())) {
+	ret = subscriber_at(index);
+	nodes[node].slots[nibble] = SUBSCRIBER_SLOT(index);
 	ret->sid = *(const sid_t *)sidp;
 	ret->abbreviate_len = pos;
 	if (config.debug.subscriber)
@@ -133,32 +198,29 @@ struct subscriber *_find_subscriber(struct __sourceloc __whence, const unsigned
       goto done;
     }else{
       // there's a subscriber in this slot, does it match the rest of the sid we've been given?
-      ret = ptr->subscribers[nibble];
-      if (memcmp(ret->sid.binary, sidp, len) == 0)
+      struct subscriber *existing = subscriber_at(SLOT_INDEX(slot));
+      if (memcmp(existing->sid.binary, sidp, len) == 0) {
+	ret = existing;
 	goto done;
+      }
       // if we need to insert this subscriber, we have to make a new tree node first
-      if (!create) {
-	ret = NULL;
+      if (!create)
 	goto done;
-      }
       // create a new tree node and move the existing subscriber into it
-      struct tree_node *new = (struct tree_node *) emalloc_zero(sizeof(struct tree_node));
-      if (new == NULL) {
-	ret = NULL;
+      int new = new_node();
+      if (new == -1)
 	goto done;
-      }
       if (config.debug.subscriber)
 	DEBUGF("create node[%.*s]", pos, alloca_tohex(sidp, len));
-      ptr->tree_nodes[nibble] = new;
-      ptr->is_tree |= (1<<nibble);
-      ptr = new;
-      nibble = get_nibble(ret->sid.binary, pos);
-      ptr->subscribers[nibble] = ret;
-      ret->abbreviate_len = pos + 1;
+      nodes[node].slots[nibble] = NODE_SLOT(new);
+      node = new;
+      nibble = get_nibble(existing->sid.binary, pos);
+      nodes[node].slots[nibble] = slot;
+      existing->abbreviate_len = pos + 1;
       if (config.debug.subscriber)
 	DEBUGF("set node[%.*s].subscribers[%c]=%p(sid=%s, abbrev_len=%d)",
 	    pos, alloca_tohex(sidp, len), hexdigit_upper[nibble],
-	    ret, alloca_tohex_sid_t(ret->sid), ret->abbreviate_len
+	    existing, alloca_tohex_sid_t(existing->sid), existing->abbreviate_len
 	  );
       // then go around the loop again to compare the next nibble against the sid until we find an empty slot.
     }
@@ -166,17 +228,18 @@ struct subscriber *_find_subscriber(struct __sourceloc __whence, const unsigned
 done:
   if (config.debug.subscriber)
     DEBUGF("find_subscriber() return %p", ret);
-  RETURN(ret);
+  return ret;
 }
 
 /* 
  Walk the subscriber tree, calling the callback function for each subscriber.
  if start is a valid pointer, the first entry returned will be after this subscriber
  if the callback returns non-zero, the process will stop.
+ The callback may add subscribers, which can move the nodes, so they are always found by index.
  */
-static int walk_tree(struct tree_node *node, int pos, 
-	      unsigned char *start, int start_len, 
-	      unsigned char *end, int end_len,
+static int walk_tree(unsigned node, int pos, 
+	      const unsigned char *start, int start_len, 
+	      const unsigned char *end, int end_len,
 	      int(*callback)(struct subscriber *, void *), void *context){
   int i=0, e=16;
   
@@ -189,11 +252,12 @@ static int walk_tree(struct tree_node *node, int pos,
   }
   
   for (;i<e;i++){
-    if (node->is_tree & (1<<i)){
-      if (walk_tree(node->tree_nodes[i], pos+1, start, start_len, end, end_len, callback, context))
+    tree_slot slot = nodes[node].slots[i];
+    if (SLOT_IS_NODE(slot)){
+      if (walk_tree(SLOT_INDEX(slot), pos+1, start, start_len, end, end_len, callback, context))
 	return 1;
-    }else if(node->subscribers[i]){
-      if (callback(node->subscribers[i], context))
+    }else if(slot){
+      if (callback(subscriber_at(SLOT_INDEX(slot)), context))
 	return 1;
     }
     // stop comparing the start sid after looking at the first branch of the tree
@@ -202,12 +266,21 @@ static int walk_tree(struct tree_node *node, int pos,
   return 0;
 }
 
+static int walk_subscribers(const unsigned char *start, int start_len,
+	      const unsigned char *end, int end_len,
+	      int(*callback)(struct subscriber *, void *), void *context)
+{
+  if (node_count == 0)
+    return 0;
+  return walk_tree(0, 0, start, start_len, end, end_len, callback, context);
+}
+
 /*
  walk the tree, starting at start inclusive, calling the supplied callback function
  */
 void enum_subscribers(struct subscriber *start, int(*callback)(struct subscriber *, void *), void *context)
 {
-  walk_tree(&root, 0, start->sid.binary, SID_SIZE, NULL, 0, callback, context);
+  walk_subscribers(start ? start->sid.binary : NULL, SID_SIZE, NULL, 0, callback, context);
 }
 
 // generate a new random broadcast address
@@ -296,10 +369,10 @@ static int add_explain_response(struct subscriber *subscriber, void *context)
   subscriber->last_explained = now;
 
   if (!response->please_explain){
-    if ((response->please_explain = emalloc_zero(sizeof(struct overlay_frame))) == NULL)
+    if ((response->please_explain = op_new()) == NULL)
       return 1; // stop walking
     if ((response->please_explain->payload = ob_new()) == NULL) {
-      free(response->please_explain);
+      op_free(response->please_explain);
       response->please_explain = NULL;
       return 1; // stop walking
     }
@@ -359,7 +432,8 @@ static int find_subscr_buffer(struct decode_context *context, struct overlay_buf
     
     // add the abbreviation you told me about
     if (!context->please_explain){
-      context->please_explain = calloc(sizeof(struct overlay_frame),1);
+      if ((context->please_explain = op_new()) == NULL)
+	return -1;
       if ((context->please_explain->payload = ob_new()) == NULL)
 	return -1;
       ob_limitsize(context->please_explain->payload, MDP_MTU);
@@ -367,7 +441,7 @@ static int find_subscr_buffer(struct decode_context *context, struct overlay_buf
     
     // And I'll tell you about any subscribers I know that match this abbreviation, 
     // so you don't try to use an abbreviation that's too short in future.
-    walk_tree(&root, 0, id, len, id, len, add_explain_response, context);
+    walk_subscribers(id, len, id, len, add_explain_response, context);
     
     INFOF("Asking for explanation of %s", alloca_tohex(id, len));
     ob_append_byte(context->please_explain->payload, len);
@@ -411,7 +485,8 @@ int overlay_address_parse(struct decode_context *context, struct overlay_buffer
       }else{
 	// add the abbreviation you told me about
 	if (!context->please_explain){
-	  context->please_explain = calloc(sizeof(struct overlay_frame),1);
+	  if ((context->please_explain = op_new()) == NULL)
+	    return -1;
 	  if ((context->please_explain->payload = ob_new()) == NULL)
 	    return -1;
 	  ob_limitsize(context->please_explain->payload, MDP_MTU);
@@ -524,7 +599,7 @@ int process_explain(struct overlay_frame *frame)
     }else{
       // reply to the sender with all subscribers that match this abbreviation
       INFOF("Sending explain responses for %s", alloca_tohex(sid, len));
-      walk_tree(&root, 0, sid, len, sid, len, add_explain_response, &context);
+      walk_subscribers(sid, len, sid, len, add_explain_response, &context);
     }
   }
   if (context.please_explain)
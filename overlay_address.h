@@ -72,6 +72,10 @@ struct subscriber{
   // if direct, or unicast, where do we send packets?
   struct network_destination *destination;
   
+  // round trip time of Rhizome MDP transfers from this peer, and its variation, 0 if not measured
+  time_ms_t rhizome_srtt;
+  time_ms_t rhizome_rttvar;
+  
   time_ms_t last_stun_request;
   time_ms_t last_probe_response;
   time_ms_t last_explained;
@@ -109,11 +113,13 @@ struct decode_context{
 
 extern struct subscriber *my_subscriber;
 extern struct subscriber *directory_service;
+extern int subscribers_in_use;
 
 struct subscriber *_find_subscriber(struct __sourceloc, const unsigned char *sid, int len, int create);
 #define find_subscriber(sid, len, create) _find_subscriber(__WHENCE__, sid, len, create)
 
 void enum_subscribers(struct subscriber *start, int(*callback)(struct subscriber *, void *), void *context);
+extern unsigned reachable_changes;
 int set_reachable(struct subscriber *subscriber, struct network_destination *destination, struct subscriber *next_hop);
 int load_subscriber_address(struct subscriber *subscriber);
 
@@ -31,9 +31,44 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  In either case, functions that don't take an offset use and advance the position.
  */
 
+static struct mem_pool buffer_pool = MEM_POOL("overlay_buffer", sizeof(struct overlay_buffer), 256);
+
+/*
+ Buffers that are no larger than a packet are allocated from pools of power of two sizes,
+ so the bytes of one packet can be reused for the next.
+ */
+#define PAYLOAD_MIN_SIZE 64
+#define PAYLOAD_MAX_SIZE 2048
+static struct mem_pool payload_pools[]={
+  MEM_POOL("payload 64", 64, 64),
+  MEM_POOL("payload 128", 128, 64),
+  MEM_POOL("payload 256", 256, 64),
+  MEM_POOL("payload 512", 512, 32),
+  MEM_POOL("payload 1024", 1024, 32),
+  MEM_POOL("payload 2048", 2048, 32),
+};
+
+static struct mem_pool *payload_pool(int size)
+{
+  unsigned i;
+  for (i=0;i<NELS(payload_pools);i++)
+    if (payload_pools[i].size == (size_t)size)
+      return &payload_pools[i];
+  return NULL;
+}
+
+static void payload_free(unsigned char *bytes, int size)
+{
+  struct mem_pool *pool = payload_pool(size);
+  if (pool)
+    pool_release(pool, bytes);
+  else
+    free(bytes);
+}
+
 struct overlay_buffer *_ob_new(struct __sourceloc __whence)
 {
-  struct overlay_buffer *ret = emalloc_zero(sizeof(struct overlay_buffer));
+  struct overlay_buffer *ret = pool_alloc_zero(&buffer_pool);
   if (config.debug.overlaybuffer)
     DEBUGF("ob_new() return %p", ret);
   if (ret == NULL)
@@ -46,7 +81,7 @@ struct overlay_buffer *_ob_new(struct __sourceloc __whence)
 // and allow other callers to use the ob_ convenience methods for reading and writing up to size bytes.
 struct overlay_buffer *_ob_static(struct __sourceloc __whence, unsigned char *bytes, int size)
 {
-  struct overlay_buffer *ret = emalloc_zero(sizeof(struct overlay_buffer));
+  struct overlay_buffer *ret = pool_alloc_zero(&buffer_pool);
   if (config.debug.overlaybuffer)
     DEBUGF("ob_static(bytes=%p, size=%d) return %p", bytes, size, ret);
   if (ret == NULL)
@@ -67,7 +102,7 @@ struct overlay_buffer *_ob_slice(struct __sourceloc __whence, struct overlay_buf
     WHY("Buffer isn't long enough to slice");
     return NULL;
   }
-  struct overlay_buffer *ret = emalloc_zero(sizeof(struct overlay_buffer));
+  struct overlay_buffer *ret = pool_alloc_zero(&buffer_pool);
   if (config.debug.overlaybuffer)
     DEBUGF("ob_slice(b=%p, offset=%d, length=%d) return %p", b, offset, length, ret);
   if (ret == NULL)
@@ -81,7 +116,7 @@ struct overlay_buffer *_ob_slice(struct __sourceloc __whence, struct overlay_buf
 
 struct overlay_buffer *_ob_dup(struct __sourceloc __whence, struct overlay_buffer *b)
 {
-  struct overlay_buffer *ret = emalloc_zero(sizeof(struct overlay_buffer));
+  struct overlay_buffer *ret = pool_alloc_zero(&buffer_pool);
   if (config.debug.overlaybuffer)
     DEBUGF("ob_dup(b=%p) return %p", b, ret);
   if (ret == NULL)
@@ -108,8 +143,8 @@ void _ob_free(struct __sourceloc __whence, struct overlay_buffer *b)
   if (config.debug.overlaybuffer)
     DEBUGF("ob_free(b=%p)", b);
   if (b->allocated)
-    free(b->allocated);
-  free(b);
+    payload_free(b->allocated, b->allocSize);
+  pool_release(&buffer_pool, b);
 }
 
 int _ob_checkpoint(struct __sourceloc __whence, struct overlay_buffer *b)
@@ -189,12 +224,17 @@ ssize_t _ob_makespace(struct __sourceloc __whence, struct overlay_buffer *b, siz
     return 0;
   }
   int newSize=b->position+bytes;
-  if (newSize<64) newSize=64;
-  if (newSize&63) newSize+=64-(newSize&63);
-  if (newSize>1024 && (newSize&1023))
-    newSize+=1024-(newSize&1023);
-  if (newSize>65536 && (newSize&65535))
-    newSize+=65536-(newSize&65535);
+  if (newSize<=PAYLOAD_MAX_SIZE){
+    int size = PAYLOAD_MIN_SIZE;
+    while(size<newSize)
+      size<<=1;
+    newSize=size;
+  }else{
+    if (newSize&1023)
+      newSize+=1024-(newSize&1023);
+    if (newSize>65536 && (newSize&65535))
+      newSize+=65536-(newSize&65535);
+  }
   if (config.debug.overlaybuffer)
     DEBUGF("realloc(b->bytes=%p,newSize=%d)", b->bytes,newSize);
   /* XXX OSX realloc() seems to be able to corrupt things if the heap is not happy when calling realloc(), making debugging memory corruption much harder.
@@ -222,14 +262,15 @@ ssize_t _ob_makespace(struct __sourceloc __whence, struct overlay_buffer *b, siz
     for(i=0;i<4096;i++) new[newSize+i]=0xbd;
   }
 #else
-  unsigned char *new = emalloc(newSize);
+  struct mem_pool *pool = payload_pool(newSize);
+  unsigned char *new = pool ? pool_alloc(pool) : emalloc(newSize);
 #endif
   if (!new)
     return 0;
   bcopy(b->bytes,new,b->position);
   if (b->allocated) {
     assert(b->allocated == b->bytes);
-    free(b->allocated);
+    payload_free(b->allocated, b->allocSize);
   }
   b->bytes=new;
   b->allocated=new;
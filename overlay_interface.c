@@ -30,6 +30,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "overlay_buffer.h"
 #include "overlay_packet.h"
 #include "str.h"
+#include "strlcpy.h"
 
 #ifdef HAVE_IFADDRS_H
 #include <ifaddrs.h>
@@ -573,6 +574,32 @@ cleanup:
   return cleanup_ret;
 }
 
+/* Find or create an interface to receive replayed packets from a captured trace.
+   Anything sent on it is written to /dev/null, and it ticks at the default interval so that
+   neighbour updates are scheduled as usual.
+ */
+int overlay_interface_replay(const char *name, short type, struct in_addr addr)
+{
+  int i;
+  for (i=0;i<overlay_interface_count;i++)
+    if (strcmp(overlay_interfaces[i].name, name)==0)
+      return i;
+  
+  struct config_network_interface ifconfig;
+  cf_dfl_config_network_interface(&ifconfig);
+  ifconfig.socket_type = SOCK_FILE;
+  ifconfig.type = type;
+  strlcpy(ifconfig.file, "/dev/null", sizeof ifconfig.file);
+  ifconfig.dummy_address = addr;
+  // replies are discarded, but must not be rate limited or the queues will fill up
+  ifconfig.mdp.packet_interval = 1;
+  
+  struct in_addr dummyaddr = hton_in_addr(INADDR_NONE);
+  if (overlay_interface_init(name, dummyaddr, dummyaddr, dummyaddr, &ifconfig))
+    return -1;
+  return overlay_interface_count -1;
+}
+
 static void interface_read_dgram(struct overlay_interface *interface){
   int plen=0;
   unsigned char packet[8096];
@@ -719,10 +746,8 @@ static void interface_read_stream(struct overlay_interface *interface){
   }
   struct slip_decode_state *state=&interface->slip_decode_state;
   
-  int i;
-  for (i=0;i<nread;i++)
-    mavlink_decode(interface, state, buffer[i]);
-    
+  mavlink_decode(interface, state, buffer, nread);
+  
   OUT();
 }
 
@@ -1118,8 +1143,11 @@ overlay_interface_register(char *name,
   return 0;
 }
   
+static struct sched_ent *discover_alarm = NULL;
+
 void overlay_interface_discover(struct sched_ent *alarm)
 {
+  discover_alarm = alarm;
   /* Mark all UP interfaces as DETECTING, so we can tell which interfaces are new, and which are dead */
   int i;
   for (i = 0; i < overlay_interface_count; i++)
@@ -1187,6 +1215,19 @@ void overlay_interface_discover(struct sched_ent *alarm)
   return;
 }
 
+/* Called when the interfaces config has changed, to open and close interfaces straight away
+ * instead of waiting for the next periodic discovery.
+ */
+void overlay_interface_config_changed()
+{
+  if (!discover_alarm)
+    return;
+  unschedule(discover_alarm);
+  discover_alarm->alarm = gettime_ms();
+  discover_alarm->deadline = discover_alarm->alarm + 100;
+  schedule(discover_alarm);
+}
+
 void logServalPacket(int level, struct __sourceloc __whence, const char *message, const unsigned char *packet, size_t len) {
   struct mallocbuf mb = STRUCT_MALLOCBUF_NULL;
   if (!message) message="<no message>";
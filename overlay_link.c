@@ -64,6 +64,9 @@ int limit_init(struct limit_state *state, int rate_micro_seconds){
   return 0;
 }
 
+// number of times any subscriber's reachability has changed, for measuring route convergence
+unsigned reachable_changes=0;
+
 int set_reachable(struct subscriber *subscriber, 
   struct network_destination *destination, struct subscriber *next_hop){
   
@@ -80,6 +83,7 @@ int set_reachable(struct subscriber *subscriber,
   
   int old_value = subscriber->reachable;
   subscriber->reachable = reachable;
+  reachable_changes++;
   set_destination_ref(&subscriber->destination, destination);
   subscriber->next_hop = next_hop;
   
@@ -114,6 +118,8 @@ int set_reachable(struct subscriber *subscriber,
     monitor_announce_unreachable_peer(&subscriber->sid);
   if ((!(old_value & REACHABLE)) && (reachable & REACHABLE))
     monitor_announce_peer(&subscriber->sid);
+  if ((!(old_value & REACHABLE_DIRECT)) && (reachable & REACHABLE_DIRECT))
+    rhizome_sync_neighbour_up(subscriber);
   
   return 1;
 }
@@ -215,8 +221,9 @@ int overlay_send_probe(struct subscriber *peer, struct network_destination *dest
   if (destination->last_tx + destination->tick_ms > now)
     return -1;
   
-  struct overlay_frame *frame=malloc(sizeof(struct overlay_frame));
-  bzero(frame,sizeof(struct overlay_frame));
+  struct overlay_frame *frame=op_new();
+  if (!frame)
+    return -1;
   frame->type=OF_TYPE_DATA;
   frame->source = my_subscriber;
   frame->next_hop = frame->destination = peer;
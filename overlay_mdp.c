@@ -116,19 +116,150 @@ int overlay_mdp_setup_sockets()
   return 0;
 }
 
-#define MDP_MAX_BINDINGS 100
 #define MDP_MAX_SOCKET_NAME_LEN 110
 
+/* Each binding is in two hashed indexes: one by (subscriber, port) to deliver incoming frames, and
+   one by the client's socket name to release all of a client's bindings when it goes away.  Both
+   grow as bindings are added, so there is no limit on the number of bindings.
+ */
 struct mdp_binding{
+  struct mdp_binding *_port_next;
+  struct mdp_binding *_client_next;
   struct subscriber *subscriber;
   mdp_port_t port;
   char socket_name[MDP_MAX_SOCKET_NAME_LEN];
-  int name_len;
+  size_t name_len;
   time_ms_t binding_time;
 };
 
-struct mdp_binding mdp_bindings[MDP_MAX_BINDINGS];
-int mdp_bindings_initialised=0;
+#define MDP_BINDING_MIN_BUCKETS 16
+
+static struct mdp_binding **mdp_port_index = NULL;
+static struct mdp_binding **mdp_client_index = NULL;
+static unsigned mdp_binding_buckets = 0;
+static unsigned mdp_binding_count = 0;
+
+static unsigned mdp_port_hash(const struct subscriber *subscriber, mdp_port_t port)
+{
+  uintptr_t h = (uintptr_t)subscriber;
+  return (unsigned)(h ^ (h >> 7) ^ (h >> 17)) * 31 + port;
+}
+
+static unsigned mdp_client_hash(const char *name, size_t len)
+{
+  // FNV-1a
+  unsigned h = 2166136261u;
+  while (len--)
+    h = (h ^ (unsigned char)*name++) * 16777619u;
+  return h;
+}
+
+static struct mdp_binding **mdp_port_bucket(const struct subscriber *subscriber, mdp_port_t port)
+{
+  return &mdp_port_index[mdp_port_hash(subscriber, port) % mdp_binding_buckets];
+}
+
+static struct mdp_binding **mdp_client_bucket(const char *name, size_t len)
+{
+  return &mdp_client_index[mdp_client_hash(name, len) % mdp_binding_buckets];
+}
+
+static struct mdp_binding *mdp_binding_find(const struct subscriber *subscriber, mdp_port_t port)
+{
+  if (!mdp_binding_buckets)
+    return NULL;
+  struct mdp_binding *b;
+  for (b = *mdp_port_bucket(subscriber, port); b; b = b->_port_next)
+    if (b->port == port && b->subscriber == subscriber)
+      return b;
+  return NULL;
+}
+
+static int mdp_binding_owned_by(const struct mdp_binding *b, const char *name, size_t len)
+{
+  return b->name_len == len && memcmp(b->socket_name, name, len) == 0;
+}
+
+static void mdp_client_link(struct mdp_binding *b)
+{
+  struct mdp_binding **bucket = mdp_client_bucket(b->socket_name, b->name_len);
+  b->_client_next = *bucket;
+  *bucket = b;
+}
+
+static void mdp_client_unlink(struct mdp_binding *b)
+{
+  struct mdp_binding **ptr = mdp_client_bucket(b->socket_name, b->name_len);
+  while (*ptr != b)
+    ptr = &(*ptr)->_client_next;
+  *ptr = b->_client_next;
+}
+
+static void mdp_port_unlink(struct mdp_binding *b)
+{
+  struct mdp_binding **ptr = mdp_port_bucket(b->subscriber, b->port);
+  while (*ptr != b)
+    ptr = &(*ptr)->_port_next;
+  *ptr = b->_port_next;
+}
+
+/* Double the number of buckets once there are as many bindings as buckets, so that chains stay
+   short.  If memory runs out, the indexes keep working at their old size.
+ */
+static int mdp_binding_grow()
+{
+  unsigned buckets = mdp_binding_buckets ? mdp_binding_buckets * 2 : MDP_BINDING_MIN_BUCKETS;
+  struct mdp_binding **port_index = emalloc_zero(buckets * sizeof *port_index);
+  if (!port_index)
+    return -1;
+  struct mdp_binding **client_index = emalloc_zero(buckets * sizeof *client_index);
+  if (!client_index) {
+    free(port_index);
+    return -1;
+  }
+  unsigned i;
+  for (i = 0; i < mdp_binding_buckets; ++i) {
+    struct mdp_binding *b;
+    while ((b = mdp_port_index[i])) {
+      mdp_port_index[i] = b->_port_next;
+      struct mdp_binding **bucket = &port_index[mdp_port_hash(b->subscriber, b->port) % buckets];
+      b->_port_next = *bucket;
+      *bucket = b;
+      bucket = &client_index[mdp_client_hash(b->socket_name, b->name_len) % buckets];
+      b->_client_next = *bucket;
+      *bucket = b;
+    }
+  }
+  if (mdp_port_index)
+    free(mdp_port_index);
+  if (mdp_client_index)
+    free(mdp_client_index);
+  mdp_port_index = port_index;
+  mdp_client_index = client_index;
+  mdp_binding_buckets = buckets;
+  if (config.debug.mdprequests)
+    DEBUGF("Resized MDP binding table to %u buckets for %u bindings", buckets, mdp_binding_count);
+  return 0;
+}
+
+/* Find the binding that should receive a frame sent to the given port.  A binding to the
+   destination itself is preferred to an "ANY" binding.  Broadcasts go to the "ANY" binding, or
+   failing that, to any binding of the port, which takes a scan of the whole table.
+ */
+static struct mdp_binding *mdp_binding_deliver_to(const struct subscriber *destination, mdp_port_t port)
+{
+  struct mdp_binding *b = NULL;
+  if (destination && (b = mdp_binding_find(destination, port)))
+    return b;
+  if ((b = mdp_binding_find(NULL, port)) || destination || !mdp_binding_buckets)
+    return b;
+  unsigned i;
+  for (i = 0; i < mdp_binding_buckets; ++i)
+    for (b = mdp_port_index[i]; b; b = b->_port_next)
+      if (b->port == port)
+	return b;
+  return NULL;
+}
 
 int overlay_mdp_reply_error(int sock,
 			    struct sockaddr_un *recvaddr, socklen_t recvaddrlen,
@@ -179,14 +310,21 @@ int overlay_mdp_reply_ok(int sock,
 int overlay_mdp_releasebindings(struct sockaddr_un *recvaddr, socklen_t recvaddrlen)
 {
   /* Free up any MDP bindings held by this client. */
-  int i;
-  for(i=0;i<MDP_MAX_BINDINGS;i++)
-    if (mdp_bindings[i].name_len==recvaddrlen)
-      if (!memcmp(mdp_bindings[i].socket_name,recvaddr->sun_path,recvaddrlen))
-	mdp_bindings[i].port=0;
-
+  if (!mdp_binding_buckets || recvaddrlen <= sizeof recvaddr->sun_family)
+    return 0;
+  size_t name_len = recvaddrlen - sizeof recvaddr->sun_family;
+  struct mdp_binding **ptr = mdp_client_bucket(recvaddr->sun_path, name_len);
+  while (*ptr) {
+    struct mdp_binding *b = *ptr;
+    if (mdp_binding_owned_by(b, recvaddr->sun_path, name_len)) {
+      *ptr = b->_client_next;
+      mdp_port_unlink(b);
+      mdp_binding_count--;
+      free(b);
+    } else
+      ptr = &b->_client_next;
+  }
   return 0;
-
 }
 
 int overlay_mdp_process_bind_request(int sock, struct subscriber *subscriber, mdp_port_t port,
@@ -198,62 +336,44 @@ int overlay_mdp_process_bind_request(int sock, struct subscriber *subscriber, md
   if (port == 0){
     return WHYF("Port %d cannot be bound", port);
   }
-  if (!mdp_bindings_initialised) {
-    /* Mark all slots as unused */
-    int i;
-    for(i=0;i<MDP_MAX_BINDINGS;i++)
-      mdp_bindings[i].port=0;
-    mdp_bindings_initialised=1;
-  }
+  if (recvaddrlen <= sizeof recvaddr->sun_family
+      || recvaddrlen - sizeof recvaddr->sun_family > MDP_MAX_SOCKET_NAME_LEN)
+    return WHYF("Invalid client socket address length %d", (int)recvaddrlen);
+  size_t name_len = recvaddrlen - sizeof recvaddr->sun_family;
 
   /* See if binding already exists */
-  int free=-1;
-  {
-    int i;
-    for(i=0;i<MDP_MAX_BINDINGS;i++) {
-      /* Look for duplicate bindings */
-      if (mdp_bindings[i].port == port && mdp_bindings[i].subscriber == subscriber) {
-	if (mdp_bindings[i].name_len==recvaddrlen &&
-	    !memcmp(mdp_bindings[i].socket_name,recvaddr->sun_path,recvaddrlen)) {
-	  // this client already owns this port binding?
-	  INFO("Identical binding exists");
-	  return 0;
-	}else if(flags&MDP_FORCE){
-	  // steal the port binding
-	  free=i;
-	  break;
-	}else{
-	  return WHY("Port already in use");
-	}
-      }
-      /* Look for free slots in case we need one */
-      if ((free==-1)&&(mdp_bindings[i].port==0)) free=i;
+  struct mdp_binding *b = mdp_binding_find(subscriber, port);
+  if (b) {
+    if (mdp_binding_owned_by(b, recvaddr->sun_path, name_len)) {
+      // this client already owns this port binding?
+      INFO("Identical binding exists");
+      return 0;
     }
-  }
- 
-  /* Okay, so no binding exists.  Make one, and return success.
-     If we have too many bindings, we should return an error.
-     XXX - We don't find out when the socket responsible for a binding has died,
-     so stale bindings can hang around.  We really need a solution to this, e.g., 
-     probing the sockets periodically (by sending an MDP NOOP frame perhaps?) and
-     destroying any socket that reports an error.
-  */
-  if (free==-1) {
-    /* XXX Should we probe for stale bindings here and now, since this is when
-       we want the spare slots ?
-
-       Picking one at random is as good a policy as any.
-       Call listeners don't have a port binding, so are unaffected by this.
+    if (!(flags&MDP_FORCE))
+      return WHY("Port already in use");
+    // steal the port binding
+    mdp_client_unlink(b);
+  } else {
+    /* Okay, so no binding exists.  Make one, and return success.
+       XXX - We don't find out when the socket responsible for a binding has died until we fail to
+       deliver a frame to it, so stale bindings can hang around until then.
     */
-    free=random()%MDP_MAX_BINDINGS;
+    if (mdp_binding_count >= mdp_binding_buckets && mdp_binding_grow() == -1 && !mdp_binding_buckets)
+      return WHY("Cannot allocate MDP binding table");
+    if ((b = emalloc_zero(sizeof *b)) == NULL)
+      return -1;
+    b->port=port;
+    b->subscriber=subscriber;
+    struct mdp_binding **bucket = mdp_port_bucket(subscriber, port);
+    b->_port_next = *bucket;
+    *bucket = b;
+    mdp_binding_count++;
   }
   /* Okay, record binding and report success */
-  mdp_bindings[free].port=port;
-  mdp_bindings[free].subscriber=subscriber;
-  
-  mdp_bindings[free].name_len = recvaddrlen - sizeof recvaddr->sun_family;
-  memcpy(mdp_bindings[free].socket_name, recvaddr->sun_path, mdp_bindings[free].name_len);
-  mdp_bindings[free].binding_time=gettime_ms();
+  b->name_len = name_len;
+  memcpy(b->socket_name, recvaddr->sun_path, name_len);
+  b->binding_time=gettime_ms();
+  mdp_client_link(b);
   return 0;
 }
 
@@ -398,8 +518,7 @@ int overlay_mdp_swap_src_dst(overlay_mdp_frame *mdp)
 static int overlay_saw_mdp_frame(struct overlay_frame *frame, overlay_mdp_frame *mdp, time_ms_t now)
 {
   IN();
-  int i;
-  int match=-1;
+  struct mdp_binding *match;
 
   switch(mdp->packetTypeAndFlags&MDP_TYPE_MASK) {
   case MDP_TX: 
@@ -422,40 +541,27 @@ static int overlay_saw_mdp_frame(struct overlay_frame *frame, overlay_mdp_frame
       destination = find_subscriber(mdp->out.dst.sid.binary, SID_SIZE, 1);
     }
     
-    for(i=0;i<MDP_MAX_BINDINGS;i++)
-      {
-	if (mdp_bindings[i].port!=mdp->out.dst.port)
-	  continue;
-	
-	if ((!destination) || mdp_bindings[i].subscriber == destination){
-	  /* exact match, so stop searching */
-	  match=i;
-	  break;
-	}else if (!mdp_bindings[i].subscriber){
-	  /* If we find an "ANY" binding, remember it. But we will prefer an exact match if we find one */
-	  match=i;
-	}
-      }
+    match = mdp_binding_deliver_to(destination, mdp->out.dst.port);
     
-    if (match>-1) {
+    if (match) {
       struct sockaddr_un addr;
       addr.sun_family = AF_UNIX;
-      bcopy(mdp_bindings[match].socket_name, addr.sun_path, mdp_bindings[match].name_len);
+      bcopy(match->socket_name, addr.sun_path, match->name_len);
       ssize_t len = overlay_mdp_relevant_bytes(mdp);
       if (len == -1)
 	RETURN(WHY("unsupported MDP packet type"));
-      socklen_t addrlen = sizeof addr.sun_family + mdp_bindings[match].name_len;
+      socklen_t addrlen = sizeof addr.sun_family + match->name_len;
       if (config.debug.mdprequests)
 	DEBUGF("Resolved bound socket on port %"PRImdp_port_t", addr=%s",
-	    mdp_bindings[match].port, alloca_sockaddr(&addr, addrlen));
+	    match->port, alloca_sockaddr(&addr, addrlen));
       ssize_t r = sendto(mdp_sock.poll.fd, mdp, (size_t)len, 0, (struct sockaddr*)&addr, addrlen);
       if ((size_t)r != (size_t)len) {
 	if (r == -1) {
 	  WHYF_perror("sendto(fd=%d,len=%zu,addr=%s)", mdp_sock.poll.fd, (size_t)len, alloca_sockaddr(&addr, addrlen));
 	  if (errno == ENOENT) {
 	    /* far-end of socket has died, so drop binding */
-	    INFOF("Closing dead MDP client '%s'",mdp_bindings[match].socket_name);
-	    overlay_mdp_releasebindings(&addr,mdp_bindings[match].name_len);
+	    INFOF("Closing dead MDP client %s", alloca_sockaddr(&addr, addrlen));
+	    overlay_mdp_releasebindings(&addr, addrlen);
 	  }
 	} else
 	  WHYF("sendto() sent %zu bytes of MDP frame (%zu) to client, socket=%d", (size_t)r, (size_t)len, mdp_sock.poll.fd); 
@@ -514,19 +620,14 @@ int overlay_mdp_check_binding(struct subscriber *subscriber, mdp_port_t port, in
   /* Check if the address is in the list of bound addresses,
      and that the recvaddr matches. */
   
-  int i;
-  for(i = 0; i < MDP_MAX_BINDINGS; ++i) {
-    if (mdp_bindings[i].port != port)
-      continue;
-    if ((!mdp_bindings[i].subscriber) || mdp_bindings[i].subscriber == subscriber) {
-      /* Binding matches, now make sure the sockets match */
-      if (  mdp_bindings[i].name_len == recvaddrlen - sizeof(sa_family_t)
-	&&  memcmp(mdp_bindings[i].socket_name, recvaddr->sun_path, recvaddrlen - sizeof(sa_family_t)) == 0
-      ) {
-	/* Everything matches, so this unix socket and MDP address combination is valid */
-	return 0;
-      }
-    }
+  if (recvaddr && recvaddrlen > sizeof(sa_family_t)) {
+    size_t name_len = recvaddrlen - sizeof(sa_family_t);
+    struct mdp_binding *b = mdp_binding_find(subscriber, port);
+    if (!(b && mdp_binding_owned_by(b, recvaddr->sun_path, name_len)))
+      b = mdp_binding_find(NULL, port);
+    /* Everything matches, so this unix socket and MDP address combination is valid */
+    if (b && mdp_binding_owned_by(b, recvaddr->sun_path, name_len))
+      return 0;
   }
 
   return WHYF("No such binding: recvaddr=%p %s addr=%s port=%"PRImdp_port_t" -- possible spoofing attack",
@@ -824,7 +925,7 @@ int overlay_mdp_dispatch(overlay_mdp_frame *mdp,int userGeneratedFrameP,
   }
   
   /* Prepare the overlay frame for dispatch */
-  struct overlay_frame *frame = emalloc_zero(sizeof(struct overlay_frame));
+  struct overlay_frame *frame = op_new();
   if (!frame){
     ob_free(plaintext);
     RETURN(-1);
@@ -1223,6 +1324,43 @@ static void overlay_mdp_poll(struct sched_ent *alarm)
 	  }
 	  return;
 	
+	case MDP_STATS:
+	  if (config.debug.mdprequests)
+	    DEBUGF("MDP_STATS offset %u from %s", mdp->stats.offset, alloca_sockaddr(recvaddr, recvaddrlen));
+	  {
+	    // keep the snapshot, so every page comes from the same document
+	    static char *json = NULL;
+	    static size_t len = 0;
+	    if (mdp->stats.offset == 0 || !json){
+	      if (json)
+		free(json);
+	      if (!(json = fd_stats_json(&len))){
+		overlay_mdp_reply_error(alarm->poll.fd, recvaddr_un, recvaddrlen, 5, "Failed to generate stats");
+		return;
+	      }
+	    }
+	    // send the next page of the document, followed by an ok once it has all been sent
+	    overlay_mdp_frame reply;
+	    bzero(&reply, sizeof(overlay_mdp_frame));
+	    reply.packetTypeAndFlags=MDP_TX;
+	    size_t ofs = mdp->stats.offset;
+	    unsigned frames;
+	    for (frames=0; frames<MDP_STATS_PAGE_FRAMES && ofs<len; frames++, ofs+=reply.out.payload_length){
+	      reply.out.payload_length = len - ofs;
+	      if (reply.out.payload_length > sizeof reply.out.payload)
+		reply.out.payload_length = sizeof reply.out.payload;
+	      bcopy(json + ofs, reply.out.payload, reply.out.payload_length);
+	      if (overlay_mdp_reply(alarm->poll.fd, recvaddr_un, recvaddrlen, &reply))
+		return;
+	    }
+	    if (ofs>=len){
+	      free(json);
+	      json = NULL;
+	      overlay_mdp_reply_ok(alarm->poll.fd, recvaddr_un, recvaddrlen, "Stats sent");
+	    }
+	  }
+	  return;
+
 	case MDP_GETADDRS:
 	  if (config.debug.mdprequests)
 	    DEBUGF("MDP_GETADDRS from %s", alloca_sockaddr(recvaddr, recvaddrlen));
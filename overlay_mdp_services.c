@@ -30,28 +30,51 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "log.h"
 #include "keyring.h"
 
-int rhizome_mdp_send_block(struct subscriber *dest, const rhizome_bid_t *bid, uint64_t version, uint64_t fileOffset, uint32_t bitmap, uint16_t blockLength)
+/* Return true if one of the ranges in a block request, each a 32 bit offset from the start of the
+ * request and a 32 bit length, covers the given range.
+ */
+int rhizome_mdp_range_held(const unsigned char *ranges, unsigned count, uint64_t start, uint64_t length)
+{
+  unsigned i;
+  for (i = 0; i < count; ++i, ranges += RHIZOME_MDP_RANGE_BYTES) {
+    uint64_t offset = read_uint32(ranges);
+    if (offset <= start && offset + read_uint32(ranges + 4) >= start + length)
+      return 1;
+  }
+  return 0;
+}
+
+// blocks sent with proofs, counted while debug.rhizome_mdp_tamper is set
+static unsigned tampered_count = 0;
+
+/* Send up to window blocks starting at fileOffset, skipping those marked in the bitmap (the first
+ * 32 blocks only) or covered by the ranges the requester already holds.
+ */
+int rhizome_mdp_send_block(struct subscriber *dest, const rhizome_bid_t *bid, uint64_t version, uint64_t fileOffset, uint32_t bitmap, uint16_t blockLength,
+			   int merkle, unsigned window, const unsigned char *ranges, unsigned nranges)
 {
   IN();
   if (!is_rhizome_mdp_server_running())
     RETURN(-1);
-  if (blockLength<=0 || blockLength>1024)
+  if (blockLength<=0 || blockLength>RHIZOME_MDP_MAX_BLOCK_SIZE)
     RETURN(WHYF("Invalid block length %d", blockLength));
 
   if (config.debug.rhizome_tx)
-    DEBUGF("Requested blocks for %s @%"PRIx64" bitmap %x", alloca_tohex_rhizome_bid_t(*bid), fileOffset, bitmap);
+    DEBUGF("Requested %u blocks of %u for %s @%"PRIx64" bitmap %x, %u ranges held%s", window, blockLength,
+	   alloca_tohex_rhizome_bid_t(*bid), fileOffset, bitmap, nranges, merkle ? " with proofs" : "");
+  
+  // Blocks can only be proved if they are whole blocks of the payload's Merkle tree
+  if (merkle && (blockLength != RHIZOME_MERKLE_BLOCK_SIZE || fileOffset % RHIZOME_MERKLE_BLOCK_SIZE))
+    merkle = 0;
     
   overlay_mdp_frame reply;
   bzero(&reply,sizeof(reply));
   // Reply is broadcast, so we cannot authcrypt, and signing is too time consuming
-  // for low devices.  The result is that an attacker can prevent rhizome transfers
-  // if they want to by injecting fake blocks.  The alternative is to not broadcast
-  // back replies, and then we can authcrypt.
-  // multiple receivers starting at different times, we really need merkle-tree hashing.
-  // so multiple receivers is not realistic for now.  So use non-broadcast unicode
-  // for now would seem the safest.  But that would stop us from allowing multiple
-  // receivers in the special case where additional nodes begin listening in from the
-  // beginning.
+  // for low devices.  Without a proof, an attacker can prevent rhizome transfers
+  // by injecting fake blocks, which are only detected when the whole payload is hashed.
+  // If the receiver knows the payload's Merkle root from its manifest, it asks for
+  // 'M' blocks, which carry the sibling hashes that prove each block on arrival.
+  // Any number of receivers can then safely accept the same broadcast blocks.
   reply.packetTypeAndFlags=MDP_TX|MDP_NOCRYPT|MDP_NOSIGN;
   reply.out.src.sid = my_subscriber->sid;
   reply.out.src.port=MDP_PORT_RHIZOME_RESPONSE;
@@ -61,46 +84,69 @@ int rhizome_mdp_send_block(struct subscriber *dest, const rhizome_bid_t *bid, ui
     reply.out.dst.sid = dest->sid;
   }else{
     // send replies to broadcast so that others can hear blocks and record them
-    // (not that preemptive listening is implemented yet).
+    // for bundles they have queued to fetch.
     reply.out.dst.sid = SID_BROADCAST;
     reply.out.ttl=1;
   }
   
   reply.out.dst.port=MDP_PORT_RHIZOME_RESPONSE;
   reply.out.queue=OQ_OPPORTUNISTIC;
-  reply.out.payload[0]='B'; // reply contains blocks
+  reply.out.payload[0]=merkle?'M':'B'; // reply contains blocks
   // include 16 bytes of BID prefix for identification
   bcopy(bid->binary, &reply.out.payload[1], 16);
   // and version of manifest (in the correct byte order)
   //  bcopy(&version, &reply.out.payload[1+16], sizeof(uint64_t));
   write_uint64(&reply.out.payload[1+16],version);
   
-  int i;
-  for(i=0;i<32;i++){
-    if (bitmap&(1<<(31-i)))
+  unsigned i, sent;
+  for(i=0, sent=0; sent<window && i<0x10000; i++){
+    if (i<32 && bitmap&(1<<(31-i)))
+      continue;
+    if (rhizome_mdp_range_held(ranges, nranges, (uint64_t)i*blockLength, blockLength))
       continue;
     
     if (overlay_queue_remaining(reply.out.queue) < 10)
       break;
     
     // calculate and set offset of block
-    uint64_t offset = fileOffset+i*blockLength;
+    uint64_t offset = fileOffset+(uint64_t)i*blockLength;
     
     write_uint64(&reply.out.payload[1+16+8], offset);
     
-    int bytes_read = rhizome_read_cached(bid, version, gettime_ms()+5000, offset, &reply.out.payload[1+16+8+8], blockLength);
-    if (bytes_read<=0)
-      break;
-    
-    reply.out.payload_length=1+16+8+8+bytes_read;
-    
-    // Mark the last block of the file, if required
-    if (bytes_read < blockLength)
-      reply.out.payload[0]='T';
+    if (merkle){
+      // 'M' blocks have the number of proof hashes and the hashes before the data
+      unsigned char *data = &reply.out.payload[1+16+8+8+1];
+      size_t room = sizeof reply.out.payload - (1+16+8+8+1) - blockLength;
+      int bytes_read = rhizome_read_cached(bid, version, gettime_ms()+5000, offset, data + room, blockLength);
+      if (bytes_read<=0)
+	break;
+      ssize_t proof_length = rhizome_read_cached_proof(bid, version, offset, data, room);
+      if (proof_length == -1)
+	break;
+      bcopy(data + room, data + proof_length, bytes_read);
+      if (config.debug.rhizome_mdp_tamper && ++tampered_count % config.debug.rhizome_mdp_tamper == 0){
+	if (config.debug.rhizome_tx)
+	  DEBUGF("Corrupting block at offset %"PRIu64" of %s", offset, alloca_tohex_rhizome_bid_t(*bid));
+	data[proof_length] ^= 0xFF;
+      }
+      reply.out.payload[1+16+8+8] = proof_length / RHIZOME_MERKLE_HASH_BYTES;
+      reply.out.payload_length=1+16+8+8+1+proof_length+bytes_read;
+    }else{
+      int bytes_read = rhizome_read_cached(bid, version, gettime_ms()+5000, offset, &reply.out.payload[1+16+8+8], blockLength);
+      if (bytes_read<=0)
+	break;
+      
+      reply.out.payload_length=1+16+8+8+bytes_read;
+      
+      // Mark the last block of the file, if required
+      if (bytes_read < blockLength)
+	reply.out.payload[0]='T';
+    }
     
     // send packet
     if (overlay_mdp_dispatch(&reply,0 /* system generated */, NULL,0))
       break;
+    sent++;
   }
 
   RETURN(0);
@@ -110,11 +156,33 @@ int rhizome_mdp_send_block(struct subscriber *dest, const rhizome_bid_t *bid, ui
 int overlay_mdp_service_rhizomerequest(struct overlay_frame *frame, overlay_mdp_frame *mdp)
 {
   const rhizome_bid_t *bidp = (const rhizome_bid_t *) &mdp->out.payload[0];
+  const size_t base = sizeof bidp->binary + 8 + 8 + 4 + 2;
+  if (mdp->out.payload_length < base)
+    return WHYF("Payload too short");
   uint64_t version = read_uint64(&mdp->out.payload[sizeof bidp->binary]);
   uint64_t fileOffset = read_uint64(&mdp->out.payload[sizeof bidp->binary + 8]);
   uint32_t bitmap = read_uint32(&mdp->out.payload[sizeof bidp->binary + 8 + 8]);
   uint16_t blockLength = read_uint16(&mdp->out.payload[sizeof bidp->binary + 8 + 8 + 4]);
-  return rhizome_mdp_send_block(frame->source, bidp, version, fileOffset, bitmap, blockLength);
+  // newer requesters append a flags byte
+  unsigned char flags = mdp->out.payload_length > base ? mdp->out.payload[base] : 0;
+  // and may follow it with the number of blocks they want and the ranges they already hold
+  unsigned window = 32;
+  const unsigned char *ranges = NULL;
+  unsigned nranges = 0;
+  if (flags & RHIZOME_MDP_REQUEST_WINDOW) {
+    if (mdp->out.payload_length < base + 1 + 2 + 1)
+      return WHYF("Payload too short");
+    window = read_uint16(&mdp->out.payload[base + 1]);
+    // the requester is not authenticated, so don't let it make us flood the network
+    if (window > config.rhizome.mdp.window_max)
+      window = config.rhizome.mdp.window_max;
+    nranges = mdp->out.payload[base + 3];
+    ranges = &mdp->out.payload[base + 4];
+    if (mdp->out.payload_length < base + 4 + nranges * RHIZOME_MDP_RANGE_BYTES)
+      return WHYF("Payload too short");
+  }
+  return rhizome_mdp_send_block(frame->source, bidp, version, fileOffset, bitmap, blockLength,
+				flags & RHIZOME_MDP_REQUEST_MERKLE, window, ranges, nranges);
 }
 
 int overlay_mdp_service_rhizomeresponse(overlay_mdp_frame *mdp)
@@ -157,6 +225,29 @@ int overlay_mdp_service_rhizomeresponse(overlay_mdp_frame *mdp)
       RETURN(0);
     }
     break;
+  case 'M': /* data block with Merkle proof */
+    {
+      if (mdp->out.payload_length<(1+16+8+8+1+1))
+	RETURN(WHYF("Payload too short"));
+      unsigned char *bidprefix=&mdp->out.payload[1];
+      uint64_t version=read_uint64(&mdp->out.payload[1+16]);
+      uint64_t offset=read_uint64(&mdp->out.payload[1+16+8]);
+      size_t proof_length = mdp->out.payload[1+16+8+8] * RHIZOME_MERKLE_HASH_BYTES;
+      if (mdp->out.payload_length <= 1+16+8+8+1+proof_length)
+	RETURN(WHYF("Payload too short"));
+      unsigned char *proof=&mdp->out.payload[1+16+8+8+1];
+      size_t count = mdp->out.payload_length-(1+16+8+8+1+proof_length);
+      unsigned char *bytes=proof+proof_length;
+
+      if (config.debug.rhizome_mdp_rx)
+	DEBUGF("bidprefix=%02x%02x%02x%02x*, offset=%"PRId64", count=%zu, proof=%zu",
+	       bidprefix[0],bidprefix[1],bidprefix[2],bidprefix[3],offset,count,proof_length);
+
+      rhizome_received_verified_content(bidprefix, version, offset, count, bytes, proof, proof_length);
+
+      RETURN(0);
+    }
+    break;
   }
 
   RETURN(-1);
@@ -360,7 +451,7 @@ static int overlay_mdp_service_manifest_requests(struct overlay_frame *frame, ov
       rhizome_advertise_manifest(frame->source, m);
       // pre-emptively send the payload if it will fit in a single packet
       if (m->filesize > 0 && m->filesize <= 1024)
-	rhizome_mdp_send_block(frame->source, &m->cryptoSignPublic, m->version, 0, 0, m->filesize);
+	rhizome_mdp_send_block(frame->source, &m->cryptoSignPublic, m->version, 0, 0, m->filesize, 0, 1, NULL, 0);
     }
     rhizome_manifest_free(m);
     offset+=RHIZOME_BAR_BYTES;
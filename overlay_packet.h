@@ -99,6 +99,7 @@ struct overlay_frame {
 };
 
 
+struct overlay_frame *op_new();
 int op_free(struct overlay_frame *p);
 struct overlay_frame *op_dup(struct overlay_frame *f);
 
@@ -388,6 +388,9 @@ int packetOkOverlay(struct overlay_interface *interface,unsigned char *packet, s
   if (recvaddr&&recvaddr->sa_family!=AF_INET)
     RETURN(WHYF("Unexpected protocol family %d",recvaddr->sa_family));
   
+  if (config.server.capture_file[0])
+    overlay_trace_capture(interface, packet, len, recvttl, recvaddr, recvaddrlen);
+  
   struct overlay_frame f;
   struct decode_context context;
   bzero(&context, sizeof context);
@@ -20,6 +20,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "serval.h"
 #include "conf.h"
 #include "str.h"
+#include "mem.h"
 #include "overlay_buffer.h"
 #include "overlay_packet.h"
 
@@ -123,6 +124,14 @@ cleanup:
   return -1;
 }
 
+static struct mem_pool frame_pool = MEM_POOL("overlay_frame", sizeof(struct overlay_frame), 128);
+
+// allocate a zero filled frame
+struct overlay_frame *op_new()
+{
+  return pool_alloc_zero(&frame_pool);
+}
+
 int op_free(struct overlay_frame *p)
 {
   if (!p) return WHY("Asked to free NULL");
@@ -132,7 +141,7 @@ int op_free(struct overlay_frame *p)
   p->next=NULL;
   if (p->payload) ob_free(p->payload);
   p->payload=NULL;
-  free(p);
+  pool_release(&frame_pool, p);
   return 0;
 }
 
@@ -141,7 +150,7 @@ struct overlay_frame *op_dup(struct overlay_frame *in)
   if (!in) return NULL;
 
   /* clone the frame */
-  struct overlay_frame *out = emalloc(sizeof(struct overlay_frame));
+  struct overlay_frame *out = pool_alloc(&frame_pool);
   if (out == NULL)
     return NULL;
 
@@ -150,7 +159,7 @@ struct overlay_frame *op_dup(struct overlay_frame *in)
 
   if (in->payload) {
     if ((out->payload = ob_dup(in->payload)) == NULL) {
-      free(out);
+      pool_release(&frame_pool, out);
       return NULL;
     }
   }
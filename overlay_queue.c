@@ -34,6 +34,11 @@ typedef struct overlay_txqueue {
   /* Latency target in ms for this traffic class.
    Frames older than the latency target will get dropped. */
   int latencyTarget;
+  /* Frames accepted, refused because the queue was full, and dropped after
+   sitting in the queue for longer than the latency target */
+  unsigned enqueued;
+  unsigned congested;
+  unsigned expired;
 } overlay_txqueue;
 
 overlay_txqueue overlay_tx[OQ_MAX];
@@ -141,6 +146,22 @@ int overlay_queue_remaining(int queue){
   return overlay_tx[queue].maxLength - overlay_tx[queue].length;
 }
 
+void overlay_queue_stats_json(strbuf b)
+{
+  int i;
+  strbuf_puts(b, "[");
+  for (i=0;i<OQ_MAX;i++){
+    overlay_txqueue *queue = &overlay_tx[i];
+    if (i)
+      strbuf_puts(b, ",");
+    strbuf_sprintf(b, "\n{\"queue\":%d,\"length\":%d,\"max_length\":%d,\"latency_target_ms\":%d,"
+		   "\"enqueued\":%u,\"congested\":%u,\"expired\":%u}",
+		   i, queue->length, queue->maxLength, queue->latencyTarget,
+		   queue->enqueued, queue->congested, queue->expired);
+  }
+  strbuf_puts(b, "]");
+}
+
 int overlay_payload_enqueue(struct overlay_frame *p)
 {
   /* Add payload p to queue q.
@@ -167,8 +188,10 @@ int overlay_payload_enqueue(struct overlay_frame *p)
   if (ob_position(p->payload) >= MDP_MTU)
     FATAL("Queued packet is too big");
 
-  if (queue->length>=queue->maxLength) 
+  if (queue->length>=queue->maxLength){
+    queue->congested++;
     return WHYF("Queue #%d congested (size = %d)",p->queue,queue->maxLength);
+  }
     
   // it should be safe to try sending all packets with an mdp sequence
   if (p->packet_version<=0)
@@ -215,6 +238,7 @@ int overlay_payload_enqueue(struct overlay_frame *p)
   queue->last=p;
   if (!queue->first) queue->first=p;
   queue->length++;
+  queue->enqueued++;
   if (p->queue==OQ_ISOCHRONOUS_VOICE)
     rhizome_saw_voice_traffic();
   
@@ -336,6 +360,7 @@ overlay_stuff_packet(struct outgoing_packet *packet, overlay_txqueue *queue, tim
 	DEBUGF("Dropping frame type %x (length %d) for %s due to expiry timeout", 
 	       frame->type, frame->payload->checkpointLength,
 	       frame->destination?alloca_tohex_sid_t(frame->destination->sid):"All");
+      queue->expired++;
       frame = overlay_queue_remove(queue, frame);
       continue;
     }
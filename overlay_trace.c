@@ -0,0 +1,326 @@
+/*
+Copyright (C) 2013 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  Capture and replay of received overlay packets.
+
+  When server.capture_file is set, every packet passed to packetOkOverlay() is appended to that
+  file, along with the time it arrived and the interface it arrived on.
+
+  "servald trace replay" feeds a captured file back through packetOkOverlay() in a fresh process,
+  using the same keyring and rhizome store as the instance that captured it. Packets can be replayed
+  as fast as possible, or scaled relative to the time they were originally received.
+  Outgoing packets are discarded.
+
+  Each record is stored in host byte order, so a trace should be replayed on the same architecture;
+
+  struct trace_record, followed by payload_length bytes of packet
+ */
+
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "serval.h"
+#include "conf.h"
+#include "log.h"
+#include "str.h"
+#include "strbuf.h"
+#include "strbuf_helpers.h"
+#include "strlcpy.h"
+#include "keyring.h"
+#include "overlay_address.h"
+
+#define TRACE_MAGIC 0x53545243 // "STRC"
+
+struct trace_record{
+  uint32_t magic;
+  uint32_t payload_length;
+  int64_t time_ms;
+  char interface[64];
+  int32_t interface_type;
+  int32_t recvttl;
+  struct sockaddr_in interface_addr;
+  struct sockaddr_in recvaddr;
+};
+
+static FILE *capture_file=NULL;
+static char capture_path[1024];
+// never capture the packets we are replaying
+static int replaying=0;
+
+static int trace_capture_path(char *path, size_t len)
+{
+  strbuf b = strbuf_local(path, len);
+  strbuf_path_join(b, serval_instancepath(), config.server.capture_file, NULL);
+  if (strbuf_overrun(b))
+    return WHYF("capture file name overrun: %s", alloca_str_toprint(strbuf_str(b)));
+  return 0;
+}
+
+static void trace_capture_close()
+{
+  if (capture_file){
+    fclose(capture_file);
+    capture_file=NULL;
+  }
+}
+
+// The path is only built when the file is opened, so once open this costs nothing per packet
+static FILE *trace_capture_open()
+{
+  if (capture_file)
+    return capture_file;
+  if (trace_capture_path(capture_path, sizeof capture_path)==-1)
+    return NULL;
+  if ((capture_file = fopen(capture_path, "a")) == NULL){
+    WHYF_perror("fopen(%s, \"a\")", alloca_str_toprint(capture_path));
+    return NULL;
+  }
+  INFOF("Capturing received packets to %s", capture_path);
+  return capture_file;
+}
+
+/* Called by the server when the server section of the config is reloaded, since packets are only
+ * passed to overlay_trace_capture() while server.capture_file is set, and the file is kept open
+ * until it is removed or renamed.
+ */
+void overlay_trace_config_changed()
+{
+  if (!capture_file)
+    return;
+  // if the file was renamed, the next packet opens the new one
+  char path[1024];
+  if (!config.server.capture_file[0]
+    || trace_capture_path(path, sizeof path)==-1
+    || strcmp(path, capture_path)!=0){
+    INFOF("Stopped capturing received packets to %s", capture_path);
+    trace_capture_close();
+  }
+}
+
+void overlay_trace_capture(struct overlay_interface *interface, const unsigned char *packet, size_t len,
+			   int recvttl, struct sockaddr *recvaddr, socklen_t recvaddrlen)
+{
+  if (replaying || !config.server.capture_file[0]){
+    trace_capture_close();
+    return;
+  }
+
+  FILE *f = trace_capture_open();
+  if (!f)
+    return;
+
+  struct trace_record record;
+  bzero(&record, sizeof record);
+  record.magic = TRACE_MAGIC;
+  record.payload_length = len;
+  record.time_ms = gettime_ms();
+  strlcpy(record.interface, interface->name, sizeof record.interface);
+  record.interface_type = interface->type;
+  record.recvttl = recvttl;
+  record.interface_addr = interface->address;
+  if (recvaddr && recvaddrlen >= sizeof record.recvaddr)
+    bcopy(recvaddr, &record.recvaddr, sizeof record.recvaddr);
+
+  if (fwrite(&record, sizeof record, 1, f)!=1
+    || fwrite(packet, len, 1, f)!=1
+    || fflush(f)){
+    WHYF_perror("fwrite(%s)", alloca_str_toprint(capture_path));
+    trace_capture_close();
+  }
+}
+
+struct trace_replay{
+  struct sched_ent alarm;
+  FILE *file;
+  double speed;
+  int done;
+
+  int64_t first_time;
+  time_ms_t start_time;
+
+  struct trace_record next;
+  unsigned char payload[OVERLAY_INTERFACE_RX_BUFFER_SIZE];
+  int have_next;
+
+  unsigned packets;
+  unsigned errors;
+  uint64_t bytes;
+  unsigned reachable_changes;
+  int64_t converged_ms;
+};
+
+static int trace_read_record(struct trace_replay *replay)
+{
+  replay->have_next=0;
+  long offset = ftell(replay->file);
+  size_t got = fread(&replay->next, 1, sizeof replay->next, replay->file);
+  if (got==0 && feof(replay->file))
+    return 0;
+  if (got!=sizeof replay->next)
+    return WHYF("Trace file is truncated at offset %ld", offset);
+  if (replay->next.magic != TRACE_MAGIC)
+    return WHYF("Trace file is corrupt at offset %ld, or was captured on a different architecture", offset);
+  if (replay->next.payload_length > sizeof replay->payload)
+    return WHYF("Trace record at offset %ld is too long (%u bytes)", offset, replay->next.payload_length);
+  if (fread(replay->payload, replay->next.payload_length, 1, replay->file)!=1)
+    return WHYF("Trace file is truncated at offset %ld", offset);
+  replay->next.interface[sizeof replay->next.interface -1]=0;
+  replay->have_next=1;
+  return 1;
+}
+
+static time_ms_t trace_due(struct trace_replay *replay)
+{
+  if (replay->speed<=0)
+    return replay->start_time;
+  return replay->start_time + (replay->next.time_ms - replay->first_time) / replay->speed;
+}
+
+static void trace_replay_packet(struct trace_replay *replay)
+{
+  struct trace_record *r = &replay->next;
+  int i = overlay_interface_replay(r->interface, r->interface_type, r->interface_addr.sin_addr);
+  if (i<0){
+    replay->errors++;
+    return;
+  }
+  struct sockaddr *addr = r->recvaddr.sin_family==AF_INET ? (struct sockaddr *)&r->recvaddr : NULL;
+  // our own packets are echoed back on dummy interfaces, and are quietly dropped
+  if (packetOkOverlay(&overlay_interfaces[i], replay->payload, r->payload_length, r->recvttl,
+		      addr, addr?sizeof r->recvaddr:0)<0)
+    replay->errors++;
+  replay->packets++;
+  replay->bytes+=r->payload_length;
+
+  // convergence is measured in trace time, from the first packet to the last reachability change
+  if (reachable_changes != replay->reachable_changes){
+    replay->reachable_changes = reachable_changes;
+    replay->converged_ms = r->time_ms - replay->first_time;
+  }
+}
+
+static void trace_replay_alarm(struct sched_ent *alarm)
+{
+  struct trace_replay *replay = (struct trace_replay *)alarm;
+  time_ms_t now = gettime_ms();
+  int count=0;
+
+  // process everything that is due, but give other alarms a chance to run every so often
+  while(replay->have_next && trace_due(replay) <= now && count < 64){
+    trace_replay_packet(replay);
+    count++;
+    if (trace_read_record(replay)<0)
+      replay->have_next=0;
+  }
+
+  if (!replay->have_next){
+    replay->done=1;
+    return;
+  }
+  alarm->alarm = trace_due(replay);
+  if (alarm->alarm < now)
+    alarm->alarm = now;
+  alarm->deadline = alarm->alarm;
+  schedule(alarm);
+}
+
+static int64_t cpu_usage_us()
+{
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage))
+    return 0;
+  return (int64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000
+    + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+int app_trace_replay(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  if (config.debug.verbose)
+    DEBUG_cli_parsed(parsed);
+  const char *path, *speed_arg;
+  if (cli_arg(parsed, "filepath", &path, NULL, "") == -1
+    || cli_arg(parsed, "--speed", &speed_arg, NULL, "0") == -1)
+    return -1;
+
+  static struct profile_total replay_stats={
+    .name="trace_replay_alarm",
+  };
+  struct trace_replay *replay = emalloc_zero(sizeof(struct trace_replay));
+  if (!replay)
+    return -1;
+  replay->alarm.function = trace_replay_alarm;
+  replaying=1;
+  replay->alarm.stats = &replay_stats;
+  replay->speed = atof(speed_arg);
+
+  int ret=-1;
+  if ((replay->file = fopen(path, "r")) == NULL){
+    WHYF_perror("fopen(%s, \"r\")", alloca_str_toprint(path));
+    goto end;
+  }
+
+  keyring = keyring_open_instance_cli(parsed);
+  if (!keyring)
+    goto end;
+  overlay_queue_init();
+  subscribers_in_use=1;
+  if (is_rhizome_enabled())
+    rhizome_opendb();
+
+  if (trace_read_record(replay)<0)
+    goto end;
+
+  replay->first_time = replay->next.time_ms;
+  replay->start_time = gettime_ms();
+  replay->reachable_changes = reachable_changes;
+  int64_t start_cpu = cpu_usage_us();
+
+  if (replay->have_next){
+    replay->alarm.alarm = replay->start_time;
+    replay->alarm.deadline = replay->start_time;
+    schedule(&replay->alarm);
+    while(!replay->done && fd_poll())
+      ;
+  }
+
+  time_ms_t elapsed = gettime_ms() - replay->start_time;
+  int64_t cpu = cpu_usage_us() - start_cpu;
+
+  cli_field_name(context, "packets", ":");
+  cli_put_long(context, replay->packets, "\n");
+  cli_field_name(context, "errors", ":");
+  cli_put_long(context, replay->errors, "\n");
+  cli_field_name(context, "bytes", ":");
+  cli_put_long(context, replay->bytes, "\n");
+  cli_field_name(context, "elapsed_ms", ":");
+  cli_put_long(context, elapsed, "\n");
+  cli_field_name(context, "packets_per_second", ":");
+  cli_put_long(context, elapsed ? (int64_t)replay->packets * 1000 / elapsed : 0, "\n");
+  cli_field_name(context, "cpu_us_per_packet", ":");
+  cli_put_long(context, replay->packets ? cpu / replay->packets : 0, "\n");
+  cli_field_name(context, "converged_ms", ":");
+  cli_put_long(context, replay->converged_ms, "\n");
+  ret=0;
+
+end:
+  // the keyring and subscribers are left alone, since the routing state we have built still refers to them
+  if (replay->file)
+    fclose(replay->file);
+  free(replay);
+  return ret;
+}
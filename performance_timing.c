@@ -19,9 +19,22 @@
 
 #include "fdqueue.h"
 #include "conf.h"
+#include "mem.h"
+#include "strbuf.h"
+#include "strbuf_helpers.h"
 
 struct profile_total *stats_head=NULL;
 struct call_stats *current_call=NULL;
+static time_ms_t stats_cleared=0;
+
+extern int fdcount;
+extern struct sched_ent *next_alarm;
+extern struct sched_ent *next_deadline;
+void overlay_queue_stats_json(strbuf b);
+void rhizome_cache_stats_json(strbuf b);
+void rhizome_index_stats_json(strbuf b);
+void rhizome_sync_stats_json(strbuf b);
+void dna_helper_stats_json(strbuf b);
 
 void fd_clearstat(struct profile_total *s){
   s->max_time = 0;
@@ -40,13 +53,13 @@ int fd_tallystats(struct profile_total *total,struct profile_total *a)
 
 int fd_showstat(struct profile_total *total, struct profile_total *a)
 {
-  INFOF("%"PRId64"ms (%2.1f%%) in %d calls (max %"PRId64"ms, avg %.1fms, +child avg %.1fms) : %s",
-       (int64_t) a->total_time,
+  INFOF("%.1fms (%2.1f%%) in %d calls (max %.3fms, avg %.3fms, +child avg %.3fms) : %s",
+       a->total_time/1000000.0,
        a->total_time*100.0/total->total_time,
        a->calls,
-       (int64_t) a->max_time,
-       a->total_time*1.00/a->calls,
-       (a->total_time+a->child_time)*1.00/a->calls,
+       a->max_time/1000000.0,
+       a->total_time/1000000.0/a->calls,
+       (a->total_time+a->child_time)/1000000.0/a->calls,
        a->name);
   return 0;
 }
@@ -128,6 +141,7 @@ struct profile_total *sort(struct profile_total *list){
 
 int fd_clearstats()
 {
+  stats_cleared = gettime_ms();
   struct profile_total *stats = stats_head;
   while(stats!=NULL){
     fd_clearstat(stats);
@@ -168,7 +182,7 @@ int fd_showstats()
       while(stats!=NULL){
 	/* If a function spends more than 1 second in any 
 	   notionally 3 second period, then dob on it */
-	if (stats->total_time>1000
+	if (stats->total_time>1000000000LL
 	    &&strcmp(stats->name,"Idle (in poll)"))
 	  fd_showstat(&total,stats);
 	stats = stats->_next;
@@ -189,6 +203,99 @@ int fd_showstats()
   return 0;
 }
 
+static void profile_json(strbuf b, const struct profile_total *p)
+{
+  uint64_t cumulative_calls=0;
+  unsigned i;
+  for (i=0;i<PROFILE_HISTOGRAM_BUCKETS;i++)
+    cumulative_calls+=p->histogram[i];
+  strbuf_puts(b, "\n{\"name\":");
+  strbuf_json_string(b, p->name);
+  strbuf_sprintf(b, ",\"type\":\"%s\",\"calls\":%d,\"total_ns\":%"PRId64",\"child_ns\":%"PRId64",\"max_ns\":%"PRId64","
+		 "\"cumulative_calls\":%"PRIu64",\"cumulative_ns\":%"PRId64",\"histogram\":[",
+		 p->alarm?"alarm":"function", p->calls,
+		 (int64_t)p->total_time, (int64_t)p->child_time, (int64_t)p->max_time,
+		 cumulative_calls, (int64_t)p->cumulative_time);
+  for (i=0;i<PROFILE_HISTOGRAM_BUCKETS;i++)
+    strbuf_sprintf(b, "%s%u", i?",":"", p->histogram[i]);
+  strbuf_puts(b, "]}");
+}
+
+/* Describe the current state of the scheduler, transmit queues, and every
+ * profiled alarm and function as a JSON object. The calls, total_ns, child_ns
+ * and max_ns of each entry only cover the time since interval_start_ms, when
+ * fd_periodicstats() last cleared them. The histogram counts every call since
+ * the process started, by the log2 of the nanoseconds spent in the call itself,
+ * excluding any profiled children.
+ */
+strbuf strbuf_append_fd_stats_json(strbuf b)
+{
+  int alarms=0, deadlines=0;
+  struct sched_ent *alarm;
+  for (alarm = next_alarm; alarm; alarm = alarm->_next)
+    alarms++;
+  for (alarm = next_deadline; alarm; alarm = alarm->_next)
+    deadlines++;
+
+  strbuf_sprintf(b, "{\n\"now_ms\":%"PRId64",\n\"interval_start_ms\":%"PRId64",\n"
+		 "\"scheduler\":{\"watched_fds\":%d,\"alarms\":%d,\"deadlines\":%d},\n"
+		 "\"histogram_buckets\":%d,\n\"queues\":",
+		 (int64_t)gettime_ms(), (int64_t)stats_cleared,
+		 fdcount, alarms, deadlines, PROFILE_HISTOGRAM_BUCKETS);
+  overlay_queue_stats_json(b);
+  strbuf_puts(b, ",\n\"pools\":[");
+  struct mem_pool *pool;
+  for (pool = mem_pools; pool; pool = pool->_next){
+    if (pool != mem_pools)
+      strbuf_puts(b, ",");
+    strbuf_puts(b, "\n{\"name\":");
+    strbuf_json_string(b, pool->name);
+    strbuf_sprintf(b, ",\"size\":%zu,\"allocs\":%"PRIu64",\"reused\":%"PRIu64",\"releases\":%"PRIu64",\"cached\":%u}",
+		   pool->size, pool->allocs, pool->reused, pool->releases, pool->free_count);
+  }
+  size_t log_buffered;
+  uint64_t log_dropped;
+  log_buffer_stats(&log_buffered, &log_dropped);
+  strbuf_sprintf(b, "],\n\"log\":{\"buffered\":%zu,\"dropped\":%"PRIu64"}", log_buffered, log_dropped);
+  strbuf_puts(b, ",\n\"rhizome_cache\":");
+  rhizome_cache_stats_json(b);
+  strbuf_puts(b, ",\n\"rhizome_index\":");
+  rhizome_index_stats_json(b);
+  strbuf_puts(b, ",\n\"rhizome_sync\":");
+  rhizome_sync_stats_json(b);
+  strbuf_puts(b, ",\n\"dna_helper\":");
+  dna_helper_stats_json(b);
+  strbuf_puts(b, ",\n\"profile\":[");
+  struct profile_total *stats;
+  for (stats = stats_head; stats; stats = stats->_next){
+    if (stats != stats_head)
+      strbuf_puts(b, ",");
+    profile_json(b, stats);
+  }
+  strbuf_puts(b, "\n]\n}\n");
+  return b;
+}
+
+/* Returns the JSON stats in a buffer allocated with malloc(), or NULL on error.
+ */
+char *fd_stats_json(size_t *length)
+{
+  size_t size = 16*1024;
+  while(1){
+    char *buf = emalloc(size);
+    if (!buf)
+      return NULL;
+    strbuf b = strbuf_local(buf, size);
+    strbuf_append_fd_stats_json(b);
+    if (!strbuf_overrun(b)){
+      *length = strbuf_len(b);
+      return buf;
+    }
+    size = strbuf_count(b) + 1;
+    free(buf);
+  }
+}
+
 void fd_periodicstats(struct sched_ent *alarm)
 {
   fd_showstats();
@@ -217,13 +324,22 @@ unsigned fd_depth()
   return depth;
 }
 
+// log2 of the elapsed time, without looping over every bit
+static unsigned histogram_bucket(time_ns_t elapsed)
+{
+  if (elapsed<=1)
+    return 0;
+  unsigned bucket = 63 - __builtin_clzll((uint64_t)elapsed);
+  return bucket < PROFILE_HISTOGRAM_BUCKETS ? bucket : PROFILE_HISTOGRAM_BUCKETS - 1;
+}
+
 int fd_func_enter(struct __sourceloc __whence, struct call_stats *this_call)
 {
   if (config.debug.profiling)
     DEBUGF("%s called from %s() %s:%d",
 	   __FUNCTION__,__whence.function,__whence.file,__whence.line); 
  
-  this_call->enter_time=gettime_ms();
+  this_call->enter_time=gettime_ns();
   this_call->child_time=0;
   this_call->prev = current_call;
   current_call = this_call;
@@ -243,8 +359,8 @@ int fd_func_exit(struct __sourceloc __whence, struct call_stats *this_call)
   if (current_call != this_call)
     FATAL("performance timing stack trace corrupted");
   
-  time_ms_t now = gettime_ms();
-  time_ms_t elapsed = now - this_call->enter_time;
+  time_ns_t now = gettime_ns();
+  time_ns_t elapsed = now - this_call->enter_time;
   current_call = this_call->prev;
   
   if (this_call->totals && !this_call->totals->_initialised){
@@ -263,6 +379,8 @@ int fd_func_exit(struct __sourceloc __whence, struct call_stats *this_call)
     this_call->totals->total_time+=elapsed;
     this_call->totals->child_time+=this_call->child_time;
     this_call->totals->calls++;
+    this_call->totals->cumulative_time+=elapsed;
+    this_call->totals->histogram[histogram_bucket(elapsed)]++;
     
     if (elapsed>this_call->totals->max_time) this_call->totals->max_time=elapsed;
   }
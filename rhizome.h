@@ -51,6 +51,25 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 // assumed to always be 2^n
 #define RHIZOME_CRYPT_PAGE_SIZE         4096
 
+// payload blocks and truncated node hashes of the Merkle tree named by the "merkle" manifest field
+#define RHIZOME_MERKLE_BLOCK_SIZE       512
+#define RHIZOME_MERKLE_HASH_BYTES       16
+#define RHIZOME_MERKLE_HASH_STRLEN      (RHIZOME_MERKLE_HASH_BYTES * 2)
+#define RHIZOME_MERKLE_MAX_HEIGHT       63
+
+// flag in Rhizome MDP block requests, asking for 'M' blocks that carry Merkle proofs
+#define RHIZOME_MDP_REQUEST_MERKLE      0x01
+// flag in Rhizome MDP block requests that are followed by a window size and the ranges already held
+#define RHIZOME_MDP_REQUEST_WINDOW      0x02
+#define RHIZOME_MDP_MAX_RANGES          16
+#define RHIZOME_MDP_RANGE_BYTES         8
+
+// bounds of Rhizome MDP transfer block size and retransmit timeout
+#define RHIZOME_MDP_MIN_BLOCK_SIZE      128
+#define RHIZOME_MDP_MAX_BLOCK_SIZE      1024
+#define RHIZOME_MDP_MIN_RTO             200
+#define RHIZOME_MDP_INITIAL_RTO         1000
+
 #define RHIZOME_HTTP_PORT 4110
 #define RHIZOME_HTTP_PORT_MAX 4150
 
@@ -239,6 +258,11 @@ typedef struct rhizome_manifest
   bool_t has_sender;
   bool_t has_recipient;
 
+  /* Set if the merkle_root field is valid, ie, the manifest contains a valid
+   * "merkle" field.
+   */
+  bool_t has_merkle_root;
+
   /* Local authorship.  Useful for dividing bundle lists between "sent" and
    * "inbox" views.
    */
@@ -292,6 +316,11 @@ typedef struct rhizome_manifest
   sid_t sender;
   sid_t recipient;
 
+  /* Root of the Merkle tree over the payload blocks, from the "merkle" field
+   * if present.
+   */
+  unsigned char merkle_root[RHIZOME_MERKLE_HASH_BYTES];
+
   /* Local data, not encapsulated in the bundle.  The ROWID of the SQLite
    * MANIFESTS table row in which this manifest is stored.  Zero if the
    * manifest has not been stored yet.
@@ -349,6 +378,8 @@ typedef struct rhizome_manifest
 #define rhizome_manifest_set_recipient(m,v)     _rhizome_manifest_set_recipient(__WHENCE__,(m),(v))
 #define rhizome_manifest_del_recipient(m)       _rhizome_manifest_del_recipient(__WHENCE__,(m))
 #define rhizome_manifest_set_crypt(m,v)         _rhizome_manifest_set_crypt(__WHENCE__,(m),(v))
+#define rhizome_manifest_set_merkle_root(m,v)   _rhizome_manifest_set_merkle_root(__WHENCE__,(m),(v))
+#define rhizome_manifest_del_merkle_root(m)     _rhizome_manifest_del_merkle_root(__WHENCE__,(m))
 #define rhizome_manifest_set_rowid(m,v)         _rhizome_manifest_set_rowid(__WHENCE__,(m),(v))
 #define rhizome_manifest_set_inserttime(m,v)    _rhizome_manifest_set_inserttime(__WHENCE__,(m),(v))
 #define rhizome_manifest_set_author(m,v)        _rhizome_manifest_set_author(__WHENCE__,(m),(v))
@@ -372,6 +403,8 @@ void _rhizome_manifest_del_sender(struct __sourceloc, rhizome_manifest *);
 void _rhizome_manifest_set_recipient(struct __sourceloc, rhizome_manifest *, const sid_t *);
 void _rhizome_manifest_del_recipient(struct __sourceloc, rhizome_manifest *);
 void _rhizome_manifest_set_crypt(struct __sourceloc, rhizome_manifest *, enum rhizome_manifest_crypt);
+void _rhizome_manifest_set_merkle_root(struct __sourceloc, rhizome_manifest *, const unsigned char *);
+void _rhizome_manifest_del_merkle_root(struct __sourceloc, rhizome_manifest *);
 void _rhizome_manifest_set_rowid(struct __sourceloc, rhizome_manifest *, uint64_t);
 void _rhizome_manifest_set_inserttime(struct __sourceloc, rhizome_manifest *, time_ms_t);
 void _rhizome_manifest_set_author(struct __sourceloc, rhizome_manifest *, const sid_t *);
@@ -398,11 +431,13 @@ int rhizome_set_datastore_path(const char *path);
 const char *rhizome_datastore_path();
 int form_rhizome_datastore_path(char * buf, size_t bufsiz, const char *fmt, ...);
 int create_rhizome_datastore_dir();
+int form_rhizome_tier_path(char * buf, size_t bufsiz, const char *tier, const char *fmt, ...);
 
 /* Handy statement for forming the path of a rhizome store file in a char buffer whose declaration
  * is in scope (so that sizeof(buf) will work).  Evaluates to true if the pathname fitted into
  * the provided buffer, false (0) otherwise (after logging an error).  */
 #define FORM_RHIZOME_DATASTORE_PATH(buf,fmt,...) (form_rhizome_datastore_path((buf), sizeof(buf), (fmt), ##__VA_ARGS__))
+#define FORM_RHIZOME_TIER_PATH(buf,tier,fmt,...) (form_rhizome_tier_path((buf), sizeof(buf), (tier), (fmt), ##__VA_ARGS__))
 #define FORM_RHIZOME_IMPORT_PATH(buf,fmt,...) (form_rhizome_import_path((buf), sizeof(buf), (fmt), ##__VA_ARGS__))
 
 extern sqlite3 *rhizome_db;
@@ -451,6 +486,7 @@ sqlite_retry_state sqlite_retry_state_init(int serverLimit, int serverSleep, int
 int rhizome_write_manifest_file(rhizome_manifest *m, const char *filename, char append);
 int rhizome_manifest_selfsign(rhizome_manifest *m);
 int rhizome_drop_stored_file(const rhizome_filehash_t *hashp, int maximum_priority);
+int rhizome_make_space(int group_priority, uint64_t bytes);
 int rhizome_manifest_priority(sqlite_retry_state *retry, const rhizome_bid_t *bidp);
 int rhizome_read_manifest_file(rhizome_manifest *m, const char *filename, size_t bufferPAndSize);
 int rhizome_hash_file(rhizome_manifest *m, const char *path, rhizome_filehash_t *hash_out, uint64_t *size_out);
@@ -572,7 +608,7 @@ int rhizome_update_file_priority(const char *fileid);
 int rhizome_find_duplicate(const rhizome_manifest *m, rhizome_manifest **found);
 int rhizome_manifest_to_bar(rhizome_manifest *m,unsigned char *bar);
 int64_t rhizome_bar_version(const unsigned char *bar);
-uint64_t rhizome_bar_bidprefix_ll(unsigned char *bar);
+uint64_t rhizome_bar_bidprefix_ll(const unsigned char *bar);
 int rhizome_is_bar_interesting(unsigned char *bar);
 int rhizome_is_manifest_interesting(rhizome_manifest *m);
 int rhizome_retrieve_manifest(const rhizome_bid_t *bid, rhizome_manifest *m);
@@ -668,6 +704,29 @@ struct rhizome_write_buffer
   unsigned char data[0];
 };
 
+/* Incremental Merkle tree hashing of a payload as it is written.
+ */
+struct rhizome_merkle
+{
+  SHA512_CTX leaf;
+  size_t leaf_bytes;
+  uint64_t leaves;
+  uint64_t pending_mask;
+  unsigned char pending[RHIZOME_MERKLE_MAX_HEIGHT + 1][RHIZOME_MERKLE_HASH_BYTES];
+};
+
+struct rhizome_merkle_tree;
+
+uint64_t rhizome_merkle_leaf_count(uint64_t filesize);
+void rhizome_merkle_init(struct rhizome_merkle *merkle);
+void rhizome_merkle_update(struct rhizome_merkle *merkle, const unsigned char *data, size_t len);
+int rhizome_merkle_final(struct rhizome_merkle *merkle, unsigned char *root);
+struct rhizome_merkle_tree *rhizome_merkle_tree_build(const rhizome_filehash_t *hashp);
+void rhizome_merkle_tree_free(struct rhizome_merkle_tree *tree);
+ssize_t rhizome_merkle_tree_proof(const struct rhizome_merkle_tree *tree, uint64_t index, unsigned char *proof, size_t size);
+int rhizome_merkle_verify(const unsigned char *root, uint64_t filesize, uint64_t offset,
+			  const unsigned char *data, size_t len, const unsigned char *proof, size_t proof_len);
+
 struct rhizome_write
 {
   rhizome_filehash_t id;
@@ -689,6 +748,12 @@ struct rhizome_write
   int64_t blob_rowid;
   int blob_fd;
   sqlite3_blob *sql_blob;
+  // storage tier of an external payload file, empty for the datastore directory
+  char tier[257];
+  
+  // if set, the Merkle tree of the payload is hashed as it is written
+  int merkle_enabled;
+  struct rhizome_merkle merkle;
 };
 
 struct rhizome_read_buffer{
@@ -763,6 +828,10 @@ typedef struct rhizome_http_request
 int rhizome_received_content(const unsigned char *bidprefix,uint64_t version, 
 			     uint64_t offset, size_t count,unsigned char *bytes,
 			     int type);
+int rhizome_received_verified_content(const unsigned char *bidprefix, uint64_t version,
+				      uint64_t offset, size_t count, unsigned char *bytes,
+				      const unsigned char *proof, size_t proof_length);
+int rhizome_mdp_range_held(const unsigned char *ranges, unsigned count, uint64_t start, uint64_t length);
 int64_t rhizome_database_create_blob_for(const char *filehashhex_or_tempid,
 					 int64_t fileLength,int priority);
 int rhizome_server_set_response(rhizome_http_request *r, const struct http_response *h);
@@ -822,6 +891,29 @@ int rhizome_direct_get_bars(const rhizome_bid_t *bid_low,
 int rhizome_direct_process_post_multipart_bytes
 (rhizome_http_request *r,const char *bytes,int count);
 
+/* Range digest enquiries.  A range is every bundle whose BID starts with a given prefix of bits,
+   so the whole store is the range with no prefix.  Each end digests the BARs in a range, and a
+   range whose digests differ is split into 2^RHIZOME_DIRECT_RANGE_FANOUT_BITS sub-ranges, until
+   it holds few enough bundles for its BARs to be compared directly.  Ranges that already match
+   cost a few bytes each, so the traffic grows with the number of differences, not the store.
+*/
+#define RHIZOME_DIRECT_RANGE_PREFIX_BYTES 8
+#define RHIZOME_DIRECT_RANGE_FANOUT_BITS 4
+#define RHIZOME_DIRECT_RANGE_DIGEST_BYTES 8
+#define RHIZOME_DIRECT_RANGE_LEAF_BARS 64
+
+struct rhizome_direct_range {
+  unsigned char prefix[RHIZOME_DIRECT_RANGE_PREFIX_BYTES];
+  unsigned char bits;
+  /* Send BARs instead of a digest */
+  unsigned char leaf;
+};
+
+int rhizome_direct_range_scan(const struct rhizome_direct_range *range, unsigned char *digest,
+			      unsigned char *bars_out, int bars_requested);
+int rhizome_direct_get_range_response(const unsigned char *request, size_t request_length,
+				      unsigned char *response, size_t response_size);
+
 typedef struct rhizome_direct_sync_request {
   struct sched_ent alarm;
   rhizome_direct_bundle_cursor *cursor;
@@ -839,6 +931,10 @@ typedef struct rhizome_direct_sync_request {
   */
   void (*dispatch_function)(struct rhizome_direct_sync_request *);
 
+  /* Optional, called when the sync has concluded, just before the request is freed.
+  */
+  void (*conclude_function)(struct rhizome_direct_sync_request *);
+
   /* General purpose pointer for transport-dependent state */
   void *transport_specific_state;
 
@@ -855,6 +951,13 @@ typedef struct rhizome_direct_sync_request {
   int bundles_pulled;
   int bundle_transfers_in_progress;
 
+  /* If set, enquiries are range digests instead of cursor fills.  The ranges still to be
+     compared are kept on a stack. */
+  int use_range_digests;
+  struct rhizome_direct_range *ranges;
+  unsigned range_count;
+  unsigned range_alloc;
+
 } rhizome_direct_sync_request;
 
 #define RHIZOME_DIRECT_MAX_SYNC_HANDLES 16
@@ -871,13 +974,37 @@ int rhizome_direct_continue_sync_request(rhizome_direct_sync_request *r);
 int rhizome_direct_conclude_sync_request(rhizome_direct_sync_request *r);
 rhizome_direct_bundle_cursor *rhizome_direct_get_fill_response
 (unsigned char *buffer,int size,int max_response_bytes);
+int rhizome_direct_process_range_response(rhizome_direct_sync_request *r,
+					  const unsigned char *fill, size_t fill_length,
+					  const unsigned char *response, size_t response_length);
+
+int rhizome_direct_queue_pull(const struct sockaddr_in *addr, const unsigned char *prefix);
+int rhizome_direct_pulls_pending();
+void rhizome_direct_start_pulls();
+void rhizome_direct_clear_pulls();
+
+/* Enquiries to one peer that may be outstanding at once.  The next cursor fill is sent while
+   the response to the previous one is still on its way. */
+#define RHIZOME_DIRECT_HTTP_PIPELINE 2
 
 typedef struct rhizome_direct_transport_state_http {
   int port;
   char host[1024];  
+  struct sockaddr_in addr;
+  int enquiries_in_flight;
+
+  /* Statistics, to report the throughput of each peer */
+  time_ms_t started;
+  time_ms_t finished;
+  int fills_sent;
+  int bundles_pushed;
+  int bundles_pulled;
+  uint64_t bytes_sent;
+  uint64_t bytes_received;
 } rhizome_direct_transport_state_http;
 
 void rhizome_direct_http_dispatch(rhizome_direct_sync_request *);
+void rhizome_direct_http_concluded(rhizome_direct_sync_request *);
 
 extern unsigned char favicon_bytes[];
 extern int favicon_len;
@@ -915,7 +1042,7 @@ int unpack_http_response(char *response, struct http_response_parts *parts);
 /* rhizome storage methods */
 
 int rhizome_exists(const rhizome_filehash_t *hashp);
-int rhizome_open_write(struct rhizome_write *write, const rhizome_filehash_t *expectedHashp, uint64_t file_length, int priority);
+int rhizome_open_write(struct rhizome_write *write, const rhizome_filehash_t *expectedHashp, uint64_t file_length, int priority, const char *service);
 int rhizome_write_buffer(struct rhizome_write *write_state, unsigned char *buffer, size_t data_size);
 int rhizome_random_write(struct rhizome_write *write_state, uint64_t offset, unsigned char *buffer, size_t data_size);
 int rhizome_write_open_manifest(struct rhizome_write *write, rhizome_manifest *m);
@@ -943,12 +1070,32 @@ int rhizome_extract_file(rhizome_manifest *m, const char *filepath);
 int rhizome_dump_file(const rhizome_filehash_t *hashp, const char *filepath, int64_t *length);
 int rhizome_read_cached(const rhizome_bid_t *bid, uint64_t version, time_ms_t timeout, 
   uint64_t fileOffset, unsigned char *buffer, size_t length);
+ssize_t rhizome_read_cached_proof(const rhizome_bid_t *bid, uint64_t version, uint64_t fileOffset,
+  unsigned char *proof, size_t size);
 int rhizome_cache_close();
 
+const char *rhizome_tier_choose(uint64_t length, int priority, const char *service);
+int rhizome_tier_open(const rhizome_filehash_t *hashp);
+int rhizome_tier_unlink(const rhizome_filehash_t *hashp);
+void rhizome_tier_note_access(const rhizome_filehash_t *hashp);
+int rhizome_tier_flush_access();
+
 int rhizome_database_filehash_from_id(const rhizome_bid_t *bidp, uint64_t version, rhizome_filehash_t *hashp);
 
+struct rhizome_index_entry {
+  rhizome_bid_t bid;
+  int64_t version;
+  uint64_t filesize;
+};
+int rhizome_index_find(const unsigned char *prefix, unsigned prefix_len, int64_t min_version, const struct rhizome_index_entry **entryp);
+void rhizome_index_stored(const rhizome_bid_t *bidp, int64_t version, uint64_t filesize);
+void rhizome_index_deleted(const rhizome_bid_t *bidp);
+void rhizome_index_stale(const rhizome_bid_t *bidp);
+void rhizome_index_close();
+
 int overlay_mdp_service_rhizome_sync(struct overlay_frame *frame, overlay_mdp_frame *mdp);
 int rhizome_sync_announce();
+int rhizome_sync_advertise();
 int rhizome_sync_bundle_inserted(const unsigned char *bar);
 
 #endif //__SERVALDNA__RHIZOME_H
@@ -147,8 +147,10 @@ void _rhizome_manifest_set_filesize(struct __sourceloc __whence, rhizome_manifes
   const char *v = rhizome_manifest_set_ll(m, "filesize", size);
   assert(v); // TODO: remove known manifest fields from vars[]
   m->filesize = size;
-  if (m->filesize == 0)
+  if (m->filesize == 0) {
     rhizome_manifest_set_filehash(m, NULL);
+    rhizome_manifest_del_merkle_root(m);
+  }
 }
 
 /* Must always set file size before setting the file hash, to avoid assertion failures.
@@ -311,6 +313,27 @@ void _rhizome_manifest_set_crypt(struct __sourceloc __whence, rhizome_manifest *
   m->payloadEncryption = flag;
 }
 
+void _rhizome_manifest_set_merkle_root(struct __sourceloc __whence, rhizome_manifest *m, const unsigned char *root)
+{
+  if (root) {
+    const char *v = rhizome_manifest_set(m, "merkle", alloca_tohex(root, RHIZOME_MERKLE_HASH_BYTES));
+    assert(v); // TODO: remove known manifest fields from vars[]
+    bcopy(root, m->merkle_root, sizeof m->merkle_root);
+    m->has_merkle_root = 1;
+  } else
+    _rhizome_manifest_del_merkle_root(__whence, m);
+}
+
+void _rhizome_manifest_del_merkle_root(struct __sourceloc __whence, rhizome_manifest *m)
+{
+  if (m->has_merkle_root) {
+    rhizome_manifest_del(m, "merkle");
+    bzero(m->merkle_root, sizeof m->merkle_root);
+    m->has_merkle_root = 0;
+  } else
+    assert(rhizome_manifest_get(m, "merkle") == NULL);
+}
+
 void _rhizome_manifest_set_rowid(struct __sourceloc __whence, rhizome_manifest *m, uint64_t rowid)
 {
   m->rowid = rowid;
@@ -613,6 +636,16 @@ int rhizome_manifest_parse(rhizome_manifest *m)
 	    if (config.debug.rhizome_manifest)
 	      DEBUGF("PARSE manifest[%d].crypt = %u", m->manifest_record_number, m->payloadEncryption == PAYLOAD_ENCRYPTED ? 1 : 0);
 	  }
+	} else if (strcasecmp(var, "merkle") == 0) {
+	  if (strlen(value) != RHIZOME_MERKLE_HASH_STRLEN || fromhexstr(m->merkle_root, value, RHIZOME_MERKLE_HASH_BYTES) == -1) {
+	    if (config.debug.rejecteddata)
+	      DEBUGF("Invalid merkle: %s", value);
+	    m->warnings++;
+	  } else {
+	    m->has_merkle_root = 1;
+	    if (config.debug.rhizome_manifest)
+	      DEBUGF("PARSE manifest[%d].merkle = %s", m->manifest_record_number, alloca_tohex(m->merkle_root, RHIZOME_MERKLE_HASH_BYTES));
+	  }
 	} else {
 	  // An unknown field is not an error... older rhizome nodes must carry newer manifests.
 	  if (config.debug.rhizome_manifest)
@@ -30,6 +30,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "rhizome.h"
 #include "crypto.h"
 #include "keyring.h"
+#include "crypto_accel.h"
 
 /* Work out the encrypt/decrypt key for the supplied manifest.
    If the manifest is not encrypted, then return NULL.
@@ -608,7 +609,7 @@ int rhizome_crypt_xor_block(unsigned char *buffer, size_t buffer_size, uint64_t
     
     unsigned char temp[RHIZOME_CRYPT_PAGE_SIZE];
     bcopy(buffer, temp + padding, size);
-    crypto_stream_xsalsa20_xor(temp, temp, size+padding, block_nonce, key);
+    crypto_xsalsa20_xor(temp, temp, size+padding, block_nonce, key);
     bcopy(temp + padding, buffer, size);
     
     add_nonce(block_nonce, RHIZOME_CRYPT_PAGE_SIZE);
@@ -620,7 +621,7 @@ int rhizome_crypt_xor_block(unsigned char *buffer, size_t buffer_size, uint64_t
     if (size>RHIZOME_CRYPT_PAGE_SIZE)
       size=RHIZOME_CRYPT_PAGE_SIZE;
     
-    crypto_stream_xsalsa20_xor(buffer+offset, buffer+offset, (unsigned long long) size, block_nonce, key);
+    crypto_xsalsa20_xor(buffer+offset, buffer+offset, (unsigned long long) size, block_nonce, key);
     
     add_nonce(block_nonce, RHIZOME_CRYPT_PAGE_SIZE);
     offset+=size;
@@ -70,6 +70,31 @@ int form_rhizome_datastore_path(char * buf, size_t bufsiz, const char *fmt, ...)
   return 1;
 }
 
+/* Form the path of a file in a storage tier, or of the tier directory itself if fmt is NULL.  A NULL
+ * or empty tier means the datastore directory.
+ */
+int form_rhizome_tier_path(char * buf, size_t bufsiz, const char *tier, const char *fmt, ...)
+{
+  va_list ap;
+  strbuf b = strbuf_local(buf, bufsiz);
+  if (tier && tier[0])
+    strbuf_path_join(b, serval_instancepath(), tier, NULL);
+  else
+    strbuf_puts(b, rhizome_datastore_path());
+  if (fmt) {
+    va_start(ap, fmt);
+    if (*strbuf_substr(b, -1) != '/')
+      strbuf_putc(b, '/');
+    strbuf_vsprintf(b, fmt, ap);
+    va_end(ap);
+  }
+  if (strbuf_overrun(b)) {
+      WHY("Path buffer overrun");
+      return 0;
+  }
+  return 1;
+}
+
 int create_rhizome_datastore_dir()
 {
   if (config.debug.rhizome) DEBUGF("mkdirs(%s, 0700)", rhizome_datastore_path());
@@ -84,7 +109,7 @@ int rhizome_manifest_priority(sqlite_retry_state *retry, const rhizome_bid_t *bi
 {
   int64_t result = 0;
   if (sqlite_exec_int64_retry(retry, &result,
-	"SELECT max(grouplist.priorty) FROM GROUPLIST,MANIFESTS,GROUPMEMBERSHIPS"
+	"SELECT max(grouplist.priority) FROM GROUPLIST,MANIFESTS,GROUPMEMBERSHIPS"
 	" WHERE MANIFESTS.id = ?"
 	"   AND GROUPLIST.id = GROUPMEMBERSHIPS.groupid"
 	"   AND GROUPMEMBERSHIPS.manifestid = MANIFESTS.id;",
@@ -261,7 +286,7 @@ int rhizome_opendb()
   int loglevel = (config.debug.rhizome) ? LOG_LEVEL_DEBUG : LOG_LEVEL_SILENT;
 
   /* Read Rhizome configuration */
-  if (config.debug.rhizome)
+  if (config.debug.rhizome && config.rhizome.database_size)
     DEBUGF("Rhizome will use %"PRIu64"B of storage for its database.", (uint64_t) config.rhizome.database_size);
   
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
@@ -309,6 +334,19 @@ int rhizome_opendb()
     sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE TABLE IF NOT EXISTS IDENTITY(uuid text not null); ", END);
     sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA user_version=5;", END);
   }
+  if (version<6){
+    // covers the range digest queries of Rhizome Direct, so they need not read manifest rows
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE INDEX IF NOT EXISTS IDX_MANIFESTS_ID_BAR ON MANIFESTS(id, bar);", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA user_version=6;", END);
+  }
+  if (version<7){
+    // storage tier of external payload files, and how recently and often they are read
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "ALTER TABLE FILES ADD COLUMN tier text;", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "ALTER TABLE FILES ADD COLUMN lastaccess integer;", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "ALTER TABLE FILES ADD COLUMN accesscount integer DEFAULT 0;", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE INDEX IF NOT EXISTS IDX_FILES_TIER ON FILES(tier);", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA user_version=7;", END);
+  }
 
   char buf[UUID_STRLEN + 1];
   int r = sqlite_exec_strbuf_retry(&retry, strbuf_local(buf, sizeof buf), "SELECT uuid from IDENTITY LIMIT 1;", END);
@@ -352,6 +390,8 @@ int rhizome_close_db()
   IN();
   if (rhizome_db) {
     rhizome_cache_close();
+    rhizome_tier_flush_access();
+    rhizome_index_close();
     
     if (!sqlite3_get_autocommit(rhizome_db)){
       WHY("Uncommitted transaction!");
@@ -1080,7 +1120,7 @@ int64_t rhizome_database_used_bytes()
   int64_t db_free_page_count;
   if (	sqlite_exec_int64(&db_page_size, "PRAGMA page_size;", END) == -1LL
     ||  sqlite_exec_int64(&db_page_count, "PRAGMA page_count;", END) == -1LL
-    ||	sqlite_exec_int64(&db_free_page_count, "PRAGMA free_count;", END) == -1LL
+    ||	sqlite_exec_int64(&db_free_page_count, "PRAGMA freelist_count;", END) == -1LL
   )
     return WHY("Cannot measure database used bytes");
   return db_page_size * (db_page_count - db_free_page_count);
@@ -1101,11 +1141,8 @@ int rhizome_database_filehash_from_id(const rhizome_bid_t *bidp, uint64_t versio
 
 static int rhizome_delete_external(const rhizome_filehash_t *hashp)
 {
-  // attempt to remove any external blob
-  char blob_path[1024];
-  if (!FORM_RHIZOME_DATASTORE_PATH(blob_path, alloca_tohex_rhizome_filehash_t(*hashp)))
-    return -1;
-  return unlink(blob_path);
+  // attempt to remove any external blob, from whichever storage tier holds it
+  return rhizome_tier_unlink(hashp);
 }
 
 static int rhizome_delete_orphan_fileblobs_retry(sqlite_retry_state *retry)
@@ -1207,30 +1244,42 @@ int rhizome_cleanup(struct rhizome_cleanup_report *report)
   OUT();
 }
 
+/* Make room in the database for a new payload of the given size, by dropping stored payloads of no
+ * higher priority, least recently read first.  Returns 0 if there is room, 1 if not enough could be
+ * dropped, -1 on error.
+ */
 int rhizome_make_space(int group_priority, uint64_t bytes)
 {
+  if (config.rhizome.database_size == 0)
+    return 0;
+
   /* Asked for impossibly large amount */
-  if (bytes>=(config.rhizome.database_size-65536))
+  if (bytes + 65536 >= config.rhizome.database_size)
     return WHYF("bytes=%"PRIu64" is too large", bytes);
+  int64_t limit = config.rhizome.database_size - 65536 - bytes;
 
   int64_t db_used = rhizome_database_used_bytes();
   if (db_used == -1)
     return -1;
   
-  rhizome_cleanup(NULL);
-  
   /* If there is already enough space now, then do nothing more */
-  if (db_used<=(config.rhizome.database_size-bytes-65536))
+  if (db_used <= limit)
     return 0;
 
-  /* Okay, not enough space, so free up some. */
+  rhizome_cleanup(NULL);
+
+  /* Okay, not enough space, so free up some.  Only payloads stored in the database take up its
+   * space, and the ones still being written must be left alone. */
+  rhizome_tier_flush_access();
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
   sqlite3_stmt *statement = sqlite_prepare_bind(&retry,
-      "SELECT id,length FROM FILES WHERE highestpriority < ? ORDER BY DESCENDING LENGTH",
+      "SELECT id,length FROM FILES WHERE highestpriority <= ? AND datavalid != 0"
+      " AND EXISTS (SELECT 1 FROM FILEBLOBS WHERE FILEBLOBS.id = FILES.id)"
+      " ORDER BY highestpriority, COALESCE(lastaccess, inserttime), length DESC",
       INT, group_priority, END);
   if (!statement)
     return -1;
-  while (bytes > (config.rhizome.database_size - 65536 - rhizome_database_used_bytes())
+  while ((db_used = rhizome_database_used_bytes()) > limit
       && sqlite_step_retry(&retry, statement) == SQLITE_ROW
   ) {
     /* Make sure we can drop this blob, and if so drop it, and recalculate number of bytes required */
@@ -1256,19 +1305,22 @@ int rhizome_make_space(int group_priority, uint64_t bytes)
        * priority of this request.  The query done earlier should ensure this, but it doesn't hurt
        * to be paranoid, and it also protects against inconsistency in the database.
        */
-      rhizome_drop_stored_file(&hash, group_priority + 1);
+      if (config.debug.rhizome)
+	DEBUGF("Evicting payload %s to make room for %"PRIu64" bytes", alloca_tohex_rhizome_filehash_t(hash), bytes);
+      rhizome_drop_stored_file(&hash, group_priority);
     }
   }
   sqlite3_finalize(statement);
+  if (db_used != -1 && db_used <= limit)
+    return 0;
 
   //int64_t equal_priority_larger_file_space_used = sqlite_exec_int64("SELECT COUNT(length) FROM
   //FILES WHERE highestpriority = ? and length > ?", INT, group_priority, INT64, bytes, END);
-  /* XXX Get rid of any equal priority files that are larger than this one */
-
   /* XXX Get rid of any higher priority files that are not relevant in this time or location */
 
   /* Couldn't make space */
-  return WHY("Incomplete");
+  WARNF("Could not make room for %"PRIu64" bytes in the Rhizome database", bytes);
+  return 1;
 }
 
 /* Drop the specified file from storage, and any manifests that reference it, provided that none of
@@ -1307,7 +1359,7 @@ int rhizome_drop_stored_file(const rhizome_filehash_t *hashp, int maximum_priori
       if (config.debug.rhizome)
 	DEBUGF("removing stale manifests, groupmemberships");
       sqlite_exec_void_retry(&retry, "DELETE FROM MANIFESTS WHERE id = ?;", RHIZOME_BID_T, &bid, END);
-      sqlite_exec_void_retry(&retry, "DELETE FROM KEYPAIRS WHERE public = ?;", RHIZOME_BID_T, &bid, END);
+      rhizome_index_deleted(&bid);
       sqlite_exec_void_retry(&retry, "DELETE FROM GROUPMEMBERSHIPS WHERE manifestid = ?;", RHIZOME_BID_T, &bid, END);
     }
   }
@@ -1463,6 +1515,7 @@ int rhizome_store_bundle(rhizome_manifest *m)
 	  alloca_tohex_rhizome_bid_t(m->cryptoSignPublic),
 	  m->version
 	);
+    rhizome_index_stored(&m->cryptoSignPublic, m->version, m->filesize);
     monitor_announce_bundle(m);
     if (serverMode)
       rhizome_sync_announce();
@@ -1831,23 +1884,29 @@ int rhizome_retrieve_manifest(const rhizome_bid_t *bidp, rhizome_manifest *m)
  */
 int rhizome_retrieve_manifest_by_prefix(const unsigned char *prefix, unsigned prefix_len, rhizome_manifest *m)
 {
+  const struct rhizome_index_entry *e;
+  switch (rhizome_index_find(prefix, prefix_len, 0, &e)) {
+  case -1:
+    return -1;
+  case 0:
+    INFOF("Manifest with id prefix=`%s` not found", alloca_tohex(prefix, prefix_len));
+    return 1;
+  }
+  rhizome_bid_t bid = e->bid;
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
-  const unsigned prefix_strlen = prefix_len * 2;
-  char like[prefix_strlen + 2];
-  tohex(like, prefix_strlen, prefix);
-  like[prefix_strlen] = '%';
-  like[prefix_strlen + 1] = '\0';
   sqlite3_stmt *statement = sqlite_prepare_bind(&retry,
-      "SELECT id, manifest, version, inserttime, author, rowid FROM manifests WHERE id like ?",
-      TEXT, like,
+      "SELECT id, manifest, version, inserttime, author, rowid FROM manifests WHERE id = ?",
+      RHIZOME_BID_T, &bid,
       END);
   if (!statement)
     return -1;
   int ret = 1;
   if (sqlite_step_retry(&retry, statement) == SQLITE_ROW)
     ret = unpack_manifest_row(m, statement);
-  else
-    INFOF("Manifest with id prefix=`%s` not found", like);
+  else {
+    rhizome_index_stale(&bid);
+    INFOF("Manifest with id prefix=`%s` not found", alloca_tohex(prefix, prefix_len));
+  }
   sqlite3_finalize(statement);
   return ret;
 }
@@ -1862,6 +1921,7 @@ static int rhizome_delete_manifest_retry(sqlite_retry_state *retry, const rhizom
     return -1;
   if (_sqlite_exec(__WHENCE__, LOG_LEVEL_ERROR, retry, statement) == -1)
     return -1;
+  rhizome_index_deleted(bidp);
   return sqlite3_changes(rhizome_db) ? 0 : 1;
 }
 
@@ -1954,16 +2014,25 @@ int rhizome_delete_file(const rhizome_filehash_t *hashp)
   return rhizome_delete_file_retry(&retry, hashp);
 }
 
-static int is_interesting(const char *id_hex, int64_t version)
+static int is_interesting(const unsigned char *prefix, unsigned prefix_len, int64_t version)
 {
   IN();
+  // do we have this bundle [or later]?
+  const struct rhizome_index_entry *e;
+  switch (rhizome_index_find(prefix, prefix_len, version, &e)) {
+  case -1:
+    RETURN(-1);
+  case 0:
+    RETURN(1);
+  }
+  rhizome_bid_t bid = e->bid;
   int ret=1;
 
-  // do we have this bundle [or later]?
+  // the index may be out of date if another process deleted the bundle
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
   sqlite3_stmt *statement = sqlite_prepare_bind(&retry,
-    "SELECT filehash FROM MANIFESTS WHERE id LIKE ? AND version >= ?",
-    TEXT_TOUPPER, id_hex,
+    "SELECT filehash FROM MANIFESTS WHERE id = ? AND version >= ?",
+    RHIZOME_BID_T, &bid,
     INT64, version,
     END);
   if (!statement)
@@ -1979,7 +2048,8 @@ static int is_interesting(const char *id_hex, int64_t version)
       } else if (!rhizome_exists(&hash))
 	ret = 1;
     }
-  }
+  } else
+    rhizome_index_stale(&bid);
   sqlite3_finalize(statement);
   RETURN(ret);
   OUT();
@@ -1987,14 +2057,10 @@ static int is_interesting(const char *id_hex, int64_t version)
 
 int rhizome_is_bar_interesting(unsigned char *bar)
 {
-  int64_t version = rhizome_bar_version(bar);
-  char id_hex[RHIZOME_BAR_PREFIX_BYTES *2 + 2];
-  tohex(id_hex, RHIZOME_BAR_PREFIX_BYTES * 2, &bar[RHIZOME_BAR_PREFIX_OFFSET]);
-  strcat(id_hex, "%");
-  return is_interesting(id_hex, version);
+  return is_interesting(&bar[RHIZOME_BAR_PREFIX_OFFSET], RHIZOME_BAR_PREFIX_BYTES, rhizome_bar_version(bar));
 }
 
 int rhizome_is_manifest_interesting(rhizome_manifest *m)
 {
-  return is_interesting(alloca_tohex_rhizome_bid_t(m->cryptoSignPublic), m->version);
+  return is_interesting(m->cryptoSignPublic.binary, sizeof m->cryptoSignPublic.binary, m->version);
 }
@@ -111,11 +111,17 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "conf.h"
 #include "rhizome.h"
 #include "str.h"
+#include "strbuf_helpers.h"
+#include "cli.h"
+#include "sha2.h"
 #include <assert.h>
 
 rhizome_direct_sync_request *rd_sync_handles[RHIZOME_DIRECT_MAX_SYNC_HANDLES];
 int rd_sync_handle_count=0;
 
+static int push_range(rhizome_direct_sync_request *r, const struct rhizome_direct_range *range);
+static int rhizome_direct_fill_range_enquiry(rhizome_direct_sync_request *r);
+
 /* Create (but don't start) a rhizome direct sync request. 
    This creates the record to say that we want to undertake this synchronisation,
    either once or at intervals as specified.
@@ -170,6 +176,15 @@ int rhizome_direct_start_sync_request(rhizome_direct_sync_request *r)
 
   r->syncs_started++;
 
+  if (r->use_range_digests) {
+    /* Start by comparing the digests of the whole store. */
+    struct rhizome_direct_range all;
+    bzero(&all, sizeof all);
+    r->range_count=0;
+    if (push_range(r, &all)==-1)
+      r->use_range_digests=0;
+  }
+
   return rhizome_direct_continue_sync_request(r);  
 }
 
@@ -188,6 +203,23 @@ int rhizome_direct_continue_sync_request(rhizome_direct_sync_request *r)
      then we can stop. 
   */
 
+  if (r->use_range_digests)
+    {
+      if (r->range_count==0) {
+	if (!r->bundle_transfers_in_progress) {
+	  DEBUG("All ranges compared");
+	  return rhizome_direct_conclude_sync_request(r);
+	}
+	DEBUGF("Waiting for %d in-progress transfers", r->bundle_transfers_in_progress);
+	return 0;
+      }
+      int count=rhizome_direct_fill_range_enquiry(r);
+      DEBUGF("Enquiring about %d ranges",count);
+      r->dispatch_function(r);
+      r->fills_sent++;
+      return count;
+    }
+
   if (r->cursor->size_high>=r->cursor->limit_size_high)
     {
       DEBUG("Out of bins");
@@ -201,8 +233,10 @@ int rhizome_direct_continue_sync_request(rhizome_direct_sync_request *r)
 	  /* seems that all is done */
 	  DEBUG("All done");
 	  return rhizome_direct_conclude_sync_request(r);
-	} else 
-	DEBUG("Stuck on in-progress transfers");
+	}
+	/* The transport will continue again as each transfer finishes. */
+	DEBUGF("Waiting for %d in-progress transfers", r->bundle_transfers_in_progress);
+	return 0;
       } else
 	DEBUGF("bid_low<limit_bid_high");
     }
@@ -222,6 +256,9 @@ int rhizome_direct_conclude_sync_request(rhizome_direct_sync_request *r)
 {
   assert(r);
   r->syncs_completed++;
+  unschedule(&r->alarm);
+  if (r->conclude_function)
+    r->conclude_function(r);
 
   /* reschedule if interval driven?
      if one-shot, should we remove from the list of active sync requests?
@@ -235,6 +272,8 @@ int rhizome_direct_conclude_sync_request(rhizome_direct_sync_request *r)
 	{
 	  DEBUG("Found it");
 	  rhizome_direct_bundle_iterator_free(&r->cursor);
+	  if (r->ranges)
+	    free(r->ranges);
 	  free(r);
 	  
 	  if (i!=rd_sync_handle_count-1)
@@ -250,14 +289,100 @@ int rhizome_direct_conclude_sync_request(rhizome_direct_sync_request *r)
   return 0;
 }
 
+/* Append a (1+RHIZOME_BAR_PREFIX_BYTES)-byte action record, 0x01 "please send" or 0x02 "I have
+   [newer]" followed by the BID prefix from the BAR.
+*/
+static size_t append_action(unsigned char *out, size_t out_used, size_t out_size,
+			    unsigned char type, const unsigned char *bar)
+{
+  if (out_used+1+RHIZOME_BAR_PREFIX_BYTES>out_size)
+    return out_used;
+  out[out_used]=type;
+  bcopy(&bar[RHIZOME_BAR_PREFIX_OFFSET],&out[out_used+1],RHIZOME_BAR_PREFIX_BYTES);
+  return out_used+1+RHIZOME_BAR_PREFIX_BYTES;
+}
+
+/* Compare the far end's list of BARs with ours, both in BID order, and write the list of
+   "please send" and "I have [newer]" records that would give both ends the same set of BARs.
+   The potential presense of multiple versions of a given bundle introduces only a slight
+   complication.  Returns the number of bytes written to <out>, which is never more than
+   <out_size>.
+*/
+static size_t rhizome_direct_compare_bars(const unsigned char *them_bars, int them_count,
+					  const unsigned char *us_bars, int us_count,
+					  unsigned char *out, size_t out_size)
+{
+  size_t out_used=0;
+  int them=0,us=0;
+  DEBUGF("themcount=%d, uscount=%d",them_count,us_count);
+  while(them<them_count||us<us_count)
+    {
+      DEBUGF("them=%d, us=%d",them,us);
+      const unsigned char *them_bar=&them_bars[them*RHIZOME_BAR_BYTES];
+      const unsigned char *us_bar=&us_bars[us*RHIZOME_BAR_BYTES];
+      int relation=0;
+      if (them<them_count&&us<us_count) {
+	relation=memcmp(them_bar,us_bar,RHIZOME_BAR_COMPARE_BYTES);
+	DEBUGF("relation = %d",relation);
+	dump("them BAR",them_bar,RHIZOME_BAR_BYTES);
+	dump("us BAR",us_bar,RHIZOME_BAR_BYTES);
+      }
+      else if (us==us_count) relation=-1; /* they have a bundle we don't have */
+      else if (them==them_count) relation=+1; /* we have a bundle they don't have */
+      else {
+	DEBUGF("This should never happen.");
+	break;
+      }
+      int who=0;
+      if (relation<0) {
+	/* They have a bundle that we don't have any version of. */
+	out_used=append_action(out,out_used,out_size,0x01,them_bar); /* Please send */
+	who=-1;
+	DEBUGF("They have previously unseen bundle %016"PRIx64"*",
+	       rhizome_bar_bidprefix_ll(them_bar));
+      } else if (relation>0) {
+	/* We have a bundle that they don't have any version of */
+	out_used=append_action(out,out_used,out_size,0x02,us_bar); /* I have [newer] */
+	who=+1;
+	DEBUGF("We have previously unseen bundle %016"PRIx64"*",
+	       rhizome_bar_bidprefix_ll(us_bar));
+      } else {
+	/* We each have a version of this bundle, so see whose is newer */
+	int64_t them_version = rhizome_bar_version(them_bar);
+	int64_t us_version = rhizome_bar_version(us_bar);
+	if (them_version>us_version) {
+	  /* They have the newer version of the bundle */
+	  out_used=append_action(out,out_used,out_size,0x01,them_bar); /* Please send */
+	  DEBUGF("They have newer version of bundle %016"PRIx64"* (%"PRId64" versus %"PRId64")",
+		 rhizome_bar_bidprefix_ll(us_bar), us_version, them_version);
+	} else if (them_version<us_version) {
+	  /* We have the newer version of the bundle */
+	  out_used=append_action(out,out_used,out_size,0x02,us_bar); /* I have [newer] */
+	  DEBUGF("We have newer version of bundle %016"PRIx64"* (%"PRId64" versus %"PRId64")",
+		 rhizome_bar_bidprefix_ll(us_bar), us_version, them_version);
+	} else {
+	  DEBUGF("We both have the same version of %016"PRIx64"*",
+		 rhizome_bar_bidprefix_ll(them_bar));
+	}
+      }
+
+      /* Advance through lists accordingly */
+      switch(who) {
+      case -1: them++; break;
+      case +1: us++; break;
+      case 0: them++; us++; break;
+      }
+    }
+  return out_used;
+}
+
 /*
   This function is called with the list of BARs for a specified cursor range
   that the far-end possesses, i.e., what we are given is a list of the far end's 
   "I have"'s.  To produce our reply, we need to work out corresponding list of
   "I have"'s, and then compare them to produce the list of "you have and I want" 
   and "I have and you want" that if fulfilled, would result in both ends having the
-  same set of BARs for the specified cursor range.  The potential presense of
-  multiple versions of a given bundle introduces only a slight complication. 
+  same set of BARs for the specified cursor range.
 */
 
 rhizome_direct_bundle_cursor *rhizome_direct_get_fill_response(unsigned char *buffer,int size, int max_response_bytes)
@@ -297,98 +422,289 @@ rhizome_direct_bundle_cursor *rhizome_direct_get_fill_response(unsigned char *bu
      the cursor's buffer with the response data. */
   bcopy(c->buffer,usbuffer,10+us_count*RHIZOME_BAR_BYTES);
   c->buffer_offset_bytes=10;
-  c->buffer_used=0;
 
-  /* Iterate until we are through both lists.
-     Note that the responses are (1+RHIZOME_BAR_PREFIX_BYTES)-bytes each, much 
+  /* Note that the responses are (1+RHIZOME_BAR_PREFIX_BYTES)-bytes each, much 
      smaller than the 32 bytes used by BARs, therefore the response will never be
      bigger than the request, and so we don't need to worry about overflows. */
-  int them=0,us=0;
-  DEBUGF("themcount=%d, uscount=%d",them_count,us_count);
-  while(them<them_count||us<us_count)
-    {
-      DEBUGF("them=%d, us=%d",them,us);
-      unsigned char *them_bar=&buffer[10+them*RHIZOME_BAR_BYTES];
-      unsigned char *us_bar=&usbuffer[10+us*RHIZOME_BAR_BYTES];
-      int relation=0;
-      if (them<them_count&&us<us_count) {
-	relation=memcmp(them_bar,us_bar,RHIZOME_BAR_COMPARE_BYTES);
-	DEBUGF("relation = %d",relation);
-	dump("them BAR",them_bar,RHIZOME_BAR_BYTES);
-	dump("us BAR",us_bar,RHIZOME_BAR_BYTES);
-      }
-      else if (us==us_count) relation=-1; /* they have a bundle we don't have */
-      else if (them==them_count) relation=+1; /* we have a bundle they don't have */
-      else {
-	DEBUGF("This should never happen.");
-	break;
-      }
-      int who=0;
-      if (relation<0) {
-	/* They have a bundle that we don't have any version of.
-	   Append 16-byte "please send" record consisting of 0x01 followed
-	   by the eight-byte BID prefix from the BAR. */
-	c->buffer[c->buffer_offset_bytes+c->buffer_used]=0x01; /* Please send */
-	bcopy(&buffer[10+them*RHIZOME_BAR_BYTES+RHIZOME_BAR_PREFIX_OFFSET],
-	      &c->buffer[c->buffer_offset_bytes+c->buffer_used+1],
-	      RHIZOME_BAR_PREFIX_BYTES);
-	c->buffer_used+=1+RHIZOME_BAR_PREFIX_BYTES;
-	who=-1;
-	DEBUGF("They have previously unseen bundle %016"PRIx64"*",
-	       rhizome_bar_bidprefix_ll(&buffer[10+them*RHIZOME_BAR_BYTES]));
-      } else if (relation>0) {
-	/* We have a bundle that they don't have any version of
-	   Append 16-byte "I have [newer]" record consisting of 0x02 followed
-	   by the eight-byte BID prefix from the BAR. */
-	c->buffer[c->buffer_offset_bytes+c->buffer_used]=0x02; /* I have [newer] */
-	bcopy(&usbuffer[10+us*RHIZOME_BAR_BYTES+RHIZOME_BAR_PREFIX_OFFSET],
-	      &c->buffer[c->buffer_offset_bytes+c->buffer_used+1],
-	      RHIZOME_BAR_PREFIX_BYTES);
-	c->buffer_used+=1+RHIZOME_BAR_PREFIX_BYTES;
-	who=+1;
-	DEBUGF("We have previously unseen bundle %016"PRIx64"*",
-	       rhizome_bar_bidprefix_ll(&usbuffer[10+us*RHIZOME_BAR_BYTES]));
+  c->buffer_used=rhizome_direct_compare_bars(&buffer[10],them_count,&usbuffer[10],us_count,
+					     &c->buffer[c->buffer_offset_bytes],
+					     c->buffer_size-c->buffer_offset_bytes);
+  return c;
+}
+
+/* The lowest and highest BIDs in a range. */
+static void range_bounds(const struct rhizome_direct_range *range, rhizome_bid_t *low, rhizome_bid_t *high)
+{
+  *low = RHIZOME_BID_ZERO;
+  *high = RHIZOME_BID_MAX;
+  unsigned i;
+  for (i = 0; i < range->bits; i += 8) {
+    unsigned char byte = range->prefix[i / 8];
+    unsigned char mask = range->bits - i >= 8 ? 0xFF : 0xFF << (8 - (range->bits - i));
+    low->binary[i / 8] = byte & mask;
+    high->binary[i / 8] = byte | ~mask;
+  }
+}
+
+/* Count the bundles in a range, and if <digest> is not NULL, write the digest of their BARs.  If
+   <bars_out> is not NULL, copy up to <bars_requested> of their BARs to it, in BID order.  The
+   (id, bar) index covers this query, so it reads no manifest rows.  Returns the count, or -1 on
+   error.
+*/
+int rhizome_direct_range_scan(const struct rhizome_direct_range *range, unsigned char *digest,
+			      unsigned char *bars_out, int bars_requested)
+{
+  rhizome_bid_t low, high;
+  range_bounds(range, &low, &high);
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite3_stmt *statement = sqlite_prepare_bind(&retry,
+      "SELECT bar FROM MANIFESTS WHERE id >= ? AND id <= ? ORDER BY id;",
+      RHIZOME_BID_T, &low,
+      RHIZOME_BID_T, &high,
+      END);
+  if (!statement)
+    return -1;
+  SHA512_CTX context;
+  if (digest)
+    SHA512_Init(&context);
+  int count = 0;
+  while (sqlite_step_retry(&retry, statement) == SQLITE_ROW) {
+    if (sqlite3_column_type(statement, 0) != SQLITE_BLOB
+	|| sqlite3_column_bytes(statement, 0) != RHIZOME_BAR_BYTES)
+      continue;
+    const unsigned char *bar = sqlite3_column_blob(statement, 0);
+    /* Leave out the TTL, which differs between copies of the same bundle. */
+    if (digest)
+      SHA512_Update(&context, bar, RHIZOME_BAR_COMPARE_BYTES);
+    if (bars_out && count < bars_requested)
+      bcopy(bar, &bars_out[count * RHIZOME_BAR_BYTES], RHIZOME_BAR_BYTES);
+    count++;
+  }
+  sqlite3_finalize(statement);
+  if (digest) {
+    unsigned char hash[SHA512_DIGEST_LENGTH];
+    SHA512_Final(hash, &context);
+    bcopy(hash, digest, RHIZOME_DIRECT_RANGE_DIGEST_BYTES);
+  }
+  return count;
+}
+
+/* Range enquiries are a sequence of records, each a type byte, the number of prefix bits and
+   the prefix of the range:
+
+     'D' count[4] digest[8]  - the enquirer's count and digest of the bundles in the range
+     'B' count[2] BARs       - the enquirer's BARs for the range, in BID order
+
+   The response starts with a bitmap with a bit for each 'D' record, set if our digest differs,
+   then our four byte count for each range that differs, then the action records for all the
+   'B' records, as in the response to a cursor fill.
+*/
+#define RANGE_RECORD_HEADER (1+1+RHIZOME_DIRECT_RANGE_PREFIX_BYTES)
+#define RANGE_DIGEST_RECORD (RANGE_RECORD_HEADER+4+RHIZOME_DIRECT_RANGE_DIGEST_BYTES)
+
+/* Step over the next record of a range enquiry.  Returns the offset of the record after it, or
+   -1 if the record is malformed.
+*/
+static ssize_t range_record_next(const unsigned char *request, size_t length, size_t offset,
+				 struct rhizome_direct_range *range)
+{
+  if (offset+RANGE_RECORD_HEADER>length)
+    return -1;
+  range->bits=request[offset+1];
+  if (range->bits>RHIZOME_DIRECT_RANGE_PREFIX_BYTES*8)
+    return -1;
+  bcopy(&request[offset+2],range->prefix,RHIZOME_DIRECT_RANGE_PREFIX_BYTES);
+  switch (request[offset]) {
+  case 'D':
+    range->leaf=0;
+    offset+=RANGE_DIGEST_RECORD;
+    break;
+  case 'B':
+    range->leaf=1;
+    if (offset+RANGE_RECORD_HEADER+2>length)
+      return -1;
+    offset+=RANGE_RECORD_HEADER+2+read_uint16((unsigned char *)&request[offset+RANGE_RECORD_HEADER])*RHIZOME_BAR_BYTES;
+    break;
+  default:
+    return -1;
+  }
+  return offset>length ? -1 : (ssize_t)offset;
+}
+
+/* Answer a range enquiry.  Returns the number of bytes written to <response>, or -1 if the
+   enquiry is malformed.
+*/
+int rhizome_direct_get_range_response(const unsigned char *request, size_t request_length,
+				      unsigned char *response, size_t response_size)
+{
+  struct rhizome_direct_range range;
+  unsigned digests=0;
+  ssize_t offset=0;
+  while (offset<(ssize_t)request_length) {
+    if ((offset=range_record_next(request,request_length,offset,&range))==-1)
+      return WHY("Malformed range enquiry");
+    if (!range.leaf)
+      digests++;
+  }
+  size_t bitmap_bytes=(digests+7)/8;
+  if (bitmap_bytes+digests*4>response_size)
+    return WHY("Range enquiry is too large");
+  bzero(response,bitmap_bytes);
+  size_t used=bitmap_bytes;
+
+  /* Counts of differing ranges come before the actions, so do the digests first. */
+  unsigned n=0;
+  size_t next;
+  for (offset=0;offset<(ssize_t)request_length;offset=next) {
+    next=range_record_next(request,request_length,offset,&range);
+    if (range.leaf)
+      continue;
+    unsigned char digest[RHIZOME_DIRECT_RANGE_DIGEST_BYTES];
+    int count=rhizome_direct_range_scan(&range,digest,NULL,0);
+    if (count==-1)
+      return -1;
+    if (memcmp(digest,&request[offset+RANGE_RECORD_HEADER+4],RHIZOME_DIRECT_RANGE_DIGEST_BYTES)!=0) {
+      response[n/8]|=1<<(n%8);
+      write_uint32(&response[used],count);
+      used+=4;
+    }
+    n++;
+  }
+  for (offset=0;offset<(ssize_t)request_length;offset=next) {
+    next=range_record_next(request,request_length,offset,&range);
+    if (!range.leaf)
+      continue;
+    unsigned them_count=read_uint16((unsigned char *)&request[offset+RANGE_RECORD_HEADER]);
+    unsigned char us_bars[RHIZOME_DIRECT_RANGE_LEAF_BARS*RHIZOME_BAR_BYTES];
+    int us_count=rhizome_direct_range_scan(&range,NULL,us_bars,RHIZOME_DIRECT_RANGE_LEAF_BARS);
+    if (us_count==-1)
+      return -1;
+    if (us_count>RHIZOME_DIRECT_RANGE_LEAF_BARS)
+      us_count=RHIZOME_DIRECT_RANGE_LEAF_BARS;
+    used+=rhizome_direct_compare_bars(&request[offset+RANGE_RECORD_HEADER+2],them_count,
+				      us_bars,us_count,&response[used],response_size-used);
+  }
+  return used;
+}
+
+static int push_range(rhizome_direct_sync_request *r, const struct rhizome_direct_range *range)
+{
+  if (r->range_count>=r->range_alloc) {
+    unsigned alloc=r->range_alloc ? r->range_alloc*2 : 64;
+    struct rhizome_direct_range *ranges=erealloc(r->ranges,alloc*sizeof *ranges);
+    if (!ranges)
+      return -1;
+    r->ranges=ranges;
+    r->range_alloc=alloc;
+  }
+  r->ranges[r->range_count++]=*range;
+  return 0;
+}
+
+/* Fill the cursor's buffer with a range enquiry, taking as many ranges off the stack as will fit.
+   Returns the number of ranges.
+*/
+static int rhizome_direct_fill_range_enquiry(rhizome_direct_sync_request *r)
+{
+  rhizome_direct_bundle_cursor *c=r->cursor;
+  unsigned char *buffer=c->buffer;
+  size_t used=0;
+  int ranges=0;
+  c->buffer_offset_bytes=0;
+  while (r->range_count) {
+    struct rhizome_direct_range *range=&r->ranges[r->range_count-1];
+    size_t record=range->leaf
+      ? RANGE_RECORD_HEADER+2+RHIZOME_DIRECT_RANGE_LEAF_BARS*RHIZOME_BAR_BYTES
+      : RANGE_DIGEST_RECORD;
+    if (used+record>c->buffer_size)
+      break;
+    buffer[used]=range->leaf?'B':'D';
+    buffer[used+1]=range->bits;
+    bcopy(range->prefix,&buffer[used+2],RHIZOME_DIRECT_RANGE_PREFIX_BYTES);
+    if (range->leaf) {
+      int count=rhizome_direct_range_scan(range,NULL,&buffer[used+RANGE_RECORD_HEADER+2],RHIZOME_DIRECT_RANGE_LEAF_BARS);
+      if (count>RHIZOME_DIRECT_RANGE_LEAF_BARS)
+	count=RHIZOME_DIRECT_RANGE_LEAF_BARS;
+      if (count<0)
+	count=0;
+      write_uint16(&buffer[used+RANGE_RECORD_HEADER],count);
+      used+=RANGE_RECORD_HEADER+2+count*RHIZOME_BAR_BYTES;
+    } else {
+      int count=rhizome_direct_range_scan(range,&buffer[used+RANGE_RECORD_HEADER+4],NULL,0);
+      write_uint32(&buffer[used+RANGE_RECORD_HEADER],count<0?0:count);
+      used+=RANGE_DIGEST_RECORD;
+    }
+    r->range_count--;
+    ranges++;
+  }
+  c->buffer_used=used;
+  return ranges;
+}
+
+/* Process the response to a range enquiry that we sent as <fill>.  Ranges that differ are pushed
+   back onto the stack, either split into sub-ranges or, if they are small enough, to have their
+   BARs compared.  Returns the offset of the action records in the response, or -1 if it is
+   malformed.
+*/
+int rhizome_direct_process_range_response(rhizome_direct_sync_request *r,
+					  const unsigned char *fill, size_t fill_length,
+					  const unsigned char *response, size_t response_length)
+{
+  struct rhizome_direct_range range;
+  unsigned digests=0;
+  ssize_t offset=0;
+  while (offset<(ssize_t)fill_length) {
+    if ((offset=range_record_next(fill,fill_length,offset,&range))==-1)
+      return WHY("Malformed range enquiry");
+    if (!range.leaf)
+      digests++;
+  }
+  size_t used=(digests+7)/8;
+  if (used>response_length)
+    return WHY("Range response is truncated");
+  unsigned n=0;
+  size_t next;
+  for (offset=0;offset<(ssize_t)fill_length;offset=next) {
+    next=range_record_next(fill,fill_length,offset,&range);
+    if (range.leaf)
+      continue;
+    if (response[n/8]&(1<<(n%8))) {
+      if (used+4>response_length)
+	return WHY("Range response is truncated");
+      uint32_t them_count=read_uint32((unsigned char *)&response[used]);
+      uint32_t us_count=read_uint32((unsigned char *)&fill[offset+RANGE_RECORD_HEADER]);
+      used+=4;
+      if (config.debug.rhizome_tx)
+	DEBUGF("Range %s/%d differs, %u bundles here, %u there",
+	       alloca_tohex(range.prefix,(range.bits+7)/8),range.bits,us_count,them_count);
+      if (us_count+them_count<=RHIZOME_DIRECT_RANGE_LEAF_BARS
+	  || range.bits+RHIZOME_DIRECT_RANGE_FANOUT_BITS>RHIZOME_DIRECT_RANGE_PREFIX_BYTES*8) {
+	range.leaf=1;
+	if (push_range(r,&range)==-1)
+	  return -1;
       } else {
-	/* We each have a version of this bundle, so see whose is newer */
-	int64_t them_version = rhizome_bar_version(&buffer[10+them*RHIZOME_BAR_BYTES]);
-	int64_t us_version = rhizome_bar_version(&usbuffer[10+us*RHIZOME_BAR_BYTES]);
-	if (them_version>us_version) {
-	  /* They have the newer version of the bundle */
-	  c->buffer[c->buffer_offset_bytes+c->buffer_used]=0x01; /* Please send */
-	  bcopy(&buffer[10+them*RHIZOME_BAR_BYTES+RHIZOME_BAR_PREFIX_OFFSET],
-		&c->buffer[c->buffer_offset_bytes+c->buffer_used+1],
-		RHIZOME_BAR_PREFIX_BYTES);
-	  c->buffer_used+=1+RHIZOME_BAR_PREFIX_BYTES;
-	  DEBUGF("They have newer version of bundle %016"PRIx64"* (%"PRId64" versus %"PRId64")",
-		 rhizome_bar_bidprefix_ll(&usbuffer[10+us*RHIZOME_BAR_BYTES]),
-		 rhizome_bar_version(&usbuffer[10+us*RHIZOME_BAR_BYTES]),
-		 rhizome_bar_version(&buffer[10+them*RHIZOME_BAR_BYTES]));
-	} else if (them_version<us_version) {
-	  /* We have the newer version of the bundle */
-	  c->buffer[c->buffer_offset_bytes+c->buffer_used]=0x02; /* I have [newer] */
-	  bcopy(&usbuffer[10+us*RHIZOME_BAR_BYTES+RHIZOME_BAR_PREFIX_OFFSET],
-		&c->buffer[c->buffer_offset_bytes+c->buffer_used+1],
-		RHIZOME_BAR_PREFIX_BYTES);
-	  c->buffer_used+=1+RHIZOME_BAR_PREFIX_BYTES;
-	  DEBUGF("We have newer version of bundle %016"PRIx64"* (%"PRId64" versus %"PRId64")",
-		 rhizome_bar_bidprefix_ll(&usbuffer[10+us*RHIZOME_BAR_BYTES]),
-		 rhizome_bar_version(&usbuffer[10+us*RHIZOME_BAR_BYTES]),
-		 rhizome_bar_version(&buffer[10+them*RHIZOME_BAR_BYTES]));
-	} else {
-	  DEBUGF("We both have the same version of %016"PRIx64"*",
-		 rhizome_bar_bidprefix_ll(&buffer[10+them*RHIZOME_BAR_BYTES]));
+	/* Split into sub-ranges, each with the next few bits of prefix. */
+	unsigned i;
+	struct rhizome_direct_range sub=range;
+	sub.bits=range.bits+RHIZOME_DIRECT_RANGE_FANOUT_BITS;
+	for (i=0;i<(1<<RHIZOME_DIRECT_RANGE_FANOUT_BITS);i++) {
+	  unsigned bit;
+	  for (bit=0;bit<RHIZOME_DIRECT_RANGE_FANOUT_BITS;bit++) {
+	    unsigned pos=range.bits+bit;
+	    unsigned char mask=0x80>>(pos%8);
+	    if (i&(1<<(RHIZOME_DIRECT_RANGE_FANOUT_BITS-1-bit)))
+	      sub.prefix[pos/8]|=mask;
+	    else
+	      sub.prefix[pos/8]&=~mask;
+	  }
+	  if (push_range(r,&sub)==-1)
+	    return -1;
 	}
       }
-
-      /* Advance through lists accordingly */
-      switch(who) {
-      case -1: them++; break;
-      case +1: us++; break;
-      case 0: them++; us++; break;
-      }
     }
-
-  return c;
+    n++;
+  }
+  return used;
 }
 
 rhizome_manifest *rhizome_direct_get_manifest(unsigned char *bid_prefix,int prefix_length)
@@ -467,35 +783,137 @@ rhizome_manifest *rhizome_direct_get_manifest(unsigned char *bid_prefix,int pref
 
 }
 
-static int rhizome_sync_with_peers(int mode, int peer_count, const struct config_rhizome_peer *const *peers)
+/* Bundles to pull, shared by all the peers being synced with, so that a bundle offered by more
+   than one peer is only fetched once.  Manifests are fetched in the order they were queued, as
+   fetch slots become free.
+ */
+struct rhizome_direct_pull {
+  struct sockaddr_in addr;
+  unsigned char prefix[RHIZOME_BAR_PREFIX_BYTES];
+};
+
+static struct rhizome_direct_pull *rd_pulls = NULL;
+static unsigned rd_pull_count = 0;
+static unsigned rd_pull_alloc = 0;
+static unsigned rd_pull_next = 0;
+
+/* Return 1 if the bundle was queued to be pulled, 0 if it has already been queued during this
+   sync, or -1 on error.
+ */
+int rhizome_direct_queue_pull(const struct sockaddr_in *addr, const unsigned char *prefix)
+{
+  unsigned i;
+  for (i = 0; i < rd_pull_count; ++i)
+    if (memcmp(rd_pulls[i].prefix, prefix, RHIZOME_BAR_PREFIX_BYTES) == 0)
+      return 0;
+  if (rd_pull_count >= rd_pull_alloc) {
+    unsigned alloc = rd_pull_alloc ? rd_pull_alloc * 2 : 64;
+    struct rhizome_direct_pull *pulls = erealloc(rd_pulls, alloc * sizeof *pulls);
+    if (!pulls)
+      return -1;
+    rd_pulls = pulls;
+    rd_pull_alloc = alloc;
+  }
+  rd_pulls[rd_pull_count].addr = *addr;
+  bcopy(prefix, rd_pulls[rd_pull_count].prefix, RHIZOME_BAR_PREFIX_BYTES);
+  rd_pull_count++;
+  return 1;
+}
+
+int rhizome_direct_pulls_pending()
 {
+  return rd_pull_next < rd_pull_count;
+}
+
+void rhizome_direct_start_pulls()
+{
+  sid_t zerosid = SID_ANY;
+  while (rd_pull_next < rd_pull_count) {
+    struct rhizome_direct_pull *p = &rd_pulls[rd_pull_next];
+    int result = rhizome_fetch_request_manifest_by_prefix(&p->addr, &zerosid, p->prefix, RHIZOME_BAR_PREFIX_BYTES);
+    if (result == SLOTBUSY)
+      return;
+    if (config.debug.rhizome_tx)
+      DEBUGF("Fetching manifest %s* from %s, result=%d",
+	  alloca_tohex(p->prefix, RHIZOME_BAR_PREFIX_BYTES), alloca_sockaddr(&p->addr, sizeof p->addr), result);
+    rd_pull_next++;
+  }
+}
 
-  /* Get iterator capable of 64KB buffering.
-     In future we should parse the sync URL and base the buffer size on the
-     transport and allowable traffic volumes. */
-  rhizome_direct_transport_state_http *state = emalloc_zero(sizeof(rhizome_direct_transport_state_http));
-  /* XXX This code runs each sync in series, when we can probably do them in
-     parallel.  But we can't really do them in parallel until we make the
-     synchronisation process fully asynchronous, which probably won't happen
-     for a while yet.
-     Also, we don't currently parse the URI protocol field fully. */
+void rhizome_direct_clear_pulls()
+{
+  if (rd_pulls)
+    free(rd_pulls);
+  rd_pulls = NULL;
+  rd_pull_count = rd_pull_alloc = rd_pull_next = 0;
+}
+
+/* Sync with all the peers at once.  Each peer has its own sync request and pipeline of enquiries,
+   all driven by the same fd_poll() loop, so a slow or unreachable peer does not hold up the others.
+ */
+static int rhizome_sync_with_peers(struct cli_context *context, int mode, int peer_count, const struct config_rhizome_peer *const *peers)
+{
   int peer_number;
   for (peer_number = 0; peer_number < peer_count; ++peer_number) {
     const struct config_rhizome_peer *peer = peers[peer_number];
     if (strcasecmp(peer->protocol, "http") != 0)
       return WHYF("Unsupported Rhizome Direct protocol %s", alloca_str_toprint(peer->protocol));
-    strbuf h = strbuf_local(state->host, sizeof state->host);
-    strbuf_puts(h, peer->host);
-    if (strbuf_overrun(h))
+    if (strlen(peer->host) >= sizeof ((rhizome_direct_transport_state_http *)0)->host)
       return WHYF("Rhizome Direct host name too long: %s", alloca_str_toprint(peer->host));
-    state->port = peer->port;
-    DEBUGF("Rhizome direct peer is %s://%s:%d", peer->protocol, state->host, state->port);
-    rhizome_direct_sync_request *s = rhizome_direct_new_sync_request(rhizome_direct_http_dispatch, 65536, 0, mode, state);
-    rhizome_direct_start_sync_request(s);
-    if (rd_sync_handle_count > 0)
-      while (fd_poll() && rd_sync_handle_count > 0)
-	;
   }
+  rhizome_direct_transport_state_http *states = emalloc_zero(peer_count * sizeof *states);
+  if (!states)
+    return -1;
+  rhizome_direct_clear_pulls();
+  int next_peer = 0;
+  while (1) {
+    /* Start as many syncs as there are free handles. */
+    while (next_peer < peer_count && rd_sync_handle_count < RHIZOME_DIRECT_MAX_SYNC_HANDLES) {
+      const struct config_rhizome_peer *peer = peers[next_peer];
+      rhizome_direct_transport_state_http *state = &states[next_peer++];
+      strcpy(state->host, peer->host);
+      state->port = peer->port;
+      DEBUGF("Rhizome direct peer is %s://%s:%d", peer->protocol, state->host, state->port);
+      rhizome_direct_sync_request *s = rhizome_direct_new_sync_request(rhizome_direct_http_dispatch, 65536, 0, mode, state);
+      if (!s)
+	break;
+      s->conclude_function = rhizome_direct_http_concluded;
+      s->use_range_digests = config.rhizome.direct.range_digests;
+      state->started = gettime_ms();
+      rhizome_direct_start_sync_request(s);
+    }
+    rhizome_direct_start_pulls();
+    if (!(next_peer < peer_count || rd_sync_handle_count > 0 || rhizome_direct_pulls_pending()
+	|| rhizome_any_fetch_active() || rhizome_any_fetch_queued()))
+      break;
+    if (!fd_poll())
+      break;
+  }
+  rhizome_direct_clear_pulls();
+
+  const char *names[] = {
+    "peer", "fills", "pushed", "pulled", "bytes_sent", "bytes_received", "elapsed_ms", "kbytes_per_sec"
+  };
+  cli_columns(context, NELS(names), names);
+  for (peer_number = 0; peer_number < peer_count; ++peer_number) {
+    rhizome_direct_transport_state_http *state = &states[peer_number];
+    strbuf b = strbuf_alloca(sizeof state->host + 20);
+    strbuf_sprintf(b, "%s:%d", peers[peer_number]->host, peers[peer_number]->port);
+    time_ms_t elapsed = (state->finished ? state->finished : gettime_ms()) - state->started;
+    cli_put_string(context, strbuf_str(b), ":");
+    cli_put_long(context, state->fills_sent, ":");
+    cli_put_long(context, state->bundles_pushed, ":");
+    cli_put_long(context, state->bundles_pulled, ":");
+    cli_put_long(context, state->bytes_sent, ":");
+    cli_put_long(context, state->bytes_received, ":");
+    cli_put_long(context, elapsed, ":");
+    cli_put_long(context, elapsed > 0 ? (state->bytes_sent + state->bytes_received) / elapsed : 0, "\n");
+    INFOF("Rhizome direct sync with %s: %d fills, %d pushed, %d pulled, %"PRIu64" bytes sent, %"PRIu64" received in %"PRId64"ms",
+	strbuf_str(b), state->fills_sent, state->bundles_pushed, state->bundles_pulled,
+	state->bytes_sent, state->bytes_received, elapsed);
+  }
+  cli_row_count(context, peer_count);
+  free(states);
   return 0;
 }
 
@@ -515,7 +933,7 @@ int app_rhizome_direct_sync(const struct cli_parsed *parsed, struct cli_context
     const struct config_rhizome_peer *peers[1] = { &peer };
     int result = cf_opt_rhizome_peer_from_uri(&peer, parsed->args[3]);
     if (result == CFOK)
-      return rhizome_sync_with_peers(mode, 1, peers);
+      return rhizome_sync_with_peers(context, mode, 1, peers);
     else {
       strbuf b = strbuf_alloca(128);
       strbuf_cf_flag_reason(b, result);
@@ -529,7 +947,7 @@ int app_rhizome_direct_sync(const struct cli_parsed *parsed, struct cli_context
     int i;
     for (i = 0; i < config.rhizome.direct.peer.ac; ++i)
       peers[i] = &config.rhizome.direct.peer.av[i].value;
-    return rhizome_sync_with_peers(mode, config.rhizome.direct.peer.ac, peers);
+    return rhizome_sync_with_peers(context, mode, config.rhizome.direct.peer.ac, peers);
   }
 }
 
@@ -108,7 +108,9 @@ static int rhizome_direct_import_end(struct http_request *hr)
   return 0;
 }
 
-int rhizome_direct_enquiry_end(struct http_request *hr)
+/* Both kinds of enquiry POST their request in the 'data' part, and the response is binary.
+ */
+static int rhizome_direct_enquiry_respond(struct http_request *hr, int ranges)
 {
   rhizome_http_request *r = (rhizome_http_request *) hr;
   if (!r->received_data) {
@@ -121,7 +123,7 @@ int rhizome_direct_enquiry_end(struct http_request *hr)
     return 0;
   }
   if (config.debug.rhizome)
-    DEBUGF("Call rhizome_direct_fill_response(%s)", alloca_str_toprint(data_path));
+    DEBUGF("Call rhizome_direct_%s_response(%s)", ranges ? "get_range" : "get_fill", alloca_str_toprint(data_path));
   /* Read data buffer in, pass to rhizome direct for comparison with local
       rhizome database, and send back responses. */
   int fd = open(data_path, O_RDONLY);
@@ -150,6 +152,22 @@ int rhizome_direct_enquiry_end(struct http_request *hr)
     http_request_simple_response(&r->http, 500, "Internal Error: Couldn't mmap file");
     return 0;
   }
+  if (ranges) {
+    unsigned char *response = emalloc(65536);
+    int bytes = response ? rhizome_direct_get_range_response(addr, stat.st_size, response, 65536) : -1;
+    munmap(addr,stat.st_size);
+    close(fd);
+    if (bytes == -1)
+      http_request_simple_response(&r->http, 400, "Malformed range enquiry");
+    else if (http_request_set_response_bufsize(&r->http, bytes) == -1)
+      http_request_simple_response(&r->http, 500, "Internal Error: Out of memory");
+    else
+      http_request_response_static(&r->http, 200, "binary/octet-stream", (const char *)response, bytes);
+    if (response)
+      free(response);
+    rhizome_direct_clear_temporary_files(r);
+    return 0;
+  }
   /* Ask for a fill response.  Regardless of the size of the set of BARs passed
       to us, we will allow up to 64KB of response. */
   rhizome_direct_bundle_cursor *c = rhizome_direct_get_fill_response(addr, stat.st_size, 65536);
@@ -168,6 +186,16 @@ int rhizome_direct_enquiry_end(struct http_request *hr)
   return 0;
 }
 
+int rhizome_direct_enquiry_end(struct http_request *hr)
+{
+  return rhizome_direct_enquiry_respond(hr, 0);
+}
+
+static int rhizome_direct_range_enquiry_end(struct http_request *hr)
+{
+  return rhizome_direct_enquiry_respond(hr, 1);
+}
+
 static int rhizome_direct_addfile_end(struct http_request *hr)
 {
   rhizome_http_request *r = (rhizome_http_request *) hr;
@@ -369,6 +397,13 @@ int rhizome_direct_enquiry(rhizome_http_request *r, const char *remainder)
   return 0;
 }
 
+int rhizome_direct_range_enquiry(rhizome_http_request *r, const char *remainder)
+{
+  int ret = rhizome_direct_enquiry(r, remainder);
+  r->http.handle_content_end = rhizome_direct_range_enquiry_end;
+  return ret;
+}
+
 /* Servald can be configured to accept files without manifests via HTTP from localhost, so that
  * rhizome bundles can be created programatically.  There are probably still some security
  * loop-holes here, which is part of why we leave it disabled by default, but it will be sufficient
@@ -438,362 +473,510 @@ static int receive_http_response(int sock, char *buffer, size_t buffer_len, stru
   return len - (parts->content_start - buffer);
 }
 
-static int fill_buffer(int sock, unsigned char *buffer, int len, int buffer_size){
-  int count;
-  do {
-    if ((count = read(sock, &buffer[len], buffer_size - len)) == -1)
-      return WHYF_perror("read(%d, %p, %d)", sock, &buffer[len], buffer_size - len);
-    len += count;
-  } while (len < buffer_size);
-  return 0;
-}
-
-void rhizome_direct_http_dispatch(rhizome_direct_sync_request *r)
+/* Send one bundle to the peer, blocking until the peer has responded.
+ */
+static void rhizome_direct_http_push(rhizome_direct_transport_state_http *state, unsigned char *bid_prefix)
 {
-  if (config.debug.rhizome_tx)
-    DEBUGF("Dispatch size_high=%"PRId64,r->cursor->size_high);
-  rhizome_direct_transport_state_http *state = r->transport_specific_state;
-
-  sid_t zerosid = SID_ANY;
-
-  int sock=socket(AF_INET, SOCK_STREAM, 0);
-  if (sock==-1) {
-    WHY_perror("socket");
-    goto end;
-  }
-
-  struct hostent *hostent;
-  hostent = gethostbyname(state->host);
-  if (!hostent) {
-    if (config.debug.rhizome_tx)
-      DEBUGF("could not resolve hostname");
-    goto end;
+  /* Start by getting the manifest, which is the main thing we need, and also
+     gives us the information we need for sending any associated file. */
+  rhizome_manifest *m = rhizome_direct_get_manifest(bid_prefix, RHIZOME_BAR_PREFIX_BYTES);
+  if (m == NULL) {
+    WHY("This should never happen.  The manifest exists, but when I went looking for it, it doesn't appear to be there.");
+    return;
   }
 
-  struct sockaddr_in addr;
-  addr.sin_family = AF_INET;
-  addr.sin_port = htons(state->port);
-  addr.sin_addr = *((struct in_addr *)hostent->h_addr);
-  bzero(&(addr.sin_zero),8);
-
-  if (connect(sock, (struct sockaddr *)&addr, sizeof addr) == -1) {
-    WHYF_perror("connect(%s)", alloca_sockaddr(&addr, sizeof addr));
-    close(sock);
-    goto end;
+  /* Get filehash and size from manifest if present */
+  if (config.debug.rhizome_tx) {
+    DEBUGF("bundle id = %s", alloca_tohex_rhizome_bid_t(m->cryptoSignPublic));
+    DEBUGF("bundle filehash = %s", alloca_tohex_rhizome_filehash_t(m->filehash));
+    DEBUGF("file size = %"PRId64, m->filesize);
+    DEBUGF("version = %"PRId64, m->version);
   }
 
   char boundary[20];
   char buffer[8192];
-
   strbuf bb = strbuf_local(boundary, sizeof boundary);
   strbuf_sprintf(bb, "%08lx%08lx", random(), random());
   assert(!strbuf_overrun(bb));
-  strbuf content_preamble = strbuf_alloca(200);
-  strbuf content_postamble = strbuf_alloca(40);
-  strbuf_sprintf(content_preamble,
-      "--%s\r\n"
-      "Content-Disposition: form-data; name=\"data\"; filename=\"IHAVEs\"\r\n"
-      "Content-Type: application/octet-stream\r\n"
-      "\r\n",
-      boundary
-    );
-  strbuf_sprintf(content_postamble, "\r\n--%s--\r\n", boundary);
-  assert(!strbuf_overrun(content_preamble));
-  assert(!strbuf_overrun(content_postamble));
-  int content_length = strbuf_len(content_preamble)
-		     + r->cursor->buffer_offset_bytes
-		     + r->cursor->buffer_used
-		     + strbuf_len(content_postamble);
-  strbuf request = strbuf_local(buffer, sizeof buffer);
-  strbuf_sprintf(request,
-      "POST /rhizome/enquiry HTTP/1.0\r\n"
-      "Content-Length: %d\r\n"
-      "Content-Type: multipart/form-data; boundary=%s\r\n"
-      "\r\n%s",
-      content_length, boundary, strbuf_str(content_preamble)
-    );
-  assert(!strbuf_overrun(request));
 
-  /* TODO: Refactor this code so that it uses our asynchronous framework.
+  /* We now have everything we need to compose the POST request and send it.
    */
-  int len = strbuf_len(request);
-  int sent=0;
-  while(sent<len) {
+  char *template="POST /rhizome/import HTTP/1.0\r\n"
+    "Content-Length: %d\r\n"
+    "Content-Type: multipart/form-data; boundary=%s\r\n"
+    "\r\n";
+  char *template2="--%s\r\n"
+    "Content-Disposition: form-data; name=\"manifest\"; filename=\"m\"\r\n"
+    "Content-Type: application/octet-stream\r\n"
+    "\r\n";
+  char *template3=
+    "\r\n--%s\r\n"
+    "Content-Disposition: form-data; name=\"data\"; filename=\"d\"\r\n"
+    "Content-Type: application/octet-stream\r\n"
+    "\r\n";
+  /* Work out what the content length should be */
+  if (config.debug.rhizome_tx)
+    DEBUGF("manifest_all_bytes=%u, manifest_bytes=%u", m->manifest_all_bytes, m->manifest_bytes);
+  assert(m->filesize != RHIZOME_SIZE_UNSET);
+  size_t content_length =
+      strlen(template2) - 2 /* minus 2 for the "%s" that gets replaced */
+    + strlen(boundary)
+    + m->manifest_all_bytes
+    + strlen(template3) - 2 /* minus 2 for the "%s" that gets replaced */
+    + strlen(boundary)
+    + m->filesize
+    + strlen("\r\n--") + strlen(boundary) + strlen("--\r\n");
+
+  int len=snprintf(buffer,8192,template,content_length,boundary);
+  len+=snprintf(&buffer[len],8192-len,template2,boundary);
+  memcpy(&buffer[len],m->manifestdata,m->manifest_all_bytes);
+  len+=m->manifest_all_bytes;
+  len+=snprintf(&buffer[len],8192-len,template3,boundary);
+
+  int sock=socket(AF_INET, SOCK_STREAM, 0);
+  if (sock==-1) {
     if (config.debug.rhizome_tx)
-      DEBUGF("write(%d, %s, %d)", sock, alloca_toprint(-1, &buffer[sent], len-sent), len-sent);
-    int count=write(sock,&buffer[sent],len-sent);
-    if (count == -1) {
-      if (errno==EPIPE) goto rx;
-      WHYF_perror("write(%d)", len - sent);
-      close(sock);
-      goto end;
-    }
-    sent+=count;
+      DEBUGF("could not open socket");
+    goto closeit;
+  }
+  if (connect(sock,(struct sockaddr *)&state->addr,sizeof(struct sockaddr)) == -1) {
+    if (config.debug.rhizome_tx)
+      DEBUGF("Could not connect to remote");
+    goto closeit;
   }
 
-  len=r->cursor->buffer_offset_bytes+r->cursor->buffer_used;
-  sent=0;
+  int sent=0;
+  /* Send buffer now */
   while(sent<len) {
-    int count=write(sock,&r->cursor->buffer[sent],len-sent);
-    if (count == -1) {
-      if (errno == EPIPE)
-	goto rx;
-      WHYF_perror("write(%d)", count);
-      close(sock);
-      goto end;
+    int r=write(sock,&buffer[sent],len-sent);
+    if (r>0) sent+=r;
+    if (r<0) goto closeit;
+  }
+  state->bytes_sent += sent;
+
+  /* send file contents */
+  {
+    rhizome_filehash_t filehash;
+    if (rhizome_database_filehash_from_id(&m->cryptoSignPublic, m->version, &filehash) == -1)
+      goto closeit;
+
+    struct rhizome_read read;
+    bzero(&read, sizeof read);
+    if (rhizome_open_read(&read, &filehash))
+      goto closeit;
+
+    uint64_t read_ofs;
+    for(read_ofs=0;read_ofs<m->filesize;){
+      unsigned char buffer[4096];
+      read.offset=read_ofs;
+      ssize_t bytes_read = rhizome_read(&read, buffer, sizeof buffer);
+      if (bytes_read == -1) {
+	rhizome_read_close(&read);
+	goto closeit;
+      }
+      size_t write_ofs = 0;
+      while (write_ofs < (size_t) bytes_read){
+	ssize_t written = write(sock, buffer + write_ofs, (size_t) bytes_read - write_ofs);
+	if (written == -1){
+	  WHY_perror("write");
+	  rhizome_read_close(&read);
+	  goto closeit;
+	}
+	write_ofs += (size_t) written;
+      }
+      read_ofs += (size_t) bytes_read;
+      state->bytes_sent += bytes_read;
     }
-    sent+=count;
+    rhizome_read_close(&read);
   }
-
-  strbuf_reset(request);
-  strbuf_puts(request, strbuf_str(content_postamble));
-  len = strbuf_len(request);
+  /* Send final mime boundary */
+  len=snprintf(buffer,8192,"\r\n--%s--\r\n",boundary);
   sent=0;
   while(sent<len) {
-    if (config.debug.rhizome_tx)
-      DEBUGF("write(%d, %s, %d)", sock, alloca_toprint(-1, &buffer[sent], len-sent), len-sent);
-    int count=write(sock,&buffer[sent],len-sent);
-    if (count == -1) {
-      if (errno==EPIPE) goto rx;
-      WHYF_perror("write(%d)", len - sent);
-      close(sock);
-      goto end;
-    }
-    sent+=count;
+    int r=write(sock,&buffer[sent],len-sent);
+    if (r>0) sent+=r;
+    if (r<0) goto closeit;
   }
+  state->bytes_sent += sent;
 
+  /* get response back. */
   struct http_response_parts parts;
- rx:
-  /* request sent, now get response back. */
-  len=receive_http_response(sock, buffer, sizeof buffer, &parts);
-  if (len == -1) {
+  if ((len = receive_http_response(sock, buffer, sizeof buffer, &parts)) == -1)
+    goto closeit;
+  state->bytes_received += (parts.content_start - buffer) + len;
+  INFOF("Received HTTP response %03u %s", parts.code, parts.reason);
+  state->bundles_pushed++;
+
+closeit:
+  if (sock != -1)
     close(sock);
-    goto end;
-  }
+  rhizome_manifest_free(m);
+}
 
-  /* Allocate a buffer to receive the entire action list */
-  content_length = parts.content_length;
-  unsigned char *actionlist=emalloc(content_length);
-  if (!actionlist){
-    close(sock);
-    goto end;
-  }
-  bcopy(parts.content_start, actionlist, len);
-  if (fill_buffer(sock, actionlist, len, content_length)==-1){
-    free(actionlist);
-    close(sock);
-    goto end;
-  }
-  close(sock);
+/* One enquiry, ie, one cursor fill POSTed to /rhizome/enquiry or one set of ranges POSTed to
+   /rhizome/digest, and the action list that comes back.  The socket is non-blocking and serviced by the scheduler, so enquiries to different
+   peers, and more than one to the same peer, can be in progress at once.
+ */
+struct rhizome_direct_enquiry {
+  struct sched_ent alarm;
+  rhizome_direct_sync_request *r;
+  rhizome_direct_transport_state_http *state;
+  char *request;
+  size_t request_length;
+  size_t request_sent;
+  int ranges;
+  size_t fill_offset;
+  size_t fill_length;
+  char *response;
+  size_t response_length;
+  size_t response_size;
+  // set once the response header has been parsed
+  size_t content_start;
+  uint64_t content_length;
+};
+
+/* A fill response carries at most 64KB of actions, so anything much longer is not from a well
+   behaved peer.
+ */
+#define RHIZOME_DIRECT_MAX_HEADER 8192
+#define RHIZOME_DIRECT_MAX_RESPONSE (65536 + RHIZOME_DIRECT_MAX_HEADER)
 
-  /* We now have the list of (1+RHIZOME_BAR_PREFIX_BYTES)-byte records that indicate
-     the list of BAR prefixes that differ between the two nodes.  We can now action
-     those which are relevant, i.e., based on whether we are pushing, pulling or
-     synchronising (both).
+static struct profile_total enquiry_stats = {
+  .name="rhizome_direct_http_enquiry",
+};
+static struct profile_total pipeline_stats = {
+  .name="rhizome_direct_http_pipeline",
+};
 
-     I am currently undecided as to whether it is cleaner to have some general
-     rhizome direct function for doing that, or whether it just adds unnecessary
-     complication, and the responses should just be handled in here.
+/* Called by the scheduler to put another enquiry into a peer's pipeline.
+ */
+static void rhizome_direct_http_pipeline(struct sched_ent *alarm)
+{
+  rhizome_direct_continue_sync_request((rhizome_direct_sync_request *) alarm);
+}
 
-     For now, I am just going to implement it in here, and we can generalise later.
-  */
-  int i;
-  for(i=10;i<content_length;i+=(1+RHIZOME_BAR_PREFIX_BYTES))
+static void rhizome_direct_http_enquiry_done(struct rhizome_direct_enquiry *e)
+{
+  rhizome_direct_sync_request *r = e->r;
+  rhizome_direct_transport_state_http *state = e->state;
+  if (e->alarm.poll.fd != -1) {
+    unwatch(&e->alarm);
+    close(e->alarm.poll.fd);
+  }
+  unschedule(&e->alarm);
+  if (e->request)
+    free(e->request);
+  if (e->response)
+    free(e->response);
+  free(e);
+  state->enquiries_in_flight--;
+  r->bundle_transfers_in_progress--;
+  unschedule(&r->alarm);
+  rhizome_direct_continue_sync_request(r);
+}
+
+/* We now have the list of (1+RHIZOME_BAR_PREFIX_BYTES)-byte records that indicate
+   the list of BAR prefixes that differ between the two nodes.  We can now action
+   those which are relevant, i.e., based on whether we are pushing, pulling or
+   synchronising (both).
+*/
+static void rhizome_direct_http_process_actions(struct rhizome_direct_enquiry *e, unsigned char *actionlist, size_t length)
+{
+  rhizome_direct_sync_request *r = e->r;
+  rhizome_direct_transport_state_http *state = e->state;
+  r->fill_responses_processed++;
+  size_t i;
+  for(i=0;i+RHIZOME_BAR_PREFIX_BYTES<length;i+=(1+RHIZOME_BAR_PREFIX_BYTES))
     {
       int type=actionlist[i];
       if (type==2&&r->pullP) {
 	/* Need to fetch manifest.  Once we have the manifest, then we can
-	   use our normal bundle fetch routines from rhizome_fetch.c
-
-	   Generate a request like: GET /rhizome/manifestbybar/<hex of bar>
-	   and add it to our list of HTTP fetch requests, then watch
-	   until the request is finished.  That will give us the manifest.
-	   Then as noted above, we can use that to pull the file down using
-	   existing routines.
-	*/
-	if (config.debug.rhizome_tx)
-	  DEBUGF("Fetching manifest %s* @ 0x%x",alloca_tohex(&actionlist[i], 1+RHIZOME_BAR_PREFIX_BYTES),i);
-	if (!rhizome_fetch_request_manifest_by_prefix(&addr, &zerosid, &actionlist[i+1], RHIZOME_BAR_PREFIX_BYTES))
-	  {
-	    /* Fetching the manifest, and then using it to see if we want to
-	       fetch the file for import is all handled asynchronously, so just
-	       wait for it to finish. */
-	    while (rhizome_any_fetch_active() || rhizome_any_fetch_queued())
-	      fd_poll();
-	  }
-
-      } else if (type==1&&r->pushP) {
-	/* Form up the POST request to submit the appropriate bundle. */
-
-	/* Start by getting the manifest, which is the main thing we need, and also
-	   gives us the information we need for sending any associated file. */
-	rhizome_manifest *m = rhizome_direct_get_manifest(&actionlist[i+1], RHIZOME_BAR_PREFIX_BYTES);
-	if (m == NULL) {
-	  WHY("This should never happen.  The manifest exists, but when I went looking for it, it doesn't appear to be there.");
-	  goto next_item;
-	}
-
-	/* Get filehash and size from manifest if present */
-	if (config.debug.rhizome_tx) {
-	  DEBUGF("bundle id = %s", alloca_tohex_rhizome_bid_t(m->cryptoSignPublic));
-	  DEBUGF("bundle filehash = %s", alloca_tohex_rhizome_filehash_t(m->filehash));
-	  DEBUGF("file size = %"PRId64, m->filesize);
-	  DEBUGF("version = %"PRId64, m->version);
-	}
-
-	/* We now have everything we need to compose the POST request and send it.
-	 */
-	char *template="POST /rhizome/import HTTP/1.0\r\n"
-	  "Content-Length: %d\r\n"
-	  "Content-Type: multipart/form-data; boundary=%s\r\n"
-	  "\r\n";
-	char *template2="--%s\r\n"
-	  "Content-Disposition: form-data; name=\"manifest\"; filename=\"m\"\r\n"
-	  "Content-Type: application/octet-stream\r\n"
-	  "\r\n";
-	char *template3=
-	  "\r\n--%s\r\n"
-	  "Content-Disposition: form-data; name=\"data\"; filename=\"d\"\r\n"
-	  "Content-Type: application/octet-stream\r\n"
-	  "\r\n";
-	/* Work out what the content length should be */
-	if (config.debug.rhizome_tx)
-	  DEBUGF("manifest_all_bytes=%u, manifest_bytes=%u", m->manifest_all_bytes, m->manifest_bytes);
-	assert(m->filesize != RHIZOME_SIZE_UNSET);
-	size_t content_length =
-	    strlen(template2) - 2 /* minus 2 for the "%s" that gets replaced */
-	  + strlen(boundary)
-	  + m->manifest_all_bytes
-	  + strlen(template3) - 2 /* minus 2 for the "%s" that gets replaced */
-	  + strlen(boundary)
-	  + m->filesize
-	  + strlen("\r\n--") + strlen(boundary) + strlen("--\r\n");
-
-	int len=snprintf(buffer,8192,template,content_length,boundary);
-	len+=snprintf(&buffer[len],8192-len,template2,boundary);
-	memcpy(&buffer[len],m->manifestdata,m->manifest_all_bytes);
-	len+=m->manifest_all_bytes;
-	len+=snprintf(&buffer[len],8192-len,template3,boundary);
-
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(state->port);
-	addr.sin_addr = *((struct in_addr *)hostent->h_addr);
-	bzero(&(addr.sin_zero),8);
-
-	sock=socket(AF_INET, SOCK_STREAM, 0);
-	if (sock==-1) {
-	  if (config.debug.rhizome_tx)
-	    DEBUGF("could not open socket");
-	  goto closeit;
-	}
-	if (connect(sock,(struct sockaddr *)&addr,sizeof(struct sockaddr)) == -1) {
+	   use our normal bundle fetch routines from rhizome_fetch.c.
+	   The fetches are started by rhizome_direct_start_pulls() as slots
+	   become free, so the next enquiry need not wait for them. */
+	switch (rhizome_direct_queue_pull(&state->addr, &actionlist[i+1])) {
+	case 1:
+	  state->bundles_pulled++;
+	  r->bundles_pulled++;
+	  break;
+	case 0:
 	  if (config.debug.rhizome_tx)
-	    DEBUGF("Could not connect to remote");
-	  goto closeit;
-	}
-
-	int sent=0;
-	/* Send buffer now */
-	while(sent<len) {
-	  int r=write(sock,&buffer[sent],len-sent);
-	  if (r>0) sent+=r;
-	  if (r<0) goto closeit;
-	}
-
-	/* send file contents */
-	{
-	  rhizome_filehash_t filehash;
-	  if (rhizome_database_filehash_from_id(&m->cryptoSignPublic, m->version, &filehash) == -1)
-	    goto closeit;
-
-	  struct rhizome_read read;
-	  bzero(&read, sizeof read);
-	  if (rhizome_open_read(&read, &filehash))
-	    goto closeit;
-
-	  uint64_t read_ofs;
-	  for(read_ofs=0;read_ofs<m->filesize;){
-	    unsigned char buffer[4096];
-	    read.offset=read_ofs;
-	    ssize_t bytes_read = rhizome_read(&read, buffer, sizeof buffer);
-	    if (bytes_read == -1) {
-	      rhizome_read_close(&read);
-	      goto closeit;
-	    }
-	    size_t write_ofs = 0;
-	    while (write_ofs < (size_t) bytes_read){
-	      ssize_t written = write(sock, buffer + write_ofs, (size_t) bytes_read - write_ofs);
-	      if (written == -1){
-		WHY_perror("write");
-		rhizome_read_close(&read);
-		goto closeit;
-	      }
-	      write_ofs += (size_t) written;
-	    }
-	    read_ofs += (size_t) bytes_read;
-	  }
-	  rhizome_read_close(&read);
-	}
-	/* Send final mime boundary */
-	len=snprintf(buffer,8192,"\r\n--%s--\r\n",boundary);
-	sent=0;
-	while(sent<len) {
-	  int r=write(sock,&buffer[sent],len-sent);
-	  if (r>0) sent+=r;
-	  if (r<0) goto closeit;
+	    DEBUGF("Already pulling %s* from another peer", alloca_tohex(&actionlist[i+1], RHIZOME_BAR_PREFIX_BYTES));
+	  break;
 	}
-
-	/* get response back. */
-	if (receive_http_response(sock, buffer, sizeof buffer, &parts) == -1)
-	  goto closeit;
-	INFOF("Received HTTP response %03u %s", parts.code, parts.reason);
-
-      closeit:
-	close(sock);
-
-	if (m) rhizome_manifest_free(m);
+      } else if (type==1&&r->pushP) {
+	rhizome_direct_http_push(state, &actionlist[i+1]);
+	r->bundles_pushed++;
       }
-    next_item:
-      continue;
     }
 
-  free(actionlist);
-
-  /* now update cursor according to what range was covered in the response.
-     We set our current position to just past the high limit of the returned
-     cursor.
-
-     XXX - This introduces potential problems with the returned cursor range.
+  /* XXX - We do not update the cursor according to what range was covered in the response.
      If the far end returns an earlier cursor position than we are in, we could
      end up in an infinite loop.  We could also end up in a very long finite loop
      if the cursor doesn't advance far.  A simple solution is to not adjust the
      cursor position, and simply re-attempt the sync until no actions result.
      That will do for now.
- */
-#ifdef FANCY_CURSOR_POSITION_HANDLING
-  rhizome_direct_bundle_cursor *c=rhizome_direct_bundle_iterator(10);
-  assert(c!=NULL);
-  if (rhizome_direct_bundle_iterator_unpickle_range(c,(unsigned char *)&p[0],10)) {
-    if (config.debug.rhizome_tx)
-      DEBUGF("Couldn't unpickle range. This should never happen.  Assuming near and far cursor ranges match.");
+  */
+}
+
+static void rhizome_direct_http_enquiry_poll(struct sched_ent *alarm)
+{
+  struct rhizome_direct_enquiry *e = (struct rhizome_direct_enquiry *) alarm;
+  rhizome_direct_transport_state_http *state = e->state;
+  if (alarm->poll.revents == 0) {
+    WHYF("Rhizome direct enquiry to %s timed out", alloca_sockaddr(&state->addr, sizeof state->addr));
+    rhizome_direct_http_enquiry_done(e);
+    return;
   }
-  else {
-    if (config.debug.rhizome_tx) {
-      DEBUGF("unpickled size_high=%"PRId64", limit_size_high=%"PRId64, c->size_high, c->limit_size_high);
-      DEBUGF("c->buffer_size=%d",c->buffer_size);
+  if (alarm->poll.revents & POLLOUT) {
+    ssize_t count = write(alarm->poll.fd, &e->request[e->request_sent], e->request_length - e->request_sent);
+    if (count == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+	return;
+      // the far end may have sent its response early and closed the connection
+      if (errno != EPIPE) {
+	WHYF_perror("write(%d)", (int)(e->request_length - e->request_sent));
+	rhizome_direct_http_enquiry_done(e);
+	return;
+      }
+      e->request_sent = e->request_length;
+    } else {
+      e->request_sent += count;
+      state->bytes_sent += count;
     }
-    r->cursor->size_low=c->limit_size_high;
-    /* Set tail of BID to all high, as we assume the far end has returned all
-       BIDs with the specified prefix. */
-    r->cursor->bid_low = RHIZOME_BID_MAX;
-    bcopy(c->limit_bid_high.binary, r->cursor->bid_low.binary, 4);
-  }
-  rhizome_direct_bundle_iterator_free(&c);
-#endif
-
-  end:
-  /* Warning: tail recursion when done this way.
-     Should be triggered by an asynchronous event.
-     But this will do for now. */
-  rhizome_direct_continue_sync_request(r);
+    if (e->request_sent >= e->request_length) {
+      alarm->poll.events = POLLIN;
+      watch(alarm);
+    }
+    return;
+  }
+  if (alarm->poll.revents & (POLLIN | POLLHUP | POLLERR)) {
+    if (e->response_length + 1 >= e->response_size) {
+      if (e->response_size >= RHIZOME_DIRECT_MAX_RESPONSE) {
+	WHYF("Rhizome direct enquiry response from %s is too long", alloca_sockaddr(&state->addr, sizeof state->addr));
+	rhizome_direct_http_enquiry_done(e);
+	return;
+      }
+      size_t size = e->response_size ? e->response_size * 2 : 8192;
+      if (size > RHIZOME_DIRECT_MAX_RESPONSE)
+	size = RHIZOME_DIRECT_MAX_RESPONSE;
+      char *response = erealloc(e->response, size);
+      if (!response) {
+	rhizome_direct_http_enquiry_done(e);
+	return;
+      }
+      e->response = response;
+      e->response_size = size;
+    }
+    ssize_t count = read(alarm->poll.fd, &e->response[e->response_length], e->response_size - e->response_length - 1);
+    if (count == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+	return;
+      WHYF_perror("read(%d)", alarm->poll.fd);
+      rhizome_direct_http_enquiry_done(e);
+      return;
+    }
+    e->response_length += count;
+    e->response[e->response_length] = '\0';
+    state->bytes_received += count;
+    if (!e->content_start) {
+      int header_end = is_http_header_complete(e->response, e->response_length, count);
+      if (!header_end) {
+	if (count == 0) {
+	  WHY("Rhizome direct enquiry response ended before HTTP header");
+	  rhizome_direct_http_enquiry_done(e);
+	} else if (e->response_length >= RHIZOME_DIRECT_MAX_HEADER) {
+	  WHYF("Rhizome direct enquiry response from %s has too long a header", alloca_sockaddr(&state->addr, sizeof state->addr));
+	  rhizome_direct_http_enquiry_done(e);
+	}
+	return;
+      }
+      // unpack_http_response() modifies the header, so parse a copy of just the header
+      size_t header_length = header_end + 1;
+      char header[header_length + 1];
+      bcopy(e->response, header, header_length);
+      header[header_length] = '\0';
+      struct http_response_parts parts;
+      if (unpack_http_response(header, &parts) == -1) {
+	rhizome_direct_http_enquiry_done(e);
+	return;
+      }
+      if (parts.code == 404 && e->ranges) {
+	/* An older server, so fall back to sending every BAR in cursor fills. */
+	INFOF("%s does not support range digests", alloca_sockaddr(&state->addr, sizeof state->addr));
+	e->r->use_range_digests = 0;
+	e->r->range_count = 0;
+	rhizome_direct_http_enquiry_done(e);
+	return;
+      }
+      if (parts.code != 200 && parts.code != 201) {
+	INFOF("Failed HTTP request: server returned %03u %s", parts.code, parts.reason);
+	rhizome_direct_http_enquiry_done(e);
+	return;
+      }
+      if (parts.content_length == -1) {
+	if (config.debug.rhizome_rx)
+	  DEBUGF("Invalid HTTP reply: missing Content-Length header");
+	rhizome_direct_http_enquiry_done(e);
+	return;
+      }
+      if (config.debug.rhizome_rx)
+	DEBUGF("Received HTTP response %03u %s, content_length=%"PRId64, parts.code, parts.reason, parts.content_length);
+      e->content_start = parts.content_start - header;
+      e->content_length = parts.content_length;
+      if (e->content_length >= RHIZOME_DIRECT_MAX_RESPONSE - e->content_start) {
+	WHYF("Rhizome direct enquiry response from %s is too long", alloca_sockaddr(&state->addr, sizeof state->addr));
+	rhizome_direct_http_enquiry_done(e);
+	return;
+      }
+    }
+    if (e->response_length < e->content_start + e->content_length) {
+      if (count == 0) {
+	WHY("Rhizome direct enquiry response is truncated");
+	rhizome_direct_http_enquiry_done(e);
+      }
+      return;
+    }
+    unwatch(alarm);
+    close(alarm->poll.fd);
+    alarm->poll.fd = -1;
+    unsigned char *content = (unsigned char *) &e->response[e->content_start];
+    size_t actions = 10;
+    if (e->ranges) {
+      int offset = rhizome_direct_process_range_response(e->r,
+	  (unsigned char *) &e->request[e->fill_offset], e->fill_length, content, e->content_length);
+      if (offset == -1) {
+	rhizome_direct_http_enquiry_done(e);
+	return;
+      }
+      actions = offset;
+    }
+    if (e->content_length > actions)
+      rhizome_direct_http_process_actions(e, content + actions, e->content_length - actions);
+    rhizome_direct_http_enquiry_done(e);
+  }
+}
+
+void rhizome_direct_http_dispatch(rhizome_direct_sync_request *r)
+{
+  if (config.debug.rhizome_tx)
+    DEBUGF("Dispatch size_high=%"PRId64,r->cursor->size_high);
+  rhizome_direct_transport_state_http *state = r->transport_specific_state;
+  state->fills_sent++;
+
+  struct rhizome_direct_enquiry *e = emalloc_zero(sizeof(struct rhizome_direct_enquiry));
+  if (!e)
+    return;
+  e->r = r;
+  e->state = state;
+  e->alarm.poll.fd = -1;
+  e->alarm.function = rhizome_direct_http_enquiry_poll;
+  e->alarm.stats = &enquiry_stats;
+  e->ranges = r->use_range_digests;
+  state->enquiries_in_flight++;
+  r->bundle_transfers_in_progress++;
+
+  if (state->addr.sin_family != AF_INET) {
+    struct hostent *hostent = gethostbyname(state->host);
+    if (!hostent) {
+      if (config.debug.rhizome_tx)
+	DEBUGF("could not resolve hostname");
+      goto fail;
+    }
+    state->addr.sin_family = AF_INET;
+    state->addr.sin_port = htons(state->port);
+    state->addr.sin_addr = *((struct in_addr *)hostent->h_addr);
+    bzero(&(state->addr.sin_zero),8);
+  }
+
+  char boundary[20];
+  strbuf bb = strbuf_local(boundary, sizeof boundary);
+  strbuf_sprintf(bb, "%08lx%08lx", random(), random());
+  assert(!strbuf_overrun(bb));
+  strbuf content_preamble = strbuf_alloca(200);
+  strbuf content_postamble = strbuf_alloca(40);
+  strbuf_sprintf(content_preamble,
+      "--%s\r\n"
+      "Content-Disposition: form-data; name=\"data\"; filename=\"IHAVEs\"\r\n"
+      "Content-Type: application/octet-stream\r\n"
+      "\r\n",
+      boundary
+    );
+  strbuf_sprintf(content_postamble, "\r\n--%s--\r\n", boundary);
+  assert(!strbuf_overrun(content_preamble));
+  assert(!strbuf_overrun(content_postamble));
+  size_t fill_length = r->cursor->buffer_offset_bytes + r->cursor->buffer_used;
+  int content_length = strbuf_len(content_preamble) + fill_length + strbuf_len(content_postamble);
+  strbuf header = strbuf_alloca(400);
+  strbuf_sprintf(header,
+      "POST /rhizome/%s HTTP/1.0\r\n"
+      "Content-Length: %d\r\n"
+      "Content-Type: multipart/form-data; boundary=%s\r\n"
+      "\r\n%s",
+      e->ranges ? "digest" : "enquiry", content_length, boundary, strbuf_str(content_preamble)
+    );
+  assert(!strbuf_overrun(header));
+
+  /* The cursor is refilled for the next enquiry while this one is in flight, so take a copy. */
+  e->request_length = strbuf_len(header) + fill_length + strbuf_len(content_postamble);
+  if ((e->request = emalloc(e->request_length)) == NULL)
+    goto fail;
+  bcopy(strbuf_str(header), e->request, strbuf_len(header));
+  e->fill_offset = strbuf_len(header);
+  e->fill_length = fill_length;
+  bcopy(r->cursor->buffer, e->request + strbuf_len(header), fill_length);
+  bcopy(strbuf_str(content_postamble), e->request + strbuf_len(header) + fill_length, strbuf_len(content_postamble));
+
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (sock == -1) {
+    WHY_perror("socket");
+    goto fail;
+  }
+  e->alarm.poll.fd = sock;
+  if (set_nonblock(sock) == -1)
+    goto fail;
+  if (connect(sock, (struct sockaddr *)&state->addr, sizeof state->addr) == -1 && errno != EINPROGRESS) {
+    WHYF_perror("connect(%s)", alloca_sockaddr(&state->addr, sizeof state->addr));
+    goto fail;
+  }
+  e->alarm.poll.events = POLLOUT;
+  watch(&e->alarm);
+  e->alarm.alarm = gettime_ms() + config.rhizome.idle_timeout;
+  e->alarm.deadline = e->alarm.alarm + config.rhizome.idle_timeout;
+  schedule(&e->alarm);
+
+  /* Fill the pipeline on the next pass through the scheduler, rather than recursing. */
+  if (state->enquiries_in_flight < RHIZOME_DIRECT_HTTP_PIPELINE && !is_scheduled(&r->alarm)) {
+    r->alarm.function = rhizome_direct_http_pipeline;
+    r->alarm.stats = &pipeline_stats;
+    r->alarm.alarm = gettime_ms();
+    r->alarm.deadline = r->alarm.alarm + 1000;
+    schedule(&r->alarm);
+  }
+  return;
+
+fail:
+  /* Move on to the next cursor fill, as if this one had no response. */
+  if (e->alarm.poll.fd != -1) {
+    close(e->alarm.poll.fd);
+    e->alarm.poll.fd = -1;
+  }
+  if (!is_scheduled(&r->alarm)) {
+    r->alarm.function = rhizome_direct_http_pipeline;
+    r->alarm.stats = &pipeline_stats;
+    r->alarm.alarm = gettime_ms();
+    r->alarm.deadline = r->alarm.alarm + 1000;
+    schedule(&r->alarm);
+  }
+  if (e->request)
+    free(e->request);
+  free(e);
+  state->enquiries_in_flight--;
+  r->bundle_transfers_in_progress--;
+}
+
+void rhizome_direct_http_concluded(rhizome_direct_sync_request *r)
+{
+  rhizome_direct_transport_state_http *state = r->transport_specific_state;
+  state->finished = gettime_ms();
 }
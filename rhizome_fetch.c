@@ -84,11 +84,34 @@ struct rhizome_fetch_slot {
   uint64_t mdp_last_request_offset;
   int mdpResponsesOutstanding;
   int mdpRXBlockLength;
-  unsigned char mdpRXWindow[32*200];
+  /* Congestion control: blocks asked for in each request, the slow start threshold, and whether
+     the last request was a retry, which makes its round trip time ambiguous */
+  unsigned mdpWindow;
+  unsigned mdpSsthresh;
+  int mdpRetry;
+  /* Blocks asked for in the last request, and the offset of the last of them, which the peer
+     sends last, so that once it arrives any still outstanding have been lost */
+  unsigned mdpRequested;
+  uint64_t mdpLastBlockOffset;
+  int mdpRTTSampled;
+  /* Smoothed round trip time and its variation, in ms, and the retransmit timeout backoff */
+  time_ms_t mdpSRTT;
+  time_ms_t mdpRTTVar;
+  unsigned mdpBackoff;
+  /* Transfer statistics */
+  unsigned mdpRequests;
+  unsigned mdpTimeouts;
+  unsigned mdpBlocks;
+  unsigned mdpDuplicates;
+  /* Set if the manifest has a Merkle root, so blocks are requested with proofs */
+  int mdpMerkle;
+  /* Set once a proved block has arrived, after which unproved blocks are ignored */
+  int mdpVerified;
 };
 
 static int rhizome_fetch_switch_to_mdp(struct rhizome_fetch_slot *slot);
 static int rhizome_fetch_mdp_requestblocks(struct rhizome_fetch_slot *slot);
+int rhizome_write_complete(struct rhizome_fetch_slot *slot);
 
 /* Represents a queue of fetch candidates and a single active fetch for bundle payloads whose size
  * is less than a given threshold.
@@ -203,6 +226,9 @@ int rhizome_fetch_status_html(strbuf b)
 	q->active.write_state.file_offset,
 	q->active.manifest->filesize,
 	alloca_tohex_sid_t_trunc(q->active.peer_sid, 16));
+      if (q->active.state==RHIZOME_FETCH_RXFILEMDP)
+	strbuf_sprintf(b, ", window %u x %d bytes, rtt %"PRId64"ms, %u timeouts",
+	  q->active.mdpWindow, q->active.mdpRXBlockLength, q->active.mdpSRTT, q->active.mdpTimeouts);
     }else{
       strbuf_puts(b, "inactive");
     }
@@ -268,7 +294,8 @@ static struct rhizome_fetch_slot *fetch_search_slot(const unsigned char *id, int
   for (i = 0; i < NQUEUES; ++i) {
     struct rhizome_fetch_queue *q = &rhizome_fetch_queues[i];
     
-    if (q->active.state != RHIZOME_FETCH_FREE && 
+    // slots fetching a manifest by prefix have no manifest yet
+    if (q->active.state != RHIZOME_FETCH_FREE && q->active.manifest &&
 	memcmp(id, q->active.manifest->cryptoSignPublic.binary, prefix_length) == 0)
       return &q->active;
   }
@@ -305,6 +332,102 @@ rhizome_manifest * rhizome_fetch_search(const unsigned char *id, int prefix_leng
   return NULL;
 }
 
+/* Blocks overheard in MDP replies to other nodes, for bundles that are queued for fetching but whose
+ * fetch has not yet switched to MDP.  Kept in order of arrival, so the oldest are discarded first
+ * when the total size would exceed rhizome.mdp.overheard_bytes, and merged into the fetch's
+ * rhizome_write when it begins.
+ */
+struct overheard_block {
+  struct overheard_block *_next;
+  rhizome_bid_t bid;
+  uint64_t version;
+  uint64_t offset;
+  size_t size;
+  unsigned char data[0];
+};
+
+static struct overheard_block *overheard_head = NULL;
+static struct overheard_block **overheard_tail = &overheard_head;
+static uint64_t overheard_bytes = 0;
+
+static void overheard_unlink(struct overheard_block **ptr)
+{
+  struct overheard_block *b = *ptr;
+  *ptr = b->_next;
+  if (overheard_tail == &b->_next)
+    overheard_tail = ptr;
+  overheard_bytes -= b->size;
+  free(b);
+}
+
+/* Discard all overheard blocks of the given bundle, eg, because it is no longer queued.
+ */
+static void overheard_drop(const rhizome_bid_t *bidp)
+{
+  struct overheard_block **ptr = &overheard_head;
+  while (*ptr) {
+    if (cmp_rhizome_bid_t(&(*ptr)->bid, bidp) == 0)
+      overheard_unlink(ptr);
+    else
+      ptr = &(*ptr)->_next;
+  }
+}
+
+static void overheard_stage(const rhizome_manifest *m, uint64_t offset, size_t count, const unsigned char *bytes)
+{
+  if (count == 0 || count > config.rhizome.mdp.overheard_bytes)
+    return;
+  if (m->filesize == RHIZOME_SIZE_UNSET || offset >= m->filesize || count > m->filesize - offset)
+    return;
+  struct overheard_block *b;
+  for (b = overheard_head; b; b = b->_next)
+    if (b->offset == offset && b->version == m->version && cmp_rhizome_bid_t(&b->bid, &m->cryptoSignPublic) == 0)
+      return;
+  while (overheard_head && overheard_bytes + count > config.rhizome.mdp.overheard_bytes)
+    overheard_unlink(&overheard_head);
+  if ((b = emalloc(sizeof *b + count)) == NULL)
+    return;
+  b->_next = NULL;
+  b->bid = m->cryptoSignPublic;
+  b->version = m->version;
+  b->offset = offset;
+  b->size = count;
+  bcopy(bytes, b->data, count);
+  *overheard_tail = b;
+  overheard_tail = &b->_next;
+  overheard_bytes += count;
+  if (config.debug.rhizome_rx)
+    DEBUGF("Staged overheard block of %s @%"PRIu64", %zu bytes (%"PRIu64" bytes staged)",
+	   alloca_tohex_rhizome_bid_t(m->cryptoSignPublic), offset, count, overheard_bytes);
+}
+
+/* Write any overheard blocks of the bundle being fetched into the slot, then discard them.
+ */
+static int overheard_merge(struct rhizome_fetch_slot *slot)
+{
+  uint64_t merged = 0;
+  int ret = 0;
+  struct overheard_block **ptr = &overheard_head;
+  while (*ptr) {
+    struct overheard_block *b = *ptr;
+    if (cmp_rhizome_bid_t(&b->bid, &slot->manifest->cryptoSignPublic) != 0) {
+      ptr = &b->_next;
+      continue;
+    }
+    if (ret == 0 && b->version == slot->manifest->version) {
+      if (rhizome_random_write(&slot->write_state, b->offset, b->data, b->size))
+	ret = -1;
+      else
+	merged += b->size;
+    }
+    overheard_unlink(ptr);
+  }
+  if (merged && config.debug.rhizome_rx)
+    DEBUGF("Merged %"PRIu64" bytes of overheard blocks into fetch of %s",
+	   merged, alloca_tohex_rhizome_bid_t(slot->manifest->cryptoSignPublic));
+  return ret;
+}
+
 /* Insert a candidate into a given queue at a given position.  All candidates succeeding the given
  * position are copied backward in the queue to open up an empty element at the given position.  If
  * the queue was full, then the tail element is discarded, freeing the manifest it points to.
@@ -319,8 +442,10 @@ static struct rhizome_fetch_candidate *rhizome_fetch_insert(struct rhizome_fetch
     DEBUGF("insert queue[%d] candidate[%u]", (int)(q - rhizome_fetch_queues), i);
   assert(i >= 0 && i < q->candidate_queue_size);
   assert(i == 0 || c[-1].manifest);
-  if (e->manifest) // queue is full
+  if (e->manifest) { // queue is full
+    overheard_drop(&e->manifest->cryptoSignPublic);
     rhizome_manifest_free(e->manifest);
+  }
   else
     while (e > c && !e[-1].manifest)
       --e;
@@ -344,6 +469,7 @@ static void rhizome_fetch_unqueue(struct rhizome_fetch_queue *q, unsigned i)
   if (config.debug.rhizome_rx)
     DEBUGF("unqueue queue[%d] candidate[%d] manifest=%p", (int)(q - rhizome_fetch_queues), i, c->manifest);
   if (c->manifest) {
+    overheard_drop(&c->manifest->cryptoSignPublic);
     rhizome_manifest_free(c->manifest);
     c->manifest = NULL;
   }
@@ -526,7 +652,7 @@ static int schedule_fetch(struct rhizome_fetch_slot *slot)
       RETURN(WHY("request overrun"));
     slot->request_len = strbuf_len(r);
 
-    if (rhizome_open_write(&slot->write_state, &slot->manifest->filehash, slot->manifest->filesize, RHIZOME_PRIORITY_DEFAULT))
+    if (rhizome_open_write(&slot->write_state, &slot->manifest->filehash, slot->manifest->filesize, RHIZOME_PRIORITY_DEFAULT, slot->manifest->service))
       RETURN(-1);
   } else {
     strbuf r = strbuf_local(slot->request, sizeof slot->request);
@@ -702,7 +828,7 @@ rhizome_fetch(struct rhizome_fetch_slot *slot, rhizome_manifest *m, const struct
   for (i = 0; i < NQUEUES; ++i) {
     struct rhizome_fetch_slot *as = &rhizome_fetch_queues[i].active;
     const rhizome_manifest *am = as->manifest;
-    if (as->state != RHIZOME_FETCH_FREE && cmp_rhizome_filehash_t(&m->filehash, &am->filehash) == 0) {
+    if (as->state != RHIZOME_FETCH_FREE && am && cmp_rhizome_filehash_t(&m->filehash, &am->filehash) == 0) {
       if (config.debug.rhizome_rx)
 	DEBUGF("   fetch already in progress, slot=%d filehash=%s", i, alloca_tohex_rhizome_filehash_t(m->filehash));
       RETURN(SAMEPAYLOAD);
@@ -1009,8 +1135,10 @@ static int rhizome_fetch_close(struct rhizome_fetch_slot *slot)
   slot->alarm.poll.fd = -1;
 
   /* Free ephemeral data */
-  if (slot->manifest)
+  if (slot->manifest) {
+    overheard_drop(&slot->manifest->cryptoSignPublic);
     rhizome_manifest_free(slot->manifest);
+  }
   slot->manifest = NULL;
 
   if (slot->previous)
@@ -1031,11 +1159,58 @@ static int rhizome_fetch_close(struct rhizome_fetch_slot *slot)
   return 0;
 }
 
+/* Adjust the window once a request has been answered, as far as it is going to be.  Grow it when
+   the whole request got through, exponentially up to the slow start threshold and linearly after
+   that.  Radio links lose packets at random whether or not they are busy, so a request that only
+   partly got through leaves the window as it is, and only one that was lost entirely halves it and
+   backs off the retransmit timeout.  When nothing at all gets through one block at a time, halve
+   the block size too, as big packets get through lossy links only rarely.  Proved blocks must stay
+   the size of the Merkle tree's.
+ */
+static void rhizome_fetch_mdp_request_end(struct rhizome_fetch_slot *slot, int timeout)
+{
+  unsigned outstanding = slot->mdpResponsesOutstanding > 0 ? slot->mdpResponsesOutstanding : 0;
+  unsigned delivered = slot->mdpRequested > outstanding ? slot->mdpRequested - outstanding : 0;
+  if (delivered == 0) {
+    // slow start back to at least the initial window, as the next request may well get through
+    slot->mdpSsthresh = slot->mdpWindow / 2;
+    if (slot->mdpSsthresh < config.rhizome.mdp.window_initial)
+      slot->mdpSsthresh = config.rhizome.mdp.window_initial;
+    if (slot->mdpSsthresh < 2)
+      slot->mdpSsthresh = 2;
+    if (slot->mdpWindow <= 1 && !slot->mdpMerkle && slot->mdpRXBlockLength > RHIZOME_MDP_MIN_BLOCK_SIZE)
+      slot->mdpRXBlockLength /= 2;
+    slot->mdpWindow = slot->mdpWindow / 2 > 1 ? slot->mdpWindow / 2 : 1;
+    if (slot->mdpBackoff < 4)
+      slot->mdpBackoff++;
+  } else if (outstanding == 0) {
+    if (slot->mdpWindow < slot->mdpSsthresh)
+      slot->mdpWindow += delivered;
+    else if (delivered >= slot->mdpWindow)
+      slot->mdpWindow++;
+  }
+  if (slot->mdpWindow > config.rhizome.mdp.window_max)
+    slot->mdpWindow = config.rhizome.mdp.window_max;
+  if (delivered && !slot->mdpMerkle && slot->mdpRXBlockLength < config.rhizome.rhizome_mdp_block_size
+      && slot->mdpRXBlockLength < RHIZOME_MDP_MAX_BLOCK_SIZE)
+    slot->mdpRXBlockLength *= 2;
+  // Karn's algorithm: if this request timed out with nothing back, a reply to the next request
+  // may be for this one; a request that was partly answered has been dealt with by the peer
+  slot->mdpRetry = timeout && delivered == 0;
+}
+
 static void rhizome_fetch_mdp_slot_callback(struct sched_ent *alarm)
 {
   IN();
   struct rhizome_fetch_slot *slot=(struct rhizome_fetch_slot*)alarm;
 
+  // overheard blocks may have given us the whole file already
+  if (slot->write_state.file_offset >= slot->write_state.file_length){
+    rhizome_write_complete(slot);
+    OUT();
+    return;
+  }
+
   time_ms_t now = gettime_ms();
   if (now-slot->last_write_time>slot->mdpIdleTimeout) {
     DEBUGF("MDP connection timed out: last RX %"PRId64"ms ago (read %"PRIu64" of %"PRIu64" bytes)",
@@ -1046,25 +1221,59 @@ static void rhizome_fetch_mdp_slot_callback(struct sched_ent *alarm)
     OUT();
     return;
   }
+  slot->mdpTimeouts++;
+  rhizome_fetch_mdp_request_end(slot, 1);
   if (config.debug.rhizome_rx)
-    DEBUGF("Timeout: Resending request for slot=0x%p (%"PRIu64" of %"PRIu64" received)",
+    DEBUGF("Timeout: Resending request for slot=0x%p (%"PRIu64" of %"PRIu64" received), window %u x %d bytes",
 	   slot, slot->write_state.file_offset,
-	   slot->write_state.file_length);
+	   slot->write_state.file_length,
+	   slot->mdpWindow, slot->mdpRXBlockLength);
   rhizome_fetch_mdp_requestblocks(slot);
   OUT();
 }
 
+/* Retransmit timeout, from the smoothed round trip time of blocks from the peer, as in RFC 6298.
+ */
+static time_ms_t rhizome_fetch_mdp_rto(struct rhizome_fetch_slot *slot)
+{
+  time_ms_t rto = RHIZOME_MDP_INITIAL_RTO;
+  if (slot->mdpSRTT)
+    rto = slot->mdpSRTT + 4 * slot->mdpRTTVar;
+  rto <<= slot->mdpBackoff;
+  if (rto < RHIZOME_MDP_MIN_RTO)
+    rto = RHIZOME_MDP_MIN_RTO;
+  if (rto > slot->mdpIdleTimeout)
+    rto = slot->mdpIdleTimeout;
+  return rto;
+}
+
+static void rhizome_fetch_mdp_rtt_sample(struct rhizome_fetch_slot *slot, time_ms_t rtt)
+{
+  if (rtt < 1)
+    rtt = 1;
+  if (slot->mdpSRTT == 0) {
+    slot->mdpSRTT = rtt;
+    slot->mdpRTTVar = rtt / 2;
+  } else {
+    time_ms_t delta = slot->mdpSRTT > rtt ? slot->mdpSRTT - rtt : rtt - slot->mdpSRTT;
+    slot->mdpRTTVar = (3 * slot->mdpRTTVar + delta) / 4;
+    slot->mdpSRTT = (7 * slot->mdpSRTT + rtt) / 8;
+  }
+  slot->mdpBackoff = 0;
+  // remember the estimate for the next transfer from the same peer
+  struct subscriber *peer = find_subscriber(slot->peer_sid.binary, SID_SIZE, 0);
+  if (peer) {
+    peer->rhizome_srtt = slot->mdpSRTT;
+    peer->rhizome_rttvar = slot->mdpRTTVar;
+  }
+}
+
 static int rhizome_fetch_mdp_touch_timeout(struct rhizome_fetch_slot *slot)
 {
-  // 266ms @ 1mbit (WiFi broadcast speed) = 32x1024 byte packets.
-  // But on a packet radio interface at perhaps 50kbit, this is clearly
-  // a bad policy.  Ideally we should know about the interface speed
-  // and adjust behaviour accordingly. Also the packet size should be smaller
-  // on lossy links.  1K packets seem to get through only very rarely.
-  // For now, we will just make the timeout 1 second from the time of the last
-  // received block.
+  // Blocks arrive about one round trip after the request and then follow one another closely,
+  // so if none arrives within the retransmit timeout, the rest of the window has been lost.
   unschedule(&slot->alarm);
-  slot->alarm.alarm=gettime_ms()+1000; 
+  slot->alarm.alarm=gettime_ms()+rhizome_fetch_mdp_rto(slot);
   slot->alarm.deadline=slot->alarm.alarm+500;
   schedule(&slot->alarm);
   return 0;
@@ -1073,11 +1282,8 @@ static int rhizome_fetch_mdp_touch_timeout(struct rhizome_fetch_slot *slot)
 static int rhizome_fetch_mdp_requestblocks(struct rhizome_fetch_slot *slot)
 {
   IN();
-  // only issue new requests every 133ms.  
-  // we automatically re-issue once we have received all packets in this
-  // request also, so if there is no packet loss, we can go substantially
-  // faster.  Optimising behaviour when there is no packet loss is an
-  // outstanding task.
+  // A new request is sent whenever all the blocks of the last one have arrived, or on timeout.
+  // The window grows while requests are answered in full, and shrinks when blocks are lost.
   
   overlay_mdp_frame mdp;
 
@@ -1090,45 +1296,85 @@ static int rhizome_fetch_mdp_requestblocks(struct rhizome_fetch_slot *slot)
   mdp.packetTypeAndFlags=MDP_TX;
 
   mdp.out.queue=OQ_ORDINARY;
-  mdp.out.payload_length= sizeof slot->bid.binary + 8 + 8 + 4 + 2;
+  const size_t base = sizeof slot->bid.binary + 8 + 8 + 4 + 2;
+  mdp.out.payload_length = base + 1 + 2 + 1;
   bcopy(slot->bid.binary, &mdp.out.payload[0], sizeof slot->bid.binary);
 
+  // proved blocks must start on a block boundary of the Merkle tree
+  uint64_t start = slot->write_state.file_offset;
+  if (slot->mdpMerkle)
+    start -= start % RHIZOME_MERKLE_BLOCK_SIZE;
+
+  // acknowledge the ranges we have already buffered beyond the start
+  unsigned char *ranges = &mdp.out.payload[base + 4];
+  unsigned nranges = 0;
+  struct rhizome_write_buffer *p;
+  for (p = slot->write_state.buffer_list; p && nranges < RHIZOME_MDP_MAX_RANGES; p = p->_next) {
+    if (p->offset + p->data_size <= start || p->offset - start + p->data_size > UINT32_MAX)
+      continue;
+    uint64_t from = p->offset > start ? p->offset - start : 0;
+    uint64_t length = p->offset + p->data_size - start - from;
+    // a range that reaches the end of the file also covers the short last block
+    if (p->offset + p->data_size >= slot->write_state.file_length)
+      length += slot->mdpRXBlockLength;
+    if (nranges && read_uint32(ranges - RHIZOME_MDP_RANGE_BYTES) + read_uint32(ranges - RHIZOME_MDP_RANGE_BYTES + 4) == from) {
+      write_uint32(ranges - RHIZOME_MDP_RANGE_BYTES + 4, read_uint32(ranges - RHIZOME_MDP_RANGE_BYTES + 4) + length);
+      continue;
+    }
+    write_uint32(ranges, from);
+    write_uint32(ranges + 4, length);
+    ranges += RHIZOME_MDP_RANGE_BYTES;
+    nranges++;
+  }
+  ranges = &mdp.out.payload[base + 4];
+  mdp.out.payload_length += nranges * RHIZOME_MDP_RANGE_BYTES;
+
+  // count the blocks the peer will send, and mark the first 32 in the bitmap for older peers
   uint32_t bitmap=0;
-  int requests=32;
-  int i;
-  struct rhizome_write_buffer *p = slot->write_state.buffer_list;
-  uint64_t offset = slot->write_state.file_offset;
-  for (i=0;i<32;i++){
-    while(p && p->offset + p->data_size < offset)
-      p=p->_next;
-    if (!p)
+  unsigned requests=0;
+  uint64_t last = start;
+  unsigned i;
+  for (i=0; requests < slot->mdpWindow; i++){
+    uint64_t offset = (uint64_t)i * slot->mdpRXBlockLength;
+    if (start + offset >= slot->write_state.file_length)
       break;
-    if (p->offset <= offset && p->offset+p->data_size >= offset+slot->mdpRXBlockLength){
-      bitmap |= 1<<(31-i);
-      requests --;
+    if (rhizome_mdp_range_held(ranges, nranges, offset, slot->mdpRXBlockLength)){
+      if (i<32)
+	bitmap |= 1<<(31-i);
+    }else{
+      last = start + offset;
+      requests++;
     }
-    offset+=slot->mdpRXBlockLength;
   }
+  if (requests == 0)
+    requests = 1;
 
   write_uint64(&mdp.out.payload[sizeof slot->bid.binary], slot->bidVersion);
-  write_uint64(&mdp.out.payload[sizeof slot->bid.binary + 8], slot->write_state.file_offset);
+  write_uint64(&mdp.out.payload[sizeof slot->bid.binary + 8], start);
   write_uint32(&mdp.out.payload[sizeof slot->bid.binary + 8 + 8], bitmap);
   write_uint16(&mdp.out.payload[sizeof slot->bid.binary + 8 + 8 + 4], slot->mdpRXBlockLength);
+  mdp.out.payload[base] = RHIZOME_MDP_REQUEST_WINDOW | (slot->mdpMerkle ? RHIZOME_MDP_REQUEST_MERKLE : 0);
+  write_uint16(&mdp.out.payload[base + 1], slot->mdpWindow);
+  mdp.out.payload[base + 3] = nranges;
 
   if (config.debug.rhizome_tx)
-    DEBUGF("src sid=%s, dst sid=%s, mdpRXWindowStart=0x%"PRIx64", slot->bidVersion=0x%"PRIx64,
+    DEBUGF("src sid=%s, dst sid=%s, mdpRXWindowStart=0x%"PRIx64", slot->bidVersion=0x%"PRIx64", window %u x %d bytes, %u ranges held",
 	   alloca_tohex_sid_t(mdp.out.src.sid),
 	   alloca_tohex_sid_t(mdp.out.dst.sid),
 	   slot->write_state.file_offset,
-	   slot->bidVersion);
+	   slot->bidVersion,
+	   slot->mdpWindow, slot->mdpRXBlockLength, nranges);
 
   overlay_mdp_dispatch(&mdp,0 /* system generated */,NULL,0);
   
-  // remember when we sent the request so that we can adjust the inter-request
-  // interval based on how fast the packets arrive.
+  // remember when we sent the request so that we can measure the round trip time
   slot->mdpResponsesOutstanding=requests;
+  slot->mdpRequested = requests;
+  slot->mdpLastBlockOffset = last;
   slot->mdp_last_request_offset = slot->write_state.file_offset;
   slot->mdp_last_request_time = gettime_ms();
+  slot->mdpRTTSampled = 0;
+  slot->mdpRequests++;
   
   rhizome_fetch_mdp_touch_timeout(slot);
   
@@ -1211,19 +1457,49 @@ static int rhizome_fetch_switch_to_mdp(struct rhizome_fetch_slot *slot)
   pipe_journal(slot);
   
     /* We are requesting a file.  The http request may have already received
-       some of the file, so take that into account when setting up ring buffer. 
-       Then send the request for the next block of data, and set our alarm to
-       re-ask in a little while. "In a little while" is 266ms, which is roughly
-       the time it takes to send 32KB via WiFi broadcast at the 1Mbit base rate 
-       (this will need tuning for non-WiFi interfaces). 32KB = 32 x 1024 bytes
-       which is the block size we will use.  200bytes would allow for several
-       blocks to fit into a packet, and probably fit at least one any any,
-       outgoing packet that is not otherwise full. But then the whole thing slows
-       down too much.  Much careful thought is required to optimise this
-       transport.
+       some of the file, so take that into account when setting up ring buffer.
+       Each request asks for a window of blocks, which starts at
+       rhizome.mdp.window_initial and grows while requests are answered in full,
+       up to rhizome.mdp.window_max, and shrinks when blocks are lost.  If the
+       rest of a window has not arrived within the retransmit timeout, derived
+       from the round trip times measured to this peer, we ask again.
     */
   slot->mdpIdleTimeout=config.rhizome.idle_timeout; // give up if nothing received for 5 seconds
   slot->mdpRXBlockLength=config.rhizome.rhizome_mdp_block_size; // Rhizome over MDP block size
+  if (slot->mdpRXBlockLength > RHIZOME_MDP_MAX_BLOCK_SIZE)
+    slot->mdpRXBlockLength = RHIZOME_MDP_MAX_BLOCK_SIZE;
+  slot->mdpMerkle = slot->manifest && slot->manifest->has_merkle_root;
+  slot->mdpVerified = 0;
+  if (slot->mdpMerkle)
+    slot->mdpRXBlockLength=RHIZOME_MERKLE_BLOCK_SIZE;
+  // start slowly, unless an earlier transfer from the same peer has measured its round trip time
+  slot->mdpWindow = config.rhizome.mdp.window_initial;
+  if (slot->mdpWindow > config.rhizome.mdp.window_max)
+    slot->mdpWindow = config.rhizome.mdp.window_max;
+  slot->mdpSsthresh = config.rhizome.mdp.window_max;
+  slot->mdpRetry = 0;
+  slot->mdpBackoff = 0;
+  slot->mdpSRTT = slot->mdpRTTVar = 0;
+  slot->mdpRequests = slot->mdpTimeouts = slot->mdpBlocks = slot->mdpDuplicates = 0;
+  struct subscriber *peer = find_subscriber(slot->peer_sid.binary, SID_SIZE, 0);
+  if (peer) {
+    slot->mdpSRTT = peer->rhizome_srtt;
+    slot->mdpRTTVar = peer->rhizome_rttvar;
+  }
+  if (slot->manifest){
+    // we may already have heard some of the file being sent to someone else
+    if (overheard_merge(slot)){
+      rhizome_fetch_close(slot);
+      RETURN(-1);
+    }
+    if (slot->write_state.file_offset >= slot->write_state.file_length){
+      // finish from the slot alarm, as we may be inside rhizome_start_next_queued_fetch()
+      slot->alarm.alarm=gettime_ms();
+      slot->alarm.deadline=slot->alarm.alarm+500;
+      schedule(&slot->alarm);
+      RETURN(0);
+    }
+  }
   rhizome_fetch_mdp_requestblocks(slot);
 
   RETURN(0);
@@ -1297,6 +1573,10 @@ int rhizome_write_complete(struct rhizome_fetch_slot *slot)
       INFOF("Completed MDP request from %s  for file %s",
 	    alloca_tohex_sid_t(slot->peer_sid),
 	    alloca_tohex_rhizome_filehash_t(slot->manifest->filehash));
+      if (config.debug.rhizome_rx && slot->state==RHIZOME_FETCH_RXFILEMDP)
+	DEBUGF("MDP transfer stats: %u requests, %u timeouts, %u blocks, %u duplicates, window %u x %d bytes, rtt %"PRId64"ms",
+	       slot->mdpRequests, slot->mdpTimeouts, slot->mdpBlocks, slot->mdpDuplicates,
+	       slot->mdpWindow, slot->mdpRXBlockLength, slot->mdpSRTT);
     }
   } else {
     /* This was to fetch the manifest, so now fetch the file if needed */
@@ -1386,8 +1666,23 @@ int rhizome_received_content(const unsigned char *bidprefix,
   struct rhizome_fetch_slot *slot=fetch_search_slot(bidprefix, 16);
   
   if (slot && slot->bidVersion == version && slot->state == RHIZOME_FETCH_RXFILEMDP){
+    if (slot->mdpVerified && type != 'M'){
+      // the sender proves its blocks, so this one is probably injected
+      if (config.debug.rhizome)
+	DEBUGF("Ignoring unproved block at offset %"PRIu64, offset);
+      RETURN(-1);
+    }
     if (config.debug.rhizome)
       DEBUGF("Rhizome over MDP receiving %zu bytes.", count);
+    slot->mdpBlocks++;
+    if (offset + count <= slot->write_state.file_offset)
+      slot->mdpDuplicates++;
+    if (!slot->mdpRTTSampled){
+      // Karn's algorithm: a reply to a retried request may be for the original
+      slot->mdpRTTSampled = 1;
+      if (!slot->mdpRetry)
+	rhizome_fetch_mdp_rtt_sample(slot, gettime_ms() - slot->mdp_last_request_time);
+    }
     if (rhizome_random_write(&slot->write_state, offset, bytes, count)){
       if (config.debug.rhizome)
 	DEBUGF("Write failed!");
@@ -1399,13 +1694,19 @@ int rhizome_received_content(const unsigned char *bidprefix,
 	DEBUGF("Complete failed!");
       RETURN(-1);
     }
+    // once complete, the slot may have been closed and reused for the next queued fetch
+    if (slot->state != RHIZOME_FETCH_RXFILEMDP || slot->bidVersion != version
+	|| memcmp(slot->bid.binary, bidprefix, 16) != 0)
+      RETURN(0);
     
     slot->last_write_time=gettime_ms();
     rhizome_fetch_mdp_touch_timeout(slot);
 
     slot->mdpResponsesOutstanding--;
-    if (slot->mdpResponsesOutstanding==0) {
-      // We have received all responses, so immediately ask for more
+    // The peer sends blocks in order, so once the last one we asked for has arrived, any still
+    // outstanding were lost; ask for them again straight away rather than waiting for the timeout.
+    if (slot->mdpResponsesOutstanding<=0 || offset == slot->mdpLastBlockOffset) {
+      rhizome_fetch_mdp_request_end(slot, 0);
       rhizome_fetch_mdp_requestblocks(slot);
     }
     RETURN(0);
@@ -1442,10 +1743,61 @@ int rhizome_received_content(const unsigned char *bidprefix,
     }
   }
   
+  // keep blocks of a bundle that we will fetch later, but only proved blocks if it has a Merkle root
+  rhizome_manifest *m = NULL;
+  slot = fetch_search_slot(bidprefix, 16);
+  if (slot && slot->bidVersion == version && slot->state != RHIZOME_FETCH_RXFILEMDP)
+    m = slot->manifest;
+  else {
+    struct rhizome_fetch_candidate *c = fetch_search_candidate(bidprefix, 16);
+    if (c && c->manifest->version == version)
+      m = c->manifest;
+  }
+  if (m && (type == 'M' || !m->has_merkle_root)) {
+    overheard_stage(m, offset, count, bytes);
+    RETURN(0);
+  }
+  
   RETURN(-1);
   OUT();
 }
 
+/* Check a block against the Merkle root in the manifest of the bundle being fetched, and only
+ * store it if it is genuine.
+ */
+int rhizome_received_verified_content(const unsigned char *bidprefix, uint64_t version,
+				      uint64_t offset, size_t count, unsigned char *bytes,
+				      const unsigned char *proof, size_t proof_length)
+{
+  IN();
+  if (!is_rhizome_mdp_enabled())
+    RETURN(-1);
+  rhizome_manifest *m = NULL;
+  struct rhizome_fetch_slot *slot = fetch_search_slot(bidprefix, 16);
+  if (slot && slot->bidVersion == version)
+    m = slot->manifest;
+  else {
+    slot = NULL;
+    struct rhizome_fetch_candidate *c = fetch_search_candidate(bidprefix, 16);
+    if (c && c->manifest->version == version)
+      m = c->manifest;
+  }
+  if (!m)
+    RETURN(-1);
+  if (!m->has_merkle_root)
+    RETURN(rhizome_received_content(bidprefix, version, offset, count, bytes, 'B'));
+  if (rhizome_merkle_verify(m->merkle_root, m->filesize, offset, bytes, count, proof, proof_length) == -1) {
+    if (config.debug.rhizome)
+      DEBUGF("Block at offset %"PRIu64" of %s fails Merkle proof -- ignored",
+	     offset, alloca_tohex_rhizome_bid_t(m->cryptoSignPublic));
+    RETURN(-1);
+  }
+  if (slot && slot->state == RHIZOME_FETCH_RXFILEMDP)
+    slot->mdpVerified = 1;
+  RETURN(rhizome_received_content(bidprefix, version, offset, count, bytes, 'M'));
+  OUT();
+}
+
 void rhizome_fetch_poll(struct sched_ent *alarm)
 {
   struct rhizome_fetch_slot *slot = (struct rhizome_fetch_slot *) alarm;
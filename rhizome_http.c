@@ -45,6 +45,7 @@ struct http_handler{
 
 static HTTP_HANDLER restful_rhizome_bundlelist_json;
 static HTTP_HANDLER restful_rhizome_newsince;
+static HTTP_HANDLER restful_stats_json;
 
 static HTTP_HANDLER rhizome_status_page;
 static HTTP_HANDLER rhizome_file_page;
@@ -56,15 +57,18 @@ static HTTP_HANDLER root_page;
 
 extern HTTP_HANDLER rhizome_direct_import;
 extern HTTP_HANDLER rhizome_direct_enquiry;
+extern HTTP_HANDLER rhizome_direct_range_enquiry;
 extern HTTP_HANDLER rhizome_direct_dispatch;
 
 struct http_handler paths[]={
   {"/restful/rhizome/bundlelist.json", restful_rhizome_bundlelist_json},
   {"/restful/rhizome/newsince/", restful_rhizome_newsince},
+  {"/restful/stats.json", restful_stats_json},
   {"/rhizome/status", rhizome_status_page},
   {"/rhizome/file/", rhizome_file_page},
   {"/rhizome/import", rhizome_direct_import},
   {"/rhizome/enquiry", rhizome_direct_enquiry},
+  {"/rhizome/digest", rhizome_direct_range_enquiry},
   {"/rhizome/manifestbyprefix/", manifest_by_prefix_page},
   {"/rhizome/", rhizome_direct_dispatch},
   {"/interface/", interface_page},
@@ -430,6 +434,26 @@ static int restful_rhizome_newsince(rhizome_http_request *r, const char *remaind
   return 0;
 }
 
+static int restful_stats_json(rhizome_http_request *r, const char *remainder)
+{
+  if (*remainder)
+    return 1;
+  if (r->http.verb != HTTP_VERB_GET) {
+    http_request_simple_response(&r->http, 405, NULL);
+    return 0;
+  }
+  if (!authorize(&r->http))
+    return 0;
+  size_t len;
+  char *json = fd_stats_json(&len);
+  if (!json)
+    return -1;
+  // the content is copied into the response buffer before this returns
+  http_request_response_static(&r->http, 200, "application/json", json, len);
+  free(json);
+  return 0;
+}
+
 static int restful_rhizome_bundlelist_json_content_chunk(sqlite_retry_state *retry, struct rhizome_http_request *r, strbuf b)
 {
   const char *headers[] = {
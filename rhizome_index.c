@@ -0,0 +1,322 @@
+/*
+Copyright (C) 2013 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  In-memory index of the stored bundles, by Bundle ID.
+
+  Advertisements and manifest requests name bundles by a BID prefix, which the MANIFESTS table can
+  only match with a LIKE scan of every row.  Instead, the BID, version and payload size of every
+  stored manifest is kept in a nibble tree like the one that holds subscribers in
+  overlay_address.c, so a prefix is resolved to a whole BID in memory, and any query that is still
+  needed can use the primary key.
+
+  The index is loaded when it is first used, then kept up to date as this process stores and
+  deletes manifests.  Other processes (eg, "servald rhizome add file") also write to the database,
+  so before the index answers that a bundle is not stored, it reads any rows added since it was
+  last loaded, which is a cheap ROWID range query.  MANIFESTS has no AUTOINCREMENT, so once the
+  newest row is deleted, its ROWID can be given to the next row stored, and that query will not
+  see it.  So a miss is finally confirmed with a range query on the primary key for the prefix.
+  Rows deleted by other processes are not noticed either, so callers must confirm a positive answer
+  against the database before relying on it, and remove the entry if it is stale.
+ */
+
+#include "serval.h"
+#include "conf.h"
+#include "rhizome.h"
+#include "strbuf.h"
+
+// each node has 16 slots based on the next 4 bits of a bundle id
+// each slot either points to another tree node or an index entry.
+struct index_node {
+  // bit flags for the type of object each element points to
+  uint16_t is_tree;
+
+  union {
+    struct index_node *nodes[16];
+    struct rhizome_index_entry *entries[16];
+  };
+};
+
+static struct index_node root;
+static int loaded = 0;
+static int64_t max_rowid = 0;
+
+static unsigned entry_count = 0;
+static unsigned node_count = 0;
+static uint64_t lookup_hits = 0;
+static uint64_t lookup_misses = 0;
+static uint64_t stale_entries = 0;
+static uint64_t refreshes = 0;
+static uint64_t rows_read = 0;
+static uint64_t checks = 0;
+static uint64_t missed_rows = 0;
+
+static unsigned char get_nibble(const unsigned char *id, unsigned pos)
+{
+  unsigned char byte = id[pos>>1];
+  if (!(pos&1))
+    byte=byte>>4;
+  return byte&0xF;
+}
+
+static void free_children(struct index_node *parent)
+{
+  unsigned i;
+  for (i = 0; i < 16; ++i) {
+    if (parent->is_tree & (1<<i)) {
+      free_children(parent->nodes[i]);
+      free(parent->nodes[i]);
+    } else if (parent->entries[i])
+      free(parent->entries[i]);
+    parent->nodes[i] = NULL;
+  }
+  parent->is_tree = 0;
+}
+
+static void index_set(const rhizome_bid_t *bidp, int64_t version, uint64_t filesize)
+{
+  struct index_node *node = &root;
+  unsigned pos = 0;
+  while (1) {
+    unsigned char nibble = get_nibble(bidp->binary, pos++);
+    if (node->is_tree & (1<<nibble)) {
+      node = node->nodes[nibble];
+      continue;
+    }
+    struct rhizome_index_entry *e = node->entries[nibble];
+    if (!e) {
+      if ((e = emalloc(sizeof *e)) == NULL)
+	return;
+      e->bid = *bidp;
+      node->entries[nibble] = e;
+      ++entry_count;
+    } else if (cmp_rhizome_bid_t(&e->bid, bidp) != 0) {
+      // push the existing entry down into a new node, then try again at the next nibble
+      struct index_node *new = emalloc_zero(sizeof *new);
+      if (new == NULL)
+	return;
+      new->entries[get_nibble(e->bid.binary, pos)] = e;
+      node->nodes[nibble] = new;
+      node->is_tree |= (1<<nibble);
+      ++node_count;
+      node = new;
+      continue;
+    }
+    e->version = version;
+    e->filesize = filesize;
+    return;
+  }
+}
+
+static void index_unset(const rhizome_bid_t *bidp)
+{
+  struct index_node *node = &root;
+  unsigned pos = 0;
+  while (1) {
+    unsigned char nibble = get_nibble(bidp->binary, pos++);
+    if (node->is_tree & (1<<nibble)) {
+      node = node->nodes[nibble];
+      continue;
+    }
+    struct rhizome_index_entry *e = node->entries[nibble];
+    if (e && cmp_rhizome_bid_t(&e->bid, bidp) == 0) {
+      node->entries[nibble] = NULL;
+      free(e);
+      --entry_count;
+    }
+    return;
+  }
+}
+
+// read every MANIFESTS row added since the last time, or all of them the first time
+static int index_refresh()
+{
+  if (rhizome_opendb() == -1)
+    return -1;
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite3_stmt *statement = sqlite_prepare_bind(&retry,
+      "SELECT rowid, id, version, filesize FROM MANIFESTS WHERE rowid > ? ORDER BY rowid;",
+      INT64, max_rowid,
+      END);
+  if (!statement)
+    return -1;
+  unsigned rows = 0;
+  int r;
+  while ((r = sqlite_step_retry(&retry, statement)) == SQLITE_ROW) {
+    int64_t q_rowid = sqlite3_column_int64(statement, 0);
+    const char *q_id = (const char *) sqlite3_column_text(statement, 1);
+    rhizome_bid_t bid;
+    if (q_id == NULL || str_to_rhizome_bid_t(&bid, q_id) == -1)
+      WARNF("malformed column value MANIFESTS.id = %s -- skipped", alloca_str_toprint(q_id));
+    else
+      index_set(&bid, sqlite3_column_int64(statement, 2), sqlite3_column_int64(statement, 3));
+    max_rowid = q_rowid;
+    ++rows;
+  }
+  sqlite3_finalize(statement);
+  if (r == -1)
+    return -1;
+  ++refreshes;
+  rows_read += rows;
+  if (config.debug.rhizome && (rows || !loaded))
+    DEBUGF("%s Rhizome index with %u rows, now %u bundles in %u nodes",
+	   loaded ? "Updated" : "Loaded", rows, entry_count, node_count);
+  loaded = 1;
+  return 0;
+}
+
+// find the first entry at or below this node whose version is at least min_version
+static const struct rhizome_index_entry *walk_node(const struct index_node *node, int64_t min_version)
+{
+  unsigned i;
+  for (i = 0; i < 16; ++i) {
+    const struct rhizome_index_entry *e = NULL;
+    if (node->is_tree & (1<<i))
+      e = walk_node(node->nodes[i], min_version);
+    else if (node->entries[i] && node->entries[i]->version >= min_version)
+      e = node->entries[i];
+    if (e)
+      return e;
+  }
+  return NULL;
+}
+
+static const struct rhizome_index_entry *index_search(const unsigned char *prefix, unsigned prefix_len, int64_t min_version)
+{
+  const struct index_node *node = &root;
+  unsigned pos;
+  for (pos = 0; pos < prefix_len * 2; ++pos) {
+    unsigned char nibble = get_nibble(prefix, pos);
+    if (node->is_tree & (1<<nibble)) {
+      node = node->nodes[nibble];
+      continue;
+    }
+    const struct rhizome_index_entry *e = node->entries[nibble];
+    if (e && memcmp(e->bid.binary, prefix, prefix_len) == 0 && e->version >= min_version)
+      return e;
+    return NULL;
+  }
+  // every bundle below this node matches the prefix
+  return walk_node(node, min_version);
+}
+
+// look in the database for a bundle with this prefix that the index does not have
+static const struct rhizome_index_entry *index_check(const unsigned char *prefix, unsigned prefix_len, int64_t min_version)
+{
+  // every BID with this prefix sorts between the hex prefix, and the prefix followed by a character
+  // that comes after any hex digit
+  char lower[RHIZOME_MANIFEST_ID_STRLEN + 1];
+  char upper[RHIZOME_MANIFEST_ID_STRLEN + 2];
+  tohex(lower, prefix_len * 2, prefix);
+  strcpy(upper, lower);
+  strcat(upper, "G");
+  ++checks;
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite3_stmt *statement = sqlite_prepare_bind(&retry,
+      "SELECT id, version, filesize FROM MANIFESTS WHERE id >= ? AND id < ? AND version >= ? LIMIT 1;",
+      STATIC_TEXT, lower,
+      STATIC_TEXT, upper,
+      INT64, min_version,
+      END);
+  if (!statement)
+    return NULL;
+  const struct rhizome_index_entry *e = NULL;
+  if (sqlite_step_retry(&retry, statement) == SQLITE_ROW) {
+    const char *q_id = (const char *) sqlite3_column_text(statement, 0);
+    rhizome_bid_t bid;
+    if (q_id && str_to_rhizome_bid_t(&bid, q_id) != -1) {
+      if (config.debug.rhizome)
+	DEBUGF("Bundle %s was missed by the Rhizome index, adding it", alloca_tohex_rhizome_bid_t(bid));
+      ++missed_rows;
+      index_set(&bid, sqlite3_column_int64(statement, 1), sqlite3_column_int64(statement, 2));
+      e = index_search(prefix, prefix_len, min_version);
+    }
+  }
+  sqlite3_finalize(statement);
+  return e;
+}
+
+/* Find a stored bundle whose BID starts with the given prefix and whose version is at least
+ * min_version.  Returns 1 and sets *entryp if one is found, 0 if not, -1 on error.
+ */
+int rhizome_index_find(const unsigned char *prefix, unsigned prefix_len, int64_t min_version, const struct rhizome_index_entry **entryp)
+{
+  if (prefix_len > sizeof(rhizome_bid_t))
+    prefix_len = sizeof(rhizome_bid_t);
+  if (!loaded && index_refresh() == -1)
+    return -1;
+  const struct rhizome_index_entry *e = index_search(prefix, prefix_len, min_version);
+  if (!e) {
+    // another process may have stored it since we last looked
+    int64_t before = max_rowid;
+    if (index_refresh() == -1)
+      return -1;
+    if (max_rowid != before)
+      e = index_search(prefix, prefix_len, min_version);
+    if (!e)
+      e = index_check(prefix, prefix_len, min_version);
+  }
+  if (!e) {
+    ++lookup_misses;
+    return 0;
+  }
+  ++lookup_hits;
+  *entryp = e;
+  return 1;
+}
+
+void rhizome_index_stored(const rhizome_bid_t *bidp, int64_t version, uint64_t filesize)
+{
+  // The new row will also be read by the next refresh, which is harmless.  Do not advance
+  // max_rowid past it, or rows stored by other processes since the last refresh would be missed.
+  if (loaded)
+    index_set(bidp, version, filesize);
+}
+
+void rhizome_index_deleted(const rhizome_bid_t *bidp)
+{
+  if (loaded)
+    index_unset(bidp);
+}
+
+/* Remove an entry that was found to have no MANIFESTS row, ie, it was deleted by another process.
+ */
+void rhizome_index_stale(const rhizome_bid_t *bidp)
+{
+  if (config.debug.rhizome)
+    DEBUGF("Bundle %s is no longer stored, removing from index", alloca_tohex_rhizome_bid_t(*bidp));
+  ++stale_entries;
+  rhizome_index_deleted(bidp);
+}
+
+void rhizome_index_close()
+{
+  free_children(&root);
+  loaded = 0;
+  max_rowid = 0;
+  entry_count = 0;
+  node_count = 0;
+}
+
+void rhizome_index_stats_json(strbuf b)
+{
+  strbuf_sprintf(b, "{\"loaded\":%s,\"bundles\":%u,\"nodes\":%u,\"hits\":%"PRIu64",\"misses\":%"PRIu64","
+		 "\"stale\":%"PRIu64",\"refreshes\":%"PRIu64",\"rows\":%"PRIu64",\"checks\":%"PRIu64",\"missed\":%"PRIu64"}",
+		 loaded ? "true" : "false", entry_count, node_count,
+		 lookup_hits, lookup_misses, stale_entries, refreshes, rows_read, checks, missed_rows);
+}
@@ -0,0 +1,281 @@
+/*
+Copyright (C) 2013 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  Merkle trees over Rhizome payloads.
+
+  The stored payload is divided into RHIZOME_MERKLE_BLOCK_SIZE byte blocks (the last may be
+  shorter).  Each leaf is the hash of a 0x00 byte followed by a block, and each interior node the
+  hash of a 0x01 byte followed by its two children.  Nodes are paired from left to right; an odd
+  node at the end of a level is carried up unchanged.  All hashes are SHA-512 truncated to
+  RHIZOME_MERKLE_HASH_BYTES.  The root goes in the "merkle" field of the manifest, so a receiver
+  can check each block sent over MDP against it, using the sibling nodes sent with the block.
+ */
+
+#include "serval.h"
+#include "conf.h"
+#include "rhizome.h"
+#include "sha2.h"
+
+static void merkle_leaf(unsigned char *out, const unsigned char *data, size_t len)
+{
+  SHA512_CTX ctx;
+  unsigned char prefix = 0;
+  unsigned char hash[SHA512_DIGEST_LENGTH];
+  SHA512_Init(&ctx);
+  SHA512_Update(&ctx, &prefix, 1);
+  SHA512_Update(&ctx, data, len);
+  SHA512_Final(hash, &ctx);
+  bcopy(hash, out, RHIZOME_MERKLE_HASH_BYTES);
+}
+
+static void merkle_node(unsigned char *out, const unsigned char *left, const unsigned char *right)
+{
+  SHA512_CTX ctx;
+  unsigned char prefix = 1;
+  unsigned char hash[SHA512_DIGEST_LENGTH];
+  SHA512_Init(&ctx);
+  SHA512_Update(&ctx, &prefix, 1);
+  SHA512_Update(&ctx, left, RHIZOME_MERKLE_HASH_BYTES);
+  SHA512_Update(&ctx, right, RHIZOME_MERKLE_HASH_BYTES);
+  SHA512_Final(hash, &ctx);
+  bcopy(hash, out, RHIZOME_MERKLE_HASH_BYTES);
+}
+
+uint64_t rhizome_merkle_leaf_count(uint64_t filesize)
+{
+  return (filesize + RHIZOME_MERKLE_BLOCK_SIZE - 1) / RHIZOME_MERKLE_BLOCK_SIZE;
+}
+
+void rhizome_merkle_init(struct rhizome_merkle *merkle)
+{
+  bzero(merkle, sizeof *merkle);
+  SHA512_Init(&merkle->leaf);
+  unsigned char prefix = 0;
+  SHA512_Update(&merkle->leaf, &prefix, 1);
+}
+
+/* Push a finished subtree of the given height, combining it with any pending subtree of the same
+   height, like carrying in binary addition.
+ */
+static void merkle_push(struct rhizome_merkle *merkle, unsigned height, unsigned char *node)
+{
+  while (height < RHIZOME_MERKLE_MAX_HEIGHT && (merkle->pending_mask & (1ULL << height))) {
+    merkle_node(node, merkle->pending[height], node);
+    merkle->pending_mask &= ~(1ULL << height);
+    height++;
+  }
+  bcopy(node, merkle->pending[height], RHIZOME_MERKLE_HASH_BYTES);
+  merkle->pending_mask |= 1ULL << height;
+}
+
+static void merkle_end_leaf(struct rhizome_merkle *merkle)
+{
+  unsigned char hash[SHA512_DIGEST_LENGTH];
+  SHA512_Final(hash, &merkle->leaf);
+  merkle_push(merkle, 0, hash);
+  merkle->leaf_bytes = 0;
+  merkle->leaves++;
+  SHA512_Init(&merkle->leaf);
+  unsigned char prefix = 0;
+  SHA512_Update(&merkle->leaf, &prefix, 1);
+}
+
+void rhizome_merkle_update(struct rhizome_merkle *merkle, const unsigned char *data, size_t len)
+{
+  while (len) {
+    size_t n = RHIZOME_MERKLE_BLOCK_SIZE - merkle->leaf_bytes;
+    if (n > len)
+      n = len;
+    SHA512_Update(&merkle->leaf, data, n);
+    merkle->leaf_bytes += n;
+    data += n;
+    len -= n;
+    if (merkle->leaf_bytes == RHIZOME_MERKLE_BLOCK_SIZE)
+      merkle_end_leaf(merkle);
+  }
+}
+
+/* Returns -1 if no data was given, so there is no tree.
+ */
+int rhizome_merkle_final(struct rhizome_merkle *merkle, unsigned char *root)
+{
+  if (merkle->leaf_bytes)
+    merkle_end_leaf(merkle);
+  if (merkle->leaves == 0)
+    return -1;
+  // fold the pending subtrees together, smallest first, which carries odd nodes up unchanged
+  int have = 0;
+  unsigned height;
+  for (height = 0; height <= RHIZOME_MERKLE_MAX_HEIGHT; ++height) {
+    if (!(merkle->pending_mask & (1ULL << height)))
+      continue;
+    if (have)
+      merkle_node(root, merkle->pending[height], root);
+    else
+      bcopy(merkle->pending[height], root, RHIZOME_MERKLE_HASH_BYTES);
+    have = 1;
+  }
+  return 0;
+}
+
+struct rhizome_merkle_tree {
+  uint64_t leaves;
+  unsigned levels;
+  unsigned char *level[RHIZOME_MERKLE_MAX_HEIGHT + 1];
+  uint64_t count[RHIZOME_MERKLE_MAX_HEIGHT + 1];
+};
+
+void rhizome_merkle_tree_free(struct rhizome_merkle_tree *tree)
+{
+  if (tree) {
+    unsigned i;
+    for (i = 0; i < tree->levels; ++i)
+      free(tree->level[i]);
+    free(tree);
+  }
+}
+
+/* Build the whole tree of a stored payload, so that proofs can be formed for any of its blocks.
+   Reads the whole payload, so is only worth doing for a payload that is being served.
+ */
+struct rhizome_merkle_tree *rhizome_merkle_tree_build(const rhizome_filehash_t *hashp)
+{
+  struct rhizome_read read;
+  bzero(&read, sizeof read);
+  if (rhizome_open_read(&read, hashp) != 0) {
+    WHYF("Payload %s not found", alloca_tohex_rhizome_filehash_t(*hashp));
+    return NULL;
+  }
+  struct rhizome_merkle_tree *tree = emalloc_zero(sizeof *tree);
+  unsigned char *block = NULL;
+  if (!tree || !(block = emalloc(RHIZOME_MERKLE_BLOCK_SIZE)))
+    goto error;
+  size_t alloc = 0;
+  while (1) {
+    size_t len = 0;
+    ssize_t r = 0;
+    while (len < RHIZOME_MERKLE_BLOCK_SIZE && (r = rhizome_read(&read, block + len, RHIZOME_MERKLE_BLOCK_SIZE - len)) > 0)
+      len += r;
+    if (r == -1)
+      goto error;
+    if (len == 0)
+      break;
+    if (tree->leaves == alloc) {
+      alloc = alloc ? alloc * 2 : 64;
+      unsigned char *n = erealloc(tree->level[0], alloc * RHIZOME_MERKLE_HASH_BYTES);
+      if (!n)
+	goto error;
+      tree->level[0] = n;
+      tree->levels = 1;
+    }
+    merkle_leaf(tree->level[0] + tree->leaves * RHIZOME_MERKLE_HASH_BYTES, block, len);
+    tree->leaves++;
+    if (len < RHIZOME_MERKLE_BLOCK_SIZE)
+      break;
+  }
+  if (tree->leaves == 0) {
+    WHY("Cannot build Merkle tree of empty payload");
+    goto error;
+  }
+  tree->count[0] = tree->leaves;
+  while (tree->count[tree->levels - 1] > 1) {
+    unsigned l = tree->levels;
+    uint64_t below = tree->count[l - 1];
+    tree->count[l] = (below + 1) / 2;
+    if (!(tree->level[l] = emalloc(tree->count[l] * RHIZOME_MERKLE_HASH_BYTES)))
+      goto error;
+    tree->levels++;
+    uint64_t i;
+    for (i = 0; i < tree->count[l]; ++i) {
+      unsigned char *node = tree->level[l] + i * RHIZOME_MERKLE_HASH_BYTES;
+      const unsigned char *left = tree->level[l - 1] + 2 * i * RHIZOME_MERKLE_HASH_BYTES;
+      if (2 * i + 1 < below)
+	merkle_node(node, left, left + RHIZOME_MERKLE_HASH_BYTES);
+      else
+	bcopy(left, node, RHIZOME_MERKLE_HASH_BYTES);
+    }
+  }
+  free(block);
+  rhizome_read_close(&read);
+  if (config.debug.rhizome_tx)
+    DEBUGF("Built Merkle tree of %"PRIu64" blocks, root %s", tree->leaves,
+	   alloca_tohex(tree->level[tree->levels - 1], RHIZOME_MERKLE_HASH_BYTES));
+  return tree;
+error:
+  if (block)
+    free(block);
+  rhizome_merkle_tree_free(tree);
+  rhizome_read_close(&read);
+  return NULL;
+}
+
+/* Copy the sibling nodes that prove the block at the given index into proof[].  Returns the
+   number of bytes copied, or -1 if the index is out of range or proof[] is too small.
+ */
+ssize_t rhizome_merkle_tree_proof(const struct rhizome_merkle_tree *tree, uint64_t index, unsigned char *proof, size_t size)
+{
+  if (index >= tree->leaves)
+    return -1;
+  size_t len = 0;
+  unsigned l;
+  for (l = 0; l + 1 < tree->levels; ++l, index >>= 1) {
+    uint64_t sibling = index ^ 1;
+    if (sibling >= tree->count[l])
+      continue;
+    if (len + RHIZOME_MERKLE_HASH_BYTES > size)
+      return -1;
+    bcopy(tree->level[l] + sibling * RHIZOME_MERKLE_HASH_BYTES, proof + len, RHIZOME_MERKLE_HASH_BYTES);
+    len += RHIZOME_MERKLE_HASH_BYTES;
+  }
+  return len;
+}
+
+/* Check one block of a payload of the given size against the Merkle root from its manifest.
+   Returns 0 if the block is genuine, -1 if not.
+ */
+int rhizome_merkle_verify(const unsigned char *root, uint64_t filesize, uint64_t offset,
+			  const unsigned char *data, size_t len, const unsigned char *proof, size_t proof_len)
+{
+  if (offset % RHIZOME_MERKLE_BLOCK_SIZE || offset >= filesize)
+    return -1;
+  uint64_t index = offset / RHIZOME_MERKLE_BLOCK_SIZE;
+  uint64_t expect = filesize - offset;
+  if (expect > RHIZOME_MERKLE_BLOCK_SIZE)
+    expect = RHIZOME_MERKLE_BLOCK_SIZE;
+  if (len != expect)
+    return -1;
+  unsigned char node[RHIZOME_MERKLE_HASH_BYTES];
+  merkle_leaf(node, data, len);
+  uint64_t count = rhizome_merkle_leaf_count(filesize);
+  for (; count > 1; index >>= 1, count = (count + 1) / 2) {
+    if ((index ^ 1) >= count)
+      continue;
+    if (proof_len < RHIZOME_MERKLE_HASH_BYTES)
+      return -1;
+    if (index & 1)
+      merkle_node(node, proof, node);
+    else
+      merkle_node(node, node, proof);
+    proof += RHIZOME_MERKLE_HASH_BYTES;
+    proof_len -= RHIZOME_MERKLE_HASH_BYTES;
+  }
+  if (proof_len)
+    return -1;
+  return memcmp(node, root, RHIZOME_MERKLE_HASH_BYTES) == 0 ? 0 : -1;
+}
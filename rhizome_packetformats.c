@@ -131,7 +131,7 @@ int64_t rhizome_bar_version(const unsigned char *bar)
 
 /* This function only displays the first 8 bytes, and should not be used
    for comparison. */
-uint64_t rhizome_bar_bidprefix_ll(unsigned char *bar)
+uint64_t rhizome_bar_bidprefix_ll(const unsigned char *bar)
 {
   uint64_t bidprefix=0;
   int i;
@@ -140,108 +140,17 @@ uint64_t rhizome_bar_bidprefix_ll(unsigned char *bar)
   return bidprefix;
 }
 
-static int append_bars(struct overlay_buffer *e, sqlite_retry_state *retry, const char *sql, int64_t *last_rowid)
-{
-  sqlite3_stmt *statement = sqlite_prepare(retry, sql);
-  if (statement == NULL)
-    return -1;
-  int params = sqlite3_bind_parameter_count(statement);
-  switch (params) {
-    case 0: break;
-    case 1:
-      if (sqlite_bind(retry, statement, INT64, *last_rowid, END) == -1)
-	return -1;
-      break;
-    default:
-      return WHYF("query has invalid number of parameters (%d): %s", params, sqlite3_sql(statement));
-  }
-  int count = 0;
-  while(sqlite_step_retry(retry, statement) == SQLITE_ROW) {
-    count++;
-    if (sqlite3_column_type(statement, 0)!=SQLITE_BLOB)
-      continue;
-    const void *data = sqlite3_column_blob(statement, 0);
-    int blob_bytes = sqlite3_column_bytes(statement, 0);
-    int64_t rowid = sqlite3_column_int64(statement, 1);
-    if (blob_bytes!=RHIZOME_BAR_BYTES) {
-      if (config.debug.rhizome_ads)
-	DEBUG("Found a BAR that is the wrong size - ignoring");
-      continue;
-    }
-    if (ob_remaining(e) < blob_bytes) {
-      // out of room
-      count--;
-      break;
-    }
-    ob_append_bytes(e, (unsigned char *)data, blob_bytes);
-    *last_rowid=rowid;
-  }
-  if (statement)
-    sqlite3_finalize(statement);
-  return count;
-}
-
-/* Periodically queue BAR advertisements
- Always advertise the most recent 3 manifests in the table, cycle through the rest of the table, adding 17 BAR's at a time
+/* Periodically advertise bundles.  The BARs are sent by the sync protocol in rhizome_sync.c,
+ * which decides how often they need to be sent.
  */
-int64_t bundles_available=0;
 void overlay_rhizome_advertise(struct sched_ent *alarm)
 {
-  bundles_available=0;
-  static int64_t bundle_last_rowid=INT64_MAX;
-  
   if (!is_rhizome_advertise_enabled())
     return;
-  
-  // TODO deprecate the below announcement method and move this alarm to rhizome_sync.c
-  rhizome_sync_announce();
-
-  int (*oldfunc)() = sqlite_set_tracefunc(is_debug_rhizome_ads);
-  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
 
-  // TODO: DEPRECATE REST OF THIS CODE WHICH SEEMS TO BE CAUSING TOO MUCH CHATTER
-  // ESPECIALLY FOR PACKET-RADIO
-  goto end;
+  // TODO move this alarm to rhizome_sync.c
+  rhizome_sync_advertise();
 
-  /* Get number of bundles available */
-  if (sqlite_exec_int64_retry(&retry, &bundles_available, "SELECT COUNT(BAR) FROM MANIFESTS;", END) != 1){
-    WHY("Could not count BARs for advertisement");
-    goto end;
-  }
-  
-  if (bundles_available<1)
-    goto end;
-  
-  struct overlay_frame *frame = malloc(sizeof(struct overlay_frame));
-  bzero(frame,sizeof(struct overlay_frame));
-  frame->type = OF_TYPE_RHIZOME_ADVERT;
-  frame->source = my_subscriber;
-  frame->ttl = 1;
-  frame->queue = OQ_OPPORTUNISTIC;
-  if ((frame->payload = ob_new()) == NULL) {
-    op_free(frame);
-    goto end;
-  }
-  ob_limitsize(frame->payload, 800);
-  ob_append_byte(frame->payload, 2);
-  ob_append_ui16(frame->payload, rhizome_http_server_port);
-  int64_t rowid=0;
-  int count = append_bars(frame->payload, &retry, 
-			  "SELECT BAR,ROWID FROM MANIFESTS ORDER BY ROWID DESC LIMIT 3", 
-			  &rowid);
-  if (count>=3){
-    if (bundle_last_rowid>rowid || bundle_last_rowid<=0)
-      bundle_last_rowid=rowid;
-    count = append_bars(frame->payload, &retry, 
-			"SELECT BAR,ROWID FROM MANIFESTS WHERE ROWID < ? ORDER BY ROWID DESC LIMIT 17", 
-			&bundle_last_rowid);
-    if (count<17)
-      bundle_last_rowid=INT64_MAX;
-  }
-  if (overlay_payload_enqueue(frame) == -1)
-    op_free(frame);
-end:
-  sqlite_set_tracefunc(oldfunc);
   alarm->alarm = gettime_ms()+config.rhizome.advertise.interval;
   alarm->deadline = alarm->alarm+10000;
   schedule(alarm);
@@ -252,8 +161,9 @@ end:
 
 /* Queue an advertisment for a single manifest */
 int rhizome_advertise_manifest(struct subscriber *dest, rhizome_manifest *m){
-  struct overlay_frame *frame = malloc(sizeof(struct overlay_frame));
-  bzero(frame,sizeof(struct overlay_frame));
+  struct overlay_frame *frame = op_new();
+  if (!frame)
+    return -1;
   frame->type = OF_TYPE_RHIZOME_ADVERT;
   frame->source = my_subscriber;
   if (dest && dest->reachable&REACHABLE)
@@ -14,9 +14,10 @@ int rhizome_exists(const rhizome_filehash_t *hashp)
   return gotfile;
 }
 
-int rhizome_open_write(struct rhizome_write *write, const rhizome_filehash_t *expectedHashp, uint64_t file_length, int priority)
+int rhizome_open_write(struct rhizome_write *write, const rhizome_filehash_t *expectedHashp, uint64_t file_length, int priority, const char *service)
 {
   write->blob_fd=-1;
+  write->tier[0]='\0';
   
   if (expectedHashp){
     if (rhizome_exists(expectedHashp))
@@ -47,14 +48,24 @@ int rhizome_open_write(struct rhizome_write *write, const rhizome_filehash_t *ex
    int sqlite3_blob_write(sqlite3_blob *, const void *z, int n, int iOffset);
    */
   
+  int external = config.rhizome.external_blobs || file_length > config.rhizome.max_blob_size;
+  if (!external && rhizome_make_space(priority, file_length) == -1)
+    WHYF("Failed to make room for %"PRIu64" byte payload", file_length);
+  if (external) {
+    const char *tier = rhizome_tier_choose(file_length, priority, service);
+    if (tier)
+      strbuf_puts(strbuf_local(write->tier, sizeof write->tier), tier);
+  }
+  
   sqlite3_stmt *statement = NULL;
   int ret = sqlite_exec_void_retry(
 	&retry,
-	"INSERT OR REPLACE INTO FILES(id,length,highestpriority,datavalid,inserttime) VALUES(?,?,?,0,?);",
+	"INSERT OR REPLACE INTO FILES(id,length,highestpriority,datavalid,inserttime,tier) VALUES(?,?,?,0,?,?);",
 	UINT64_TOSTR, write->temp_id,
 	INT64, file_length,
 	INT, priority,
 	INT64, now,
+	NUL|TEXT, write->tier[0] ? write->tier : NULL,
 	END
       );
   if (ret==-1)
@@ -62,8 +73,8 @@ int rhizome_open_write(struct rhizome_write *write, const rhizome_filehash_t *ex
   
   char blob_path[1024];
   
-  if (config.rhizome.external_blobs || file_length > 128*1024) {
-    if (!FORM_RHIZOME_DATASTORE_PATH(blob_path, "%"PRId64, write->temp_id)){
+  if (external) {
+    if (!FORM_RHIZOME_TIER_PATH(blob_path, write->tier, "%"PRId64, write->temp_id)){
       WHY("Invalid path");
       goto insert_row_fail;
     }
@@ -155,6 +166,8 @@ static int prepare_data(struct rhizome_write *write_state, unsigned char *buffer
   }
   
   SHA512_Update(&write_state->sha512_context, buffer, data_size);
+  if (write_state->merkle_enabled)
+    rhizome_merkle_update(&write_state->merkle, buffer, data_size);
   write_state->file_offset+=data_size;
   
   if (config.debug.rhizome)
@@ -492,6 +505,11 @@ int rhizome_finish_write(struct rhizome_write *write)
     // we've already got that payload, delete the new copy
     sqlite_exec_void_retry_loglevel(LOG_LEVEL_WARN, &retry, "DELETE FROM FILEBLOBS WHERE id = ?;", UINT64_TOSTR, write->temp_id, END);
     sqlite_exec_void_retry_loglevel(LOG_LEVEL_WARN, &retry, "DELETE FROM FILES WHERE id = ?;", UINT64_TOSTR, write->temp_id, END);
+    if (fd>=0){
+      char blob_path[1024];
+      if (FORM_RHIZOME_TIER_PATH(blob_path, write->tier, "%"PRId64, write->temp_id))
+	unlink(blob_path);
+    }
     if (config.debug.rhizome)
       DEBUGF("File id=%s already present, removed id='%"PRId64"'", alloca_tohex_rhizome_filehash_t(write->id), write->temp_id);
   } else {
@@ -516,11 +534,11 @@ int rhizome_finish_write(struct rhizome_write *write)
     if (fd>=0){
       char blob_path[1024];
       char dest_path[1024];
-      if (!FORM_RHIZOME_DATASTORE_PATH(blob_path, "%"PRId64, write->temp_id)){
+      if (!FORM_RHIZOME_TIER_PATH(blob_path, write->tier, "%"PRId64, write->temp_id)){
 	WHYF("Failed to generate file path");
 	goto dbfailure;
       }
-      if (!FORM_RHIZOME_DATASTORE_PATH(dest_path, alloca_tohex_rhizome_filehash_t(write->id))){
+      if (!FORM_RHIZOME_TIER_PATH(dest_path, write->tier, "%s", alloca_tohex_rhizome_filehash_t(write->id))){
 	WHYF("Failed to generate file path");
 	goto dbfailure;
       }
@@ -567,7 +585,7 @@ int rhizome_import_file(rhizome_manifest *m, const char *filepath)
   struct rhizome_write write;
   bzero(&write, sizeof(write));
   
-  int ret=rhizome_open_write(&write, &m->filehash, m->filesize, RHIZOME_PRIORITY_DEFAULT);
+  int ret=rhizome_open_write(&write, &m->filehash, m->filesize, RHIZOME_PRIORITY_DEFAULT, m->service);
   if (ret!=0)
     return ret;
   
@@ -599,7 +617,7 @@ int rhizome_import_buffer(rhizome_manifest *m, unsigned char *buffer, size_t len
   struct rhizome_write write;
   bzero(&write, sizeof(write));
   
-  int ret=rhizome_open_write(&write, &m->filehash, m->filesize, RHIZOME_PRIORITY_DEFAULT);
+  int ret=rhizome_open_write(&write, &m->filehash, m->filesize, RHIZOME_PRIORITY_DEFAULT, m->service);
   if (ret!=0)
     return ret;
   
@@ -661,7 +679,7 @@ static int rhizome_write_derive_key(rhizome_manifest *m, struct rhizome_write *w
 int rhizome_write_open_manifest(struct rhizome_write *write, rhizome_manifest *m)
 {
   assert(m->filesize != RHIZOME_SIZE_UNSET);
-  if (rhizome_open_write(write, NULL, m->filesize, RHIZOME_PRIORITY_DEFAULT))
+  if (rhizome_open_write(write, NULL, m->filesize, RHIZOME_PRIORITY_DEFAULT, m->service))
     return -1;
 
   if (rhizome_write_derive_key(m, write))
@@ -678,11 +696,21 @@ int rhizome_add_file(rhizome_manifest *m, const char *filepath)
   bzero(&write, sizeof(write));
   if (rhizome_write_open_manifest(&write, m))
     goto failure;
+  // journals are fetched from their tail, so only give whole payloads a Merkle tree
+  if (config.rhizome.merkle_tree && !m->is_journal) {
+    write.merkle_enabled = 1;
+    rhizome_merkle_init(&write.merkle);
+  }
   if (rhizome_write_file(&write, filepath))
     goto failure;
   if (rhizome_finish_write(&write))
     goto failure;
   rhizome_manifest_set_filehash(m, &write.id);
+  unsigned char root[RHIZOME_MERKLE_HASH_BYTES];
+  if (write.merkle_enabled && rhizome_merkle_final(&write.merkle, root) == 0)
+    rhizome_manifest_set_merkle_root(m, root);
+  else
+    rhizome_manifest_del_merkle_root(m);
   return 0;
 failure:
   rhizome_fail_write(&write);
@@ -705,23 +733,23 @@ int rhizome_open_read(struct rhizome_read *read, const rhizome_filehash_t *hashp
     return -1;
   if (read->blob_rowid != -1) {
     read->length = RHIZOME_SIZE_UNSET; // discover the length on opening the db BLOB
+    rhizome_tier_note_access(&read->id);
   } else {
-    // No row in FILEBLOBS, look for an external blob file.
-    char blob_path[1024];
-    if (!FORM_RHIZOME_DATASTORE_PATH(blob_path, alloca_tohex_rhizome_filehash_t(read->id)))
-      return -1;
-    read->blob_fd = open(blob_path, O_RDONLY);
+    // No row in FILEBLOBS, look for an external blob file in the storage tiers.
+    const char *name = alloca_tohex_rhizome_filehash_t(read->id);
+    read->blob_fd = rhizome_tier_open(&read->id);
     if (read->blob_fd == -1) {
       if (errno == ENOENT)
 	return 1; // file not available
-      return WHYF_perror("open(%s)", alloca_str_toprint(blob_path));
+      return WHYF_perror("open(%s)", name);
     }
     off64_t pos = lseek64(read->blob_fd, 0, SEEK_END);
     if (pos == -1)
-      return WHYF_perror("lseek64(%s,0,SEEK_END)", alloca_str_toprint(blob_path));
+      return WHYF_perror("lseek64(%s,0,SEEK_END)", name);
     read->length = pos;
     if (config.debug.externalblobs)
-      DEBUGF("Opened stored file %s as fd %d, len %"PRIx64,blob_path, read->blob_fd, read->length);
+      DEBUGF("Opened stored file %s as fd %d, len %"PRIx64, name, read->blob_fd, read->length);
+    rhizome_tier_note_access(&read->id);
   }
   read->offset = 0;
   read->hash_offset = 0;
@@ -915,10 +943,178 @@ struct cache_entry{
   rhizome_bid_t bundle_id;
   uint64_t version;
   struct rhizome_read read_state;
+  struct rhizome_merkle_tree *merkle;
+  char merkle_failed;
   time_ms_t expires;
+  // the page after the last one read from the store, so sequential reads can be detected
+  uint64_t next_page;
 };
 struct cache_entry *root;
 
+/* Pages of stored payloads, shared by everyone reading the same bundle through the cache.  Pages
+ * are found by hashing their entry and page number, and the least recently used are discarded once
+ * the total would exceed rhizome.mdp.cache_size.
+ */
+struct cache_page{
+  struct cache_page *_hash_next;
+  struct cache_page *_lru_prev;
+  struct cache_page *_lru_next;
+  struct cache_entry *entry;
+  uint64_t index;
+  size_t len;
+  unsigned char data[RHIZOME_CRYPT_PAGE_SIZE];
+};
+
+#define CACHE_PAGE_BUCKETS 256
+static struct cache_page *page_hash[CACHE_PAGE_BUCKETS];
+static struct cache_page *page_lru_head = NULL; // most recently used
+static struct cache_page *page_lru_tail = NULL;
+static unsigned page_count = 0;
+static uint64_t page_hits = 0;
+static uint64_t page_misses = 0;
+static uint64_t page_read_ahead = 0;
+static uint64_t page_evictions = 0;
+
+static struct cache_page **page_bucket(const struct cache_entry *entry, uint64_t index)
+{
+  uint64_t h = ((uintptr_t) entry >> 4) ^ (index * 2654435761u);
+  return &page_hash[h % CACHE_PAGE_BUCKETS];
+}
+
+static void page_lru_unlink(struct cache_page *page)
+{
+  if (page->_lru_prev)
+    page->_lru_prev->_lru_next = page->_lru_next;
+  else
+    page_lru_head = page->_lru_next;
+  if (page->_lru_next)
+    page->_lru_next->_lru_prev = page->_lru_prev;
+  else
+    page_lru_tail = page->_lru_prev;
+  page->_lru_prev = page->_lru_next = NULL;
+}
+
+static void page_lru_push(struct cache_page *page)
+{
+  page->_lru_prev = NULL;
+  page->_lru_next = page_lru_head;
+  if (page_lru_head)
+    page_lru_head->_lru_prev = page;
+  else
+    page_lru_tail = page;
+  page_lru_head = page;
+}
+
+static struct cache_page *page_find(const struct cache_entry *entry, uint64_t index)
+{
+  struct cache_page *page;
+  for (page = *page_bucket(entry, index); page; page = page->_hash_next)
+    if (page->entry == entry && page->index == index)
+      return page;
+  return NULL;
+}
+
+static void page_free(struct cache_page *page)
+{
+  struct cache_page **ptr = page_bucket(page->entry, page->index);
+  while (*ptr != page)
+    ptr = &(*ptr)->_hash_next;
+  *ptr = page->_hash_next;
+  page_lru_unlink(page);
+  page_count--;
+  free(page);
+}
+
+static void page_free_entry(const struct cache_entry *entry)
+{
+  struct cache_page *page = page_lru_head;
+  while (page) {
+    struct cache_page *next = page->_lru_next;
+    if (page->entry == entry)
+      page_free(page);
+    page = next;
+  }
+}
+
+static struct cache_page *page_new(struct cache_entry *entry, uint64_t index)
+{
+  while (page_lru_tail && (uint64_t)(page_count + 1) * RHIZOME_CRYPT_PAGE_SIZE > config.rhizome.mdp.cache_size) {
+    page_free(page_lru_tail);
+    page_evictions++;
+  }
+  struct cache_page *page = emalloc(sizeof(struct cache_page));
+  if (!page)
+    return NULL;
+  page->entry = entry;
+  page->index = index;
+  page->len = 0;
+  struct cache_page **bucket = page_bucket(entry, index);
+  page->_hash_next = *bucket;
+  *bucket = page;
+  page_lru_push(page);
+  page_count++;
+  return page;
+}
+
+/* Read the given page from the store, and if the payload is being read in order, the pages that
+ * follow it too, all in one read.
+ */
+static struct cache_page *page_load(struct cache_entry *entry, uint64_t index)
+{
+  unsigned count = 1;
+  if (index == entry->next_page) {
+    unsigned max = config.rhizome.mdp.cache_size / RHIZOME_CRYPT_PAGE_SIZE / 2;
+    count += config.rhizome.mdp.read_ahead;
+    if (count > max)
+      count = max > 1 ? max : 1;
+  }
+  if (entry->read_state.length != RHIZOME_SIZE_UNSET) {
+    uint64_t pages = (entry->read_state.length + RHIZOME_CRYPT_PAGE_SIZE - 1) / RHIZOME_CRYPT_PAGE_SIZE;
+    if (index + count > pages)
+      count = pages > index ? pages - index : 1;
+  }
+  unsigned i;
+  for (i = 1; i < count; ++i)
+    if (page_find(entry, index + i))
+      break;
+  count = i;
+  unsigned char *data = emalloc(count * RHIZOME_CRYPT_PAGE_SIZE);
+  if (!data)
+    return NULL;
+  entry->read_state.offset = index * RHIZOME_CRYPT_PAGE_SIZE;
+  ssize_t r = rhizome_read(&entry->read_state, data, count * RHIZOME_CRYPT_PAGE_SIZE);
+  if (r == -1) {
+    free(data);
+    return NULL;
+  }
+  // only keep a short page if it is the end of the payload, not a short read
+  uint64_t end = entry->read_state.offset;
+  struct cache_page *first = NULL;
+  size_t ofs;
+  for (i = 0, ofs = 0; ofs < (size_t) r || i == 0; ++i, ofs += RHIZOME_CRYPT_PAGE_SIZE) {
+    size_t len = (size_t) r - ofs;
+    if (len > RHIZOME_CRYPT_PAGE_SIZE)
+      len = RHIZOME_CRYPT_PAGE_SIZE;
+    if (len < RHIZOME_CRYPT_PAGE_SIZE && end < entry->read_state.length)
+      break;
+    struct cache_page *page = page_new(entry, index + i);
+    if (!page)
+      break;
+    bcopy(data + ofs, page->data, len);
+    page->len = len;
+    if (i == 0)
+      first = page;
+    else
+      page_read_ahead++;
+  }
+  free(data);
+  entry->next_page = index + i;
+  if (config.debug.rhizome_tx)
+    DEBUGF("Cached %u pages of %s from page %"PRIu64" (%u pages cached)", i,
+	   alloca_tohex_rhizome_bid_t(entry->bundle_id), index, page_count);
+  return first;
+}
+
 static struct cache_entry ** find_entry_location(struct cache_entry **ptr, const rhizome_bid_t *bundle_id, uint64_t version)
 {
   while(*ptr){
@@ -952,7 +1148,9 @@ static time_ms_t close_entries(struct cache_entry **entry, time_ms_t timeout)
     ret=t_right;
     
   if ((*entry)->expires < timeout || timeout==0){
+    page_free_entry(*entry);
     rhizome_read_close(&(*entry)->read_state);
+    rhizome_merkle_tree_free((*entry)->merkle);
     // remember the two children
     struct cache_entry *left=(*entry)->_left;
     struct cache_entry *right=(*entry)->_right;
@@ -1009,6 +1207,14 @@ int rhizome_cache_count()
   return _rhizome_cache_count(root);
 }
 
+void rhizome_cache_stats_json(strbuf b)
+{
+  strbuf_sprintf(b, "{\"entries\":%d,\"pages\":%u,\"bytes\":%"PRIu64",\"hits\":%"PRIu64",\"misses\":%"PRIu64","
+		 "\"read_ahead\":%"PRIu64",\"evictions\":%"PRIu64"}",
+		 rhizome_cache_count(), page_count, (uint64_t) page_count * RHIZOME_CRYPT_PAGE_SIZE,
+		 page_hits, page_misses, page_read_ahead, page_evictions);
+}
+
 // read a block of data, caching meta data for reuse
 int rhizome_read_cached(const rhizome_bid_t *bidp, uint64_t version, time_ms_t timeout, uint64_t fileOffset, unsigned char *buffer, size_t length)
 {
@@ -1045,7 +1251,60 @@ int rhizome_read_cached(const rhizome_bid_t *bidp, uint64_t version, time_ms_t t
     }
   }
   
-  return rhizome_read(&entry->read_state, buffer, length);
+  if (config.rhizome.mdp.cache_size < RHIZOME_CRYPT_PAGE_SIZE)
+    return rhizome_read(&entry->read_state, buffer, length);
+  
+  size_t copied = 0;
+  while (length > 0) {
+    uint64_t index = fileOffset / RHIZOME_CRYPT_PAGE_SIZE;
+    struct cache_page *page = page_find(entry, index);
+    if (page) {
+      page_hits++;
+      page_lru_unlink(page);
+      page_lru_push(page);
+    } else {
+      page_misses++;
+      if ((page = page_load(entry, index)) == NULL) {
+	if (copied)
+	  break;
+	// could not fill the page, so read the block directly
+	entry->read_state.offset = fileOffset;
+	return rhizome_read(&entry->read_state, buffer, length);
+      }
+    }
+    size_t ofs = fileOffset - index * RHIZOME_CRYPT_PAGE_SIZE;
+    if (ofs >= page->len)
+      break;
+    size_t n = page->len - ofs;
+    if (n > length)
+      n = length;
+    bcopy(page->data + ofs, buffer, n);
+    buffer += n;
+    length -= n;
+    fileOffset += n;
+    copied += n;
+    if (page->len < RHIZOME_CRYPT_PAGE_SIZE)
+      break;
+  }
+  return copied;
+}
+
+// form the Merkle proof of a block of a payload in the read cache, building its tree the first time
+ssize_t rhizome_read_cached_proof(const rhizome_bid_t *bidp, uint64_t version, uint64_t fileOffset, unsigned char *proof, size_t size)
+{
+  struct cache_entry *entry = *find_entry_location(&root, bidp, version);
+  if (!entry)
+    return WHYF("Payload of %s is not being read", alloca_tohex_rhizome_bid_t(*bidp));
+  if (fileOffset % RHIZOME_MERKLE_BLOCK_SIZE)
+    return WHYF("Offset %"PRIu64" is not at a block boundary", fileOffset);
+  if (!entry->merkle) {
+    // don't read the whole payload again for every request if it could not be done
+    if (entry->merkle_failed || !(entry->merkle = rhizome_merkle_tree_build(&entry->read_state.id))) {
+      entry->merkle_failed = 1;
+      return -1;
+    }
+  }
+  return rhizome_merkle_tree_proof(entry->merkle, fileOffset / RHIZOME_MERKLE_BLOCK_SIZE, proof, size);
 }
 
 /* Returns -1 on error, 0 on success.
@@ -1199,7 +1458,7 @@ int rhizome_write_open_journal(struct rhizome_write *write, rhizome_manifest *m,
 
   rhizome_manifest_set_version(m, m->filesize);
 
-  ret = rhizome_open_write(write, NULL, m->filesize, RHIZOME_PRIORITY_DEFAULT);
+  ret = rhizome_open_write(write, NULL, m->filesize, RHIZOME_PRIORITY_DEFAULT, m->service);
   if (ret)
     goto failure;
 
@@ -40,6 +40,15 @@ struct bar_entry
   time_ms_t next_request;
 };
 
+// what we have sent a peer in reply to its requests
+struct sync_served
+{
+  uint64_t start;
+  uint64_t end;
+  unsigned requests;
+  time_ms_t last_request;
+};
+
 struct rhizome_sync
 {
   // window of BAR's we have synced
@@ -58,8 +67,30 @@ struct rhizome_sync
   struct bar_entry bars[CACHE_BARS];
   // how many bars are we interested in?
   int bar_count;
+  struct sync_served served;
 };
 
+/* Advertisement planner.  The newest BARs are broadcast every rhizome.advertise.interval, so that
+ * neighbours notice new bundles and start syncing.  While there are no new bundles and no neighbour
+ * has asked for BARs since the last broadcast, the interval doubles up to
+ * rhizome.advertise.max_interval.  A new bundle or a new neighbour brings it straight back down.
+ */
+static uint64_t announced_head=0;
+static time_ms_t last_announce=0;
+static time_ms_t announce_interval=0;
+
+static struct {
+  uint64_t announcements;
+  uint64_t announce_bars;
+  uint64_t announce_bytes;
+  uint64_t skipped;
+  uint64_t responses;
+  uint64_t response_bars;
+  uint64_t response_bytes;
+  uint64_t requests;
+  uint64_t request_bytes;
+} airtime;
+
 void rhizome_sync_status_html(struct strbuf *b, struct subscriber *subscriber)
 {
   if (!subscriber->sync_state)
@@ -71,6 +102,11 @@ void rhizome_sync_status_html(struct strbuf *b, struct subscriber *subscriber)
     state->sync_end,
     state->highest_seen,
     state->bar_count);
+  if (state->served.requests)
+    strbuf_sprintf(b, "Sent BARs [%"PRIu64" to %"PRIu64"] in reply to %u requests<br>",
+      state->served.start,
+      state->served.end,
+      state->served.requests);
 }
 
 static void rhizome_sync_request(struct subscriber *subscriber, uint64_t token, unsigned char forwards)
@@ -93,6 +129,8 @@ static void rhizome_sync_request(struct subscriber *subscriber, uint64_t token,
   mdp.out.payload_length = ob_position(b);
   if (config.debug.rhizome)
     DEBUGF("Sending request to %s for BARs from %"PRIu64" %s", alloca_tohex_sid_t(subscriber->sid), token, forwards?"forwards":"backwards");
+  airtime.requests++;
+  airtime.request_bytes += mdp.out.payload_length;
   overlay_mdp_dispatch(&mdp,0,NULL,0);
   ob_free(b);
 }
@@ -246,7 +284,9 @@ static void sync_process_bar_list(struct subscriber *subscriber, struct rhizome_
   
   if (now - state->start_time > (60*60*1000)){
     // restart rhizome sync every hour, no matter what state it is in
+    struct sync_served served = state->served;
     bzero(state, sizeof(struct rhizome_sync));
+    state->served = served;
     state->start_time = now;
   }
   state->last_response = now;
@@ -377,6 +417,7 @@ static void sync_send_response(struct subscriber *dest, int forwards, uint64_t t
   sqlite3_bind_int64(statement, 1, token);
   int count=0;
   uint64_t last=0;
+  uint64_t lowest=UINT64_MAX, highest=0;
 
   while(sqlite_step_retry(&retry, statement)==SQLITE_ROW){
     uint64_t rowid = sqlite3_column_int64(statement, 0);
@@ -391,7 +432,8 @@ static void sync_send_response(struct subscriber *dest, int forwards, uint64_t t
       rhizome_sync_bundle_inserted(bar);
     }
 
-    if (count < max_count){
+    // a broadcast includes every bundle that is new since the last one, as far as will fit
+    if (count < max_count || (!dest && announced_head && rowid > announced_head && count < BARS_PER_RESPONSE)){
       // make sure we include the exact rowid that was requested, even if we just deleted / replaced the manifest
       if (count==0 && rowid!=token){
         if (token!=HEAD_FLAG){
@@ -413,6 +455,10 @@ static void sync_send_response(struct subscriber *dest, int forwards, uint64_t t
       else {
         last = rowid;
         count++;
+        if (rowid < lowest)
+          lowest = rowid;
+        if (rowid > highest)
+          highest = rowid;
       }
     }
     if (count >= max_count && rowid <= max_token)
@@ -440,20 +486,152 @@ static void sync_send_response(struct subscriber *dest, int forwards, uint64_t t
     mdp.out.payload_length = ob_position(b);
     if (config.debug.rhizome_ads)
       DEBUGF("Sending %d BARs from %"PRIu64" to %"PRIu64, count, token, last);
+    if (dest){
+      airtime.responses++;
+      airtime.response_bars += count;
+      airtime.response_bytes += mdp.out.payload_length;
+      struct rhizome_sync *state = dest->sync_state;
+      if (state && highest){
+        // a zero lower bound means the peer has now been sent everything below
+        if (last == 0)
+          lowest = 0;
+        if (state->served.end == 0 || lowest < state->served.start)
+          state->served.start = lowest;
+        if (highest > state->served.end)
+          state->served.end = highest;
+      }
+    }else{
+      airtime.announcements++;
+      airtime.announce_bars += count;
+      airtime.announce_bytes += mdp.out.payload_length;
+      if (highest > announced_head)
+        announced_head = highest;
+    }
     overlay_mdp_dispatch(&mdp,0,NULL,0);
   }
   ob_free(b);
   OUT();
 }
 
-int rhizome_sync_announce()
+static void sync_announce(time_ms_t now)
 {
   int (*oldfunc)() = sqlite_set_tracefunc(is_debug_rhizome_ads);
   sync_send_response(NULL, 0, HEAD_FLAG, 5);
   sqlite_set_tracefunc(oldfunc);
+  last_announce = now;
+}
+
+static void sync_reset_interval(const char *reason)
+{
+  if (announce_interval > config.rhizome.advertise.interval && config.debug.rhizome_ads)
+    DEBUGF("Rhizome advertisement interval now %"PRIu32"ms, %s", config.rhizome.advertise.interval, reason);
+  announce_interval = config.rhizome.advertise.interval;
+}
+
+// a new bundle has been stored by this process
+int rhizome_sync_announce()
+{
+  sync_reset_interval("new bundle");
+  sync_announce(gettime_ms());
   return 0;
 }
 
+void rhizome_sync_neighbour_up(struct subscriber *subscriber)
+{
+  if (config.debug.rhizome_ads)
+    DEBUGF("New neighbour %s", alloca_tohex_sid_t(subscriber->sid));
+  sync_reset_interval("new neighbour");
+}
+
+static int peer_syncing(struct subscriber *subscriber, void *context)
+{
+  int *syncing = context;
+  struct rhizome_sync *state = subscriber->sync_state;
+  if (state && (subscriber->reachable & REACHABLE_DIRECT) && state->served.last_request >= last_announce)
+    *syncing = 1;
+  return *syncing;
+}
+
+/* Called every rhizome.advertise.interval to decide whether to broadcast the newest BARs now.
+ */
+int rhizome_sync_advertise()
+{
+  time_ms_t now = gettime_ms();
+  time_ms_t base = config.rhizome.advertise.interval;
+  time_ms_t max = config.rhizome.advertise.max_interval;
+  if (max < base)
+    max = base;
+  if (announce_interval < base)
+    announce_interval = base;
+  else if (announce_interval > max)
+    announce_interval = max;
+
+  // bundles stored by another process are not announced when they are stored
+  int64_t head = 0;
+  int (*oldfunc)() = sqlite_set_tracefunc(is_debug_rhizome_ads);
+  int r = sqlite_exec_int64(&head, "SELECT max(rowid) FROM MANIFESTS;", END);
+  sqlite_set_tracefunc(oldfunc);
+  if (r == -1)
+    return -1;
+  if ((uint64_t)head < announced_head)
+    announced_head = head;
+
+  if ((uint64_t)head > announced_head){
+    sync_reset_interval("new bundle");
+  }else if (now < last_announce + announce_interval){
+    airtime.skipped++;
+    return 0;
+  }else{
+    // back off while no neighbour has asked for more since the last broadcast
+    int syncing = 0;
+    enum_subscribers(NULL, peer_syncing, &syncing);
+    if (syncing)
+      sync_reset_interval("neighbour syncing");
+    else if (announce_interval < max){
+      announce_interval = announce_interval * 2 > max ? max : announce_interval * 2;
+      if (config.debug.rhizome_ads)
+        DEBUGF("Rhizome advertisement interval now %"PRId64"ms, neighbours in sync", announce_interval);
+    }
+  }
+  sync_announce(now);
+  return 0;
+}
+
+struct neighbour_stats_context {
+  strbuf b;
+  unsigned count;
+};
+
+static int neighbour_stats_json(struct subscriber *subscriber, void *context)
+{
+  struct neighbour_stats_context *c = context;
+  struct rhizome_sync *state = subscriber->sync_state;
+  if (!state)
+    return 0;
+  if (c->count++)
+    strbuf_putc(c->b, ',');
+  strbuf_sprintf(c->b, "{\"sid\":\"%s\",\"requests\":%u,\"sent_start\":%"PRIu64",\"sent_end\":%"PRIu64","
+		 "\"synced_start\":%"PRIu64",\"synced_end\":%"PRIu64",\"highest_seen\":%"PRIu64",\"interesting\":%d}",
+		 alloca_tohex_sid_t(subscriber->sid), state->served.requests, state->served.start, state->served.end,
+		 state->sync_start, state->sync_end, state->highest_seen, state->bar_count);
+  return 0;
+}
+
+void rhizome_sync_stats_json(strbuf b)
+{
+  strbuf_sprintf(b, "{\"interval_ms\":%"PRId64",\"announced_head\":%"PRIu64","
+		 "\"announcements\":%"PRIu64",\"announce_bars\":%"PRIu64",\"announce_bytes\":%"PRIu64",\"skipped\":%"PRIu64","
+		 "\"responses\":%"PRIu64",\"response_bars\":%"PRIu64",\"response_bytes\":%"PRIu64","
+		 "\"requests\":%"PRIu64",\"request_bytes\":%"PRIu64",\"neighbours\":[",
+		 announce_interval, announced_head,
+		 airtime.announcements, airtime.announce_bars, airtime.announce_bytes, airtime.skipped,
+		 airtime.responses, airtime.response_bars, airtime.response_bytes,
+		 airtime.requests, airtime.request_bytes);
+  struct neighbour_stats_context context = { .b = b, .count = 0 };
+  enum_subscribers(NULL, neighbour_stats_json, &context);
+  strbuf_puts(b, "]}");
+}
+
 int overlay_mdp_service_rhizome_sync(struct overlay_frame *frame, overlay_mdp_frame *mdp)
 {
   if (!frame)
@@ -462,6 +640,7 @@ int overlay_mdp_service_rhizome_sync(struct overlay_frame *frame, overlay_mdp_fr
   if (!state){
     state = frame->source->sync_state = emalloc_zero(sizeof(struct rhizome_sync));
     state->start_time=gettime_ms();
+    sync_reset_interval("new neighbour");
   }
   struct overlay_buffer *b = ob_static(mdp->out.payload, sizeof(mdp->out.payload));
   ob_limitsize(b, mdp->out.payload_length);
@@ -474,6 +653,8 @@ int overlay_mdp_service_rhizome_sync(struct overlay_frame *frame, overlay_mdp_fr
       {
         int forwards = ob_get(b);
         uint64_t token = ob_get_packed_ui64(b);
+        state->served.requests++;
+        state->served.last_request = gettime_ms();
         sync_send_response(frame->source, forwards, token, 0);
       }
       break;
@@ -0,0 +1,434 @@
+/*
+Copyright (C) 2013 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  Rhizome storage tiers.
+
+  Payloads larger than rhizome.max_blob_size are stored as files outside the database.  By default
+  they go in the datastore directory, but rhizome.tier.N can list other directories, fastest first,
+  eg, a small eMMC partition followed by a large SD card.  A new payload is placed in the first
+  tier whose size, priority and service rules admit it and that has room for it, otherwise in the
+  datastore directory.  FILES.tier records the path of the tier that holds each payload (NULL for
+  the datastore directory or the database itself).
+
+  Reads are counted in memory and written to FILES.lastaccess and FILES.accesscount in batches.
+  Every rhizome.tier_interval_ms the server moves up to rhizome.tier_migrate_bytes of payloads:
+  the least recently read payloads in a tier that is over its size are moved to the next tier that
+  admits them, payloads read at least rhizome.tier_promote_reads times are moved into a "hot" tier,
+  and a few pages of free space are returned from the database file.
+ */
+
+#include "serval.h"
+#include "conf.h"
+#include "rhizome.h"
+#include "str.h"
+#include "strbuf.h"
+
+#define RHIZOME_TIER_PATH_MAX (sizeof config.rhizome.tier.av[0].value.path)
+#define RHIZOME_TIER_SERVICE_MAX (sizeof config.rhizome.tier.av[0].value.service)
+#define RHIZOME_TIER_ACCESS_MAX 64
+#define RHIZOME_TIER_CANDIDATES 8
+/* Read counts of payloads that have not been read for this long are halved at each interval */
+#define RHIZOME_TIER_DECAY_MS (60 * 60 * 1000)
+
+static struct rhizome_tier_access {
+  rhizome_filehash_t id;
+  unsigned count;
+  time_ms_t last;
+} accesses[RHIZOME_TIER_ACCESS_MAX];
+static unsigned access_count = 0;
+
+struct tier_candidate {
+  rhizome_filehash_t id;
+  uint64_t length;
+  int priority;
+  char tier[RHIZOME_TIER_PATH_MAX];
+  time_ms_t last;
+  int64_t reads;
+};
+
+static const struct config_rhizome_tier *find_tier(const char *path, int *index)
+{
+  unsigned i;
+  if (path && path[0])
+    for (i = 0; i < config.rhizome.tier.ac; ++i)
+      if (strcmp(config.rhizome.tier.av[i].value.path, path) == 0) {
+	if (index)
+	  *index = i;
+	return &config.rhizome.tier.av[i].value;
+      }
+  if (index)
+    *index = config.rhizome.tier.ac;
+  return NULL;
+}
+
+static int tier_admits(const struct config_rhizome_tier *tier, uint64_t length, int priority, const char *service)
+{
+  if (length < tier->min_payload_size)
+    return 0;
+  if (tier->max_payload_size && length > tier->max_payload_size)
+    return 0;
+  if (priority < tier->min_priority)
+    return 0;
+  if (tier->service[0] && (service == NULL || strcasecmp(service, tier->service) != 0))
+    return 0;
+  return 1;
+}
+
+static int64_t tier_used_bytes(const struct config_rhizome_tier *tier)
+{
+  int64_t used = 0;
+  if (sqlite_exec_int64(&used, "SELECT COALESCE(SUM(length), 0) FROM FILES WHERE tier = ?;", STATIC_TEXT, tier->path, END) == -1)
+    return -1;
+  return used;
+}
+
+static int tier_mkdir(const char *tier)
+{
+  char dir[1024];
+  if (!FORM_RHIZOME_TIER_PATH(dir, tier, NULL))
+    return -1;
+  return emkdirs(dir, 0700);
+}
+
+static int tier_has_room(const struct config_rhizome_tier *tier, uint64_t length)
+{
+  if (tier->size == 0)
+    return 1;
+  int64_t used = tier_used_bytes(tier);
+  return used != -1 && used + length <= tier->size;
+}
+
+const char *rhizome_tier_choose(uint64_t length, int priority, const char *service)
+{
+  unsigned i;
+  for (i = 0; i < config.rhizome.tier.ac; ++i) {
+    const struct config_rhizome_tier *tier = &config.rhizome.tier.av[i].value;
+    if (tier_admits(tier, length, priority, service) && tier_has_room(tier, length)) {
+      if (tier_mkdir(tier->path) == -1)
+	continue;
+      if (config.debug.externalblobs)
+	DEBUGF("Placing %"PRIu64" byte payload in tier %s", length, alloca_str_toprint(tier->path));
+      return tier->path;
+    }
+  }
+  return NULL;
+}
+
+int rhizome_tier_open(const rhizome_filehash_t *hashp)
+{
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  char recorded[RHIZOME_TIER_PATH_MAX];
+  strbuf b = strbuf_local(recorded, sizeof recorded);
+  if (sqlite_exec_strbuf_retry(&retry, b, "SELECT tier FROM FILES WHERE id = ? AND tier IS NOT NULL;", RHIZOME_FILEHASH_T, hashp, END) == -1)
+    strbuf_reset(b);
+  const char *name = alloca_tohex_rhizome_filehash_t(*hashp);
+  char path[1024];
+  int fd;
+  /* Look in the recorded tier first, then everywhere else in case the tiers have changed. */
+  if (recorded[0] && find_tier(recorded, NULL) && FORM_RHIZOME_TIER_PATH(path, recorded, "%s", name)
+      && ((fd = open(path, O_RDONLY)) != -1 || errno != ENOENT))
+    return fd;
+  if (FORM_RHIZOME_TIER_PATH(path, NULL, "%s", name) && ((fd = open(path, O_RDONLY)) != -1 || errno != ENOENT))
+    return fd;
+  unsigned i;
+  for (i = 0; i < config.rhizome.tier.ac; ++i) {
+    const char *tier = config.rhizome.tier.av[i].value.path;
+    if (strcmp(tier, recorded) != 0
+	&& FORM_RHIZOME_TIER_PATH(path, tier, "%s", name)
+	&& ((fd = open(path, O_RDONLY)) != -1 || errno != ENOENT))
+      return fd;
+  }
+  errno = ENOENT;
+  return -1;
+}
+
+int rhizome_tier_unlink(const rhizome_filehash_t *hashp)
+{
+  const char *name = alloca_tohex_rhizome_filehash_t(*hashp);
+  char path[1024];
+  int ret = -1;
+  if (FORM_RHIZOME_TIER_PATH(path, NULL, "%s", name) && unlink(path) == 0)
+    ret = 0;
+  unsigned i;
+  for (i = 0; i < config.rhizome.tier.ac; ++i)
+    if (FORM_RHIZOME_TIER_PATH(path, config.rhizome.tier.av[i].value.path, "%s", name) && unlink(path) == 0)
+      ret = 0;
+  return ret;
+}
+
+void rhizome_tier_note_access(const rhizome_filehash_t *hashp)
+{
+  time_ms_t now = gettime_ms();
+  unsigned i;
+  for (i = 0; i < access_count; ++i)
+    if (cmp_rhizome_filehash_t(&accesses[i].id, hashp) == 0) {
+      accesses[i].count++;
+      accesses[i].last = now;
+      return;
+    }
+  if (access_count >= RHIZOME_TIER_ACCESS_MAX)
+    rhizome_tier_flush_access();
+  if (access_count < RHIZOME_TIER_ACCESS_MAX) {
+    accesses[access_count].id = *hashp;
+    accesses[access_count].count = 1;
+    accesses[access_count].last = now;
+    access_count++;
+  }
+}
+
+int rhizome_tier_flush_access()
+{
+  if (access_count == 0 || !rhizome_db)
+    return 0;
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  if (sqlite_exec_void_retry(&retry, "BEGIN TRANSACTION;", END) == -1)
+    return -1;
+  unsigned i;
+  for (i = 0; i < access_count; ++i)
+    sqlite_exec_void_retry(&retry,
+	"UPDATE FILES SET lastaccess = ?, accesscount = COALESCE(accesscount, 0) + ? WHERE id = ?;",
+	INT64, accesses[i].last,
+	INT, accesses[i].count,
+	RHIZOME_FILEHASH_T, &accesses[i].id,
+	END);
+  if (sqlite_exec_void_retry(&retry, "COMMIT;", END) == -1) {
+    sqlite_exec_void_retry(&retry, "ROLLBACK;", END);
+    return -1;
+  }
+  access_count = 0;
+  return 0;
+}
+
+static int copy_file(const char *src, const char *dst)
+{
+  int in = open(src, O_RDONLY);
+  if (in == -1)
+    return WHYF_perror("open(%s)", alloca_str_toprint(src));
+  int out = open(dst, O_CREAT | O_TRUNC | O_WRONLY, 0664);
+  if (out == -1) {
+    close(in);
+    return WHYF_perror("open(%s)", alloca_str_toprint(dst));
+  }
+  unsigned char buf[65536];
+  ssize_t n;
+  int ret = 0;
+  while ((n = read(in, buf, sizeof buf)) > 0)
+    if (write_all(out, buf, n) == -1) {
+      ret = -1;
+      break;
+    }
+  if (n == -1)
+    ret = WHYF_perror("read(%s)", alloca_str_toprint(src));
+  if (ret == 0 && fsync(out) == -1)
+    ret = WHYF_perror("fsync(%s)", alloca_str_toprint(dst));
+  close(in);
+  close(out);
+  if (ret == -1)
+    unlink(dst);
+  return ret;
+}
+
+/* Move a payload file from one tier to another (NULL for the datastore directory), and record its
+   new tier.  The old file is unlinked, so a payload being read keeps its open file descriptor.
+ */
+static int tier_move(const struct tier_candidate *c, const char *to)
+{
+  const char *name = alloca_tohex_rhizome_filehash_t(c->id);
+  const char *from = c->tier[0] ? c->tier : NULL;
+  char src[1024], dst[1024], tmp[1024];
+  if (   !FORM_RHIZOME_TIER_PATH(src, from, "%s", name)
+      || !FORM_RHIZOME_TIER_PATH(dst, to, "%s", name)
+      || !FORM_RHIZOME_TIER_PATH(tmp, to, "%s.move", name))
+    return -1;
+  if (tier_mkdir(to) == -1)
+    return -1;
+  int copied = 0;
+  if (rename(src, dst) == -1) {
+    if (errno != EXDEV)
+      return WHYF_perror("rename(%s, %s)", alloca_str_toprint(src), alloca_str_toprint(dst));
+    // on different file systems
+    if (copy_file(src, tmp) == -1)
+      return -1;
+    if (rename(tmp, dst) == -1) {
+      WHYF_perror("rename(%s, %s)", alloca_str_toprint(tmp), alloca_str_toprint(dst));
+      unlink(tmp);
+      return -1;
+    }
+    copied = 1;
+  }
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  if (sqlite_exec_void_retry(&retry, "UPDATE FILES SET tier = ?, accesscount = 0 WHERE id = ?;",
+	NUL|TEXT, to, RHIZOME_FILEHASH_T, &c->id, END) == -1) {
+    if (copied)
+      unlink(dst);
+    else
+      rename(dst, src);
+    return -1;
+  }
+  if (copied)
+    unlink(src);
+  if (config.debug.externalblobs)
+    DEBUGF("Moved %"PRIu64" byte payload %s from tier %s to %s", c->length, name,
+	   alloca_str_toprint(from ? from : ""), alloca_str_toprint(to ? to : ""));
+  return 0;
+}
+
+/* Fetch up to RHIZOME_TIER_CANDIDATES payloads stored as files, from a query which must select
+   CANDIDATE_COLUMNS.  Finalises the statement.
+ */
+#define CANDIDATE_COLUMNS "id, length, highestpriority, tier, COALESCE(lastaccess, inserttime), COALESCE(accesscount, 0)"
+
+static int tier_candidates(struct tier_candidate *c, sqlite_retry_state *retry, sqlite3_stmt *statement)
+{
+  if (!statement)
+    return -1;
+  int n = 0;
+  while (n < RHIZOME_TIER_CANDIDATES && sqlite_step_retry(retry, statement) == SQLITE_ROW) {
+    if (str_to_rhizome_filehash_t(&c[n].id, (const char *) sqlite3_column_text(statement, 0)) == -1)
+      continue;
+    c[n].length = sqlite3_column_int64(statement, 1);
+    c[n].priority = sqlite3_column_int(statement, 2);
+    const char *tier = (const char *) sqlite3_column_text(statement, 3);
+    strbuf_puts(strbuf_local(c[n].tier, sizeof c[n].tier), tier ? tier : "");
+    c[n].last = sqlite3_column_int64(statement, 4);
+    c[n].reads = sqlite3_column_int64(statement, 5);
+    n++;
+  }
+  sqlite3_finalize(statement);
+  return n;
+}
+
+static const char *payload_service(const rhizome_filehash_t *hashp, strbuf b)
+{
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  if (sqlite_exec_strbuf_retry(&retry, b, "SELECT service FROM MANIFESTS WHERE filehash = ? LIMIT 1;", RHIZOME_FILEHASH_T, hashp, END) != 1)
+    return NULL;
+  return strbuf_str(b);
+}
+
+/* Move a payload into the first tier after <from> that admits it and has room, or the datastore
+   directory if there is none.
+ */
+static int tier_demote(const struct tier_candidate *c, int from)
+{
+  strbuf service = strbuf_alloca(RHIZOME_TIER_SERVICE_MAX);
+  const char *svc = payload_service(&c->id, service);
+  unsigned i;
+  for (i = from + 1; i < config.rhizome.tier.ac; ++i) {
+    const struct config_rhizome_tier *tier = &config.rhizome.tier.av[i].value;
+    if (tier_admits(tier, c->length, c->priority, svc) && tier_has_room(tier, c->length))
+      return tier_move(c, tier->path);
+  }
+  return tier_move(c, NULL);
+}
+
+/* Move the least recently read payloads out of tiers that are over their size.
+ */
+static void tier_demote_full(uint64_t *budget)
+{
+  unsigned i;
+  for (i = 0; i < config.rhizome.tier.ac && *budget; ++i) {
+    const struct config_rhizome_tier *tier = &config.rhizome.tier.av[i].value;
+    if (tier->size == 0)
+      continue;
+    int64_t used = tier_used_bytes(tier);
+    if (used == -1 || (uint64_t)used <= tier->size)
+      continue;
+    struct tier_candidate c[RHIZOME_TIER_CANDIDATES];
+    sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+    int n = tier_candidates(c, &retry, sqlite_prepare_bind(&retry,
+	"SELECT " CANDIDATE_COLUMNS " FROM FILES WHERE tier = ? AND datavalid = 1"
+	" ORDER BY COALESCE(lastaccess, inserttime) LIMIT ?;",
+	STATIC_TEXT, tier->path, INT, RHIZOME_TIER_CANDIDATES, END));
+    int j;
+    for (j = 0; j < n && (uint64_t)used > tier->size && *budget >= c[j].length; ++j)
+      if (tier_demote(&c[j], i) == 0) {
+	used -= c[j].length;
+	*budget -= c[j].length;
+      }
+  }
+}
+
+/* Move payloads that are read often into hot tiers, making room by moving out payloads that have
+   been read less often and less recently.
+ */
+static void tier_promote(uint64_t *budget)
+{
+  unsigned i;
+  for (i = 0; i < config.rhizome.tier.ac && *budget; ++i) {
+    const struct config_rhizome_tier *hot = &config.rhizome.tier.av[i].value;
+    if (!hot->hot)
+      continue;
+    struct tier_candidate c[RHIZOME_TIER_CANDIDATES];
+    sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+    int n = tier_candidates(c, &retry, sqlite_prepare_bind(&retry,
+	"SELECT " CANDIDATE_COLUMNS " FROM FILES WHERE datavalid = 1 AND accesscount >= ?"
+	" AND (tier IS NULL OR tier != ?)"
+	" AND NOT EXISTS (SELECT 1 FROM FILEBLOBS WHERE FILEBLOBS.id = FILES.id)"
+	" ORDER BY accesscount DESC, lastaccess DESC LIMIT ?;",
+	INT, config.rhizome.tier_promote_reads, STATIC_TEXT, hot->path, INT, RHIZOME_TIER_CANDIDATES, END));
+    int j;
+    for (j = 0; j < n && *budget >= c[j].length; ++j) {
+      // only move payloads up from slower tiers
+      int from;
+      find_tier(c[j].tier, &from);
+      if (from < (int)i)
+	continue;
+      strbuf service = strbuf_alloca(RHIZOME_TIER_SERVICE_MAX);
+      if (!tier_admits(hot, c[j].length, c[j].priority, payload_service(&c[j].id, service)))
+	continue;
+      if (!tier_has_room(hot, c[j].length)) {
+	struct tier_candidate cold[RHIZOME_TIER_CANDIDATES];
+	int m = tier_candidates(cold, &retry, sqlite_prepare_bind(&retry,
+	    "SELECT " CANDIDATE_COLUMNS " FROM FILES WHERE tier = ? AND datavalid = 1"
+	    " AND COALESCE(accesscount, 0) < ? AND COALESCE(lastaccess, inserttime) < ?"
+	    " ORDER BY COALESCE(lastaccess, inserttime) LIMIT ?;",
+	    STATIC_TEXT, hot->path, INT64, c[j].reads, INT64, c[j].last, INT, RHIZOME_TIER_CANDIDATES, END));
+	int k;
+	for (k = 0; k < m && !tier_has_room(hot, c[j].length) && *budget >= cold[k].length; ++k)
+	  if (tier_demote(&cold[k], i) == 0)
+	    *budget -= cold[k].length;
+	if (!tier_has_room(hot, c[j].length))
+	  continue;
+      }
+      if (tier_move(&c[j], hot->path) == 0)
+	*budget -= c[j].length;
+    }
+  }
+}
+
+void rhizome_tier_migrate(struct sched_ent *alarm)
+{
+  if (rhizome_db) {
+    rhizome_tier_flush_access();
+    if (config.rhizome.tier.ac) {
+      uint64_t budget = config.rhizome.tier_migrate_bytes;
+      tier_demote_full(&budget);
+      tier_promote(&budget);
+      sqlite_exec_void_loglevel(LOG_LEVEL_WARN,
+	  "UPDATE FILES SET accesscount = accesscount / 2 WHERE accesscount > 0 AND lastaccess < ?;",
+	  INT64, gettime_ms() - RHIZOME_TIER_DECAY_MS, END);
+    }
+    // compact the database itself a little at a time
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA incremental_vacuum(64);", END);
+  }
+  alarm->alarm = gettime_ms() + config.rhizome.tier_interval_ms;
+  alarm->deadline = alarm->alarm + config.rhizome.tier_interval_ms;
+  schedule(alarm);
+}
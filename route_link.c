@@ -40,22 +40,23 @@ struct link{
   struct network_destination *destination;
   struct subscriber *receiver;
 
+  // other links in this neighbour's tree that are transmitted by our receiver
+  struct link *_first_child;
+  struct link *_next_sibling;
+
   // What's the last ack we've heard so we don't process nacks twice.
   int last_ack_seq;
 
-  // neighbour path version when path scores were last updated
-  char path_version;
-
   // link quality stats;
   char link_version;
   char drop_rate;
 
+  // cost of this single hop, cached until the neighbour's path version changes
+  int link_cost;
+
   // calculated path score;
   int hop_count;
-  int path_drop_rate;
-
-  // loop prevention;
-  char calculating;
+  int path_cost;
 };
 
 // statistics of incoming half of network links
@@ -93,6 +94,8 @@ struct neighbour{
 
   // whenever we hear about a link change, update the version to mark all link path scores as dirty
   char path_version;
+  // path version when the children and costs of our link tree were last indexed
+  char tree_version;
 
   // when do we assume the link is dead because they stopped hearing us or vice versa?
   time_ms_t link_in_timeout;
@@ -134,11 +137,16 @@ struct link_state{
   struct subscriber *next_hop;
   struct subscriber *transmitter;
   int hop_count;
+  int path_cost;
   int route_version;
   // if a neighbour is free'd this link will point to invalid memory.
   // don't use this pointer directly, call find_best_link instead
   struct link *link;
-  char calculating;
+
+  // result of the last shortest path calculation, valid when calc_version == route_version
+  int calc_version;
+  struct link *calc_link;
+  struct subscriber *calc_next_hop;
 
   // when do we need to send a new link state message.
   time_ms_t next_update;
@@ -235,6 +243,7 @@ static struct link_state *get_link_state(struct subscriber *subscriber)
   if (!subscriber->link_state){
     subscriber->link_state = emalloc_zero(sizeof(struct link_state));
     subscriber->link_state->route_version = route_version -1;
+    subscriber->link_state->calc_version = route_version -1;
   }
   return subscriber->link_state;
 }
@@ -253,6 +262,7 @@ static struct neighbour *get_neighbour(struct subscriber *subscriber, char creat
     n->_next = neighbours;
     n->last_update_seq = -1;
     n->mdp_ack_sequence = -1;
+    n->tree_version = n->path_version -1;
     // TODO measure min/max rtt
     n->rtt = 120;
     n->next_neighbour_update = gettime_ms() + 10;
@@ -284,7 +294,6 @@ static struct link *find_link(struct neighbour *neighbour, struct subscriber *re
       if (create){
         link = *link_ptr = emalloc_zero(sizeof(struct link));
         link->receiver = receiver;
-        link->path_version = neighbour->path_version -1;
 	link->last_ack_seq = -1;
 	link->link_version = -1;
       }
@@ -298,59 +307,262 @@ static struct link *find_link(struct neighbour *neighbour, struct subscriber *re
   return link;
 }
 
-static struct link *get_parent(struct neighbour *neighbour, struct link *link)
+// Path costs are measured in 1/256ths of a perfect wifi hop.
+#define COST_PERFECT_HOP 256
+// how much more expensive is a retransmission than another hop?
+#define COST_LOSS_WEIGHT 4
+#define COST_ASYMMETRY 16
+
+// ignore occasional dropped packets due to collisions
+static int effective_drop_rate(int drop_rate)
 {
-  // root of the routing table.
-  if (link->receiver == neighbour->subscriber || link->transmitter == NULL)
-    return NULL;
+  if (drop_rate<=2)
+    return 0;
+  if (drop_rate>15)
+    return 15;
+  return drop_rate;
+}
 
-  if (!link->parent)
-    link->parent = find_link(neighbour, link->transmitter, 0);
+static int interface_hop_cost(struct network_destination *destination)
+{
+  if (!destination)
+    return COST_PERFECT_HOP;
+  switch(destination->interface->type){
+    case OVERLAY_INTERFACE_ETHERNET:
+      return COST_PERFECT_HOP*3/4;
+    case OVERLAY_INTERFACE_WIFI:
+      return COST_PERFECT_HOP;
+    case OVERLAY_INTERFACE_PACKETRADIO:
+      return COST_PERFECT_HOP*2;
+  }
+  return COST_PERFECT_HOP*5/4;
+}
+
+/* ETX like cost of one hop;
+  - the expected number of transmissions 1/(df*dr) is derived from the fraction of the last 16 packets
+    lost in each direction, any retransmission is weighted more heavily than adding a perfect hop
+  - slower interface types cost more
+  - asymmetric links are penalised as acks are less likely to arrive
+*/
+static int hop_cost(struct network_destination *destination, int forward_drop, int reverse_drop)
+{
+  int f = effective_drop_rate(forward_drop);
+  int r = effective_drop_rate(reverse_drop);
+  int etx = (COST_PERFECT_HOP * 256) / ((16 - f) * (16 - r));
+  return interface_hop_cost(destination)
+    + (etx - COST_PERFECT_HOP) * COST_LOSS_WEIGHT
+    + abs(f - r) * COST_ASYMMETRY;
+}
 
-  return link->parent;
+// cost of the first hop from us to this neighbour.
+// We know how many of our packets they heard, and how many of theirs we heard.
+static int neighbour_hop_cost(struct neighbour *neighbour, struct link *link)
+{
+  int reverse_drop = 0;
+  if (neighbour->best_link)
+    reverse_drop = 15 - NumberOfSetBits(neighbour->best_link->ack_mask & 0x7FFF);
+  return hop_cost(link->destination, link->drop_rate, reverse_drop);
 }
 
-static void update_path_score(struct neighbour *neighbour, struct link *link){
-  if (link->path_version == neighbour->path_version)
+static void index_link_tree(struct neighbour *neighbour, struct link *link)
+{
+  if (!link)
+    return;
+  index_link_tree(neighbour, link->_left);
+  index_link_tree(neighbour, link->_right);
+
+  link->hop_count = -1;
+  link->path_cost = 0;
+  if (neighbour->tree_version == neighbour->path_version)
     return;
-  if (link->calculating)
+
+  link->parent = NULL;
+  if (!link->transmitter 
+    || link->transmitter == my_subscriber 
+    || link->receiver == neighbour->subscriber)
     return;
 
-  link->calculating = 1;
-  int hop_count = -1;
-  int drop_rate = 0;
+  // we only know the quality of this link as reported by the transmitter, assume it is symmetric
+  link->link_cost = hop_cost(NULL, link->drop_rate, link->drop_rate);
+  struct link *parent = find_link(neighbour, link->transmitter, 0);
+  if (!parent || parent == link)
+    return;
+  link->parent = parent;
+  link->_next_sibling = parent->_first_child;
+  parent->_first_child = link;
+}
 
-  if (link->transmitter == my_subscriber){
-    if (link->receiver==neighbour->subscriber){
-      hop_count = 1;
-    }
-  }else{
-    struct link *parent = get_parent(neighbour, link);
-    if (parent && (!parent->calculating)){
-      update_path_score(neighbour, parent);
-      // TODO more interesting path cost metrics...
-      if (parent->hop_count>0){
-        hop_count = parent->hop_count+1;
-        drop_rate = parent->path_drop_rate;
-      }
-    }
+static void clear_link_children(struct link *link)
+{
+  if (!link)
+    return;
+  clear_link_children(link->_left);
+  clear_link_children(link->_right);
+  link->_first_child = NULL;
+  link->_next_sibling = NULL;
+}
+
+// min-heap of candidate paths, ordered by path cost then hop count
+struct route_candidate{
+  struct link *link;
+  struct subscriber *next_hop;
+};
+
+static struct route_candidate *candidates=NULL;
+static int candidate_count=0;
+static int candidate_size=0;
+
+static int candidate_less(int a, int b)
+{
+  struct link *la = candidates[a].link, *lb = candidates[b].link;
+  if (la->path_cost != lb->path_cost)
+    return la->path_cost < lb->path_cost;
+  return la->hop_count < lb->hop_count;
+}
+
+static void candidate_swap(int a, int b)
+{
+  struct route_candidate t = candidates[a];
+  candidates[a] = candidates[b];
+  candidates[b] = t;
+}
+
+static int candidate_push(struct link *link, struct subscriber *next_hop)
+{
+  if (candidate_count >= candidate_size){
+    int size = candidate_size ? candidate_size * 2 : 64;
+    struct route_candidate *c = erealloc(candidates, sizeof(struct route_candidate) * size);
+    if (!c)
+      return -1;
+    candidates = c;
+    candidate_size = size;
+  }
+  int i = candidate_count++;
+  candidates[i].link = link;
+  candidates[i].next_hop = next_hop;
+  while (i>0){
+    int parent = (i-1)/2;
+    if (!candidate_less(i, parent))
+      break;
+    candidate_swap(i, parent);
+    i = parent;
   }
+  return 0;
+}
 
-  // ignore occasional dropped packets due to collisions
-  if (link->drop_rate>2)
-    drop_rate += link->drop_rate;
+static struct route_candidate candidate_pop()
+{
+  struct route_candidate ret = candidates[0];
+  candidates[0] = candidates[--candidate_count];
+  int i=0;
+  while(1){
+    int l = i*2+1, r = l+1, smallest = i;
+    if (l < candidate_count && candidate_less(l, smallest))
+      smallest = l;
+    if (r < candidate_count && candidate_less(r, smallest))
+      smallest = r;
+    if (smallest == i)
+      break;
+    candidate_swap(i, smallest);
+    i = smallest;
+  }
+  return ret;
+}
 
-  if (config.debug.verbose && config.debug.linkstate && hop_count != link->hop_count)
-    DEBUGF("LINK STATE; path score to %s via %s version %d = %d",
-	alloca_tohex_sid_t(link->receiver->sid),
-	alloca_tohex_sid_t(neighbour->subscriber->sid),
-	neighbour->path_version,
-	hop_count);
+// statistics of routing table calculations
+static struct route_calc_stats{
+  unsigned calculations;
+  unsigned trees_indexed;
+  unsigned nodes_settled;
+  unsigned links_relaxed;
+  time_ns_t last_elapsed;
+  time_ns_t max_elapsed;
+} route_calc_stats;
+
+static int route_calc_version=-1;
+
+/* Calculate the best path to every reachable subscriber at once.
+ *
+ * Each neighbour tells us the tree of links they are using, the cost of a path via that neighbour
+ * is our cost to reach the neighbour plus the cost of each link in their tree.
+ * We may only use a link from a neighbour's tree if we are also routing to its transmitter via the
+ * same neighbour, so the calculation is a Dijkstra search from ourselves that only follows the 
+ * children of the neighbour tree we reached each subscriber through.
+ *
+ * Link costs and the child index of each neighbour tree are cached until that neighbour's
+ * path version changes.
+ *
+ * The search itself is repeated in full for every route_version rather than repaired in place.
+ * Which children of a tree may be followed depends on the neighbour each subscriber was settled
+ * through, so one changed link can move a whole subtree onto a different neighbour's tree, and
+ * an incremental update would have to track those dependencies to stay correct. The full search
+ * is O((subscribers + links) log links), runs at most once per route_version no matter how many
+ * routes are looked up, and is deferred until a route is needed, so a burst of link updates from
+ * one packet or alarm costs a single calculation. The timings on the neighbour status page show
+ * whether this stops being cheap enough.
+ */
+static void route_calculate()
+{
+  if (route_calc_version == route_version)
+    return;
+  IN();
+  time_ns_t start = gettime_ns();
+  time_ms_t now = gettime_ms();
+  route_calc_version = route_version;
+  route_calc_stats.calculations++;
+  candidate_count=0;
+
+  struct neighbour *neighbour;
+  for (neighbour = neighbours; neighbour; neighbour = neighbour->_next){
+    if (neighbour->tree_version != neighbour->path_version){
+      clear_link_children(neighbour->root);
+      route_calc_stats.trees_indexed++;
+    }
+    index_link_tree(neighbour, neighbour->root);
+    neighbour->tree_version = neighbour->path_version;
+
+    if (neighbour->link_in_timeout < now)
+      continue;
+    struct link *link = find_link(neighbour, neighbour->subscriber, 0);
+    if (!link || link->transmitter != my_subscriber || neighbour->subscriber->reachable==REACHABLE_SELF)
+      continue;
+    link->hop_count = 1;
+    link->path_cost = neighbour_hop_cost(neighbour, link);
+    candidate_push(link, neighbour->subscriber);
+  }
+
+  while (candidate_count>0){
+    struct route_candidate c = candidate_pop();
+    struct link_state *state = get_link_state(c.link->receiver);
+    if (state->calc_version == route_version)
+      continue;
+    state->calc_version = route_version;
+    state->calc_link = c.link;
+    state->calc_next_hop = c.next_hop;
+    route_calc_stats.nodes_settled++;
+
+    struct link *child;
+    for (child = c.link->_first_child; child; child = child->_next_sibling){
+      if (child->receiver->reachable==REACHABLE_SELF)
+	continue;
+      struct link_state *child_state = get_link_state(child->receiver);
+      if (child_state->calc_version == route_version)
+	continue;
+      child->hop_count = c.link->hop_count + 1;
+      child->path_cost = c.link->path_cost + child->link_cost;
+      route_calc_stats.links_relaxed++;
+      if (candidate_push(child, c.next_hop))
+	break;
+    }
+  }
 
-  link->hop_count = hop_count;
-  link->path_version = neighbour->path_version;
-  link->path_drop_rate = drop_rate;
-  link->calculating = 0;
+  time_ns_t elapsed = gettime_ns() - start;
+  route_calc_stats.last_elapsed = elapsed;
+  if (elapsed > route_calc_stats.max_elapsed)
+    route_calc_stats.max_elapsed = elapsed;
+  if (config.debug.verbose && config.debug.linkstate)
+    DEBUGF("LINK STATE; calculated routes for version %d in %.3fms", route_version, elapsed / 1e6);
+  OUT();
 }
 
 // pick the best path to this network destination
@@ -364,49 +576,30 @@ static struct link * find_best_link(struct subscriber *subscriber)
   if (state->route_version == route_version)
     RETURN(state->link);
 
-  if (state->calculating)
-    RETURN(NULL);
-  state->calculating = 1;
+  route_calculate();
 
-  struct neighbour *neighbour = neighbours;
   struct network_destination *destination = NULL;
   int best_hop_count = 99;
-  int best_drop_rate = 99;
+  int best_path_cost = 0;
   struct link *best_link = NULL;
   struct subscriber *next_hop = NULL, *transmitter=NULL;
   time_ms_t now = gettime_ms();
 
-  while (neighbour){
-    if (neighbour->link_in_timeout < now)
-      goto next;
-
-    struct link *link = find_link(neighbour, subscriber, 0);
-    if (!(link && link->transmitter))
-      goto next;
-
-    if (link->transmitter != my_subscriber){
-      struct link_state *parent_state = get_link_state(link->transmitter);
-      find_best_link(link->transmitter);
-      if (parent_state->next_hop != neighbour->subscriber)
-	goto next;
-    }
-
-    update_path_score(neighbour, link);
-
-    if (link->hop_count>0){
-      if (link->path_drop_rate < best_drop_rate ||
-         (link->path_drop_rate == best_drop_rate && link->hop_count < best_hop_count)){
-        next_hop = neighbour->subscriber;
-        best_hop_count = link->hop_count;
-	best_drop_rate = link->path_drop_rate;
-        transmitter = link->transmitter;
-        destination = link->destination;
-        best_link = link;
-      }
-    }
-
-next:
-    neighbour = neighbour->_next;
+  if (state->calc_version == route_version && state->calc_link){
+    best_link = state->calc_link;
+    next_hop = state->calc_next_hop;
+    best_hop_count = best_link->hop_count;
+    best_path_cost = best_link->path_cost;
+    transmitter = best_link->transmitter;
+    destination = best_link->destination;
+
+    if (config.debug.verbose && config.debug.linkstate && best_link != state->link)
+      DEBUGF("LINK STATE; path score to %s via %s version %d = %d (%d hops)",
+	  alloca_tohex_sid_t(subscriber->sid),
+	  alloca_tohex_sid_t(next_hop->sid),
+	  route_version,
+	  best_path_cost,
+	  best_hop_count);
   }
 
   int changed =0;
@@ -416,8 +609,8 @@ next:
   state->next_hop = next_hop;
   state->transmitter = transmitter;
   state->hop_count = best_hop_count;
+  state->path_cost = best_path_cost;
   state->route_version = route_version;
-  state->calculating = 0;
   state->link = best_link;
   
   if (next_hop == subscriber)
@@ -561,6 +754,8 @@ static void free_neighbour(struct neighbour **neighbour_ptr){
   n->root=NULL;
   *neighbour_ptr = n->_next;
   free(n);
+  // calculated routes may still point to this neighbour's links
+  route_version++;
 }
 
 static void clean_neighbours(time_ms_t now)
@@ -627,7 +822,7 @@ static void link_status_html(struct strbuf *b, struct subscriber *n, struct link
   strbuf_sprintf(b, "%s* -%s H: %d, C: %d, via %s*<br>", 
     alloca_tohex_sid_t_trunc(link->receiver->sid, 16), 
     best?" *best*":"",
-    link->hop_count, link->path_drop_rate, 
+    link->hop_count, link->path_cost, 
     link->transmitter?alloca_tohex_sid_t_trunc(link->transmitter->sid, 16):"unreachable");
   link_status_html(b, n, link->_right);
 }
@@ -637,6 +832,13 @@ void link_neighbour_short_status_html(struct strbuf *b, const char *link_prefix)
   struct neighbour *n = neighbours;
   if (!n)
     strbuf_puts(b, "No peers<br>");
+  strbuf_sprintf(b, "Route calculations: %u, trees indexed: %u, nodes settled: %u, links relaxed: %u, last %.3fms, max %.3fms<br>",
+    route_calc_stats.calculations,
+    route_calc_stats.trees_indexed,
+    route_calc_stats.nodes_settled,
+    route_calc_stats.links_relaxed,
+    route_calc_stats.last_elapsed / 1e6,
+    route_calc_stats.max_elapsed / 1e6);
   while(n){
     strbuf_sprintf(b, "<a href=\"%s/%s\">%s*</a>, seq=%d, mask=%08"PRIx64"<br>", 
       link_prefix,
@@ -685,7 +887,7 @@ void link_neighbour_status_html(struct strbuf *b, struct subscriber *neighbour)
 
 
 static int send_legacy_self_announce_ack(struct neighbour *neighbour, struct link_in *link, time_ms_t now){
-  struct overlay_frame *frame=emalloc_zero(sizeof(struct overlay_frame));
+  struct overlay_frame *frame=op_new();
   frame->type = OF_TYPE_SELFANNOUNCE_ACK;
   frame->ttl = 6;
   frame->destination = neighbour->subscriber;
@@ -770,7 +972,7 @@ static int send_neighbour_link(struct neighbour *n)
     send_legacy_self_announce_ack(n, n->best_link, now);
     n->last_update = now;
   } else {
-    struct overlay_frame *frame = emalloc_zero(sizeof(struct overlay_frame));
+    struct overlay_frame *frame = op_new();
     frame->type=OF_TYPE_DATA;
     frame->source=my_subscriber;
     frame->ttl=1;
@@ -867,7 +1069,7 @@ static void link_send(struct sched_ent *alarm)
   // TODO use a separate alarm
   link_send_neighbours();
 
-  struct overlay_frame *frame=emalloc_zero(sizeof(struct overlay_frame));
+  struct overlay_frame *frame=op_new();
   frame->type=OF_TYPE_DATA;
   frame->source=my_subscriber;
   frame->ttl=1;
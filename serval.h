@@ -205,6 +205,7 @@ int _socket_connect(struct __sourceloc, int sock, const struct sockaddr *addr, s
 int _socket_listen(struct __sourceloc, int sock, int backlog);
 int _socket_set_reuseaddr(struct __sourceloc, int sock, int reuseP);
 int _socket_set_rcvbufsize(struct __sourceloc, int sock, unsigned buffer_size);
+int _socket_peer_uid(struct __sourceloc, int sock, uid_t *uid);
 
 #define make_local_sockaddr(sockname, addrlenp, fmt,...) _make_local_sockaddr(__WHENCE__, (sockname), (addrlenp), (fmt), ##__VA_ARGS__)
 #define esocket(domain, type, protocol)             _esocket(__WHENCE__, (domain), (type), (protocol))
@@ -213,11 +214,14 @@ int _socket_set_rcvbufsize(struct __sourceloc, int sock, unsigned buffer_size);
 #define socket_listen(sock, backlog)                _socket_listen(__WHENCE__, (sock), (backlog))
 #define socket_set_reuseaddr(sock, reuseP)          _socket_set_reuseaddr(__WHENCE__, (sock), (reuseP))
 #define socket_set_rcvbufsize(sock, buffer_size)    _socket_set_rcvbufsize(__WHENCE__, (sock), (buffer_size))
+#define socket_peer_uid(sock, uid)                  _socket_peer_uid(__WHENCE__, (sock), (uid))
 
 int real_sockaddr(const struct sockaddr_un *src_addr, socklen_t src_addrlen, struct sockaddr_un *dst_addr, socklen_t *dst_addrlen);
 int cmp_sockaddr(const struct sockaddr *, socklen_t, const struct sockaddr *, socklen_t);
 
 #define SERVER_CONFIG_RELOAD_INTERVAL_MS	1000
+#define SERVER_CONFIG_WATCHED_RELOAD_INTERVAL_MS	10000
+#define SERVER_LOG_DRAIN_INTERVAL_MS	100
 
 struct cli_parsed;
 
@@ -452,6 +456,9 @@ void insertTransactionInCache(unsigned char *transaction_id);
 int overlay_forward_payload(struct overlay_frame *f);
 int packetOkOverlay(struct overlay_interface *interface,unsigned char *packet, size_t len,
 		    int recvttl, struct sockaddr *recvaddr, socklen_t recvaddrlen);
+void overlay_trace_capture(struct overlay_interface *interface, const unsigned char *packet, size_t len,
+			   int recvttl, struct sockaddr *recvaddr, socklen_t recvaddrlen);
+void overlay_trace_config_changed();
 int parseMdpPacketHeader(struct decode_context *context, struct overlay_frame *frame, 
 			 struct overlay_buffer *buffer, struct subscriber **nexthop);
 int parseEnvelopeHeader(struct decode_context *context, struct overlay_interface *interface, 
@@ -473,6 +480,7 @@ int overlay_packet_init_header(int packet_version, int encapsulation,
 int overlay_interface_args(const char *arg);
 void overlay_rhizome_advertise(struct sched_ent *alarm);
 void rhizome_sync_status_html(struct strbuf *b, struct subscriber *subscriber);
+void rhizome_sync_neighbour_up(struct subscriber *subscriber);
 int rhizome_cache_count();
 int overlay_add_local_identity(unsigned char *s);
 
@@ -488,6 +496,7 @@ int rfs_decode(unsigned char *b,int *offset);
 int overlayServerMode(const struct cli_parsed *parsed);
 int overlay_payload_enqueue(struct overlay_frame *p);
 int overlay_queue_remaining(int queue);
+void overlay_queue_stats_json(struct strbuf *b);
 int overlay_queue_schedule_next(time_ms_t next_allowed_packet);
 int overlay_send_tick_packet(struct network_destination *destination);
 int overlay_queue_ack(struct subscriber *neighbour, struct network_destination *destination, uint32_t ack_mask, int ack_seq);
@@ -506,6 +515,7 @@ int rhizome_fetching_get_fds(struct pollfd *fds,int *fdcount,int fdmax);
 int rhizome_opendb();
 
 int parseCommandLine(struct cli_context *context, const char *argv0, int argc, const char *const *argv);
+int server_run_command(struct cli_context *context, const char *cwd, int argc, const char *const *argv);
 
 int overlay_mdp_get_fds(struct pollfd *fds,int *fdcount,int fdmax);
 int overlay_mdp_reply_error(int sock,
@@ -544,6 +554,13 @@ typedef struct overlay_mdp_addrlist {
   sid_t sids[MDP_MAX_SID_REQUEST];
 } overlay_mdp_addrlist;
 
+/* "servald stats print" asks for the stats document a page at a time, since a client socket only
+ * queues a few datagrams.  A request with offset 0 takes a new snapshot.
+ */
+typedef struct overlay_mdp_stats {
+  unsigned int offset;
+} overlay_mdp_stats;
+
 typedef struct overlay_mdp_nodeinfo {
   sid_t sid;
   int sid_prefix_length; /* must be long enough to be unique */
@@ -564,6 +581,7 @@ typedef struct overlay_mdp_frame {
     overlay_mdp_addrlist addrlist;
     overlay_mdp_nodeinfo nodeinfo;
     overlay_mdp_error error;
+    overlay_mdp_stats stats;
     /* 2048 is too large (causes EMSGSIZE errors on OSX, but probably fine on
        Linux) */
     char raw[MDP_MTU];
@@ -602,6 +620,7 @@ int overlay_interface_register(char *name,
 overlay_interface * overlay_interface_get_default();
 overlay_interface * overlay_interface_find(struct in_addr addr, int return_default);
 overlay_interface * overlay_interface_find_name(const char *name);
+int overlay_interface_replay(const char *name, short type, struct in_addr addr);
 int overlay_interface_compare(overlay_interface *one, overlay_interface *two);
 int overlay_broadcast_ensemble(struct network_destination *destination, struct overlay_buffer *buffer);
 void interface_state_html(struct strbuf *b, struct overlay_interface *interface);
@@ -613,6 +632,8 @@ int app_nonce_test(const struct cli_parsed *parsed, struct cli_context *context)
 int app_rhizome_direct_sync(const struct cli_parsed *parsed, struct cli_context *context);
 int app_monitor_cli(const struct cli_parsed *parsed, struct cli_context *context);
 int app_vomp_console(const struct cli_parsed *parsed, struct cli_context *context);
+int app_trace_replay(const struct cli_parsed *parsed, struct cli_context *context);
+int app_exec(const struct cli_parsed *parsed, struct cli_context *context);
 int app_meshms_conversations(const struct cli_parsed *parsed, struct cli_context *context);
 int app_meshms_send_message(const struct cli_parsed *parsed, struct cli_context *context);
 int app_meshms_list_messages(const struct cli_parsed *parsed, struct cli_context *context);
@@ -621,6 +642,7 @@ int app_meshms_mark_read(const struct cli_parsed *parsed, struct cli_context *co
 int monitor_get_fds(struct pollfd *fds,int *fdcount,int fdmax);
 
 int monitor_setup_sockets();
+int command_setup_socket();
 int monitor_get_fds(struct pollfd *fds,int *fdcount,int fdmax);
 int monitor_announce_peer(const sid_t *sidp);
 int monitor_announce_unreachable_peer(const sid_t *sidp);
@@ -682,17 +704,22 @@ void sigIoHandler(int signal);
 int overlay_mdp_setup_sockets();
 
 void overlay_interface_discover(struct sched_ent *alarm);
+void overlay_interface_config_changed();
 void overlay_packetradio_poll(struct sched_ent *alarm);
 int overlay_packetradio_setup_port(overlay_interface *interface);
 int overlay_packetradio_tx_packet(struct overlay_frame *frame);
 void overlay_dummy_poll(struct sched_ent *alarm);
 void server_config_reload(struct sched_ent *alarm);
+void server_config_watch_setup();
 void server_shutdown_check(struct sched_ent *alarm);
+void server_log_drain(struct sched_ent *alarm);
+void server_log_drain_setup();
 int overlay_mdp_try_interal_services(struct overlay_frame *frame, overlay_mdp_frame *mdp);
 int overlay_send_probe(struct subscriber *peer, struct network_destination *destination, int queue);
 int overlay_send_stun_request(struct subscriber *server, struct subscriber *request);
 void fd_periodicstats(struct sched_ent *alarm);
 void rhizome_check_connections(struct sched_ent *alarm);
+void rhizome_tier_migrate(struct sched_ent *alarm);
 
 int overlay_tick_interface(int i, time_ms_t now);
 int overlay_queue_init();
@@ -716,9 +743,9 @@ int olsr_send(struct overlay_frame *frame);
 void write_uint64(unsigned char *o,uint64_t v);
 void write_uint16(unsigned char *o,uint16_t v);
 void write_uint32(unsigned char *o,uint32_t v);
-uint64_t read_uint64(unsigned char *o);
-uint32_t read_uint32(unsigned char *o);
-uint16_t read_uint16(unsigned char *o);
+uint64_t read_uint64(const unsigned char *o);
+uint32_t read_uint32(const unsigned char *o);
+uint16_t read_uint16(const unsigned char *o);
 
 int pack_uint(unsigned char *buffer, uint64_t v);
 int measure_packed_uint(uint64_t v);
@@ -732,7 +759,6 @@ uint32_t Crc32_ComputeBuf( uint32_t inCrc32, const void *buf,
 			  size_t bufLen );
 int rhizome_active_fetch_count();
 uint64_t rhizome_active_fetch_bytes_received(int q);
-extern int64_t bundles_available;
 extern char crash_handler_clue[1024];
 
 
@@ -753,7 +779,7 @@ int link_stop_routing(struct subscriber *subscriber);
 
 int generate_nonce(unsigned char *nonce,int bytes);
 
-int mavlink_decode(struct overlay_interface *interface, struct slip_decode_state *state,uint8_t c);
+int mavlink_decode(struct overlay_interface *interface, struct slip_decode_state *state, const uint8_t *buffer, size_t len);
 int mavlink_heartbeat(unsigned char *frame,int *outlen);
 int mavlink_encode_packet(struct overlay_interface *interface);
 
@@ -0,0 +1,566 @@
+/*
+Copyright (C) 2013 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  Micro-benchmarks for the hot paths of servald, built by "make bench".
+
+  servald_bench [--quick] [--samples=<N>] [<name>...]
+
+  Each case is first calibrated, doubling the number of iterations until one sample takes at least
+  the target time, then timed for the given number of samples.  The results are written to standard
+  output as JSON, one object per case, giving the minimum, median, mean and standard deviation of
+  the time taken per operation in nanoseconds, so that runs can be compared to catch regressions.
+  If any names are given, only the cases whose names contain one of them are run.
+
+  The benchmarks run in a temporary instance directory with the default configuration, which is
+  removed when the run finishes.
+ */
+
+#include <ftw.h>
+#include <math.h>
+#include <stdlib.h>
+#include "serval.h"
+#include "conf.h"
+#include "rhizome.h"
+#include "overlay_address.h"
+#include "overlay_buffer.h"
+#include "sha2.h"
+#include "crypto_accel.h"
+#include "crypto_sign_edwards25519sha512batch.h"
+
+#define BENCH_DEFAULT_SAMPLES 11
+#define BENCH_TARGET_NS 20000000LL
+#define BENCH_QUICK_TARGET_NS 2000000LL
+#define BENCH_MAX_SAMPLES 101
+#define BENCH_SUBSCRIBERS 256
+#define BENCH_MANY_SUBSCRIBERS 32768
+#define BENCH_ADDRESSES 4096
+
+struct bench_case{
+  const char *name;
+  size_t bytes;
+  int (*setup)(struct bench_case *c);
+  void (*run)(struct bench_case *c, unsigned iterations);
+};
+
+static unsigned char data[1024*1024];
+static unsigned char output[1024*1024 + 64];
+static unsigned char key[crypto_box_curve25519xsalsa20poly1305_BEFORENMBYTES];
+static unsigned char nonce[crypto_box_curve25519xsalsa20poly1305_NONCEBYTES];
+
+static int setup_random(struct bench_case *c)
+{
+  urandombytes(data, sizeof data);
+  urandombytes(key, sizeof key);
+  urandombytes(nonce, sizeof nonce);
+  return 0;
+}
+
+static void run_box_afternm(struct bench_case *c, unsigned iterations)
+{
+  unsigned i;
+  for (i = 0; i < iterations; ++i){
+    bzero(data, crypto_box_curve25519xsalsa20poly1305_ZEROBYTES);
+    crypto_box_curve25519xsalsa20poly1305_afternm(output, data, c->bytes, nonce, key);
+  }
+}
+
+static unsigned char sign_pk[crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES];
+static unsigned char sign_sk[crypto_sign_edwards25519sha512batch_SECRETKEYBYTES];
+static unsigned char signed_message[1024 + crypto_sign_edwards25519sha512batch_BYTES];
+static unsigned long long signed_length;
+
+static int setup_sign(struct bench_case *c)
+{
+  setup_random(c);
+  if (crypto_sign_edwards25519sha512batch_keypair(sign_pk, sign_sk))
+    return WHY("crypto_sign_edwards25519sha512batch_keypair() failed");
+  if (crypto_sign_edwards25519sha512batch(signed_message, &signed_length, data, c->bytes, sign_sk))
+    return WHY("crypto_sign_edwards25519sha512batch() failed");
+  return 0;
+}
+
+static void run_sign(struct bench_case *c, unsigned iterations)
+{
+  unsigned i;
+  unsigned long long len;
+  for (i = 0; i < iterations; ++i)
+    crypto_sign_edwards25519sha512batch(output, &len, data, c->bytes, sign_sk);
+}
+
+static void run_verify(struct bench_case *c, unsigned iterations)
+{
+  unsigned i;
+  unsigned long long len;
+  for (i = 0; i < iterations; ++i)
+    if (crypto_sign_edwards25519sha512batch_open(output, &len, signed_message, signed_length, sign_pk))
+      FATAL("signature did not verify");
+}
+
+static void run_sha512(struct bench_case *c, unsigned iterations)
+{
+  unsigned i;
+  SHA512_CTX context;
+  for (i = 0; i < iterations; ++i){
+    SHA512_Init(&context);
+    SHA512_Update(&context, data, c->bytes);
+    SHA512_Final(output, &context);
+  }
+}
+
+static void run_crypt_xor(struct bench_case *c, unsigned iterations)
+{
+  unsigned i;
+  for (i = 0; i < iterations; ++i)
+    rhizome_crypt_xor_block(data, c->bytes, 0, key, nonce);
+}
+
+// the same, without the CPU specific implementations in crypto_accel.c, for comparison
+static void run_sha512_portable(struct bench_case *c, unsigned iterations)
+{
+  crypto_accel_enable(0);
+  run_sha512(c, iterations);
+  crypto_accel_enable(1);
+}
+
+static void run_crypt_xor_portable(struct bench_case *c, unsigned iterations)
+{
+  crypto_accel_enable(0);
+  run_crypt_xor(c, iterations);
+  crypto_accel_enable(1);
+}
+
+// a spread of values that encode to every length that pack_uint() can produce
+static uint64_t uint_values[256];
+
+static int setup_uint(struct bench_case *c)
+{
+  unsigned i;
+  for (i = 0; i < NELS(uint_values); ++i){
+    uint64_t v;
+    urandombytes((unsigned char *)&v, sizeof v);
+    uint_values[i] = v >> (i % 64);
+  }
+  return 0;
+}
+
+static void run_pack_uint(struct bench_case *c, unsigned iterations)
+{
+  unsigned i;
+  for (i = 0; i < iterations; ++i)
+    pack_uint(output, uint_values[i % NELS(uint_values)]);
+}
+
+static unsigned char packed_uints[NELS(uint_values)][10];
+
+static void run_unpack_uint(struct bench_case *c, unsigned iterations)
+{
+  unsigned i;
+  uint64_t v;
+  for (i = 0; i < iterations; ++i)
+    if (unpack_uint(packed_uints[i % NELS(uint_values)], 10, &v) == -1)
+      FATAL("unpack_uint() failed");
+}
+
+static int setup_unpack_uint(struct bench_case *c)
+{
+  setup_uint(c);
+  unsigned i;
+  for (i = 0; i < NELS(uint_values); ++i)
+    pack_uint(packed_uints[i], uint_values[i]);
+  return 0;
+}
+
+static struct subscriber *subscribers[BENCH_SUBSCRIBERS];
+static struct overlay_buffer *address_buffer = NULL;
+
+static int setup_subscribers(struct bench_case *c)
+{
+  if (address_buffer)
+    return 0;
+  unsigned i;
+  for (i = 0; i < NELS(subscribers); ++i){
+    sid_t sid;
+    urandombytes(sid.binary, sizeof sid.binary);
+    if ((subscribers[i] = find_subscriber(sid.binary, SID_SIZE, 1)) == NULL)
+      return WHY("find_subscriber() failed");
+  }
+  // encode every address in full, as for a peer we have not heard from before
+  if ((address_buffer = ob_new()) == NULL)
+    return -1;
+  for (i = 0; i < NELS(subscribers); ++i){
+    subscribers[i]->send_full = 1;
+    overlay_address_append(NULL, address_buffer, subscribers[i]);
+  }
+  ob_flip(address_buffer);
+  ob_checkpoint(address_buffer);
+  return 0;
+}
+
+static void run_address_append(struct bench_case *c, unsigned iterations)
+{
+  struct overlay_buffer *b = ob_static(output, sizeof output);
+  struct decode_context context;
+  bzero(&context, sizeof context);
+  unsigned i;
+  for (i = 0; i < iterations; ++i){
+    if (i % NELS(subscribers) == 0)
+      ob_rewind(b);
+    overlay_address_append(&context, b, subscribers[i % NELS(subscribers)]);
+  }
+  ob_free(b);
+}
+
+static void run_address_parse(struct bench_case *c, unsigned iterations)
+{
+  struct decode_context context;
+  bzero(&context, sizeof context);
+  unsigned i;
+  for (i = 0; i < iterations; ++i){
+    if (i % NELS(subscribers) == 0)
+      ob_rewind(address_buffer);
+    struct subscriber *s = NULL;
+    if (overlay_address_parse(&context, address_buffer, &s) == -1 || !s)
+      FATAL("overlay_address_parse() failed");
+  }
+}
+
+/* A large mesh, where each packet names a different few of many known subscribers, so the
+   subscriber table does not stay in the CPU cache.
+ */
+static struct subscriber *many[BENCH_MANY_SUBSCRIBERS];
+static struct subscriber *addressed[BENCH_ADDRESSES];
+static struct overlay_buffer *many_buffer = NULL;
+
+static int setup_many_subscribers(struct bench_case *c)
+{
+  if (many_buffer)
+    return 0;
+  unsigned i;
+  for (i = 0; i < NELS(many); ++i){
+    sid_t sid;
+    urandombytes(sid.binary, sizeof sid.binary);
+    if ((many[i] = find_subscriber(sid.binary, SID_SIZE, 1)) == NULL)
+      return WHY("find_subscriber() failed");
+  }
+  // encode with the shortest abbreviations, as for a peer that knows them all
+  if ((many_buffer = ob_new()) == NULL)
+    return -1;
+  for (i = 0; i < NELS(addressed); ++i){
+    addressed[i] = many[random() % NELS(many)];
+    overlay_address_append(NULL, many_buffer, addressed[i]);
+  }
+  ob_flip(many_buffer);
+  ob_checkpoint(many_buffer);
+  return 0;
+}
+
+static void run_many_append(struct bench_case *c, unsigned iterations)
+{
+  struct overlay_buffer *b = ob_static(output, sizeof output);
+  struct decode_context context;
+  bzero(&context, sizeof context);
+  unsigned i;
+  for (i = 0; i < iterations; ++i){
+    if (i % NELS(addressed) == 0)
+      ob_rewind(b);
+    overlay_address_append(&context, b, addressed[i % NELS(addressed)]);
+  }
+  ob_free(b);
+}
+
+static void run_many_parse(struct bench_case *c, unsigned iterations)
+{
+  struct decode_context context;
+  bzero(&context, sizeof context);
+  unsigned i;
+  for (i = 0; i < iterations; ++i){
+    if (i % NELS(addressed) == 0)
+      ob_rewind(many_buffer);
+    struct subscriber *s = NULL;
+    if (overlay_address_parse(&context, many_buffer, &s) == -1 || s != addressed[i % NELS(addressed)])
+      FATAL("overlay_address_parse() failed");
+  }
+}
+
+static unsigned enum_count = 0;
+
+static int count_subscriber(struct subscriber *subscriber, void *context)
+{
+  ++*(unsigned *)context;
+  return 0;
+}
+
+static void run_many_enum(struct bench_case *c, unsigned iterations)
+{
+  unsigned i;
+  for (i = 0; i < iterations; ++i)
+    enum_subscribers(NULL, count_subscriber, &enum_count);
+}
+
+static rhizome_manifest *manifest = NULL;
+
+static int setup_manifest(struct bench_case *c)
+{
+  if (manifest)
+    return 0;
+  if ((manifest = rhizome_new_manifest()) == NULL)
+    return -1;
+  if (rhizome_manifest_createid(manifest) == -1)
+    return -1;
+  rhizome_filehash_t hash;
+  urandombytes(hash.binary, sizeof hash.binary);
+  rhizome_manifest_set_service(manifest, RHIZOME_SERVICE_FILE);
+  rhizome_manifest_set_name(manifest, "benchmark.txt");
+  rhizome_manifest_set_version(manifest, gettime_ms());
+  rhizome_manifest_set_date(manifest, gettime_ms());
+  rhizome_manifest_set_filesize(manifest, 12345);
+  rhizome_manifest_set_filehash(manifest, &hash);
+  if (rhizome_manifest_pack_variables(manifest) == -1 || rhizome_manifest_selfsign(manifest) == -1)
+    return -1;
+  return 0;
+}
+
+static void run_manifest_pack(struct bench_case *c, unsigned iterations)
+{
+  unsigned i;
+  for (i = 0; i < iterations; ++i)
+    if (rhizome_manifest_pack_variables(manifest) == -1)
+      FATAL("rhizome_manifest_pack_variables() failed");
+  // put the signature back, for the parse case
+  rhizome_manifest_selfsign(manifest);
+}
+
+static void run_manifest_parse(struct bench_case *c, unsigned iterations)
+{
+  unsigned i;
+  for (i = 0; i < iterations; ++i){
+    rhizome_manifest *m = rhizome_new_manifest();
+    if (!m || rhizome_read_manifest_file(m, (const char *)manifest->manifestdata, manifest->manifest_all_bytes) == -1)
+      FATAL("rhizome_read_manifest_file() failed");
+    rhizome_manifest_free(m);
+  }
+}
+
+static uint64_t blob_counter = 0;
+static rhizome_filehash_t blob_hash;
+
+static int setup_storage(struct bench_case *c)
+{
+  setup_random(c);
+  return rhizome_opendb();
+}
+
+static int write_blob(size_t bytes, rhizome_filehash_t *hash)
+{
+  struct rhizome_write write;
+  bzero(&write, sizeof write);
+  // every blob is different, otherwise the store would keep only one copy
+  blob_counter++;
+  bcopy(&blob_counter, data, sizeof blob_counter);
+  if (rhizome_open_write(&write, NULL, bytes, RHIZOME_PRIORITY_DEFAULT, NULL) == -1)
+    return -1;
+  if (rhizome_write_buffer(&write, data, bytes) == -1){
+    rhizome_fail_write(&write);
+    return -1;
+  }
+  if (rhizome_finish_write(&write) == -1)
+    return -1;
+  if (hash)
+    *hash = write.id;
+  return 0;
+}
+
+static void run_blob_write(struct bench_case *c, unsigned iterations)
+{
+  unsigned i;
+  for (i = 0; i < iterations; ++i)
+    if (write_blob(c->bytes, NULL) == -1)
+      FATAL("blob write failed");
+}
+
+static int setup_blob_read(struct bench_case *c)
+{
+  if (setup_storage(c) == -1)
+    return -1;
+  return write_blob(c->bytes, &blob_hash);
+}
+
+static void run_blob_read(struct bench_case *c, unsigned iterations)
+{
+  unsigned i;
+  for (i = 0; i < iterations; ++i){
+    struct rhizome_read read;
+    bzero(&read, sizeof read);
+    if (rhizome_open_read(&read, &blob_hash) != 0)
+      FATAL("rhizome_open_read() failed");
+    size_t total = 0;
+    ssize_t n;
+    while ((n = rhizome_read(&read, output, sizeof output)) > 0)
+      total += n;
+    rhizome_read_close(&read);
+    if (n == -1 || total != c->bytes)
+      FATAL("blob read failed");
+  }
+}
+
+static struct bench_case cases[]={
+  {"crypto_box_afternm", 64, setup_random, run_box_afternm},
+  {"crypto_box_afternm", 1024, setup_random, run_box_afternm},
+  {"crypto_box_afternm", 16384, setup_random, run_box_afternm},
+  {"ed25519_sign", 64, setup_sign, run_sign},
+  {"ed25519_verify", 64, setup_sign, run_verify},
+  {"sha512", 64, setup_random, run_sha512},
+  {"sha512", 1024, setup_random, run_sha512},
+  {"sha512", 65536, setup_random, run_sha512},
+  {"sha512_portable", 65536, setup_random, run_sha512_portable},
+  {"rhizome_crypt_xor_block", 1024, setup_random, run_crypt_xor},
+  {"rhizome_crypt_xor_block", 65536, setup_random, run_crypt_xor},
+  {"rhizome_crypt_xor_block_portable", 65536, setup_random, run_crypt_xor_portable},
+  {"pack_uint", 0, setup_uint, run_pack_uint},
+  {"unpack_uint", 0, setup_unpack_uint, run_unpack_uint},
+  {"overlay_address_append", 0, setup_subscribers, run_address_append},
+  {"overlay_address_parse", 0, setup_subscribers, run_address_parse},
+  {"overlay_address_append_32k", 0, setup_many_subscribers, run_many_append},
+  {"overlay_address_parse_32k", 0, setup_many_subscribers, run_many_parse},
+  {"enum_subscribers_32k", 0, setup_many_subscribers, run_many_enum},
+  {"manifest_pack", 0, setup_manifest, run_manifest_pack},
+  {"manifest_parse", 0, setup_manifest, run_manifest_parse},
+  {"blob_write", 1024, setup_storage, run_blob_write},
+  {"blob_write", 65536, setup_storage, run_blob_write},
+  {"blob_write", 1024*1024, setup_storage, run_blob_write},
+  {"blob_read", 1024, setup_blob_read, run_blob_read},
+  {"blob_read", 65536, setup_blob_read, run_blob_read},
+  {"blob_read", 1024*1024, setup_blob_read, run_blob_read},
+};
+
+static time_ns_t time_sample(struct bench_case *c, unsigned iterations)
+{
+  time_ns_t start = gettime_ns();
+  c->run(c, iterations);
+  return gettime_ns() - start;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static int run_case(struct bench_case *c, unsigned samples, time_ns_t target, int first)
+{
+  if (c->setup && c->setup(c) == -1)
+    return WHYF("setup of %s failed", c->name);
+
+  unsigned iterations = 1;
+  while (time_sample(c, iterations) < target && iterations < (1u << 30))
+    iterations *= 2;
+
+  double per_op[BENCH_MAX_SAMPLES];
+  double sum = 0;
+  unsigned i;
+  for (i = 0; i < samples; ++i){
+    per_op[i] = (double)time_sample(c, iterations) / iterations;
+    sum += per_op[i];
+  }
+  double mean = sum / samples;
+  double variance = 0;
+  for (i = 0; i < samples; ++i)
+    variance += (per_op[i] - mean) * (per_op[i] - mean);
+  double stddev = samples > 1 ? sqrt(variance / (samples - 1)) : 0;
+  qsort(per_op, samples, sizeof per_op[0], cmp_double);
+  double median = per_op[samples / 2];
+
+  printf("%s\n{\"name\":\"%s\",\"bytes\":%zu,\"iterations\":%u,\"samples\":%u,"
+	 "\"min_ns\":%.1f,\"median_ns\":%.1f,\"mean_ns\":%.1f,\"stddev_ns\":%.1f",
+	 first ? "" : ",", c->name, c->bytes, iterations, samples,
+	 per_op[0], median, mean, stddev);
+  if (c->bytes)
+    printf(",\"mb_per_sec\":%.2f", c->bytes * 1000.0 / median);
+  printf("}");
+  fflush(stdout);
+  return 0;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+  if (remove(path) == -1)
+    WHYF_perror("remove(%s)", alloca_str_toprint(path));
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  unsigned samples = BENCH_DEFAULT_SAMPLES;
+  time_ns_t target = BENCH_TARGET_NS;
+  const char **names = alloca(sizeof(char *) * argc);
+  int namec = 0;
+  int i;
+  for (i = 1; i < argc; ++i){
+    if (strcmp(argv[i], "--quick") == 0){
+      target = BENCH_QUICK_TARGET_NS;
+      samples = 5;
+    }else if (strncmp(argv[i], "--samples=", 10) == 0){
+      samples = atoi(argv[i] + 10);
+      if (samples < 1 || samples > BENCH_MAX_SAMPLES){
+	fprintf(stderr, "samples must be between 1 and %d\n", BENCH_MAX_SAMPLES);
+	return 1;
+      }
+    }else if (argv[i][0] == '-'){
+      fprintf(stderr, "usage: %s [--quick] [--samples=<N>] [<name>...]\n", argv[0]);
+      return 1;
+    }else
+      names[namec++] = argv[i];
+  }
+
+  char instance_path[256];
+  strbuf b = strbuf_local(instance_path, sizeof instance_path);
+  strbuf_sprintf(b, "%s/servald_bench.XXXXXX", getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+  if (strbuf_overrun(b) || mkdtemp(instance_path) == NULL){
+    perror("mkdtemp");
+    return 1;
+  }
+  setenv("SERVALINSTANCE_PATH", instance_path, 1);
+
+  srandomdev();
+  cf_init();
+  cf_reload_permissive();
+
+  int ret = 0;
+  int first = 1;
+  printf("{\"benchmarks\":[");
+  unsigned n;
+  for (n = 0; n < NELS(cases); ++n){
+    if (namec){
+      int j;
+      for (j = 0; j < namec && !strstr(cases[n].name, names[j]); ++j)
+	;
+      if (j == namec)
+	continue;
+    }
+    if (run_case(&cases[n], samples, target, first) == -1)
+      ret = 1;
+    else
+      first = 0;
+  }
+  printf("\n]}\n");
+
+  rhizome_close_db();
+  nftw(instance_path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+  return ret;
+}
@@ -22,6 +22,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <time.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
 
 #include "serval.h"
 #include "conf.h"
@@ -130,11 +133,34 @@ int server(const struct cli_parsed *parsed)
   OUT();
 }
 
-/* Called periodically by the server process in its main loop.
+#ifdef HAVE_SYS_INOTIFY_H
+static struct sched_ent config_watch = {.poll.fd = -1};
+static struct profile_total config_watch_stats = {
+  .name = "server_config_watch",
+};
+#endif
+
+/* Apply the parts of a new config that are not simply read from the config struct when needed.
+ * Only sections that actually changed are touched, so eg, a change to debug flags does not disturb
+ * the network interfaces.
  */
-void server_config_reload(struct sched_ent *alarm)
+static void server_config_apply()
+{
+  if (cf_changed("interfaces"))
+    overlay_interface_config_changed();
+  if (cf_changed("server"))
+    overlay_trace_config_changed();
+  if (cf_changed("log"))
+    server_log_drain_setup();
+  if (cf_changed("rhizome") && is_rhizome_enabled() && !rhizome_db) {
+    rhizome_opendb();
+    rhizome_http_server_start(RHIZOME_HTTP_PORT, RHIZOME_HTTP_PORT_MAX);
+  }
+}
+
+static void server_config_update(int reread)
 {
-  switch (cf_reload_strict()) {
+  switch (reread ? cf_load_strict() : cf_reload_strict()) {
   case -1:
     WARN("server continuing with prior config");
     break;
@@ -142,16 +168,125 @@ void server_config_reload(struct sched_ent *alarm)
     break;
   default:
     INFO("server config successfully reloaded");
+    server_config_apply();
     break;
   }
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+static void server_config_watch(struct sched_ent *alarm)
+{
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  int changed = 0;
+  int lost = 0;
+  ssize_t len;
+  while (!lost && (len = read(alarm->poll.fd, buf, sizeof buf)) > 0) {
+    const char *p;
+    for (p = buf; p < buf + len; ) {
+      const struct inotify_event *event = (const struct inotify_event *) p;
+      if ((event->mask & IN_Q_OVERFLOW) || (event->len && strcmp(event->name, "serval.conf") == 0))
+	changed = 1;
+      if (event->mask & IN_IGNORED)
+	lost = 1;
+      p += sizeof *event + event->len;
+    }
+  }
+  if (!lost && len == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+    WHY_perror("read");
+    lost = 1;
+  }
+  if (lost) {
+    WARN("no longer watching instance directory, polling for config changes");
+    unwatch(alarm);
+    close(alarm->poll.fd);
+    alarm->poll.fd = -1;
+  }
+  // the file may change twice within its mtime resolution, so read it again regardless
+  if (changed)
+    server_config_update(1);
+}
+#endif
+
+/* Watch the instance directory for the config file being written or replaced, so that the new
+ * config takes effect as soon as it is saved.  Where this is not possible, server_config_reload()
+ * checks the file more often instead.
+ */
+void server_config_watch_setup()
+{
+#ifdef HAVE_SYS_INOTIFY_H
+  int fd = inotify_init();
+  if (fd == -1) {
+    WHY_perror("inotify_init");
+    return;
+  }
+  if (inotify_add_watch(fd, serval_instancepath(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_CREATE) == -1) {
+    WHYF_perror("inotify_add_watch(%s)", alloca_str_toprint(serval_instancepath()));
+    close(fd);
+    return;
+  }
+  if (set_nonblock(fd) == -1) {
+    close(fd);
+    return;
+  }
+  config_watch.function = server_config_watch;
+  config_watch.stats = &config_watch_stats;
+  config_watch.poll.fd = fd;
+  config_watch.poll.events = POLLIN;
+  watch(&config_watch);
+#endif
+}
+
+/* Called periodically by the server process in its main loop.  If the config file is being
+ * watched, this is only a fallback, eg, for file systems that do not report changes.
+ */
+void server_config_reload(struct sched_ent *alarm)
+{
+  server_config_update(0);
   if (alarm) {
     time_ms_t now = gettime_ms();
     alarm->alarm = now + SERVER_CONFIG_RELOAD_INTERVAL_MS;
+#ifdef HAVE_SYS_INOTIFY_H
+    if (config_watch.poll.fd != -1)
+      alarm->alarm = now + SERVER_CONFIG_WATCHED_RELOAD_INTERVAL_MS;
+#endif
     alarm->deadline = alarm->alarm + 1000;
     schedule(alarm);
   }
 }
 
+static struct profile_total log_drain_stats = {
+  .name = "server_log_drain",
+};
+static struct sched_ent log_drain_alarm = {
+  .function = server_log_drain,
+  .stats = &log_drain_stats,
+};
+
+/* Called periodically by the server process in its main loop, to write out any log messages
+ * buffered because log.file.buffer_size is set.  Stops once buffering is turned off, after writing
+ * out what was left in the buffer.
+ */
+void server_log_drain(struct sched_ent *alarm)
+{
+  logDrain();
+  if (alarm && config.log.file.buffer_size) {
+    alarm->alarm = gettime_ms() + SERVER_LOG_DRAIN_INTERVAL_MS;
+    alarm->deadline = alarm->alarm + 1000;
+    schedule(alarm);
+  }
+}
+
+/* Start draining the log buffer if log.file.buffer_size is set.
+ */
+void server_log_drain_setup()
+{
+  if (config.log.file.buffer_size && !is_scheduled(&log_drain_alarm)) {
+    log_drain_alarm.alarm = gettime_ms() + SERVER_LOG_DRAIN_INTERVAL_MS;
+    log_drain_alarm.deadline = log_drain_alarm.alarm + 1000;
+    schedule(&log_drain_alarm);
+  }
+}
+
 /* Called periodically by the server process in its main loop.
  */
 void server_shutdown_check(struct sched_ent *alarm)
@@ -244,6 +379,9 @@ void serverCleanUp()
     
   if (FORM_SERVAL_INSTANCE_PATH(filename, "monitor.socket"))
     unlink(filename);
+
+  if (FORM_SERVAL_INSTANCE_PATH(filename, "command.socket"))
+    unlink(filename);
   
   /* Try to remove shutdown and PID files and exit */
   server_remove_stopfile();
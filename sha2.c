@@ -40,6 +40,7 @@
 #include <sys/byteorder.h>
 #endif
 #include "sha2.h"
+#include "crypto_accel.h"
 
 /* Translate from Solaris */
 #ifndef BYTE_ORDER
@@ -682,6 +683,7 @@ void SHA512_Init(SHA512_CTX* context) {
 	if (context == (SHA512_CTX*)0) {
 		return;
 	}
+	crypto_accel_init();
 	MEMCPY_BCOPY(context->state, sha512_initial_hash_value, SHA512_DIGEST_LENGTH);
 	MEMSET_BZERO(context->buffer, SHA512_BLOCK_LENGTH);
 	context->bitcount[0] = context->bitcount[1] =  0;
@@ -723,7 +725,7 @@ void SHA512_Init(SHA512_CTX* context) {
 	(h) = T1 + Sigma0_512(a) + Maj((a), (b), (c)); \
 	j++
 
-void SHA512_Transform(SHA512_CTX* context, const sha2_word64* data) {
+static void SHA512_Transform_portable(SHA512_CTX* context, const sha2_word64* data) {
 	sha2_word64	a, b, c, d, e, f, g, h, s0, s1;
 	sha2_word64	T1, *W512 = (sha2_word64*)context->buffer;
 	int		j;
@@ -778,7 +780,7 @@ void SHA512_Transform(SHA512_CTX* context, const sha2_word64* data) {
 
 #else /* SHA2_UNROLL_TRANSFORM */
 
-void SHA512_Transform(SHA512_CTX* context, const sha2_word64* data) {
+static void SHA512_Transform_portable(SHA512_CTX* context, const sha2_word64* data) {
 	sha2_word64	a, b, c, d, e, f, g, h, s0, s1;
 	sha2_word64	T1, T2, *W512 = (sha2_word64*)context->buffer;
 	int		j;
@@ -856,6 +858,13 @@ void SHA512_Transform(SHA512_CTX* context, const sha2_word64* data) {
 
 #endif /* SHA2_UNROLL_TRANSFORM */
 
+void SHA512_Transform(SHA512_CTX* context, const sha2_word64* data) {
+	if (SHA512_Transform_accel)
+		SHA512_Transform_accel(context->state, (const sha2_byte*)data, 1);
+	else
+		SHA512_Transform_portable(context, data);
+}
+
 void SHA512_Update(SHA512_CTX* context, const sha2_byte *data, size_t len) {
 	unsigned int	freespace, usedspace;
 
@@ -888,6 +897,14 @@ void SHA512_Update(SHA512_CTX* context, const sha2_byte *data, size_t len) {
 			return;
 		}
 	}
+	if (SHA512_Transform_accel && len >= SHA512_BLOCK_LENGTH) {
+		/* Pass all the complete blocks at once */
+		size_t	bytes = len - len % SHA512_BLOCK_LENGTH;
+		SHA512_Transform_accel(context->state, data, bytes / SHA512_BLOCK_LENGTH);
+		ADDINC128(context->bitcount, (sha2_word64)bytes << 3);
+		len -= bytes;
+		data += bytes;
+	}
 	while (len >= SHA512_BLOCK_LENGTH) {
 		/* Process as many complete blocks as we can */
 		SHA512_Transform(context, (sha2_word64*)data);
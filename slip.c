@@ -359,6 +359,65 @@ int upper7_decode(struct slip_decode_state *state,unsigned char byte)
   OUT();
 }
 
+/* Word-at-a-time tests for any byte in w equal to c, or any byte without its top bit set.
+   See "Determine if a word has a zero byte" in Sean Anderson's bit twiddling hacks.
+ */
+#define WORD_ONES 0x0101010101010101ULL
+#define WORD_HIGHS 0x8080808080808080ULL
+#define word_has_zero(w) (((w) - WORD_ONES) & ~(w) & WORD_HIGHS)
+#define word_has_byte(w, c) word_has_zero((w) ^ (WORD_ONES * (c)))
+#define word_all_high(w) (((w) & WORD_HIGHS) == WORD_HIGHS)
+
+/* Copy a run of plain SLIP data bytes, stopping at the first END or ESC byte.
+   Returns the number of bytes copied.
+ */
+static int slip_copy_span(unsigned char *dst, const unsigned char *src, int len)
+{
+  int i=0;
+  while (i+8<=len){
+    uint64_t w;
+    memcpy(&w, &src[i], 8);
+    if (word_has_byte(w, SLIP_END) || word_has_byte(w, SLIP_ESC))
+      break;
+    memcpy(&dst[i], &w, 8);
+    i+=8;
+  }
+  while (i<len && src[i]!=SLIP_END && src[i]!=SLIP_ESC){
+    dst[i]=src[i];
+    i++;
+  }
+  return i;
+}
+
+/* Decode as many complete 8 byte UPPER7 data groups as possible, without
+   going through upper7_decode() for each byte.
+   Any group that contains a framing byte or RSSI text is left for upper7_decode().
+ */
+static void upper7_decode_span(struct slip_decode_state *state)
+{
+  while (state->state==UPPER7_STATE_D0
+      && state->src_offset+8 <= state->src_size
+      && state->packet_length < OVERLAY_INTERFACE_RX_BUFFER_SIZE
+      && state->dst_offset >= 0
+      && state->dst_offset+7 < OVERLAY_INTERFACE_RX_BUFFER_SIZE){
+    const unsigned char *b = &state->src[state->src_offset];
+    uint64_t w;
+    memcpy(&w, b, 8);
+    if (!word_all_high(w))
+      return;
+    unsigned char *d = &state->dst[state->dst_offset];
+    d[0]=(b[0]<<1)|((b[1]>>6)&0x01);
+    d[1]=(b[1]<<2)|((b[2]>>5)&0x03);
+    d[2]=(b[2]<<3)|((b[3]>>4)&0x07);
+    d[3]=(b[3]<<4)|((b[4]>>3)&0x0f);
+    d[4]=(b[4]<<5)|((b[5]>>2)&0x1f);
+    d[5]=(b[5]<<6)|((b[6]>>1)&0x3f);
+    d[6]=(b[6]<<7)|((b[7]>>0)&0x7f);
+    state->dst_offset+=7;
+    state->src_offset+=8;
+  }
+}
+
 /* state->src and state->src_size contain the freshly read bytes
    we must accumulate any partial state between calls.
 */
@@ -378,6 +437,27 @@ int slip_decode(struct slip_decode_state *state)
 	if (state->dst_offset>=sizeof(state->dst))
 	  state->state&=~DC_VALID;
 	
+	if (state->state==0){
+	  // nothing can be decoded until the next SLIP_END, so skip straight to it
+	  const unsigned char *end = memchr(&state->src[state->src_offset], SLIP_END, 
+					    state->src_size - state->src_offset);
+	  if (!end){
+	    state->src_offset=state->src_size;
+	    break;
+	  }
+	  state->src_offset = end - state->src;
+	}else if (state->state==DC_VALID){
+	  // copy any run of plain data bytes in one go
+	  int len = state->src_size - state->src_offset;
+	  if (len > (int)sizeof(state->dst) - state->dst_offset)
+	    len = sizeof(state->dst) - state->dst_offset;
+	  int copied = slip_copy_span(&state->dst[state->dst_offset], &state->src[state->src_offset], len);
+	  state->dst_offset+=copied;
+	  state->src_offset+=copied;
+	  if (copied)
+	    continue;
+	}
+	
 	if (state->state&DC_ESC){
 	  // clear escape bit
 	  state->state&=~DC_ESC;
@@ -453,7 +533,13 @@ int slip_decode(struct slip_decode_state *state)
 	       state->state,state->rssi_len,state->rssi_text,
 	       state->src,state->src_size);
       }
+     int fast = !(config.debug.slipdecode || config.debug.slipbytestream);
      while(state->src_offset<state->src_size) {
+	if (fast){
+	  upper7_decode_span(state);
+	  if (state->src_offset>=state->src_size)
+	    break;
+	}
 	if (upper7_decode(state,state->src[state->src_offset++])==1) {
 	  if (config.debug.slip) {
 	    dump("de-slipped packet",state->dst,state->packet_length);
@@ -26,6 +26,16 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "log.h"
 #include "strbuf_helpers.h"
 
+#ifdef HAVE_UCRED_H
+#include <ucred.h>
+#endif
+
+#ifdef linux
+#if defined(LOCAL_PEERCRED) && !defined(SO_PEERCRED)
+#define SO_PEERCRED LOCAL_PEERCRED
+#endif
+#endif
+
 /* Form the name of an AF_UNIX (local) socket in the instance directory as an absolute path.
  * Under Linux, this will create a socket name in the abstract namespace.  This permits us to use
  * local sockets on Android despite its lack of a shared writeable directory on a UFS partition.
@@ -225,3 +235,34 @@ int _socket_set_rcvbufsize(struct __sourceloc __whence, int sock, unsigned buffe
     DEBUGF("setsockopt(%d, SOL_SOCKET, SO_RCVBUF, &%u, %u)", sock, buffer_size, (unsigned)sizeof buffer_size);
   return 0;
 }
+
+/* Find the user id of the process at the other end of a connected local socket.
+ */
+int _socket_peer_uid(struct __sourceloc __whence, int sock, uid_t *uid)
+{
+#ifdef SO_PEERCRED
+  /* Linux way */
+  struct ucred ucred;
+  socklen_t len = sizeof(ucred);
+  if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &ucred, &len))
+    return WHY_perror("getsockopt(SO_PEERCRED)");
+  if (len < sizeof(ucred))
+    return WHYF("getsockopt(SO_PEERCRED) returned the wrong size (Got %d expected %d)", len, (int)sizeof(ucred));
+  *uid = ucred.uid;
+#elif defined(HAVE_UCRED_H)
+  /* Solaris way */
+  ucred_t *ucred = NULL;
+  if (getpeerucred(sock, &ucred) != 0)
+    return WHY_perror("getpeerucred");
+  *uid = ucred_geteuid(ucred);
+  ucred_free(ucred);
+#elif defined(HAVE_GETPEEREID)
+  /* BSD way */
+  gid_t gid;
+  if (getpeereid(sock, uid, &gid) != 0)
+    return WHY_perror("getpeereid");
+#else
+#error No way to get socket peer credentials
+#endif
+  return 0;
+}
@@ -1,12 +1,14 @@
 SERVAL_SOURCES = \
 	$(SERVAL_BASE)cli.c \
 	$(SERVAL_BASE)commandline.c \
+	$(SERVAL_BASE)command_socket.c \
 	$(SERVAL_BASE)conf.c \
 	$(SERVAL_BASE)conf_om.c \
 	$(SERVAL_BASE)conf_parse.c \
 	$(SERVAL_BASE)conf_schema.c \
 	$(SERVAL_BASE)crc32.c \
 	$(SERVAL_BASE)crypto.c \
+	$(SERVAL_BASE)crypto_accel.c \
 	$(SERVAL_BASE)dataformats.c \
 	$(SERVAL_BASE)directory_client.c \
 	$(SERVAL_BASE)dna_helper.c \
@@ -43,6 +45,7 @@ SERVAL_SOURCES = \
 	$(SERVAL_BASE)overlay_olsr.c \
 	$(SERVAL_BASE)overlay_packetformats.c \
 	$(SERVAL_BASE)overlay_payload.c \
+	$(SERVAL_BASE)overlay_trace.c \
 	$(SERVAL_BASE)performance_timing.c \
 	$(SERVAL_BASE)randombytes.c \
 	$(SERVAL_BASE)route_link.c \
@@ -54,9 +57,12 @@ SERVAL_SOURCES = \
 	$(SERVAL_BASE)rhizome_direct_http.c \
 	$(SERVAL_BASE)rhizome_fetch.c \
 	$(SERVAL_BASE)rhizome_http.c \
+	$(SERVAL_BASE)rhizome_index.c \
+	$(SERVAL_BASE)rhizome_merkle.c \
 	$(SERVAL_BASE)rhizome_packetformats.c \
 	$(SERVAL_BASE)rhizome_store.c \
 	$(SERVAL_BASE)rhizome_sync.c \
+	$(SERVAL_BASE)rhizome_tier.c \
 	$(SERVAL_BASE)rotbuf.c \
 	$(SERVAL_BASE)serval_packetvisualise.c \
 	$(SERVAL_BASE)server.c \
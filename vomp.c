@@ -78,6 +78,12 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
   Tell any clients that the call hasn't timed out yet
   (if servald is behaving this should be redundant, if it isn't behaving how do we hangup?)
   $ KEEPALIVE [token]
+  // and how well audio is arriving
+  $ CALLSTATS [token] [received] [lost] [late] [duplicates] [reordered] [playout delay ms] [max delay ms] [recovered]
+
+  If vomp.jitter.playout is enabled, audio is held until its playout time and released in sequence.
+  When we give up waiting for missing audio, clients may want to conceal the gap
+  $ MISSING [token] [first sequence] [count]
  
   Hanging up (may also be triggered on network or call establishment timeout)
   # HANGUP [token]
@@ -115,6 +121,15 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  
  We need to resume a call even with large periods of zero traffic (eg >10s), 
  we should be able to use our own wall clock to estimate which 5s interval the audio belongs to.
+ 
+ Forward error correction;
+ If both parties include VOMP_CODEC_FEC_XOR in their codec list, then after every group of audio frames
+ we also send a parity frame;
+ - codec VOMP_CODEC_FEC_XOR
+ - number of frames in the group
+ - for each frame; codec, time, sequence & audio length
+ - XOR of the audio from each frame
+ Any single frame lost from the group can be rebuilt from the parity frame and the others.
  */
 
 
@@ -147,6 +162,7 @@ struct vomp_call_half {
 
 struct jitter_sample{
   int sample_clock;
+  int sequence;
   int local_clock;
   int delta;
   int sort_index;
@@ -163,6 +179,65 @@ struct jitter_measurements{
 
 #define SEEN_SAMPLES 16
 
+// must be a power of 2, and larger than VOMP_FEC_MAX_GROUP
+#define FEC_RECENT_FRAMES 16
+
+struct fec_frame_info{
+  int codec;
+  int time;
+  int sequence;
+  int audio_length;
+};
+
+struct fec_encoder{
+  int count;
+  struct fec_frame_info frames[VOMP_FEC_MAX_GROUP];
+  int parity_length;
+  unsigned char parity[MAX_AUDIO_BYTES];
+};
+
+struct fec_frame{
+  struct fec_frame_info info;
+  unsigned char audio[];
+};
+
+struct fec_decoder{
+  // recently received audio, so we can rebuild a missing frame when parity arrives
+  struct fec_frame *frames[FEC_RECENT_FRAMES];
+  unsigned recovered;
+};
+
+// must be a power of 2
+#define PLAYOUT_SLOTS 32
+
+struct playout_frame{
+  int sequence;
+  int codec;
+  int time;
+  int delay;
+  time_ms_t play_time;
+  int audio_length;
+  unsigned char audio[];
+};
+
+struct playout_buffer{
+  struct sched_ent alarm;
+  struct playout_frame *frames[PLAYOUT_SLOTS];
+  char started;
+  int first_sequence;
+  int next_sequence;
+  int highest_sequence;
+
+  // statistics reported to monitor clients
+  unsigned received;
+  unsigned played;
+  unsigned lost;
+  unsigned late;
+  unsigned duplicates;
+  unsigned reordered;
+  int max_delay;
+};
+
 struct vomp_call_state {
   struct sched_ent alarm;
   struct vomp_call_half local;
@@ -178,6 +253,9 @@ struct vomp_call_state {
   int rejection_reason;
   unsigned char remote_codec_flags[CODEC_FLAGS_LENGTH];
   struct jitter_measurements jitter;
+  struct playout_buffer playout;
+  struct fec_encoder fec_tx;
+  struct fec_decoder fec_rx;
 };
 
 /* Some clients may only support one call at a time, even then we allow for multiple call states.
@@ -188,8 +266,10 @@ int vomp_call_count=0;
 // TODO allocate call structures dynamically
 struct vomp_call_state vomp_call_states[VOMP_MAX_CALLS];
 struct profile_total vomp_stats;
+struct profile_total vomp_playout_stats;
 
 static void vomp_process_tick(struct sched_ent *alarm);
+static void vomp_playout_alarm(struct sched_ent *alarm);
 strbuf strbuf_append_vomp_supported_codecs(strbuf sb, const unsigned char supported_codecs[256]);
 
 
@@ -227,7 +307,7 @@ char vomp_dtmf_digit_to_char(int digit)
   return '?';
 }
 
-static int store_jitter_sample(struct jitter_measurements *measurements, int sample_clock, int local_clock, int *delay){
+static int store_jitter_sample(struct jitter_measurements *measurements, int sample_clock, int sequence, int local_clock, int *delay){
   IN();
   int i, count=0;
   
@@ -237,7 +317,7 @@ static int store_jitter_sample(struct jitter_measurements *measurements, int sam
     while(count<SEEN_SAMPLES && count<=measurements->sample_count){
       if (i<0)
 	i=measurements->sample_count -1;
-      if (measurements->samples[i].sample_clock == sample_clock)
+      if (measurements->samples[i].sequence == sequence)
 	RETURN(-1);
       i--;
       count++;
@@ -291,6 +371,7 @@ static int store_jitter_sample(struct jitter_measurements *measurements, int sam
     measurements->sample_count++;
   
   sample->sample_clock = sample_clock;
+  sample->sequence = sequence;
   sample->local_clock = local_clock;
   sample->delta = delta;
   sample->sort_index = pos;
@@ -304,15 +385,18 @@ static int store_jitter_sample(struct jitter_measurements *measurements, int sam
   OUT();
 }
 
+// how long should we delay audio so that enough frames arrive before they need to be played?
 static int get_jitter_size(struct jitter_measurements *measurements){
   IN();
-  int i=JITTER_SAMPLES -4;
+  int i=(measurements->sample_count * config.vomp.jitter.percentile) / 100;
   int jitter;
   if (i>=measurements->sample_count)
     i=measurements->sample_count -1;
   jitter=measurements->sorted_samples[i]->delta - measurements->sorted_samples[0]->delta;
-  if (jitter < 60)
-    jitter=60;
+  if (jitter < config.vomp.jitter.min_delay_ms)
+    jitter=config.vomp.jitter.min_delay_ms;
+  if (jitter > config.vomp.jitter.max_delay_ms)
+    jitter=config.vomp.jitter.max_delay_ms;
   RETURN(jitter);
   OUT();
 }
@@ -387,6 +471,11 @@ static struct vomp_call_state *vomp_create_call(struct subscriber *remote,
   vomp_stats.name="vomp_process_tick";
   call->alarm.stats=&vomp_stats;
   schedule(&call->alarm);
+  
+  call->playout.alarm.function = vomp_playout_alarm;
+  call->playout.alarm.context = call;
+  vomp_playout_stats.name="vomp_playout_alarm";
+  call->playout.alarm.stats=&vomp_playout_stats;
   if (config.debug.vomp)
     DEBUGF("Returning new call #%d",local_session);
   return call;
@@ -500,6 +589,8 @@ static int vomp_send_status_remote(struct vomp_call_state *call)
     
     /* Include the list of supported codecs */
     monitor_get_all_supported_codecs(codecs);
+    if (config.vomp.fec.enable)
+      set_codec_flag(VOMP_CODEC_FEC_XOR, codecs);
     
     int i;
     for (i = 0; i < 256; ++i)
@@ -528,6 +619,69 @@ static int vomp_send_status_remote(struct vomp_call_state *call)
   return 0;
 }
 
+static void vomp_fec_send_parity(struct vomp_call_state *call)
+{
+  struct fec_encoder *fec = &call->fec_tx;
+  overlay_mdp_frame mdp;
+  unsigned short  *len=&mdp.out.payload_length;
+  
+  bzero(&mdp,sizeof(mdp));
+  prepare_vomp_header(call, &mdp);
+  
+  if (*len + 2 + fec->count * 7 + fec->parity_length > sizeof(mdp.out.payload)){
+    if (config.debug.vomp)
+      DEBUGF("Parity frame would be too large (%d bytes of audio), skipping", fec->parity_length);
+    return;
+  }
+  
+  mdp.out.payload[(*len)++]=VOMP_CODEC_FEC_XOR;
+  mdp.out.payload[(*len)++]=fec->count;
+  int i;
+  for (i=0;i<fec->count;i++){
+    struct fec_frame_info *info = &fec->frames[i];
+    mdp.out.payload[(*len)++]=info->codec;
+    mdp.out.payload[(*len)++]=(info->time>>8)&0xff;
+    mdp.out.payload[(*len)++]=(info->time>>0)&0xff;
+    mdp.out.payload[(*len)++]=(info->sequence>>8)&0xff;
+    mdp.out.payload[(*len)++]=(info->sequence>>0)&0xff;
+    mdp.out.payload[(*len)++]=(info->audio_length>>8)&0xff;
+    mdp.out.payload[(*len)++]=(info->audio_length>>0)&0xff;
+  }
+  bcopy(fec->parity, &mdp.out.payload[(*len)], fec->parity_length);
+  (*len)+=fec->parity_length;
+  
+  mdp.out.queue=OQ_ISOCHRONOUS_VOICE;
+  overlay_mdp_dispatch(&mdp,0,NULL,0);
+}
+
+// add this audio frame to the current parity group, sending the parity frame when the group is complete
+static void vomp_fec_encode(struct vomp_call_state *call, int audio_codec, int time, int sequence,
+			    const unsigned char *audio, int audio_length)
+{
+  struct fec_encoder *fec = &call->fec_tx;
+  if (audio_length > MAX_AUDIO_BYTES)
+    return;
+  
+  struct fec_frame_info *info = &fec->frames[fec->count++];
+  info->codec = audio_codec;
+  info->time = time;
+  info->sequence = sequence;
+  info->audio_length = audio_length;
+  
+  int i;
+  for (i=0;i<audio_length;i++)
+    fec->parity[i]^=audio[i];
+  if (audio_length > fec->parity_length)
+    fec->parity_length = audio_length;
+  
+  if (fec->count >= config.vomp.fec.group_size){
+    vomp_fec_send_parity(call);
+    bzero(fec->parity, fec->parity_length);
+    fec->parity_length=0;
+    fec->count=0;
+  }
+}
+
 int vomp_received_audio(struct vomp_call_state *call, int audio_codec, int time, int sequence,
 			const unsigned char *audio, int audio_length)
 {
@@ -537,7 +691,9 @@ int vomp_received_audio(struct vomp_call_state *call, int audio_codec, int time,
   // note we assume the caller will be consistent about providing time and sequence info
   if (time==-1){
     time = call->audio_clock;
-    call->audio_clock+=vomp_codec_timespan(audio_codec, audio_length);
+    int timespan = vomp_codec_timespan(audio_codec, audio_length);
+    if (timespan>0)
+      call->audio_clock+=timespan;
   }
   
   if (sequence==-1)
@@ -561,7 +717,15 @@ int vomp_received_audio(struct vomp_call_state *call, int audio_codec, int time,
     
   mdp.out.queue=OQ_ISOCHRONOUS_VOICE;
   
-  overlay_mdp_dispatch(&mdp,0,NULL,0);
+  int fec = config.vomp.fec.enable && is_codec_set(VOMP_CODEC_FEC_XOR, call->remote_codec_flags);
+  if (fec && config.debug.vomp_fec_drop_frame == call->fec_tx.count + 1){
+    if (config.debug.vomp)
+      DEBUGF("Not sending audio frame %d, it can only be recovered from parity", sequence);
+  }else
+    overlay_mdp_dispatch(&mdp,0,NULL,0);
+  
+  if (fec)
+    vomp_fec_encode(call, audio_codec, time & 0xFFFF, sequence & 0xFFFF, audio, audio_length);
   
   return 0;
 }
@@ -608,6 +772,150 @@ static int monitor_send_audio(struct vomp_call_state *call, int audio_codec, int
   return 0;
 }
 
+static void playout_schedule(struct playout_buffer *playout, time_ms_t when)
+{
+  if (is_scheduled(&playout->alarm)){
+    if (playout->alarm.alarm == when)
+      return;
+    unschedule(&playout->alarm);
+  }
+  playout->alarm.alarm = when;
+  playout->alarm.deadline = when + 10;
+  schedule(&playout->alarm);
+}
+
+/* Release buffered audio to monitor clients in sequence order, once it is due to be played.
+ * Frames before min_sequence are released immediately.
+ * Missing frames are given up on when the next buffered frame is due.
+ */
+static void playout_release(struct vomp_call_state *call, time_ms_t now, int min_sequence)
+{
+  struct playout_buffer *playout = &call->playout;
+  while(playout->next_sequence <= playout->highest_sequence){
+    struct playout_frame **slot = &playout->frames[playout->next_sequence & (PLAYOUT_SLOTS -1)];
+    struct playout_frame *frame = *slot;
+    if (frame){
+      if (frame->play_time > now && frame->sequence >= min_sequence){
+	playout_schedule(playout, frame->play_time);
+	return;
+      }
+      if (monitor_socket_count)
+	monitor_send_audio(call, frame->codec, frame->time, frame->sequence,
+			   frame->audio, frame->audio_length, frame->delay);
+      *slot = NULL;
+      free(frame);
+      playout->played++;
+      playout->next_sequence++;
+      continue;
+    }
+    
+    int next;
+    for (next = playout->next_sequence+1; next <= playout->highest_sequence; next++){
+      frame = playout->frames[next & (PLAYOUT_SLOTS -1)];
+      if (frame)
+	break;
+    }
+    if (!frame)
+      break;
+    // keep waiting for the missing frame until the next one is due
+    if (frame->play_time > now && next > min_sequence){
+      playout_schedule(playout, frame->play_time);
+      return;
+    }
+    if (config.debug.vomp)
+      DEBUGF("Giving up on %d missing audio frames from %d", next - playout->next_sequence, playout->next_sequence);
+    playout->lost += next - playout->next_sequence;
+    monitor_tell_formatted(MONITOR_VOMP, "\nMISSING:%06x:%d:%d\n", 
+			   call->local.session, playout->next_sequence, next - playout->next_sequence);
+    playout->next_sequence = next;
+  }
+  if (playout->next_sequence < min_sequence){
+    playout->lost += min_sequence - playout->next_sequence;
+    playout->next_sequence = min_sequence;
+  }
+  if (is_scheduled(&playout->alarm))
+    unschedule(&playout->alarm);
+}
+
+static void playout_insert(struct vomp_call_state *call, int codec, int time, int sequence,
+			   const unsigned char *audio, int audio_length, int delay, time_ms_t now)
+{
+  struct playout_buffer *playout = &call->playout;
+  
+  // we've already given up on this frame
+  if (sequence < playout->next_sequence){
+    playout->late++;
+    return;
+  }
+  
+  // make room if this frame is too far ahead of everything we are holding
+  if (sequence - playout->next_sequence >= PLAYOUT_SLOTS)
+    playout_release(call, now, sequence - PLAYOUT_SLOTS + 1);
+  
+  struct playout_frame **slot = &playout->frames[sequence & (PLAYOUT_SLOTS -1)];
+  if (*slot){
+    playout->duplicates++;
+    return;
+  }
+  
+  struct playout_frame *frame = emalloc(sizeof(struct playout_frame) + audio_length);
+  if (!frame)
+    return;
+  frame->sequence = sequence;
+  frame->codec = codec;
+  frame->time = time;
+  frame->delay = delay;
+  frame->audio_length = audio_length;
+  bcopy(audio, frame->audio, audio_length);
+  
+  // this frame arrived delay ms later than the fastest frame we have seen,
+  // hold it until the jitter window has passed
+  int jitter = get_jitter_size(&call->jitter);
+  frame->play_time = now + (jitter > delay ? jitter - delay : 0);
+  *slot = frame;
+  
+  if (sequence > playout->highest_sequence)
+    playout->highest_sequence = sequence;
+  playout_release(call, now, playout->next_sequence);
+}
+
+static void vomp_playout_alarm(struct sched_ent *alarm)
+{
+  struct vomp_call_state *call = alarm->context;
+  playout_release(call, gettime_ms(), call->playout.next_sequence);
+}
+
+static void playout_free(struct playout_buffer *playout)
+{
+  int i;
+  if (is_scheduled(&playout->alarm))
+    unschedule(&playout->alarm);
+  for (i=0;i<PLAYOUT_SLOTS;i++){
+    if (playout->frames[i]){
+      free(playout->frames[i]);
+      playout->frames[i]=NULL;
+    }
+  }
+}
+
+static int monitor_call_stats(struct vomp_call_state *call)
+{
+  struct playout_buffer *playout = &call->playout;
+  unsigned lost = playout->lost;
+  if (!config.vomp.jitter.playout && playout->started){
+    // without a playout buffer, anything we haven't received yet is lost
+    unsigned expected = playout->highest_sequence - playout->first_sequence +1;
+    lost = expected > playout->received ? expected - playout->received : 0;
+  }
+  int jitter_delay = call->jitter.sample_count ? get_jitter_size(&call->jitter) : 0;
+  return monitor_tell_formatted(MONITOR_VOMP, "\nCALLSTATS:%06x:%u:%u:%u:%u:%u:%d:%d:%u\n",
+				call->local.session,
+				playout->received, lost, playout->late,
+				playout->duplicates, playout->reordered,
+				jitter_delay, playout->max_delay,
+				call->fec_rx.recovered);
+}
+
 // update local state and notify interested clients with the correct message
 static int vomp_update_local_state(struct vomp_call_state *call, int new_state){
   if (call->local.state>=new_state)
@@ -709,6 +1017,97 @@ static int to_absolute_value(int short_value, int reference_value){
   return short_value;
 }
 
+static void vomp_fec_remember(struct vomp_call_state *call, int codec, int time, int sequence,
+			      const unsigned char *audio, int audio_length)
+{
+  struct fec_frame **slot = &call->fec_rx.frames[sequence & (FEC_RECENT_FRAMES -1)];
+  if (*slot && (*slot)->info.sequence == sequence)
+    return;
+  if (*slot){
+    free(*slot);
+    *slot = NULL;
+  }
+  struct fec_frame *frame = emalloc(sizeof(struct fec_frame) + audio_length);
+  if (!frame)
+    return;
+  frame->info.codec = codec;
+  frame->info.time = time;
+  frame->info.sequence = sequence;
+  frame->info.audio_length = audio_length;
+  bcopy(audio, frame->audio, audio_length);
+  *slot = frame;
+}
+
+static void vomp_fec_free(struct fec_decoder *fec)
+{
+  int i;
+  for (i=0;i<FEC_RECENT_FRAMES;i++){
+    if (fec->frames[i]){
+      free(fec->frames[i]);
+      fec->frames[i]=NULL;
+    }
+  }
+}
+
+static int vomp_process_frame(struct vomp_call_state *call, int codec, int time, int sequence,
+			      const unsigned char *audio, int audio_len, time_ms_t now);
+
+// if exactly one frame from this parity group is missing, rebuild it
+static int vomp_process_parity(struct vomp_call_state *call, const unsigned char *payload, int payload_length, time_ms_t now)
+{
+  int ofs=0;
+  if (payload_length < 1)
+    return 0;
+  int count = payload[ofs++];
+  if (count < 1 || count > VOMP_FEC_MAX_GROUP || ofs + count * 7 > payload_length)
+    return WHYF("Malformed VoMP parity frame");
+  
+  struct fec_frame_info frames[VOMP_FEC_MAX_GROUP];
+  int i, missing=-1;
+  for (i=0;i<count;i++){
+    struct fec_frame_info *info = &frames[i];
+    info->codec = payload[ofs];
+    info->time = payload[ofs+1]<<8 | payload[ofs+2];
+    info->sequence = payload[ofs+3]<<8 | payload[ofs+4];
+    info->audio_length = payload[ofs+5]<<8 | payload[ofs+6];
+    ofs+=7;
+    
+    struct fec_frame *frame = call->fec_rx.frames[info->sequence & (FEC_RECENT_FRAMES -1)];
+    if (frame && frame->info.sequence == info->sequence)
+      continue;
+    // we can only rebuild one missing frame
+    if (missing!=-1)
+      return 0;
+    missing = i;
+  }
+  if (missing==-1)
+    return 0;
+  
+  const unsigned char *parity = &payload[ofs];
+  int parity_length = payload_length - ofs;
+  struct fec_frame_info *lost = &frames[missing];
+  if (lost->audio_length > parity_length || lost->audio_length > MAX_AUDIO_BYTES)
+    return WHYF("Malformed VoMP parity frame");
+  
+  unsigned char audio[MAX_AUDIO_BYTES];
+  bcopy(parity, audio, lost->audio_length);
+  for (i=0;i<count;i++){
+    if (i==missing)
+      continue;
+    struct fec_frame *frame = call->fec_rx.frames[frames[i].sequence & (FEC_RECENT_FRAMES -1)];
+    int j, len = frame->info.audio_length;
+    if (len > lost->audio_length)
+      len = lost->audio_length;
+    for (j=0;j<len;j++)
+      audio[j]^=frame->audio[j];
+  }
+  
+  call->fec_rx.recovered++;
+  if (config.debug.vomp)
+    DEBUGF("Recovered audio frame %d from parity", lost->sequence);
+  return vomp_process_frame(call, lost->codec, lost->time, lost->sequence, audio, lost->audio_length, now);
+}
+
 static int vomp_process_audio(struct vomp_call_state *call, overlay_mdp_frame *mdp, time_ms_t now)
 {
   int ofs=6;
@@ -718,11 +1117,26 @@ static int vomp_process_audio(struct vomp_call_state *call, overlay_mdp_frame *m
   
   int codec=mdp->in.payload[ofs++];
   
+  if (codec==VOMP_CODEC_FEC_XOR)
+    return vomp_process_parity(call, &mdp->in.payload[ofs], mdp->in.payload_length - ofs, now);
+  
+  if (ofs + 4 > mdp->in.payload_length)
+    return 0;
+  
   int time = mdp->in.payload[ofs]<<8 | mdp->in.payload[ofs+1]<<0;
   ofs+=2;
   int sequence = mdp->in.payload[ofs]<<8 | mdp->in.payload[ofs+1]<<0;
   ofs+=2;
   
+  return vomp_process_frame(call, codec, time, sequence, &mdp->in.payload[ofs], mdp->in.payload_length - ofs, now);
+}
+
+static int vomp_process_frame(struct vomp_call_state *call, int codec, int time, int sequence,
+			      const unsigned char *audio, int audio_len, time_ms_t now)
+{
+  if (config.vomp.fec.enable)
+    vomp_fec_remember(call, codec, time, sequence, audio, audio_len);
+  
   // rebuild absolute time value from short relative time.
   int decoded_time = to_absolute_value(time, call->remote_audio_clock);
   int decoded_sequence = to_absolute_value(sequence, call->remote.sequence);
@@ -741,17 +1155,39 @@ static int vomp_process_audio(struct vomp_call_state *call, overlay_mdp_frame *m
 
   decoded_time=decoded_time * 20;
   
-  int audio_len = mdp->in.payload_length - ofs;
   int delay=0;
+  struct playout_buffer *playout = &call->playout;
   
-  if (store_jitter_sample(&call->jitter, decoded_time, now, &delay))
+  if (store_jitter_sample(&call->jitter, decoded_time, decoded_sequence, now, &delay)){
+    playout->duplicates++;
     return 0;
+  }
+  
+  if (!playout->started){
+    playout->started = 1;
+    playout->first_sequence = decoded_sequence;
+    playout->next_sequence = decoded_sequence;
+    playout->highest_sequence = decoded_sequence -1;
+  }
+  playout->received++;
+  if (decoded_sequence < playout->highest_sequence)
+    playout->reordered++;
+  if (delay > playout->max_delay)
+    playout->max_delay = delay;
+  
+  if (config.vomp.jitter.playout){
+    playout_insert(call, codec, decoded_time, decoded_sequence,
+		   audio, audio_len, delay, now);
+    return 0;
+  }
+  
+  if (decoded_sequence > playout->highest_sequence)
+    playout->highest_sequence = decoded_sequence;
   
   /* Pass audio frame to all registered listeners */
   if (monitor_socket_count)
     monitor_send_audio(call, codec, decoded_time, decoded_sequence,
-		       &mdp->in.payload[ofs],
-		       audio_len, delay);
+		       audio, audio_len, delay);
   return 0;
 }
 
@@ -776,16 +1212,25 @@ static int vomp_call_destroy(struct vomp_call_state *call)
   /* now release the call structure */
   int i = (call - vomp_call_states);
   unschedule(&call->alarm);
+  playout_free(&call->playout);
+  vomp_fec_free(&call->fec_rx);
   call->local.session=0;
   call->remote.session=0;
   
   vomp_call_count--;
   if (i!=vomp_call_count){
-    unschedule(&vomp_call_states[vomp_call_count].alarm);
-    bcopy(&vomp_call_states[vomp_call_count],
+    struct vomp_call_state *last = &vomp_call_states[vomp_call_count];
+    int playout_scheduled = is_scheduled(&last->playout.alarm);
+    unschedule(&last->alarm);
+    if (playout_scheduled)
+      unschedule(&last->playout.alarm);
+    bcopy(last,
 	  call,
 	  sizeof(struct vomp_call_state));
+    call->playout.alarm.context = call;
     schedule(&call->alarm);
+    if (playout_scheduled)
+      schedule(&call->playout.alarm);
   }
   return 0;
 }
@@ -1136,6 +1581,9 @@ static void vomp_process_tick(struct sched_ent *alarm)
   len = snprintf(msg,sizeof(msg) -1,"\nKEEPALIVE:%06x\n", call->local.session);
   monitor_tell_clients(msg, len, MONITOR_VOMP);
   
+  if (call->local.state==VOMP_STATE_INCALL && call->playout.started)
+    monitor_call_stats(call);
+  
   alarm->alarm = gettime_ms() + VOMP_CALL_STATUS_INTERVAL;
   alarm->deadline = alarm->alarm + VOMP_CALL_STATUS_INTERVAL/2;
   schedule(alarm);
@@ -34,6 +34,7 @@
 #include "constants.h"
 #include "strbuf.h"
 #include "strbuf_helpers.h"
+#include "strlcpy.h"
 
 int call_token=-1;
 int seen_audio=0;
@@ -60,8 +61,12 @@ static void send_pickup(int session_id){
 static void send_call(const char *sid, const char *caller_id, const char *remote_ext){
   monitor_client_writeline(monitor_client_fd, "call %s %s %s\n", sid, caller_id, remote_ext);
 }
-static void send_audio(int session_id, unsigned char *buffer, int len, int codec){
-  monitor_client_writeline_and_data(monitor_client_fd, buffer, len, "audio %06x %d\n", session_id, codec);
+// time and sequence are chosen by the server unless sequence is given
+static void send_audio(int session_id, unsigned char *buffer, int len, int codec, int time, int sequence){
+  if (sequence >= 0)
+    monitor_client_writeline_and_data(monitor_client_fd, buffer, len, "audio %06x %d %d %d\n", session_id, codec, time, sequence);
+  else
+    monitor_client_writeline_and_data(monitor_client_fd, buffer, len, "audio %06x %d\n", session_id, codec);
 }
 
 static int remote_call(char *cmd, int argc, char **argv, unsigned char *data, int dataLen, void *context){
@@ -170,6 +175,22 @@ static int remote_print(char *cmd, int argc, char **argv, unsigned char *data, i
   return 1;
 }
 
+// call statistics are sent every tick, so only print them when they change
+static int remote_call_stats(char *cmd, int argc, char **argv, unsigned char *data, int dataLen, void *context){
+  static char last[256];
+  char stats[256];
+  strbuf b = strbuf_local(stats, sizeof stats);
+  int i;
+  for (i=0;i<argc;i++)
+    strbuf_sprintf(b, " %s", argv[i]);
+  if (strcmp(stats, last)==0)
+    return 1;
+  strlcpy(last, stats, sizeof last);
+  printf("%s%s\n", cmd, stats);
+  fflush(stdout);
+  return 1;
+}
+
 static int remote_noop(char *cmd, int argc, char **argv, unsigned char *data, int dataLen, void *context){
   return 1;
 }
@@ -184,6 +205,8 @@ struct monitor_command_handler console_handlers[]={
   {.command="CODECS",        .handler=remote_codecs},
   {.command="INFO",          .handler=remote_print},
   {.command="CALLSTATUS",    .handler=remote_noop},
+  {.command="CALLSTATS",     .handler=remote_call_stats},
+  {.command="MISSING",       .handler=remote_print},
   {.command="KEEPALIVE",     .handler=remote_noop},
   {.command="MONITORSTATUS", .handler=remote_noop},
 };
@@ -223,6 +246,9 @@ static int console_hangup(const struct cli_parsed *parsed, struct cli_context *c
 
 static int console_audio(const struct cli_parsed *parsed, struct cli_context *context)
 {
+  const char *time_text = NULL, *sequence_text = NULL;
+  cli_arg(parsed, "time", &time_text, NULL, NULL);
+  cli_arg(parsed, "sequence", &sequence_text, NULL, NULL);
   if (call_token==-1){
     printf("No active call\n");
     fflush(stdout);
@@ -240,7 +266,8 @@ static int console_audio(const struct cli_parsed *parsed, struct cli_context *co
 	strbuf_puts(&str_buf, "NULL");
     }
 
-    send_audio(call_token, (unsigned char *)strbuf_str(&str_buf), strbuf_len(&str_buf), VOMP_CODEC_TEXT);
+    send_audio(call_token, (unsigned char *)strbuf_str(&str_buf), strbuf_len(&str_buf), VOMP_CODEC_TEXT,
+	       time_text ? atoi(time_text) : -1, sequence_text ? atoi(sequence_text) : -1);
   }
   return 0;
 }
@@ -253,6 +280,7 @@ struct cli_schema console_commands[]={
   {console_hangup,{"hangup",NULL},0,"Hangup the phone line"},
   {console_usage,{"help",NULL},0,"This usage message"},
   {console_audio,{"say","...",NULL},0,"Send a text string to the other party"},
+  {console_audio,{"sayat","<time>","<sequence>","...",NULL},0,"Send a text string with the given audio time in ms and sequence number"},
   {NULL},
 };
 